@@ -45,6 +45,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <termios.h>
 #include <unistd.h>
@@ -52,13 +53,32 @@
 #include <time.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <stdint.h>
+#include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Commands
 // p - Create passenger
 // r - Reset map
 // l - Print logical map
 // s - Taxi status
+// w - Save the city to the city file
+// o - Load the city from the city file
+// c - Toggle congestion-aware routing
+// k - Write a checkpoint of the whole simulation
+// b - Write the lock contention report
 // q - Quit
 // ↑ - Create taxi
 // ↓ - Destroy taxi
@@ -86,9 +106,11 @@
 #define MIN_DISTANCE 2
 
 #define MAX_ATTEMPTS 1000
+#define MAPGEN_MAX_THREADS 8 // Threads rasterising large maps
+#define MAPGEN_PARALLEL_MIN_CELLS (1 << 20) // Smaller maps are rasterised on the calling thread
 #define TAXI_REFRESH_RATE 100000
 #define TAXI_SPEED_FACTOR 5
-#define MAX_PASSENGERS 20
+#define MAX_PASSENGERS 99 // Passenger IDs must fit the 100-wide cell ranges below
 #define REFRESH_PASSENGERS_SEC 8
 
 #define R_TAXI_FREE 100 // 100 - 199 free taxis
@@ -100,6 +122,18 @@
 #define ROAD 0
 #define SIDEWALK 1
 
+#define ROUTE_UP 0
+#define ROUTE_DOWN 1
+#define ROUTE_LEFT 2
+#define ROUTE_RIGHT 3
+#define ROUTE_PICKUP 4 // Waypoint event: passenger picked up
+#define ROUTE_DROPOFF 5 // Waypoint event: passenger dropped off
+#define ROUTE_WAIT 6 // Stay on the current cell for run steps
+#define ROUTE_MAX_RUN ((1u << 29) - 1)
+
+#define WAYPOINT_PICKUP -2 // MOVE_TO coordinate signalling arrival at the passenger
+#define WAYPOINT_DROPOFF -3 // MOVE_TO coordinate signalling arrival at the destination
+
 #define ORIGIN 'E'
 #define DESTINATION 'D'
 #define VISITED '-'
@@ -118,16 +152,177 @@
 #define TAXI_EMOJI "🚖"
 #define PASSENGER_POINT_EMOJI "🔲"
 
+#define MAP_TILE_SHIFT 6
+#define MAP_TILE_SIZE (1 << MAP_TILE_SHIFT) // Tiles are 64x64 cells, one bitboard word wide
+#define MAP_TILE_MASK (MAP_TILE_SIZE - 1)
+#define MAP_TILE_CELLS (MAP_TILE_SIZE * MAP_TILE_SIZE)
+
 #define MAP_VERTICAL_PROPORTION 0.6
 #define MAP_HORIZONTAL_PROPORTION 0.5
 
 #define MAX_TAXIS 6
 
+#define BITBFS_MIN_CELLS 1024 // Maps at least this large use the bitboard BFS (it beats findPath from 24x48 up in --pathbench)
+#define BITBFS_DENSE_SHARE 4 // A layer with this share of its row band active runs the SIMD row kernel
+
+#define ROUTE_CACHE_SLOTS 1024
+#define ROUTE_CACHE_BUCKETS 2048
+
+#define RESERVATION_WINDOW 16 // Route steps each taxi reserves ahead
+#define RESERVATION_MAX_WAITS 20 // Ticks a taxi waits for an occupied cell before asking for a way around
+#define RESERVATION_CELL(col, row) ((row) * 65536 + (col)) // Map-size independent cell key
+
+#define DSTAR_INF (INT_MAX / 4) // Unreachable cost in D* Lite (leaves room for key sums)
+
+#define CONGESTION_DECAY 0.95 // Fraction of traffic density kept per tick
+#define CONGESTION_WEIGHT 1 // Extra cost per unit of density
+#define CONGESTION_MAX_PENALTY 8 // Cap on the extra cost of a cell (Dial buckets = penalty + 2)
+
+#define CITY_FILE_PATH "city.txc" // Default city file for the save/load commands
+#define CITY_FILE_MAGIC "TXCITY\r\n" // 8 bytes, catches text-mode mangling
+#define CITY_FILE_VERSION 2 // 2: tiled grid
+#define CITY_FILE_ENDIAN 0x01020304u // Read back differently on a foreign byte order
+
+#define RNG_STREAM_MAP 1 // Random stream of map generation
+#define RNG_STREAM_SPAWN 2 // Random stream of taxi and passenger placement
+#define RNG_STREAM_HOTSPOTS 3 // Random stream of demand hotspot placement
+#define RNG_STREAM_DEMAND 4 // Random stream of passenger arrival times
+
+#define SCHED_FREE 0 // Threads run as scheduled by the OS
+#define SCHED_RECORD 1 // Threads take turns, and every turn is logged
+#define SCHED_REPLAY 2 // Threads take turns in the order of a replay log
+#define SCHED_STEP 0 // Turn kind: a thread handles one message of its queue
+#define SCHED_RESUME 1 // Turn kind: a thread continues a step after a wait
+#define SCHED_EXTERNAL 2 // Turn kind: a key press or timer tick enters a queue
+#define SCHED_ANY -1 // No particular actor
+#define SCHED_ACTOR_CENTER 0 // Replay actors: the consumer of each queue
+#define SCHED_ACTOR_VISUALIZER 1
+#define SCHED_ACTOR_TAXI 2 // Taxis are SCHED_ACTOR_TAXI + creation order
+#define REPLAY_FILE_MAGIC "TXREPLAY"
+#define REPLAY_FILE_VERSION 6 // 2: route epochs replace DROP; 3: asynchronous taxi retirement; 4: resets keep the fleet; 5: hotspots; 6: time scale
+#define REPLAY_STALL_SEC 5 // A replay turn nobody takes for this long has diverged
+
+#define CHECKPOINT_FILE_PATH "checkpoint.txk" // Checkpoint written by the 'k' key
+#define CHECKPOINT_FILE_MAGIC "TXCHKPT\n"
+#define CHECKPOINT_FILE_VERSION 6 // 2: passenger lifecycle and taxi idle times; 3: route epochs; 4: trip records; 5: time scale; 6: routes drop remaining moves
+#define CHECKPOINT_QUEUE_CENTER 0 // Queues of checkpointed messages
+#define CHECKPOINT_QUEUE_VISUALIZER 1
+#define CHECKPOINT_QUEUE_TAXI 2 // Taxi queues are CHECKPOINT_QUEUE_TAXI + index in center->taxis
+
+#define HDR_SUB_BUCKET_BITS 7 // 128 sub-buckets per power of two: values kept within 1%
+#define HDR_SUB_BUCKETS (1 << HDR_SUB_BUCKET_BITS)
+#define HDR_MAX_MAGNITUDE 40 // Largest recordable value is 2^40 - 1 (in us: about 12 days)
+#define HDR_COUNTS ((HDR_MAX_MAGNITUDE - HDR_SUB_BUCKET_BITS + 1) * HDR_SUB_BUCKETS)
+#define METRIC_WAIT 0 // Spawn to pickup (us)
+#define METRIC_ETA_ERROR 1 // Pickup time minus the ETA given at assignment, either way (us)
+#define METRIC_TRIP 2 // Pickup to drop-off (us)
+#define METRIC_RETIRE 3 // Taxi retirement requested to taxi thread joined and freed (us)
+#define METRIC_IDLE 4 // Share of each taxi's time spent free, per snapshot interval (per mille)
+#define METRIC_COUNT 5
+#define METRICS_FILE_PATH "metrics_log.txt" // Percentile snapshots, one line per timer tick
+
+#define SIM_MIN_TIME_SCALE 0.001 // Taxi ticks stay at least 100 us long
+
+#define BENCH_DEFAULT_ROWS 40 // Map size of a headless benchmark without --size
+#define BENCH_DEFAULT_COLS 80
+#define BENCH_FLEET_TIMEOUT_SEC 5 // Longest wait for the benchmark fleet before measuring anyway
+
+#define DEMAND_PROFILE_HOURS 24 // Rate multipliers per simulated day
+#define DEMAND_DEFAULT_DAY_SEC 240.0 // A simulated day of the demand profile lasts 4 minutes
+#define DEMAND_MIN_SLEEP_NS 1000000LL // Arrivals due within 1 ms are requested together
+#define DEMAND_MAX_SLEEP_NS 100000000LL // Longest sleep between arrivals (pauses are noticed within it)
+#define DEMAND_MAX_HOTSPOTS 16
+#define DEMAND_HOTSPOT_RADIUS_DIVISOR 6 // Hotspot radius: the shorter map side over this
+#define DEMAND_HOTSPOT_PEAK 20 // Extra spawn weight at a hotspot centre, relative to 1 elsewhere
+
+#define TRIPS_FILE_MAGIC "TXTRIPS\n" // Binary trip trace (anything else is read as CSV)
+#define TRIPS_FILE_VERSION 1
+#define TRIPS_CHUNK_BYTES 65536 // Trace read per fread
+#define TRIPS_LOOKAHEAD 4096 // Requests parsed ahead of the simulation clock
+#define TRIPS_MAX_LINE 256 // Longer CSV lines are rejected
+#define TRIPS_SNAP_RADIUS 16 // Cells searched around a trace point for a free curb
+
+#define TRIPLOG_FILE_MAGIC "TXTRLOG\n" // Columnar trip records written with --trip-log
+#define TRIPLOG_FILE_VERSION 1
+#define TRIPLOG_BLOCK_ROWS 4096 // Trips per compressed block
+#define TRIPLOG_MAX_PENDING 8 // Full blocks waiting for the writer before trips are dropped
+#define TRIPLOG_NAME_BYTES 16 // Column names in the file header, NUL-padded
+#define TRIPLOG_ENCODING_DELTA 1 // Column encoding bits: values minus the previous one...
+#define TRIPLOG_ENCODING_RLE 2 // ...then (value, run length) pairs; both stored as zigzag LEB128 varints
+#define TRIPLOG_COL_TRIP 0 // Columns: trip number in the run (1, 2, ...)
+#define TRIPLOG_COL_PASSENGER 1
+#define TRIPLOG_COL_TAXI 2
+#define TRIPLOG_COL_SPAWNED_US 3 // Simulation times; 0 if the trip never got there
+#define TRIPLOG_COL_ASSIGNED_US 4
+#define TRIPLOG_COL_PICKED_UP_US 5
+#define TRIPLOG_COL_DROPPED_OFF_US 6
+#define TRIPLOG_COL_ORIGIN_COL 7 // Road cells of the pickup and the drop-off
+#define TRIPLOG_COL_ORIGIN_ROW 8
+#define TRIPLOG_COL_DEST_COL 9
+#define TRIPLOG_COL_DEST_ROW 10
+#define TRIPLOG_COL_ROUTE_CELLS 11 // Cells of the route sent at assignment
+#define TRIPLOG_COL_DETOURS 12 // Repaired routes sent after it
+#define TRIPLOG_COL_CONGESTION 13 // 1 if planned with congestion costs
+#define TRIPLOG_COLUMNS 14
+
+#define PATHBENCH_DEFAULT_SIZES "64x128,256x256,512x512" // Maps of the routing benchmark without --sizes
+#define PATHBENCH_DEFAULT_DENSITIES "25" // Squares per 10000 cells
+#define PATHBENCH_DEFAULT_SEEDS 3
+#define PATHBENCH_DEFAULT_QUERIES 100
+#define PATHBENCH_SET_PAIRS 0 // Random road cells of the same component
+#define PATHBENCH_SET_CURB 1 // Curb to curb, as passenger trips
+#define PATHBENCH_SET_TAXI 2 // Curb to the nearest free taxi, as dispatch
+#define PATHBENCH_SETS 3
+#define PATHBENCH_ENGINE_BFS 0 // findPathCoordinates / findPath
+#define PATHBENCH_ENGINE_CACHED 1 // findPathCoordinatesCached, warmed up
+#define PATHBENCH_ENGINE_DSTAR 2 // dstarPlan + dstarExtract
+#define PATHBENCH_ENGINE_COOP 3 // findPathCooperative over an empty reservation table
+#define PATHBENCH_ENGINE_BITBOARD 4 // findPathBitboard
+#define PATHBENCH_ENGINE_FIELD 5 // taxiFieldNearest
+#define PATHBENCH_ENGINES 6
+
+#define TRACE_RING_EVENTS 16384 // Spans kept per thread (the oldest are overwritten)
+#define TRACE_MAX_RINGS 256 // Threads traced per run (taxi threads come and go)
+
+#define LOCK_CENTER 0 // center->lock
+#define LOCK_MAP 1 // map->lock
+#define LOCK_QUEUE 2 // Every MessageQueue lock
+#define LOCK_PAUSE 3 // pause_mutex
+#define LOCK_CLASSES 4
+#define LOCK_MAX_NESTING 8 // Holds of one lock class tracked per thread at a time
+#define LOCK_PROFILE_FILE_PATH "lock_profile.txt" // Contention report ('b' key and shutdown)
+
+#define PERF_REGION_BFS 0 // findPath, findPathCoordinates, bitbfsRun
+#define PERF_REGION_RENDER 1 // renderMap
+#define PERF_REGION_GENERATE 2 // generateMap
+#define PERF_REGION_DISPATCH 3 // One message handled by any thread
+#define PERF_REGIONS 4
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_CACHE_MISSES 2
+#define PERF_BRANCH_MISSES 3
+#define PERF_COUNTERS 4
+#define PERF_FILE_PATH "perf_counters.txt" // Per-region counter report written on exit with --perf
+
 // Global variables for pause/resume functionality and logging
 pthread_mutex_t pause_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
 bool isPaused = false;
 FILE* log_file = NULL;
+FILE* metrics_file = NULL; // Lifecycle metric snapshots (NULL: not written)
+unsigned long map_epoch_counter = 0; // Source of map epochs (never reused across maps)
+const char* city_file_path = CITY_FILE_PATH; // City file for the save/load commands
+bool city_load_on_start = false; // Start from city_file_path instead of a generated map
+uint64_t sim_seed = 0; // Seed of every random stream (see rngSeed)
+int sim_rows = 0, sim_cols = 0; // Fixed map size (0: fit the terminal)
+const char* checkpoint_file_path = CHECKPOINT_FILE_PATH; // Checkpoint written by the 'k' key
+const char* checkpoint_restore_path = NULL; // Checkpoint the simulation resumes from (NULL: fresh start)
+double sim_time_scale = 1.0; // Factor on every simulated wait and on the taxi tick (0.01: 100x faster)
+bool headless = false; // No terminal: nothing is rendered nor read from the keyboard
+const char* trace_file_path = NULL; // Chrome trace written on exit (NULL: tracing off)
+bool perf_enabled = false; // Hardware counters around the hot regions (see perfBegin)
+int demand_hotspots = 0; // Curb hotspots passengers spawn around (0: every curb alike)
+static const int sidewalk_tile[MAP_TILE_CELLS] = { [0 ... MAP_TILE_CELLS - 1] = SIDEWALK }; // Shared all-sidewalk tile
 
 // -------------------- STRUCTURES --------------------
 
@@ -147,6 +342,141 @@ typedef struct {
     int parent_index;
 } Node;
 
+/**
+ * Bitboard structure for bit-parallel BFS
+ * 
+ * One bit per map cell, packed row by row into 64-bit words with:
+ * @param rows: Number of rows in the board
+ * @param cols: Number of columns in the board
+ * @param words: Payload words per row (rounded up to a multiple of 4 for SIMD)
+ * @param stride: Words per row including one zero guard word on each side
+ * @param data: (rows + 2) * stride words, with a zero guard row above and below
+ * 
+ * @note The guard words let row shifts and up/down reads run without bounds checks
+ */
+
+typedef struct {
+    int rows, cols;
+    int words;
+    int stride;
+    uint64_t* data;
+} Bitboard;
+
+/**
+ * Bit-parallel BFS context
+ * 
+ * Working set for frontier expansion over bitboards with:
+ * @param passable: Cells the search may enter (ROAD, targets and the pass range)
+ * @param targets: Cells that end a nearest-target search
+ * @param target_low, target_high: Cell values loaded as targets (see bitbfsLoad)
+ * @param pass_low, pass_high: Further cell values loaded as passable
+ * @param visited: Cells already reached
+ * @param frontier: Cells reached in the current layer
+ * @param next: Scratch board for the next layer (all zero between layers)
+ * @param dist: BFS layer per cell, 64 slots per board word (read with bitbfsDist; valid only where visited)
+ * @param active: Board data offset of every non-zero frontier word
+ * @param num_active: Number of active words
+ * @param touched: Scratch list of the next layer's words
+ * @param visited_lo, visited_hi: Range of board data offsets holding visited bits (cleared by the next bitbfsStart)
+ * @param layer: Last layer expanded by bitbfsRun
+ * @param layer_limit: Layer at which bitbfsRun stops (INT_MAX after bitbfsStart)
+ * 
+ * @note Kept alive between searches: only the rows and words a search
+ *       touched are cleared again, and passable/targets follow map writes
+ *       through bitbfsSetCell
+ */
+
+typedef struct {
+    Bitboard* passable;
+    Bitboard* targets;
+    int target_low, target_high;
+    int pass_low, pass_high;
+    Bitboard* visited;
+    Bitboard* frontier;
+    Bitboard* next;
+    int* dist;
+    int* active;
+    int num_active;
+    int* touched;
+    int visited_lo, visited_hi;
+    int layer, layer_limit;
+} BitBFS;
+
+/**
+ * Distance field from all free taxis
+ * 
+ * Road distance from every cell to the nearest free taxi, kept up to date
+ * incrementally as map cells change, with:
+ * @param rows: Number of rows in the field
+ * @param cols: Number of columns in the field
+ * @param dist: Distance per cell (0 on free taxis, INT_MAX if unreachable/blocked)
+ * @param kind: Cell class per cell (FIELD_BLOCKED, FIELD_ROAD or FIELD_SOURCE)
+ * @param stack: Scratch stack of cells for the raise wave
+ * @param stack_dist: Distances the stacked cells had before invalidation
+ * @param invalid: Scratch list of cells invalidated by the raise wave
+ * @param heap_keys: Min-heap distances for the lower wave
+ * @param heap_cells: Min-heap cells for the lower wave
+ * @param heap_size: Current heap size
+ * @param heap_capacity: Allocated heap size
+ */
+
+typedef struct {
+    int rows, cols;
+    int* dist;
+    unsigned char* kind;
+    int* stack;
+    int* stack_dist;
+    int* invalid;
+    int* heap_keys;
+    int* heap_cells;
+    int heap_size;
+    int heap_capacity;
+} TaxiField;
+
+/**
+ * Live traffic density used to price road cells
+ * 
+ * Every taxi move or wait deposits one unit of density on its cell; density
+ * decays by CONGESTION_DECAY per tick, applied lazily when a cell is touched, with:
+ * @param rows: Number of rows in the map
+ * @param cols: Number of columns in the map
+ * @param density: Traffic density per cell as of its stamp
+ * @param stamp: Tick at which each cell's density was last updated
+ * @param memory: Ticks a saturated cell takes to decay back to unit cost
+ * @param active_until: Tick after which every cell is back to unit cost
+ * @param origin_ns: Monotonic time of tick 0
+ */
+
+typedef struct {
+    int rows, cols;
+    float* density;
+    long* stamp;
+    long memory;
+    long active_until;
+    long long origin_ns;
+} CongestionMap;
+
+/**
+ * Congestion-weighted cost field, kept across searches (see dialDistanceField)
+ * 
+ * @param rows: Number of rows in the map
+ * @param cols: Number of columns in the map
+ * @param dist: Cost from each cell to the last destination (INT_MAX where unreached)
+ * @param touched: Cells whose dist the last search wrote; the next one resets only these
+ * @param num_touched: Number of touched cells
+ * @param bucket, bucket_size, bucket_capacity: Dial's circular bucket queue
+ */
+
+typedef struct {
+    int rows, cols;
+    int* dist;
+    int* touched;
+    int num_touched;
+    int* bucket[CONGESTION_MAX_PENALTY + 2];
+    int bucket_size[CONGESTION_MAX_PENALTY + 2];
+    int bucket_capacity[CONGESTION_MAX_PENALTY + 2];
+} DialField;
+
 /**
  * Square structure for map generation
  * 
@@ -161,24 +491,162 @@ typedef struct {
     int size;
 } Square;
 
+/**
+ * Candidate road between two squares for the MST
+ * 
+ * @param weight: Manhattan distance between the square centres
+ * @param a, b: Indices of the connected squares (a < b)
+ */
+
+typedef struct {
+    int weight;
+    int a, b;
+} SquareEdge;
+
+/**
+ * Map cells stored as lazily allocated 64x64 tiles
+ * 
+ * Tiles that are entirely sidewalk all point at the read-only sidewalk_tile
+ * and get their own storage on the first other write (tileSet), so memory
+ * follows the road area instead of the map area. Cells inside a tile are
+ * row-major, and tile columns line up with bitboard words.
+ * 
+ * @param rows, cols: Map dimensions in cells
+ * @param tile_rows, tile_cols: Dimensions of the tile table
+ * @param tiles: Tile table, row-major; sidewalk_tile for untouched tiles
+ * @param materialised: Tiles with their own storage
+ * @param mapped_begin, mapped_end: City file mapping holding loaded tiles (not freed here)
+ * @param spare, num_spare: Storage of recycled tiles, handed out again before any malloc
+ */
+
+typedef struct {
+    int rows, cols;
+    int tile_rows, tile_cols;
+    int** tiles;
+    size_t materialised;
+    const char* mapped_begin;
+    const char* mapped_end;
+    int** spare;
+    size_t num_spare;
+} TileGrid;
+
 /**
  * Map structure containing city layout
  * 
  * Represents the entire city map with:
- * @param rows: Number of rows in the matrix
- * @param cols: Number of columns in the matrix
+ * @param rows: Number of rows in the map
+ * @param cols: Number of columns in the map
  * @param road_width: Width of roads in cells
- * @param matrix: 2D array representing map cells
+ * @param grid: Map cells (read with tileGet, written through mapSetCell)
+ * @param free_taxi_field: Distance field to the nearest free taxi (NULL if not built)
+ * @param bitbfs: Bitboard search state of findPathBitboard (NULL until its first search)
+ * @param coop_bfs: Road and taxi cells for findPathCooperative (NULL until its first search)
+ * @param coop_dial: Congestion-weighted cost field of findPathCooperative (NULL until first needed)
+ * @param congestion: Live traffic density for weighted routing (NULL if not built)
+ * @param epoch: Terrain version, changes on regeneration and terrain edits
+ * @param squares: Building squares the city was generated from
+ * @param num_squares: Number of squares
+ * @param road_cells: Index (row * cols + col) of every road cell, ascending
+ * @param num_road_cells: Number of road cells
+ * @param curb_cells: Road cells next to a sidewalk (passenger spawn points)
+ * @param num_curb_cells: Number of curb cells
+ * @param road_component: Connected component (1-based) of each road cell
+ * @param num_components: Number of road components
+ * @param index_mapped: Squares and road indexes point into the mapping
+ * @param mapping: Private mapping of the city file the map was loaded from (NULL if generated)
+ * @param mapping_bytes: Size of the mapping
  * @param lock: Mutex for thread-safe map access
  */
 
 typedef struct {
     int rows, cols;
     int road_width;
-    int **matrix;
+    TileGrid grid;
+    TaxiField* free_taxi_field;
+    BitBFS* bitbfs;
+    BitBFS* coop_bfs;
+    DialField* coop_dial;
+    CongestionMap* congestion;
+    unsigned long epoch;
+    Square* squares;
+    int num_squares;
+    uint32_t* road_cells;
+    uint32_t num_road_cells;
+    uint32_t* curb_cells;
+    uint32_t num_curb_cells;
+    uint32_t* road_component;
+    uint32_t num_components;
+    bool index_mapped;
+    void* mapping;
+    size_t mapping_bytes;
     pthread_mutex_t lock; 
 } Map;
 
+/**
+ * Header of a city file (little-endian host layout, 8-byte aligned sections)
+ * 
+ * A city file is the header followed by these sections, each at its offset:
+ * - tile table: one uint64 per map tile (row-major), the file offset of
+ *   the tile's cells, or 0 for an all-sidewalk tile
+ * - tiles: num_stored_tiles tiles of tile_size^2 int32 terrain cells
+ *   (ROAD / SIDEWALK only)
+ * - squares: num_squares Square records (x, y, size as int32)
+ * - roads: num_road_cells uint32 cell indices (row * cols + col), ascending
+ * - curbs: num_curb_cells uint32 indices of road cells next to a sidewalk
+ * - components: num_road_cells uint32 component labels, parallel to roads
+ * The file is mapped privately on load, so stored tiles are used in place
+ * and runtime markers written into them never reach the disk.
+ */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint32_t endian;
+    int32_t rows, cols;
+    int32_t road_width;
+    int32_t num_squares;
+    uint32_t num_road_cells;
+    uint32_t num_curb_cells;
+    uint32_t num_components;
+    uint32_t tile_size;
+    uint32_t num_stored_tiles;
+    uint64_t tile_table_offset;
+    uint64_t tiles_offset;
+    uint64_t squares_offset;
+    uint64_t roads_offset;
+    uint64_t curbs_offset;
+    uint64_t components_offset;
+    uint64_t file_bytes;
+} CityFileHeader;
+
+_Static_assert(sizeof(CityFileHeader) == 112, "City file header layout changed");
+_Static_assert(sizeof(int) == sizeof(int32_t), "City file tiles are mapped as int cells");
+_Static_assert(sizeof(Square) == 3 * sizeof(int32_t), "City file squares are mapped in place");
+
+/**
+ * Band of map rows rasterised by one map generation thread
+ * 
+ * Each thread owns rows [row_begin, row_end), so bands never share cells, with:
+ * @param map: Map being generated
+ * @param squares: Accepted squares
+ * @param num_squares: Number of squares
+ * @param roads: Road endpoints (x1, y1, x2, y2 per road)
+ * @param num_roads: Number of roads
+ * @param border_width: Width of the road around each square
+ * @param row_begin, row_end: Rows owned by this band
+ */
+
+typedef struct {
+    Map* map;
+    const Square* squares;
+    int num_squares;
+    const int* roads;
+    int num_roads;
+    int border_width;
+    int row_begin, row_end;
+} MapBand;
+
 /**
  * Passenger structure representing a taxi customer
  * 
@@ -193,6 +661,14 @@ typedef struct {
  * @param y_sidewalk_dest: Y coordinate of sidewalk destination
  * @param x_road_dest: X coordinate of adjacent road destination
  * @param y_road_dest: Y coordinate of adjacent road destination
+ * @param trip_started_ns: Monotonic time the trip was dispatched (0 if not yet)
+ * @param trip_congestion_aware: Whether the trip was planned with congestion costs
+ * @param spawned_ns: Simulation time the passenger was created
+ * @param picked_up_ns: Simulation time a taxi reached the passenger (0 if not yet)
+ * @param pickup_eta_ns: Pickup time predicted when the taxi was assigned (0 if not yet)
+ * @param taxi_id: Taxi assigned to the trip (0 if not yet)
+ * @param route_cells: Cells of the route sent at assignment
+ * @param detours: Repaired routes sent since
  */
 
 typedef struct {
@@ -206,6 +682,14 @@ typedef struct {
     int y_sidewalk_dest;
     int x_road_dest;
     int y_road_dest;
+    long long trip_started_ns;
+    bool trip_congestion_aware;
+    long long spawned_ns;
+    long long picked_up_ns;
+    long long pickup_eta_ns;
+    int taxi_id;
+    int route_cells;
+    int detours;
 } Passenger;
 
 // Message types
@@ -225,13 +709,40 @@ typedef enum {
     MOVE_TO,
     FINISH,
     PRINT_LOGICO,
-    DROP,
     GOT_PASSENGER,
     ARRIVED_AT_DESTINATION,
-    REFRESH_PASSENGERS
+    REFRESH_PASSENGERS,
+    SAVE_MAP,
+    LOAD_MAP,
+    TOGGLE_CONGESTION,
+    CHECKPOINT,
+    RETIRE_TAXI,
+    MAP_READY,
+    ROUTE_BLOCKED
     
 } MessageType;
 
+/**
+ * HDR histogram of non-negative integer values
+ * 
+ * Values below 2 * HDR_SUB_BUCKETS get a bucket each; above that every power
+ * of two is split into HDR_SUB_BUCKETS buckets, so any value is counted with
+ * under 1% error over the whole range. Recording is a handful of atomic adds
+ * and never takes a lock; readers walk the counts while writers go on.
+ * 
+ * @param counts: Values recorded per bucket
+ * @param total: Values recorded
+ * @param sum: Sum of the values recorded (for the mean)
+ * @param max: Largest value recorded
+ */
+
+typedef struct {
+    uint64_t counts[HDR_COUNTS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} HdrHistogram;
+
 /**
  * Message structure for inter-thread communication
  * 
@@ -243,6 +754,7 @@ typedef enum {
  * @param extra_x: Secondary X coordinate or ID data
  * @param extra_y: Secondary Y coordinate or flags
  * @param pointer: Generic pointer for additional data
+ * @param enqueued_ns: Monotonic time the message entered its queue
  */
 
 typedef struct Message {
@@ -253,6 +765,7 @@ typedef struct Message {
     int extra_x;
     int extra_y;
     void* pointer;
+    long long enqueued_ns;
 } Message;
 
 /**
@@ -263,6 +776,14 @@ typedef struct Message {
  * @param tail: Pointer to last message in queue
  * @param lock: Mutex for thread-safe operations
  * @param cond: Condition variable for blocking dequeue
+ * @param actor: Replay actor consuming the queue (SCHED_ACTOR_*)
+ * @param current: Message its consumer is handling (see schedDequeue), still
+ *                 pending for a checkpoint
+ * @param depth: Messages waiting (atomic, so readers need not take the lock)
+ * @param high_water: Largest depth reached
+ * @param enqueued, dequeued: Messages that entered the queue / reached its consumer
+ * @param dropped: Messages discarded unhandled (stale routes, teardown)
+ * @param sojourn: Time from enqueue to dequeue, in us
  */
 
 typedef struct {
@@ -270,23 +791,233 @@ typedef struct {
     Message* tail;
     pthread_mutex_t lock;
     pthread_cond_t cond;
+    int actor;
+    Message* current;
+    unsigned long depth;
+    unsigned long high_water;
+    unsigned long enqueued;
+    unsigned long dequeued;
+    unsigned long dropped;
+    HdrHistogram sojourn;
 } MessageQueue;
 
+/**
+ * Random number stream (SplitMix64)
+ * 
+ * Each consumer owns its stream, so the numbers it draws depend only on
+ * the seed and on its own call sequence, not on other threads.
+ * 
+ * @param state: Generator state
+ */
+
+typedef struct {
+    uint64_t state;
+} Rng;
+
+/**
+ * Replay log event
+ * 
+ * One turn of a recorded run, 32 bytes on disk:
+ * @param actor: Thread taking the turn (SCHED_ACTOR_*); the target queue's
+ *               actor for SCHED_EXTERNAL
+ * @param kind: SCHED_STEP, SCHED_RESUME or SCHED_EXTERNAL
+ * @param type: MessageType handled or injected (0 for SCHED_RESUME)
+ * @param data_x, data_y, extra_x, extra_y: Message fields, checked on replay
+ * @param now_ns: Simulation clock during the turn
+ */
+
+typedef struct {
+    uint32_t actor;
+    uint16_t kind;
+    uint16_t type;
+    int32_t data_x;
+    int32_t data_y;
+    int32_t extra_x;
+    int32_t extra_y;
+    int64_t now_ns;
+} ReplayEvent;
+
+_Static_assert(sizeof(ReplayEvent) == 32, "replay events are 32 bytes on disk");
+
+/**
+ * Replay log header
+ * 
+ * Everything besides the events that decides a run:
+ * @param magic: REPLAY_FILE_MAGIC
+ * @param version: REPLAY_FILE_VERSION
+ * @param event_bytes: sizeof(ReplayEvent)
+ * @param seed: sim_seed of the recorded run
+ * @param rows, cols: Map size of the recorded run
+ * @param load_city: The run started from city_path
+ * @param demand_hotspots: Hotspots passenger spawns were weighted towards
+ * @param time_scale: sim_time_scale of the recorded run (taxi ticks, reservations, ETAs)
+ * @param city_path: City file of the recorded run
+ */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_bytes;
+    uint64_t seed;
+    int32_t rows;
+    int32_t cols;
+    uint32_t load_city;
+    uint32_t demand_hotspots;
+    double time_scale;
+    char city_path[256];
+} ReplayHeader;
+
+/**
+ * Turn schedule of recorded and replayed runs
+ * 
+ * While recording or replaying, the control center, visualizer and taxi
+ * threads only touch simulation state while holding the turn, so a run is
+ * a sequence of turns. Recording logs that sequence; replaying hands the
+ * turn out in the logged order. In every mode the schedule also counts the
+ * steps in progress, so a checkpoint can stop the world between steps.
+ * 
+ * @param mode: SCHED_FREE, SCHED_RECORD or SCHED_REPLAY
+ * @param lock, cond: Guard the fields below and signal turn changes
+ * @param busy: A thread holds the turn
+ * @param active: Steps in progress (threads between acquiring and releasing)
+ * @param stopping: The world is stopped, or about to be (see schedStopWorld)
+ * @param file: Replay log being written or read
+ * @param path: Path of the replay log
+ * @param next: Replay: the event owning the current/next turn
+ * @param events: Events recorded or replayed so far
+ * @param origin_ns: Monotonic time at simulation clock 0
+ * @param clock_ns: Simulation clock of the current turn
+ * @param progress_ns: Monotonic time of the last released turn
+ * @param status: How the last record/replay ended, shown under the map
+ */
+
+typedef struct {
+    int mode;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool busy;
+    int active;
+    bool stopping;
+    FILE* file;
+    const char* path;
+    ReplayEvent next;
+    unsigned long events;
+    long long origin_ns;
+    long long clock_ns;
+    long long progress_ns;
+    char status[160];
+} Schedule;
+
+/**
+ * Run-length route segment
+ * 
+ * One step group of a compact path with:
+ * @param op: Direction (ROUTE_UP/DOWN/LEFT/RIGHT), waypoint event (ROUTE_PICKUP/DROPOFF) or ROUTE_WAIT
+ * @param run: Number of cells moved in that direction, or steps waited (0 for events)
+ */
+
+typedef struct {
+    unsigned int op : 3;
+    unsigned int run : 29;
+} RouteSegment;
+
 /**
  * Path data structure for storing navigation solutions
  * 
- * Contains computed path information with:
- * @param solucaoX: Array of X coordinates in path
- * @param solucaoY: Array of Y coordinates in path
- * @param tamanho_solucao: Number of points in path
+ * Contains a run-length encoded path with:
+ * @param start_x: X coordinate of the first cell
+ * @param start_y: Y coordinate of the first cell
+ * @param end_x: X coordinate of the last cell
+ * @param end_y: Y coordinate of the last cell
+ * @param segments: (direction, run) segments and waypoint events in order
+ * @param num_segments: Number of segments in use
+ * @param capacity: Allocated number of segments
+ * @param tamanho_solucao: Number of cells in path (0 for an empty/failed path)
  */
 
 typedef struct {
-    int* solucaoX;         
-    int* solucaoY;         
+    int start_x, start_y;
+    int end_x, end_y;
+    RouteSegment* segments;
+    int num_segments;
+    int capacity;
     int tamanho_solucao;   
 } PathData;
 
+/**
+ * Cursor for walking a PathData cell by cell
+ * 
+ * @param path: Path being walked
+ * @param segment: Index of the current segment
+ * @param step: Cells already taken within the current segment
+ * @param col: X coordinate of the current cell
+ * @param row: Y coordinate of the current cell
+ */
+
+typedef struct {
+    const PathData* path;
+    int segment;
+    int step;
+    int col, row;
+} PathCursor;
+
+/**
+ * Space-time reservation entry
+ * 
+ * @param cell: Reserved cell (RESERVATION_CELL key)
+ * @param tick: Simulation tick of the reservation
+ * @param taxi_id: Owning taxi (0 marks an empty slot)
+ */
+
+typedef struct {
+    int cell;
+    long tick;
+    int taxi_id;
+} Reservation;
+
+/**
+ * Space-time reservation table for cooperative routing
+ * 
+ * Taxis reserve the cells they will occupy over the next few route steps
+ * so later routes plan around them, with:
+ * @param slots: Open-addressing hash table of (cell, tick) reservations
+ * @param capacity: Number of slots (power of two)
+ * @param count: Slots in use
+ * @param occupied_cell: Cell each taxi currently stands on, by taxi ID (-1 if none)
+ * @param reserved_until: First tick past each taxi's last reservation, by taxi ID
+ * @param origin_ns: Monotonic time of tick 0
+ * @param lock: Mutex for thread-safe access
+ */
+
+typedef struct {
+    Reservation* slots;
+    int capacity;
+    int count;
+    int occupied_cell[MAX_TAXIS + 1];
+    long reserved_until[MAX_TAXIS + 1];
+    long long origin_ns;
+    pthread_mutex_t lock;
+} ReservationTable;
+
+/**
+ * Distance field the cooperative planner routes along
+ * 
+ * @param rows: Number of rows in the map
+ * @param cols: Number of columns in the map
+ * @param dist: Weighted cost from each cell to the destination (NULL: use bfs)
+ * @param bfs: Road distance search from the destination, bounded to the window
+ * @param congestion: Congestion map pricing moves (NULL: every move costs 1)
+ * @param now: Congestion tick the prices were taken at
+ */
+
+typedef struct {
+    int rows, cols;
+    const int* dist;
+    const BitBFS* bfs;
+    const CongestionMap* congestion;
+    long now;
+} CoopField;
+
 /**
  * Taxi structure representing a taxi vehicle
  * 
@@ -301,8 +1032,14 @@ typedef struct {
  * @param control_queue: Pointer to control center's queue
  * @param visualizerQueue: Pointer to visualizer's queue
  * @param thread_id: POSIX thread identifier
- * @param drop_cond: Condition variable for drop synchronization
- * @param drop_processed: Flag indicating drop completion
+ * @param route_epoch: Route generation, bumped for every new route (under lock);
+ *                     route messages carry the epoch they belong to
+ * @param reservations: Shared reservation table (cell occupancy)
+ * @param idle_ns: Time spent free before state_since_ns
+ * @param state_since_ns: Simulation time isFree last changed
+ * @param sampled_ns, sampled_idle_ns: Time and idle_ns at the last idle ratio sample
+ * @param retiring: Removed from dispatch and sent EXIT (under lock)
+ * @param retire_ns: Monotonic time its retirement was requested
  */
 
 typedef struct {
@@ -315,8 +1052,14 @@ typedef struct {
     MessageQueue* control_queue;
     MessageQueue* visualizerQueue; 
     pthread_t thread_id; 
-    pthread_cond_t drop_cond; 
-    bool drop_processed; 
+    int route_epoch;
+    ReservationTable* reservations;
+    long long idle_ns;
+    long long state_since_ns;
+    long long sampled_ns;
+    long long sampled_idle_ns;
+    bool retiring;
+    long long retire_ns;
 } Taxi;
 
 /**
@@ -330,6 +1073,20 @@ typedef struct {
  * @param taxis: Array of pointers to active taxis
  * @param numTaxis: Current taxi count
  * @param passengers: Array of pointers to active passengers
+ * @param reservations: Space-time reservation table shared by routing and taxis
+ * @param congestion_routing: Plan with congestion costs (false: plain BFS distances)
+ * @param trips: Completed trips, indexed by congestion_routing at dispatch
+ * @param trip_ns: Total dispatch-to-drop-off time of those trips
+ * @param taxis_created: Taxis created so far (numbers their replay actors)
+ * @param resetting: The map is being replaced; routes planned on the old one are
+ *        dropped until the visualizer sends MAP_READY
+ * @param retiring, numRetiring: Taxis sent EXIT that the visualizer has not seen
+ *        leave yet (their IDs stay taken)
+ * @param reaper_queue: Retired taxis for the reaper thread to join and free
+ * @param passengers_created, dispatches, routes: Passengers accepted, passenger
+ *        routes sent to taxis and successful ROUTE_PLANs (throughput counters)
+ * @param passengers_shed: Passenger requests turned away at MAX_PASSENGERS
+ * @param passengers_unplaced: Passengers the visualizer found no curb for
  */
 
 typedef struct {
@@ -340,8 +1097,164 @@ typedef struct {
     Taxi* taxis[MAX_TAXIS];
     int numTaxis;
     Passenger* passengers[MAX_PASSENGERS]; 
+    ReservationTable* reservations;
+    bool congestion_routing;
+    unsigned long trips[2];
+    long long trip_ns[2];
+    unsigned int taxis_created;
+    bool resetting;
+    Taxi* retiring[MAX_TAXIS];
+    int numRetiring;
+    MessageQueue reaper_queue;
+    unsigned long passengers_created;
+    unsigned long dispatches;
+    unsigned long routes;
+    unsigned long passengers_shed;
+    unsigned long passengers_unplaced;
 } ControlCenter;
 
+/**
+ * Passenger lifecycle metrics
+ * 
+ * @param histograms: One HdrHistogram per METRIC_* kind
+ * @param snapshots: Snapshots written to metrics_file so far
+ */
+
+typedef struct {
+    HdrHistogram histograms[METRIC_COUNT];
+    unsigned long snapshots;
+} LifecycleMetrics;
+
+/**
+ * Route cache entry
+ * 
+ * One cached findPathCoordinates result with:
+ * @param src_x, src_y: Path start
+ * @param dst_x, dst_y: Path destination
+ * @param epoch: Map epoch the path was computed on
+ * @param path: Compact copy of the route
+ * @param next: Next slot in the same hash bucket (-1 ends the chain)
+ * @param referenced: CLOCK reference bit
+ * @param used: Slot holds a route
+ */
+
+typedef struct {
+    int src_x, src_y;
+    int dst_x, dst_y;
+    unsigned long epoch;
+    PathData* path;
+    int next;
+    bool referenced;
+    bool used;
+} RouteCacheEntry;
+
+/**
+ * Bounded route cache with CLOCK eviction
+ * 
+ * Shared by routing callers with:
+ * @param slots: Fixed pool of ROUTE_CACHE_SLOTS entries
+ * @param buckets: Hash bucket heads (slot index or -1)
+ * @param hand: CLOCK hand position
+ * @param lock: Mutex for thread-safe access
+ * @param hits: Lookups served from the cache
+ * @param misses: Lookups that ran the BFS
+ * @param stale: Hits rejected because the path is now blocked
+ * @param hit_ns: Total time spent on hits
+ * @param miss_ns: Total time spent on misses (BFS included)
+ */
+
+typedef struct {
+    RouteCacheEntry slots[ROUTE_CACHE_SLOTS];
+    int buckets[ROUTE_CACHE_BUCKETS];
+    int hand;
+    pthread_mutex_t lock;
+    unsigned long hits, misses, stale;
+    long long hit_ns, miss_ns;
+} RouteCache;
+
+/**
+ * Incremental search state of one route leg (D* Lite)
+ * 
+ * Searches backward from the goal so the start can follow the taxi; cells
+ * whose routability changes are repaired locally. Per-cell arrays are reset
+ * lazily through generation stamps, so replanning never clears the map, with:
+ * @param rows, cols: Map dimensions
+ * @param start_col, start_row: Taxi position (or leg start while queued)
+ * @param goal_col, goal_row: Leg destination
+ * @param last_col, last_row: Start when km was last updated
+ * @param km: Key modifier accumulated as the start moves
+ * @param g, rhs: D* Lite cost estimates per cell
+ * @param heap_pos: Index of each cell in the open heap (-1 if absent)
+ * @param stamp: Generation in which each cell was last initialised
+ * @param generation: Current search generation
+ * @param heap_cells, heap_k1, heap_k2: Open list as a binary min-heap on (k1, k2)
+ * @param heap_size, heap_capacity: Heap occupancy
+ * @param mark: Generation in which each cell was last on the sent route
+ * @param mark_generation: Current route marking
+ */
+
+typedef struct {
+    int rows, cols;
+    int start_col, start_row;
+    int goal_col, goal_row;
+    int last_col, last_row;
+    int km;
+    int* g;
+    int* rhs;
+    int* heap_pos;
+    unsigned int* stamp;
+    unsigned int generation;
+    int* heap_cells;
+    int* heap_k1;
+    int* heap_k2;
+    int heap_size, heap_capacity;
+    unsigned int* mark;
+    unsigned int mark_generation;
+} DStarLite;
+
+/**
+ * Route a taxi is currently driving, kept repairable
+ * 
+ * @param legs: Search state per leg (to the passenger, then to the destination)
+ * @param leg_event: Waypoint event ending each leg (ROUTE_PICKUP, ROUTE_DROPOFF or -1)
+ * @param num_legs: Legs in the route (0 when no route is tracked)
+ * @param leg: Leg being driven
+ * @param passenger_id: Passenger served by the route (0 when cruising)
+ * @param ticks_per_step: Ticks per cell at the taxi's speed on this route
+ */
+
+typedef struct {
+    DStarLite* legs[2];
+    int leg_event[2];
+    int num_legs;
+    int leg;
+    int passenger_id;
+    int ticks_per_step;
+} InflightRoute;
+
+/**
+ * Hotspot weighting of the curb cells passengers spawn on
+ * 
+ * Curbs within a hotspot's radius weigh up to DEMAND_HOTSPOT_PEAK times
+ * more, falling off with the squared distance. A spawn draws a point on
+ * the running sum and finds its curb by binary search.
+ * 
+ * @param epoch: Map epoch the weights were built for (0: not built)
+ * @param count: Curb cells weighted (map->num_curb_cells at build time)
+ * @param cumulative: Running sum of the curb weights, in map->curb_cells order
+ * @param hotspot_x, hotspot_y: Hotspot centres
+ * @param num_hotspots: Hotspots placed
+ */
+
+typedef struct {
+    unsigned long epoch;
+    uint32_t count;
+    uint64_t* cumulative;
+    int hotspot_x[DEMAND_MAX_HOTSPOTS];
+    int hotspot_y[DEMAND_MAX_HOTSPOTS];
+    int num_hotspots;
+} CurbWeights;
+
 /**
  * Visualizer structure for map rendering
  * 
@@ -355,6 +1268,17 @@ typedef struct {
  * @param queue: Message queue for receiving commands
  * @param control_queue: Pointer to control center's queue
  * @param center: Pointer to control center structure
+ * @param route_cache: Cache of computed routes (NULL disables caching)
+ * @param inflight: Repairable route of each taxi, by taxi ID
+ * @param route_repairs: In-flight routes repaired so far
+ * @param city_status: Outcome of the last city save/load, shown under the map
+ * @param map_rng: Random stream of map generation
+ * @param spawn_rng: Random stream of taxi and passenger placement
+ * @param restored_map: Map restored from a checkpoint, used instead of a new city at start
+ * @param resets: Time to replace the city on RESET_MAP/LOAD_MAP, in us
+ * @param last_reset_us, last_reset_in_place: The last of those, and whether it reused the map
+ * @param hotspot_rng: Random stream of demand hotspot placement
+ * @param curb_weights: Spawn weights of the curbs of the current map (see demand_hotspots)
  */
 
 typedef struct {
@@ -367,98 +1291,772 @@ typedef struct {
     MessageQueue queue;
     MessageQueue* control_queue;
     ControlCenter* center;
+    RouteCache* route_cache;
+    InflightRoute inflight[MAX_TAXIS + 1];
+    unsigned long route_repairs;
+    char city_status[160];
+    Rng map_rng;
+    Rng spawn_rng;
+    Map* restored_map;
+    HdrHistogram resets;
+    long long last_reset_us;
+    bool last_reset_in_place;
+    Rng hotspot_rng;
+    CurbWeights curb_weights;
 } Visualizer;
 
-// Function prototypes
-static void drawSquare(Map* map, Square q, int borderWidth);
-static void connectSquaresMST(Map* map, Square* squares, int num_squares);
-static void findConnectionPoints(Square a, Square b, int* px1, int* py1, int* px2, int* py2);
-void init_operations();
-void renderMap(Map* map, ControlCenter* center, Visualizer* visualizer);
-pthread_t create_taxi_thread(Taxi* taxi);
-bool find_random_free_point(Map* map, int* random_x, int* random_y);
-const char* message_type_to_abbreviation(MessageType type);
+/**
+ * Header of a checkpoint file (host layout, 8-byte aligned sections)
+ * 
+ * A checkpoint is the header followed by these sections, each at its offset:
+ * - tile index: num_stored_tiles uint32 indices of the stored map tiles
+ * - tiles: num_stored_tiles tiles of tile_size^2 uint16 cells, runtime
+ *   markers (taxis, passengers, destinations) included
+ * - squares: num_squares Square records
+ * - taxis, passengers: in center->taxis / center->passengers order
+ * - routes: in-flight routes kept repairable (see InflightRoute)
+ * - reservations: live entries of the reservation table
+ * - congestion: road cells with traffic density
+ * - messages: the pending messages of every queue, in queue order, each
+ *   queue's current message first
+ * - payload: int32 words of the routes and destinations messages point to
+ * Search state, the route cache and the free taxi distance field are
+ * rebuilt on restore rather than stored. Lifecycle histograms are not stored
+ * either: they start empty, while passengers and taxis keep their timestamps.
+ */
 
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint32_t endian;
+    uint32_t tile_size;
+    uint64_t seed;
+    int64_t clock_ns;
+    double time_scale;
+    uint64_t map_rng;
+    uint64_t spawn_rng;
+    int32_t rows, cols;
+    int32_t road_width;
+    int32_t num_squares;
+    uint32_t num_stored_tiles;
+    uint32_t num_taxis;
+    uint32_t num_passengers;
+    uint32_t num_routes;
+    uint32_t num_reservations;
+    uint32_t num_congested;
+    uint32_t num_messages;
+    uint32_t num_payload_words;
+    uint32_t congestion_routing;
+    uint32_t taxis_created;
+    uint64_t trips[2];
+    int64_t trip_ns[2];
+    uint64_t route_repairs;
+    int64_t reservation_origin_ns;
+    int64_t congestion_origin_ns;
+    int64_t congestion_active_until;
+    uint64_t tile_index_offset;
+    uint64_t tiles_offset;
+    uint64_t squares_offset;
+    uint64_t taxis_offset;
+    uint64_t passengers_offset;
+    uint64_t routes_offset;
+    uint64_t reservations_offset;
+    uint64_t congestion_offset;
+    uint64_t messages_offset;
+    uint64_t payload_offset;
+    uint64_t file_bytes;
+} CheckpointHeader;
 
-// -------------------- QUEUE FUNCTIONS ---------------------
+/**
+ * Checkpointed taxi
+ * 
+ * @param id, x, y, is_free, current_passenger: As in Taxi
+ * @param actor: Replay actor of its queue
+ * @param occupied_cell, reserved_until: Its entries in the reservation table
+ * @param route_epoch: As in Taxi (queued route messages carry theirs)
+ * @param idle_ns, state_since_ns, sampled_ns, sampled_idle_ns: Idle accounting as in Taxi
+ */
 
-// Initialize the queue
-void init_queue(MessageQueue* queue) {
-    queue->head = NULL;
-    queue->tail = NULL;
-    pthread_mutex_init(&queue->lock, NULL);
-    pthread_cond_init(&queue->cond, NULL);
-}
+typedef struct {
+    int32_t id;
+    int32_t x, y;
+    uint32_t is_free;
+    int32_t current_passenger;
+    int32_t actor;
+    int32_t occupied_cell;
+    int32_t route_epoch;
+    int64_t reserved_until;
+    int64_t idle_ns;
+    int64_t state_since_ns;
+    int64_t sampled_ns;
+    int64_t sampled_idle_ns;
+} CheckpointTaxi;
+
+// Checkpointed passenger (fields as in Passenger)
+typedef struct {
+    int32_t id;
+    int32_t x_sidewalk, y_sidewalk;
+    int32_t x_road, y_road;
+    int32_t x_sidewalk_dest, y_sidewalk_dest;
+    int32_t x_road_dest, y_road_dest;
+    uint32_t is_free;
+    uint32_t trip_congestion_aware;
+    int32_t taxi_id;
+    int32_t route_cells;
+    int32_t detours;
+    int64_t trip_started_ns;
+    int64_t spawned_ns;
+    int64_t picked_up_ns;
+    int64_t pickup_eta_ns;
+} CheckpointPassenger;
 
-// Enqueue a message
-void enqueue_message(MessageQueue* queue, MessageType type, int x, int y, int extra_x, int extra_y, void* pointer) {
-    Message* new_msg = malloc(sizeof(Message));
-    new_msg->type = type;
-    new_msg->data_x = x;
-    new_msg->data_y = y;
-    new_msg->extra_x = extra_x;
-    new_msg->extra_y = extra_y;
-    new_msg->pointer = pointer;
-    new_msg->next = NULL;
+/**
+ * Checkpointed in-flight route
+ * 
+ * Each leg from `leg` on is planned again from its start (the taxi's cell
+ * for the current leg) to its goal on restore.
+ * 
+ * @param taxi_id, num_legs, leg, passenger_id, ticks_per_step, leg_event: As in InflightRoute
+ * @param start_col, start_row, goal_col, goal_row: Endpoints of each leg
+ */
 
-    pthread_mutex_lock(&queue->lock);
-    if (queue->tail == NULL) {
-        queue->head = queue->tail = new_msg;
-    } else {
-        queue->tail->next = new_msg;
-        queue->tail = new_msg;
-    }
-    pthread_cond_signal(&queue->cond);
-    pthread_mutex_unlock(&queue->lock);
+typedef struct {
+    int32_t taxi_id;
+    int32_t num_legs;
+    int32_t leg;
+    int32_t passenger_id;
+    int32_t ticks_per_step;
+    int32_t leg_event[2];
+    int32_t start_col[2], start_row[2];
+    int32_t goal_col[2], goal_row[2];
+    int32_t reserved;
+} CheckpointRoute;
+
+// Checkpointed reservation (fields as in Reservation)
+typedef struct {
+    int32_t cell;
+    int32_t taxi_id;
+    int64_t tick;
+} CheckpointReservation;
 
-    // Log the message
-    if (log_file) {
-        pthread_mutex_lock(&pause_mutex); // Ensure thread-safe logging
-        fprintf(log_file, "Enqueued Message: Type=%s, DataX=%d, DataY=%d, ExtraX=%d, ExtraY=%d\n",
-                message_type_to_abbreviation(type), x, y, extra_x, extra_y);
-        fflush(log_file); // Ensure the log is written immediately
-        pthread_mutex_unlock(&pause_mutex);
-    }
-}
+// Checkpointed traffic density of one cell (see CongestionMap)
+typedef struct {
+    uint32_t cell;
+    float density;
+    int64_t stamp;
+} CheckpointCongestion;
 
-// Priority enqueue a message
-void priority_enqueue_message(MessageQueue* queue, MessageType type, int x, int y, int extra_x, int extra_y, void* pointer) {
-    Message* new_msg = malloc(sizeof(Message));
-    new_msg->type = type;
-    new_msg->data_x = x;
-    new_msg->data_y = y;
-    new_msg->extra_x = extra_x;
-    new_msg->extra_y = extra_y;
-    new_msg->pointer = pointer;
-    new_msg->next = NULL;
+/**
+ * Checkpointed message
+ * 
+ * Pointers are stored by what they point to:
+ * - CREATE_PASSENGER, MOVE_TO, SPAWN_TAXI: ref is the index of the passenger,
+ *   taxi or taxi queue in the checkpoint (-1 for NULL)
+ * - ROUTE_PLAN: payload holds start_x, start_y, end_x, end_y, tamanho_solucao
+ *   and one (op | run << 3) word per segment
+ * - PATHFIND_REQUEST: payload holds the 4 destination coordinates
+ * 
+ * @param queue: CHECKPOINT_QUEUE_* of the queue holding the message
+ * @param type: MessageType
+ * @param data_x, data_y, extra_x, extra_y: Message fields
+ * @param ref: Index the pointer referred to (-1 if none)
+ * @param payload: First payload word of the pointed-to data
+ * @param payload_words: Payload words (0 if none)
+ */
 
-    pthread_mutex_lock(&queue->lock);
+typedef struct {
+    int32_t queue;
+    uint32_t type;
+    int32_t data_x, data_y;
+    int32_t extra_x, extra_y;
+    int32_t ref;
+    uint32_t payload;
+    uint32_t payload_words;
+    uint32_t reserved;
+} CheckpointMessage;
+
+_Static_assert(sizeof(CheckpointHeader) == 272, "Checkpoint header layout changed");
+_Static_assert(sizeof(CheckpointTaxi) == 72 && sizeof(CheckpointPassenger) == 88 &&
+               sizeof(CheckpointRoute) == 64 && sizeof(CheckpointReservation) == 16 &&
+               sizeof(CheckpointCongestion) == 16 && sizeof(CheckpointMessage) == 40,
+               "Checkpoint record layout changed");
+_Static_assert(sizeof(RouteSegment) == sizeof(uint32_t), "Route segments are checkpointed as one word");
 
-    // Insert the message at the head of the queue
-    if (queue->head == NULL) {
-        queue->head = queue->tail = new_msg;
-    } else {
-        new_msg->next = queue->head;
-        queue->head = new_msg;
-    }
+/**
+ * Checkpoint file image being built in memory
+ * 
+ * @param data: Bytes written so far
+ * @param size: Bytes in use
+ * @param capacity: Bytes allocated
+ * @param failed: An allocation failed (the image is incomplete)
+ */
 
-    pthread_cond_signal(&queue->cond);
-    pthread_mutex_unlock(&queue->lock);
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} CheckpointBuffer;
 
-    if (log_file) {
-        pthread_mutex_lock(&pause_mutex); // Ensure thread-safe logging
-        fprintf(log_file, "Enqueued Message: Type=%s, DataX=%d, DataY=%d, ExtraX=%d, ExtraY=%d\n",
-                message_type_to_abbreviation(type), x, y, extra_x, extra_y);
+/**
+ * Background writer of checkpoint files
+ * 
+ * @param lock: Guards the fields below
+ * @param thread: Writer of the last checkpoint
+ * @param started: thread has not been joined yet
+ * @param writing: thread is still writing
+ * @param image: Checkpoint being written (owned by the writer)
+ * @param pause_ns: How long the world was stopped to take it
+ * @param status: Outcome of the last checkpoint, shown under the map
+ */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool started;
+    bool writing;
+    CheckpointBuffer image;
+    long long pause_ns;
+    char status[160];
+} CheckpointWriter;
+
+/**
+ * Headless benchmark settings (see bench_thread)
+ * 
+ * @param enabled: Run the benchmark instead of reading the keyboard
+ * @param taxis: Fleet created before measuring
+ * @param rate: Passengers requested per second (0: none)
+ * @param duration_s: Length of the measured window
+ * @param output: File the JSON report goes to (NULL: stdout)
+ */
+
+typedef struct {
+    bool enabled;
+    int taxis;
+    double rate;
+    double duration_s;
+    const char* output;
+} BenchConfig;
+
+/**
+ * Counters read at each end of the benchmark window
+ * 
+ * @param ns: Monotonic time of the sample
+ * @param messages: Messages handled by every queue's consumer
+ * @param routes, dispatches, passengers, trips: As counted by the control center
+ * @param shed, demand: Passengers turned away, and requested by the demand generator
+ * @param cpu_user_ns, cpu_system_ns: CPU time of the process
+ */
+
+typedef struct {
+    long long ns;
+    unsigned long messages;
+    unsigned long routes;
+    unsigned long dispatches;
+    unsigned long passengers;
+    unsigned long trips;
+    unsigned long shed;
+    unsigned long demand;
+    unsigned long traced;
+    unsigned long unplaced;
+    long long cpu_user_ns;
+    long long cpu_system_ns;
+} BenchSample;
+
+/**
+ * Work done by the routing engines, counted per thread
+ * 
+ * @param expanded: Cells taken off a search queue or frontier (or walked, for gradients)
+ * @param allocations: malloc/calloc/realloc calls made while routing
+ */
+
+typedef struct {
+    unsigned long expanded;
+    unsigned long allocations;
+} RouteStats;
+
+/**
+ * Pathfinding micro-benchmark settings (see pathBenchRun)
+ * 
+ * @param enabled: Run the routing benchmark and exit (no threads, no terminal)
+ * @param sizes: Comma-separated ROWSxCOLS map sizes
+ * @param densities: Comma-separated building densities, in squares per 10000 cells
+ * @param engines: Comma-separated engines to time, or "all"
+ * @param seeds: Maps generated per size and density (seeds sim_seed, sim_seed + 1, ...)
+ * @param queries: Queries per query set and map
+ */
+
+typedef struct {
+    bool enabled;
+    const char* sizes;
+    const char* densities;
+    const char* engines;
+    int seeds;
+    int queries;
+} PathBenchConfig;
+
+/**
+ * Passenger demand generator settings and state (see demand_thread)
+ * 
+ * @param rate: Passengers requested per second, averaged over a day (0: no generator)
+ * @param profile: Rate multiplier of each hour of the simulated day (mean 1)
+ * @param profile_name: Profile shown under the map
+ * @param day_s: Seconds a simulated day lasts
+ * @param clock_ns: Time into the current day (stops while paused)
+ * @param requested: Passengers requested so far
+ */
+
+typedef struct {
+    double rate;
+    double profile[DEMAND_PROFILE_HOURS];
+    const char* profile_name;
+    double day_s;
+    long long clock_ns;
+    unsigned long requested;
+} DemandConfig;
+
+// Trip request of a trace: when, and from which road cell to which
+typedef struct {
+    long long time_us;
+    int origin_col, origin_row;
+    int dest_col, dest_row;
+} TripRequest;
+
+/**
+ * Trip record of a binary trace, 24 bytes on disk after a header of
+ * TRIPS_FILE_MAGIC, uint32 TRIPS_FILE_VERSION and uint32 record size
+ * 
+ * @param time_us: Request time in microseconds (any origin)
+ * @param origin_col, origin_row, dest_col, dest_row: Road cells of the trip
+ */
+
+typedef struct {
+    int64_t time_us;
+    int32_t origin_col;
+    int32_t origin_row;
+    int32_t dest_col;
+    int32_t dest_row;
+} TripRecord;
+
+_Static_assert(sizeof(TripRecord) == 24, "trip records are 24 bytes on disk");
+
+/**
+ * Streaming trip-request trace (see trips_thread)
+ * 
+ * The file is read in TRIPS_CHUNK_BYTES chunks and parsed into a ring of
+ * at most TRIPS_LOOKAHEAD requests, so memory does not grow with the trace.
+ * 
+ * @param path: Trace file (NULL: no trace)
+ * @param speed: Trace seconds played per second
+ * @param file: Open trace
+ * @param binary: TripRecord records instead of CSV lines
+ * @param chunk, chunk_len, chunk_pos: Bytes read and not parsed yet
+ * @param ahead, ahead_head, ahead_count: Parsed requests waiting for their time
+ * @param origin_us: Time of the first request (trace time 0)
+ * @param clock_ns: Time into the trace (stops while paused)
+ * @param read, injected, rejected: Requests parsed, sent to the control
+ *        center, and skipped as malformed or degenerate
+ * @param done: The whole trace has been injected (or could not be read)
+ * @param status: Problem opening or reading the trace, shown under the map
+ */
+
+typedef struct {
+    const char* path;
+    double speed;
+    FILE* file;
+    bool binary;
+    char* chunk;
+    size_t chunk_len;
+    size_t chunk_pos;
+    TripRequest* ahead;
+    int ahead_head;
+    int ahead_count;
+    long long origin_us;
+    long long clock_ns;
+    unsigned long read;
+    unsigned long injected;
+    unsigned long rejected;
+    bool done;
+    char status[160];
+} TripTrace;
+
+/**
+ * Trip log file header
+ * 
+ * Followed by blocks, each a TripLogBlockHeader and its columns' bytes in
+ * column order.
+ * 
+ * @param magic: TRIPLOG_FILE_MAGIC
+ * @param version: TRIPLOG_FILE_VERSION
+ * @param columns: TRIPLOG_COLUMNS
+ * @param block_rows: Most trips in one block
+ * @param names: Column names (see TRIPLOG_COL_*)
+ */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t columns;
+    uint32_t block_rows;
+    uint32_t reserved;
+    char names[TRIPLOG_COLUMNS][TRIPLOG_NAME_BYTES];
+} TripLogHeader;
+
+/**
+ * Header of one compressed block of trips
+ * 
+ * A reader wanting some columns seeks past the others with column_bytes;
+ * one looking for a time range skips whole blocks with the drop-off times.
+ * 
+ * @param rows: Trips in the block
+ * @param payload_bytes: Bytes of all its columns
+ * @param first_dropped_off_us, last_dropped_off_us: Drop-off times of its first and last trip
+ * @param column_bytes: Encoded size of each column
+ * @param encoding: TRIPLOG_ENCODING_* bits of each column
+ */
+
+typedef struct {
+    uint32_t rows;
+    uint32_t payload_bytes;
+    int64_t first_dropped_off_us;
+    int64_t last_dropped_off_us;
+    uint32_t column_bytes[TRIPLOG_COLUMNS];
+    uint8_t encoding[TRIPLOG_COLUMNS];
+    uint8_t reserved[2];
+} TripLogBlockHeader;
+_Static_assert(sizeof(TripLogHeader) == 24 + TRIPLOG_COLUMNS * TRIPLOG_NAME_BYTES, "trip log header layout changed");
+_Static_assert(sizeof(TripLogBlockHeader) == 96, "trip log block header layout changed");
+
+// Trips being gathered into a block, one array per column
+typedef struct TripLogBlock {
+    int rows;
+    int64_t values[TRIPLOG_COLUMNS][TRIPLOG_BLOCK_ROWS];
+    struct TripLogBlock* next;
+} TripLogBlock;
+
+/**
+ * Background writer of trip records
+ * 
+ * The control center appends a row per completed trip to `filling`; full
+ * blocks queue up for the writer thread, which encodes each column and
+ * appends the block to the file. The center never waits on the disk: with
+ * TRIPLOG_MAX_PENDING blocks queued, new trips are dropped (and counted).
+ * 
+ * @param path: Trip log file (NULL: no trip log)
+ * @param file: Open trip log (owned by the writer thread once started)
+ * @param lock: Guards the fields below
+ * @param cond: Signals a queued block or stop
+ * @param thread: Writer thread
+ * @param started: thread was created and not joined yet
+ * @param stop: The writer returns once the queue is empty
+ * @param filling: Block trips are appended to
+ * @param pending, pending_tail, num_pending: Full blocks waiting for the writer
+ * @param spare: A written block kept for reuse
+ * @param trips, dropped: Trips appended and lost to a full queue
+ * @param blocks: Blocks written
+ * @param raw_bytes, file_bytes: Size of the written trips as plain int64 columns, and in the file
+ * @param status: Problem writing the file, shown under the map
+ */
+
+typedef struct {
+    const char* path;
+    FILE* file;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool started;
+    bool stop;
+    TripLogBlock* filling;
+    TripLogBlock* pending;
+    TripLogBlock* pending_tail;
+    int num_pending;
+    TripLogBlock* spare;
+    unsigned long trips;
+    unsigned long dropped;
+    unsigned long blocks;
+    unsigned long long raw_bytes;
+    unsigned long long file_bytes;
+    char status[160];
+} TripLog;
+
+// One routing query of the benchmark (for nearest-taxi queries only the start is used)
+typedef struct {
+    int start_col, start_row;
+    int dest_col, dest_row;
+} PathBenchQuery;
+
+/**
+ * Totals of one engine on one query set, over every map of a size and density
+ * 
+ * @param ns: Time spent in the engine
+ * @param queries, found: Queries run and routes returned
+ * @param expanded, allocations: RouteStats of the engine over those queries
+ * @param length: Sum of the lengths of the returned routes (cells)
+ * @param mismatches: Queries whose length (or reachability) differs from the BFS
+ */
+
+typedef struct {
+    long long ns;
+    unsigned long queries;
+    unsigned long found;
+    unsigned long expanded;
+    unsigned long allocations;
+    unsigned long length;
+    unsigned long mismatches;
+} PathBenchResult;
+
+// Engine state shared by the benchmark queries on one map
+typedef struct {
+    Map* map;
+    RouteCache* cache;
+    DStarLite* dstar;
+    ReservationTable* table;
+    TaxiField* field;
+} PathBenchEngines;
+
+// One finished span of a thread (a Chrome trace "complete" event)
+typedef struct {
+    const char* name;
+    const char* category;
+    long long start_ns;
+    long long duration_ns;
+} TraceEvent;
+
+/**
+ * Ring buffer of one thread's spans
+ * 
+ * @param events: The last TRACE_RING_EVENTS spans
+ * @param head: Spans written so far (the next goes to head % TRACE_RING_EVENTS)
+ * @param tid: Track of the thread in the exported trace
+ * @param name: Thread name shown on the track
+ * @param next: Next ring of the registry
+ */
+
+typedef struct TraceRing {
+    TraceEvent events[TRACE_RING_EVENTS];
+    unsigned long head;
+    int tid;
+    char name[32];
+    struct TraceRing* next;
+} TraceRing;
+
+/**
+ * Contention figures of one named lock (every instance of its class)
+ * 
+ * @param acquisitions: Times the lock was taken
+ * @param contended: Times the taker found it held and had to wait
+ * @param wait: Wait before acquiring, for contended acquisitions (ns)
+ * @param hold: Time held, not counting condition variable waits (ns)
+ */
+
+typedef struct {
+    unsigned long acquisitions;
+    unsigned long contended;
+    HdrHistogram wait;
+    HdrHistogram hold;
+} LockProfile;
+
+// Time and counter values at the start of an instrumented region
+typedef struct {
+    uint64_t values[PERF_COUNTERS];
+    long long ns;
+    bool counted;
+} PerfSample;
+
+/**
+ * Totals of one instrumented region over every thread
+ * 
+ * @param calls: Times the region ran
+ * @param counted: Calls whose counters could be read
+ * @param ns: Wall time spent in the region
+ * @param values: Counter totals over the counted calls (PERF_CYCLES, ...)
+ */
+
+typedef struct {
+    unsigned long calls;
+    unsigned long counted;
+    long long ns;
+    uint64_t values[PERF_COUNTERS];
+} PerfRegion;
+
+/**
+ * Counter group of one thread
+ * 
+ * @param fds: Counter descriptors (-1: unavailable); fds[0] leads the group
+ * @param slot: Position of each counter in a group read (-1: not in the group)
+ * @param count: Counters in the group
+ */
+
+typedef struct {
+    int fds[PERF_COUNTERS];
+    int slot[PERF_COUNTERS];
+    int count;
+} PerfThread;
+
+// Function prototypes
+static void drawSquare(Map* map, Square q, int borderWidth, int row_begin, int row_end);
+static int connectSquaresMST(const Square* squares, int num_squares, int rows, int cols, int* roads);
+static void rasterizeMap(Map* map, const Square* squares, int num_squares, const int* roads, int num_roads, int border_width);
+static void findConnectionPoints(Square a, Square b, int* px1, int* py1, int* px2, int* py2);
+static void mapReleaseIndex(Map* map);
+static bool mapBuildIndex(Map* map);
+bool mapSameComponent(const Map* map, int x1, int y1, int x2, int y2);
+bool mapSave(Map* map, const char* path);
+Map* mapLoad(const char* path);
+void init_operations();
+void renderMap(Map* map, ControlCenter* center, Visualizer* visualizer);
+pthread_t create_taxi_thread(Taxi* taxi);
+bool find_random_free_point(Map* map, Rng* rng, int* random_x, int* random_y);
+bool curbWeightsBuild(CurbWeights* weights, Map* map, Rng* rng, int num_hotspots);
+bool find_demand_point(Visualizer* visualizer, Map* map, int* free_x, int* free_y, int* sidewalk_x, int* sidewalk_y);
+bool snap_to_curb(Map* map, int* col, int* row, int* sidewalk_x, int* sidewalk_y);
+bool tripTraceOpen(TripTrace* trace);
+bool tripLogOpen(TripLog* log);
+void tripLogAppend(TripLog* log, const Passenger* passenger, long long dropped_off_ns);
+void tripLogClose(TripLog* log);
+bool tripLogDump(const char* path, FILE* out);
+void tripTraceClose(TripTrace* trace);
+long long monotonic_ns();
+const char* message_type_to_abbreviation(MessageType type);
+const char* message_type_to_name(MessageType type);
+long long traceStart();
+void traceSpan(const char* category, const char* name, long long started);
+void lockAcquire(pthread_mutex_t* mutex, int lock);
+void lockRelease(pthread_mutex_t* mutex, int lock);
+void lockWait(pthread_cond_t* cond, pthread_mutex_t* mutex, int lock);
+void perfBegin(PerfSample* sample);
+void perfEnd(int region, const PerfSample* start);
+void traceThreadName(const char* name);
+void print_route_cache(RouteCache* cache);
+void print_trip_times(ControlCenter* center);
+void print_demand(ControlCenter* center);
+void print_checkpoint();
+void print_trip_log();
+void print_metrics();
+void print_lock_profile();
+void hdrRecord(HdrHistogram* h, uint64_t value);
+uint64_t hdrPercentiles(const HdrHistogram* h, const double* percentiles, uint64_t* values, int count);
+TaxiField* taxiFieldCreate(int rows, int cols);
+void taxiFieldFree(TaxiField* field);
+bool taxiFieldBuild(TaxiField* field, const TileGrid* maze);
+void taxiFieldUpdate(TaxiField* field, int col, int row, int value);
+void bitbfsFree(BitBFS* bfs);
+void bitbfsSetCell(BitBFS* bfs, int col, int row, int value);
+void bitbfsLoad(BitBFS* bfs, const TileGrid* maze, int target_low, int target_high, int pass_low, int pass_high);
+void congestionClear(CongestionMap* congestion);
+void congestionFree(CongestionMap* congestion);
+void dialFieldFree(DialField* field);
+void dstarFree(DStarLite* d);
+
+
+// -------------------- QUEUE FUNCTIONS ---------------------
+
+// Initialize the queue
+void init_queue(MessageQueue* queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    queue->actor = SCHED_ANY;
+    queue->current = NULL;
+    queue->depth = 0;
+    queue->high_water = 0;
+    queue->enqueued = 0;
+    queue->dequeued = 0;
+    queue->dropped = 0;
+    memset(&queue->sojourn, 0, sizeof(queue->sojourn));
+}
+
+// Counts a message into the queue and stamps it (queue->lock held)
+static void queueCountIn(MessageQueue* queue, Message* msg) {
+    msg->enqueued_ns = monotonic_ns();
+    __atomic_add_fetch(&queue->enqueued, 1, __ATOMIC_RELAXED);
+    unsigned long depth = __atomic_add_fetch(&queue->depth, 1, __ATOMIC_RELAXED);
+    if (depth > queue->high_water) {
+        __atomic_store_n(&queue->high_water, depth, __ATOMIC_RELAXED);
+    }
+}
+
+// Counts a message handed to the consumer and records its sojourn (queue->lock held)
+static void queueCountOut(MessageQueue* queue, Message* msg) {
+    __atomic_add_fetch(&queue->dequeued, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&queue->depth, 1, __ATOMIC_RELAXED);
+    long long sojourn_ns = monotonic_ns() - msg->enqueued_ns;
+    hdrRecord(&queue->sojourn, sojourn_ns > 0 ? (uint64_t)(sojourn_ns / 1000) : 0);
+}
+
+// Enqueue a message
+void enqueue_message(MessageQueue* queue, MessageType type, int x, int y, int extra_x, int extra_y, void* pointer) {
+    Message* new_msg = malloc(sizeof(Message));
+    new_msg->type = type;
+    new_msg->data_x = x;
+    new_msg->data_y = y;
+    new_msg->extra_x = extra_x;
+    new_msg->extra_y = extra_y;
+    new_msg->pointer = pointer;
+    new_msg->next = NULL;
+
+    lockAcquire(&queue->lock, LOCK_QUEUE);
+    if (queue->tail == NULL) {
+        queue->head = queue->tail = new_msg;
+    } else {
+        queue->tail->next = new_msg;
+        queue->tail = new_msg;
+    }
+    queueCountIn(queue, new_msg);
+    pthread_cond_signal(&queue->cond);
+    lockRelease(&queue->lock, LOCK_QUEUE);
+
+    // Log the message
+    if (log_file) {
+        lockAcquire(&pause_mutex, LOCK_PAUSE); // Ensure thread-safe logging
+        fprintf(log_file, "Enqueued Message: Type=%s, DataX=%d, DataY=%d, ExtraX=%d, ExtraY=%d\n",
+                message_type_to_abbreviation(type), x, y, extra_x, extra_y);
+        fflush(log_file); // Ensure the log is written immediately
+        lockRelease(&pause_mutex, LOCK_PAUSE);
+    }
+}
+
+// Priority enqueue a message
+void priority_enqueue_message(MessageQueue* queue, MessageType type, int x, int y, int extra_x, int extra_y, void* pointer) {
+    Message* new_msg = malloc(sizeof(Message));
+    new_msg->type = type;
+    new_msg->data_x = x;
+    new_msg->data_y = y;
+    new_msg->extra_x = extra_x;
+    new_msg->extra_y = extra_y;
+    new_msg->pointer = pointer;
+    new_msg->next = NULL;
+
+    lockAcquire(&queue->lock, LOCK_QUEUE);
+
+    // Insert the message at the head of the queue
+    if (queue->head == NULL) {
+        queue->head = queue->tail = new_msg;
+    } else {
+        new_msg->next = queue->head;
+        queue->head = new_msg;
+    }
+    queueCountIn(queue, new_msg);
+
+    pthread_cond_signal(&queue->cond);
+    lockRelease(&queue->lock, LOCK_QUEUE);
+
+    if (log_file) {
+        lockAcquire(&pause_mutex, LOCK_PAUSE); // Ensure thread-safe logging
+        fprintf(log_file, "Enqueued Message: Type=%s, DataX=%d, DataY=%d, ExtraX=%d, ExtraY=%d\n",
+                message_type_to_abbreviation(type), x, y, extra_x, extra_y);
         fflush(log_file); // Ensure the log is written immediately
-        pthread_mutex_unlock(&pause_mutex);
+        lockRelease(&pause_mutex, LOCK_PAUSE);
     }
 }
 
 // Dequeue a message
 Message* dequeue_message(MessageQueue* queue) {
-    pthread_mutex_lock(&queue->lock);
+    lockAcquire(&queue->lock, LOCK_QUEUE);
     while (queue->head == NULL) {
-        pthread_cond_wait(&queue->cond, &queue->lock);
+        lockWait(&queue->cond, &queue->lock, LOCK_QUEUE);
     }
 
     Message* msg = queue->head;
@@ -466,844 +2064,8040 @@ Message* dequeue_message(MessageQueue* queue) {
     if (queue->head == NULL) {
         queue->tail = NULL;
     }
+    queueCountOut(queue, msg);
+
+    lockRelease(&queue->lock, LOCK_QUEUE);
+    return msg;
+}
+
+// Cleanup the queue
+void cleanup_queue(MessageQueue* queue) {
+    lockAcquire(&queue->lock, LOCK_QUEUE); // Lock the queue to ensure thread safety
+
+    Message* current = queue->head;
+    unsigned long count = 0;
+    while (current != NULL) {
+        Message* next = current->next; // Save the next message
+        free(current);                 // Free the current message
+        current = next;                // Move to the next message
+        count++;
+    }
+
+    // Reset the queue
+    queue->head = NULL;
+    queue->tail = NULL;
+    __atomic_store_n(&queue->depth, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&queue->dropped, count, __ATOMIC_RELAXED);
+
+    lockRelease(&queue->lock, LOCK_QUEUE); // Unlock the queue
+}
+
+// -------------------- RANDOM STREAM FUNCTIONS --------------------
+
+// Next 64 random bits of a stream
+uint64_t rngNext(Rng* rng) {
+    uint64_t z = (rng->state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Starts a random stream
+ * 
+ * Streams of the same seed start at unrelated points of the generator, so
+ * each consumer can own one and draw independently of the others.
+ * 
+ * @param rng Stream to start
+ * @param seed Run seed (sim_seed)
+ * @param stream Stream number (RNG_STREAM_*)
+ */
+
+void rngSeed(Rng* rng, uint64_t seed, uint64_t stream) {
+    Rng mix = {stream};
+    rng->state = seed ^ rngNext(&mix);
+}
+
+// Uniform integer in [0, bound) (bound > 0)
+uint32_t rngBelow(Rng* rng, uint32_t bound) {
+    return (uint32_t)(((rngNext(rng) >> 32) * bound) >> 32);
+}
+
+// -------------------- REPLAY FUNCTIONS --------------------
+
+static Schedule schedule = {
+    .mode = SCHED_FREE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+static __thread int sched_actor = SCHED_ANY; // Actor of the calling thread
+static __thread bool sched_holding = false; // The calling thread is inside a step
+static __thread bool sched_ordered = false; // ... and holds the record/replay turn
+static __thread MessageQueue* sched_queue = NULL; // Queue whose current message the step handles
+static __thread long long sched_traced = 0; // Trace span of the current message (0: none)
+static __thread const char* sched_traced_name = NULL;
+static __thread PerfSample sched_perf; // Counters at the start of the current message
+
+/**
+ * Simulation clock in nanoseconds
+ * 
+ * Free runs follow the monotonic clock. Recorded and replayed runs read the
+ * clock of the current turn instead, so everything decided from time
+ * (reservation ticks, congestion decay, trip times) sees the same values
+ * when the run is replayed.
+ * 
+ * @return Nanoseconds since the simulation clock origin
+ */
+
+long long simNowNs() {
+    if (__atomic_load_n(&schedule.mode, __ATOMIC_ACQUIRE) == SCHED_FREE) {
+        return monotonic_ns() - schedule.origin_ns;
+    }
+    return __atomic_load_n(&schedule.clock_ns, __ATOMIC_RELAXED);
+}
+
+// Length of one taxi tick on the simulation clock (TAXI_REFRESH_RATE, scaled by sim_time_scale)
+long long simTickNs() {
+    return (long long)(TAXI_REFRESH_RATE * 1000.0 * sim_time_scale);
+}
+
+// Ends recording/replaying (status NULL: report how far it got); the
+// simulation clock carries on from the last turn
+static void schedStopLocked(const char* status) {
+    if (schedule.mode == SCHED_FREE) return;
+
+    char summary[160];
+    if (!status) {
+        snprintf(summary, sizeof(summary), schedule.mode == SCHED_RECORD ? "Recorded %s: %lu events" :
+                 "Replay of %s stopped at event %lu", schedule.path, schedule.events);
+        status = summary;
+    }
+
+    if (schedule.file) {
+        fclose(schedule.file);
+        schedule.file = NULL;
+    }
+    schedule.origin_ns = monotonic_ns() - schedule.clock_ns;
+    __atomic_store_n(&schedule.mode, SCHED_FREE, __ATOMIC_RELEASE);
+    snprintf(schedule.status, sizeof(schedule.status), "%s", status);
+    if (log_file) {
+        fprintf(log_file, "Schedule: %s\n", status);
+        fflush(log_file);
+    }
+    pthread_cond_broadcast(&schedule.cond);
+}
+
+// Replay: moves to the next logged turn, finishing at the end of the log
+static void schedAdvanceLocked() {
+    if (fread(&schedule.next, sizeof(ReplayEvent), 1, schedule.file) == 1) {
+        return;
+    }
+
+    char status[160];
+    snprintf(status, sizeof(status), "Replayed %s: %lu events", schedule.path, schedule.events);
+    schedStopLocked(status);
+}
+
+// Replay: a thread that cannot follow the log ends the replay
+static void schedDivergedLocked(const char* what) {
+    char status[160];
+    snprintf(status, sizeof(status), "Replay of %s diverged at event %lu: %s",
+             schedule.path, schedule.events, what);
+    schedStopLocked(status);
+}
+
+/**
+ * Starts recording the run into a replay log
+ * 
+ * Pins the map size to the current terminal so resets keep the size the
+ * log was recorded with.
+ * 
+ * @param path Replay log to create
+ * @return true if recording, false if the file cannot be written
+ */
+
+bool schedRecord(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+
+    ReplayHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REPLAY_FILE_MAGIC, sizeof(header.magic));
+    header.version = REPLAY_FILE_VERSION;
+    header.event_bytes = sizeof(ReplayEvent);
+    header.seed = sim_seed;
+    header.rows = sim_rows;
+    header.cols = sim_cols;
+    header.load_city = city_load_on_start;
+    header.demand_hotspots = demand_hotspots;
+    header.time_scale = sim_time_scale;
+    snprintf(header.city_path, sizeof(header.city_path), "%s", city_file_path);
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        return false;
+    }
+
+    pthread_mutex_lock(&schedule.lock);
+    schedule.file = file;
+    schedule.path = path;
+    schedule.events = 0;
+    schedule.clock_ns = 1; // Trip clocks use 0 as "not started"
+    schedule.origin_ns = monotonic_ns() - schedule.clock_ns;
+    __atomic_store_n(&schedule.mode, SCHED_RECORD, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&schedule.lock);
+    return true;
+}
+
+/**
+ * Starts replaying a recorded run
+ * 
+ * Takes the seed, map size, city file, hotspots and time scale of the recorded run from the log
+ * header, so it must be called before the simulation starts.
+ * 
+ * @param path Replay log written by schedRecord
+ * @return true if replaying, false if the log cannot be read
+ */
+
+bool schedReplay(const char* path) {
+    static char city_path[256];
+
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+
+    ReplayHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, REPLAY_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != REPLAY_FILE_VERSION || header.event_bytes != sizeof(ReplayEvent) || !(header.time_scale > 0)) {
+        fclose(file);
+        return false;
+    }
+
+    sim_seed = header.seed;
+    sim_rows = header.rows;
+    sim_cols = header.cols;
+    city_load_on_start = header.load_city;
+    demand_hotspots = (int)MIN(header.demand_hotspots, DEMAND_MAX_HOTSPOTS);
+    sim_time_scale = MAX(SIM_MIN_TIME_SCALE, header.time_scale);
+    if (header.load_city) {
+        snprintf(city_path, sizeof(city_path), "%.*s", (int)sizeof(header.city_path) - 1, header.city_path);
+        city_file_path = city_path;
+    }
+
+    pthread_mutex_lock(&schedule.lock);
+    schedule.file = file;
+    schedule.path = path;
+    schedule.events = 0;
+    schedule.clock_ns = 1;
+    schedule.progress_ns = monotonic_ns();
+    __atomic_store_n(&schedule.mode, SCHED_REPLAY, __ATOMIC_RELEASE);
+    schedAdvanceLocked();
+    pthread_mutex_unlock(&schedule.lock);
+    return true;
+}
+
+/**
+ * Ends recording or replaying
+ * 
+ * The remaining threads run freely from then on. A no-op on free runs.
+ * 
+ * @param status Message shown under the map (NULL: events recorded/replayed)
+ */
+
+void schedStop(const char* status) {
+    pthread_mutex_lock(&schedule.lock);
+    schedStopLocked(status);
+    pthread_mutex_unlock(&schedule.lock);
+}
+
+// Whether the turn can be given to actor for a turn of this kind
+static bool schedTurnIsFor(int actor, int kind) {
+    if (schedule.busy) return false;
+    if (schedule.mode == SCHED_RECORD) return true;
+    return schedule.next.kind == kind && (actor == SCHED_ANY || (int)schedule.next.actor == actor);
+}
+
+/**
+ * Starts a step, waiting for the turn when recording or replaying
+ * 
+ * Recording gives the turn to whichever thread asks first; replaying waits
+ * until the log says it is this actor's turn of this kind. A replay turn
+ * nobody takes for REPLAY_STALL_SEC ends the replay. In every mode no step
+ * starts while the world is stopped.
+ * 
+ * @param actor Calling actor (SCHED_ANY for external events)
+ * @param kind SCHED_STEP, SCHED_RESUME or SCHED_EXTERNAL
+ * @return true if the caller now holds the turn, false on free runs (the
+ *         step is started either way)
+ */
+
+static bool schedAcquire(int actor, int kind) {
+    pthread_mutex_lock(&schedule.lock);
+    while (schedule.stopping || (schedule.mode != SCHED_FREE && !schedTurnIsFor(actor, kind))) {
+        if (schedule.mode != SCHED_REPLAY) {
+            pthread_cond_wait(&schedule.cond, &schedule.lock);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&schedule.cond, &schedule.lock, &deadline);
+
+        // Nobody moves while paused or stopped: that is not a stall
+        long long now = monotonic_ns();
+        if (__atomic_load_n(&isPaused, __ATOMIC_RELAXED) || schedule.stopping) {
+            schedule.progress_ns = now;
+        } else if (!schedule.busy && schedule.mode == SCHED_REPLAY &&
+                   now - schedule.progress_ns > REPLAY_STALL_SEC * 1000000000LL) {
+            schedDivergedLocked("nobody took the turn");
+        }
+    }
+
+    sched_ordered = schedule.mode != SCHED_FREE;
+    if (sched_ordered) {
+        schedule.busy = true;
+        if (schedule.mode == SCHED_RECORD) {
+            schedule.clock_ns = MAX(schedule.clock_ns, monotonic_ns() - schedule.origin_ns);
+        } else {
+            schedule.clock_ns = schedule.next.now_ns;
+        }
+    }
+    schedule.active++;
+    sched_holding = true;
+    pthread_mutex_unlock(&schedule.lock);
+    return sched_ordered;
+}
+
+/**
+ * Logs (recording) or checks (replaying) the turn the caller holds
+ * 
+ * @param actor Actor of the turn
+ * @param kind Kind of the turn
+ * @param msg Message handled or injected (NULL for SCHED_RESUME)
+ */
+
+static void schedNote(int actor, int kind, const Message* msg) {
+    ReplayEvent event;
+    memset(&event, 0, sizeof(event));
+    event.actor = (uint32_t)actor;
+    event.kind = (uint16_t)kind;
+    if (msg) {
+        event.type = (uint16_t)msg->type;
+        event.data_x = msg->data_x;
+        event.data_y = msg->data_y;
+        event.extra_x = msg->extra_x;
+        event.extra_y = msg->extra_y;
+    }
+
+    pthread_mutex_lock(&schedule.lock);
+    if (schedule.mode == SCHED_RECORD) {
+        event.now_ns = schedule.clock_ns;
+        if (fwrite(&event, sizeof(event), 1, schedule.file) != 1 || fflush(schedule.file) != 0) {
+            schedStopLocked("Could not write the replay log");
+        } else {
+            schedule.events++;
+        }
+    } else if (schedule.mode == SCHED_REPLAY) {
+        event.now_ns = schedule.next.now_ns;
+        if (memcmp(&event, &schedule.next, sizeof(event)) != 0) {
+            char what[64];
+            snprintf(what, sizeof(what), "got %s, logged %s", message_type_to_abbreviation(event.type),
+                     message_type_to_abbreviation(schedule.next.type));
+            schedDivergedLocked(what);
+        } else {
+            schedule.events++;
+        }
+    }
+    pthread_mutex_unlock(&schedule.lock);
+}
+
+// Gives up the turn around a blocking wait inside a step (see schedResume);
+// the message being handled stays current
+void schedLeave() {
+    if (!sched_holding) return;
+    sched_holding = false;
+
+    pthread_mutex_lock(&schedule.lock);
+    schedule.active--;
+    if (sched_ordered) {
+        sched_ordered = false;
+        schedule.busy = false;
+        schedule.progress_ns = monotonic_ns();
+        if (schedule.mode == SCHED_REPLAY) {
+            schedAdvanceLocked();
+        }
+    }
+    pthread_cond_broadcast(&schedule.cond);
+    pthread_mutex_unlock(&schedule.lock);
+}
+
+/**
+ * Ends the caller's step, if any
+ * 
+ * The message it handled is done, and on replay the turn moves to the next
+ * logged event.
+ */
+
+void schedRelease() {
+    traceSpan("message", sched_traced_name, sched_traced);
+    sched_traced = 0;
+    perfEnd(PERF_REGION_DISPATCH, &sched_perf);
+    sched_perf.ns = 0;
+    if (sched_queue) {
+        sched_queue->current = NULL;
+        sched_queue = NULL;
+    }
+    schedLeave();
+}
+
+// Takes the turn back after schedLeave
+void schedResume() {
+    if (schedAcquire(sched_actor, SCHED_RESUME)) {
+        schedNote(sched_actor, SCHED_RESUME, NULL);
+    }
+}
+
+// Starts the calling thread's first step outside any message (thread start-up)
+void schedEnter(int actor) {
+    sched_actor = actor;
+    schedResume();
+}
+
+// Sleeps inside a step (scaled by sim_time_scale) without holding up the other threads
+void schedSleep(useconds_t usec) {
+    bool held = sched_holding;
+    schedLeave();
+    usleep((useconds_t)(usec * sim_time_scale));
+    if (held) {
+        schedResume();
+    }
+}
+
+/**
+ * Dequeues the next message of a thread's own queue as one step
+ * 
+ * Ends the caller's previous step. The message is taken, and logged or
+ * checked when recording or replaying, inside the new step, which lasts
+ * until the caller dequeues again (or calls schedRelease). Until then the
+ * message stays the queue's current one.
+ * 
+ * @param queue Queue consumed by the calling thread
+ * @return Dequeued message
+ */
+
+Message* schedDequeue(MessageQueue* queue) {
+    schedRelease();
+    sched_actor = queue->actor;
+
+    // Wait for work before starting the step, so idle threads take no turns
+    // (a replay knows from the log when the message is due)
+    if (__atomic_load_n(&schedule.mode, __ATOMIC_ACQUIRE) != SCHED_REPLAY) {
+        lockAcquire(&queue->lock, LOCK_QUEUE);
+        while (queue->head == NULL) {
+            lockWait(&queue->cond, &queue->lock, LOCK_QUEUE);
+        }
+        lockRelease(&queue->lock, LOCK_QUEUE);
+    }
+
+    bool ordered = schedAcquire(queue->actor, SCHED_STEP);
+    lockAcquire(&queue->lock, LOCK_QUEUE);
+    Message* msg = queue->head;
+    if (msg) {
+        queue->head = msg->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        queue->current = msg;
+        queueCountOut(queue, msg);
+    }
+    lockRelease(&queue->lock, LOCK_QUEUE);
+
+    if (msg) {
+        sched_queue = queue;
+        sched_traced = traceStart();
+        sched_traced_name = message_type_to_name(msg->type);
+        perfBegin(&sched_perf);
+        if (ordered) {
+            schedNote(queue->actor, SCHED_STEP, msg);
+        }
+        return msg;
+    }
+
+    // Only a replay reaches a step before its message
+    pthread_mutex_lock(&schedule.lock);
+    if (schedule.mode == SCHED_REPLAY) {
+        schedDivergedLocked("logged message never arrived");
+    }
+    pthread_mutex_unlock(&schedule.lock);
+    return schedDequeue(queue);
+}
+
+/**
+ * Stops the world between steps
+ * 
+ * Waits until no step of the control center, visualizer, taxis or external
+ * events is in progress, and keeps new ones from starting until
+ * schedResumeWorld. Threads waiting inside a step (schedLeave) stay parked
+ * there with their message current. The caller must not be inside a step.
+ */
+
+void schedStopWorld() {
+    pthread_mutex_lock(&schedule.lock);
+    while (schedule.stopping) {
+        pthread_cond_wait(&schedule.cond, &schedule.lock);
+    }
+    schedule.stopping = true;
+    while (schedule.active > 0) {
+        pthread_cond_wait(&schedule.cond, &schedule.lock);
+    }
+    pthread_mutex_unlock(&schedule.lock);
+}
+
+// Lets steps start again after schedStopWorld
+void schedResumeWorld() {
+    pthread_mutex_lock(&schedule.lock);
+    schedule.stopping = false;
+    schedule.progress_ns = monotonic_ns();
+    pthread_cond_broadcast(&schedule.cond);
+    pthread_mutex_unlock(&schedule.lock);
+}
+
+/**
+ * Enqueues a message with data coming from outside the simulation
+ * 
+ * Key presses, timer ticks and trace requests are recorded as external
+ * events, data included. While replaying they are ignored: the replay
+ * thread injects the logged ones.
+ * 
+ * @param queue Target queue (control center or visualizer)
+ * @param type Message type
+ * @param data_x, data_y, extra_x, extra_y Message fields
+ */
+
+void externalRequest(MessageQueue* queue, MessageType type, int data_x, int data_y, int extra_x, int extra_y) {
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state); // Never die holding the turn
+
+    if (__atomic_load_n(&schedule.mode, __ATOMIC_ACQUIRE) != SCHED_REPLAY) {
+        if (schedAcquire(SCHED_ANY, SCHED_EXTERNAL)) {
+            Message event = {.type = type, .data_x = data_x, .data_y = data_y, .extra_x = extra_x, .extra_y = extra_y};
+            schedNote(queue->actor, SCHED_EXTERNAL, &event);
+        }
+        enqueue_message(queue, type, data_x, data_y, extra_x, extra_y, NULL);
+        schedRelease();
+    }
+
+    pthread_setcancelstate(cancel_state, NULL);
+}
+
+// Enqueues a key press or timer tick (no data; see externalRequest)
+void externalEvent(MessageQueue* queue, MessageType type) {
+    externalRequest(queue, type, 0, 0, 0, 0);
+}
+
+// -------------------- PATH FUNCTIONS --------------------
+
+static __thread RouteStats route_stats; // Routing work of the calling thread (see pathBenchRun)
+
+/**
+ * Creates an empty path
+ * 
+ * @return Pointer to new PathData with no cells (tamanho_solucao == 0)
+ */
+
+PathData* pathCreate() {
+    PathData* path = calloc(1, sizeof(PathData));
+    route_stats.allocations++;
+    return path;
+}
+
+void pathFree(PathData* path) {
+    if (!path) return;
+    free(path->segments);
+    free(path);
+}
+
+// Empties a path, keeping its segment buffer for reuse
+void pathClear(PathData* path) {
+    path->num_segments = 0;
+    path->tamanho_solucao = 0;
+}
+
+// Appends a raw segment, growing the segment buffer as needed (false: out of memory)
+static bool pathPushSegment(PathData* path, unsigned int op, unsigned int run) {
+    if (path->num_segments == path->capacity) {
+        int capacity = path->capacity ? path->capacity * 2 : 8;
+        RouteSegment* segments = realloc(path->segments, capacity * sizeof(RouteSegment));
+        route_stats.allocations++;
+        if (!segments) return false;
+        path->segments = segments;
+        path->capacity = capacity;
+    }
+    path->segments[path->num_segments].op = op;
+    path->segments[path->num_segments].run = run;
+    path->num_segments++;
+    return true;
+}
+
+/**
+ * Extends a path by run cells in one direction
+ * 
+ * Merges into the last segment when it has the same direction. Out of
+ * memory, the path keeps the cells it could store and stays consistent.
+ * 
+ * @param path Non-empty path to extend
+ * @param dir ROUTE_UP, ROUTE_DOWN, ROUTE_LEFT or ROUTE_RIGHT
+ * @param run Number of cells to move
+ * @return false if the segment buffer could not grow
+ */
+
+bool pathAppendRun(PathData* path, int dir, int run) {
+    static const int delta_col[] = {0, 0, -1, 1};
+    static const int delta_row[] = {-1, 1, 0, 0};
+
+    while (run > 0) {
+        RouteSegment* last = path->num_segments ? &path->segments[path->num_segments - 1] : NULL;
+        unsigned int step;
+        if (last && last->op == (unsigned int)dir && last->run < ROUTE_MAX_RUN) {
+            unsigned int room = ROUTE_MAX_RUN - last->run;
+            step = (unsigned int)run < room ? (unsigned int)run : room;
+            last->run += step;
+        } else {
+            step = (unsigned int)run < ROUTE_MAX_RUN ? (unsigned int)run : ROUTE_MAX_RUN;
+            if (!pathPushSegment(path, dir, step)) return false;
+        }
+        path->end_x += delta_col[dir] * (int)step;
+        path->end_y += delta_row[dir] * (int)step;
+        path->tamanho_solucao += step;
+        run -= step;
+    }
+    return true;
+}
+
+/**
+ * Appends a cell to a path
+ * 
+ * The first cell becomes the start; later cells must be adjacent to the
+ * current end (a repeated end cell is ignored).
+ * 
+ * @param path Path to extend
+ * @param col X coordinate of the cell
+ * @param row Y coordinate of the cell
+ * @return false if the segment buffer could not grow
+ */
+
+bool pathAppendCell(PathData* path, int col, int row) {
+    if (path->tamanho_solucao == 0) {
+        path->start_x = path->end_x = col;
+        path->start_y = path->end_y = row;
+        path->tamanho_solucao = 1;
+        return true;
+    }
+
+    int dc = col - path->end_x;
+    int dr = row - path->end_y;
+    if (dc == 0 && dr == 0) return true;
+
+    int dir = (dr == -1) ? ROUTE_UP : (dr == 1) ? ROUTE_DOWN : (dc == -1) ? ROUTE_LEFT : ROUTE_RIGHT;
+    return pathAppendRun(path, dir, 1);
+}
+
+// Appends a waypoint event (ROUTE_PICKUP or ROUTE_DROPOFF) at the current end
+bool pathAppendEvent(PathData* path, int event) {
+    return pathPushSegment(path, event, 0);
+}
+
+// Appends steps spent waiting on the current end cell
+bool pathAppendWait(PathData* path, int steps) {
+    if (steps <= 0) return true;
+    RouteSegment* last = path->num_segments ? &path->segments[path->num_segments - 1] : NULL;
+    if (last && last->op == ROUTE_WAIT && last->run + (unsigned int)steps <= ROUTE_MAX_RUN) {
+        last->run += steps;
+        return true;
+    }
+    return pathPushSegment(path, ROUTE_WAIT, steps);
+}
+
+/**
+ * Appends another path to the end of this one
+ * 
+ * The source path must start on (or next to) the current end cell; a
+ * shared junction cell is stored only once.
+ * 
+ * @param path Path to extend
+ * @param other Path to append
+ * @return false if the segment buffer could not grow (path holds a prefix)
+ */
+
+bool pathAppendPath(PathData* path, const PathData* other) {
+    if (other->tamanho_solucao == 0) return true;
+
+    bool stored = pathAppendCell(path, other->start_x, other->start_y);
+    for (int i = 0; stored && i < other->num_segments; i++) {
+        if (other->segments[i].op == ROUTE_WAIT) {
+            stored = pathAppendWait(path, other->segments[i].run);
+        } else if (other->segments[i].op >= ROUTE_PICKUP) {
+            stored = pathAppendEvent(path, other->segments[i].op);
+        } else {
+            stored = pathAppendRun(path, other->segments[i].op, other->segments[i].run);
+        }
+    }
+    return stored;
+}
+
+// Number of time steps (moves plus waits) needed to drive a path
+int pathSteps(const PathData* path) {
+    int steps = 0;
+    for (int i = 0; i < path->num_segments; i++) {
+        if (path->segments[i].op < ROUTE_PICKUP || path->segments[i].op == ROUTE_WAIT) {
+            steps += path->segments[i].run;
+        }
+    }
+    return steps;
+}
+
+// Replaces the contents of path with a copy of other (false: out of memory)
+bool pathCopy(PathData* path, const PathData* other) {
+    pathClear(path);
+    return pathAppendPath(path, other);
+}
+
+/**
+ * Reverses a path in place
+ * 
+ * Swaps start and end, reverses the segment order and flips every
+ * direction. Intended for search results, which carry no waypoint events.
+ * 
+ * @param path Path to reverse
+ */
+
+void pathReverse(PathData* path) {
+    for (int i = 0, j = path->num_segments - 1; i < j; i++, j--) {
+        RouteSegment swap = path->segments[i];
+        path->segments[i] = path->segments[j];
+        path->segments[j] = swap;
+    }
+    for (int i = 0; i < path->num_segments; i++) {
+        if (path->segments[i].op < ROUTE_PICKUP) {
+            path->segments[i].op ^= 1; // UP <-> DOWN, LEFT <-> RIGHT
+        }
+    }
+
+    int x = path->start_x, y = path->start_y;
+    path->start_x = path->end_x;
+    path->start_y = path->end_y;
+    path->end_x = x;
+    path->end_y = y;
+}
+
+/**
+ * Positions a cursor on the first cell of a path
+ * 
+ * @param cursor Cursor to initialise
+ * @param path Path to walk
+ */
+
+void pathCursorInit(PathCursor* cursor, const PathData* path) {
+    cursor->path = path;
+    cursor->segment = 0;
+    cursor->step = 0;
+    cursor->col = path->start_x;
+    cursor->row = path->start_y;
+}
+
+/**
+ * Advances a cursor to the next cell or waypoint event
+ * 
+ * @param cursor Path cursor
+ * @param event Output: ROUTE_PICKUP/ROUTE_DROPOFF for events, ROUTE_WAIT for a
+ *              step spent in place, -1 for a move (the new cell is then in
+ *              cursor->col / cursor->row)
+ * @return false once the end of the path is reached
+ */
+
+bool pathCursorNext(PathCursor* cursor, int* event) {
+    static const int delta_col[] = {0, 0, -1, 1};
+    static const int delta_row[] = {-1, 1, 0, 0};
+    const PathData* path = cursor->path;
+
+    while (cursor->segment < path->num_segments) {
+        RouteSegment segment = path->segments[cursor->segment];
+        if (segment.op == ROUTE_PICKUP || segment.op == ROUTE_DROPOFF) {
+            cursor->segment++;
+            *event = segment.op;
+            return true;
+        }
+        if (cursor->step < (int)segment.run) {
+            cursor->step++;
+            if (segment.op == ROUTE_WAIT) {
+                *event = ROUTE_WAIT;
+            } else {
+                cursor->col += delta_col[segment.op];
+                cursor->row += delta_row[segment.op];
+                *event = -1;
+            }
+            return true;
+        }
+        cursor->segment++;
+        cursor->step = 0;
+    }
+    return false;
+}
+
+// -------------------- TILE GRID FUNCTIONS --------------------
+
+/**
+ * Initialises an all-sidewalk grid
+ * 
+ * Only the tile pointer table is allocated; every tile starts as the
+ * shared sidewalk sentinel.
+ * 
+ * @param grid Grid to initialise
+ * @param rows Number of rows
+ * @param cols Number of columns
+ * @return true on success, false on allocation failure
+ */
+
+bool tileGridInit(TileGrid* grid, int rows, int cols) {
+    grid->rows = rows;
+    grid->cols = cols;
+    grid->tile_rows = (rows + MAP_TILE_MASK) >> MAP_TILE_SHIFT;
+    grid->tile_cols = (cols + MAP_TILE_MASK) >> MAP_TILE_SHIFT;
+    grid->materialised = 0;
+    grid->mapped_begin = NULL;
+    grid->mapped_end = NULL;
+    grid->spare = NULL;
+    grid->num_spare = 0;
+
+    size_t num_tiles = (size_t)grid->tile_rows * grid->tile_cols;
+    grid->tiles = malloc(MAX(num_tiles, 1) * sizeof(int*));
+    if (!grid->tiles) return false;
+
+    for (size_t t = 0; t < num_tiles; t++) {
+        grid->tiles[t] = (int*)sidewalk_tile;
+    }
+    return true;
+}
+
+// Whether a tile was allocated by tileMaterialise() (not the sentinel nor part of a city file)
+static bool tileOwned(const TileGrid* grid, const int* tile) {
+    if (tile == sidewalk_tile) return false;
+    return !((const char*)tile >= grid->mapped_begin && (const char*)tile < grid->mapped_end);
+}
+
+/**
+ * Turns every tile back into the sidewalk sentinel
+ * 
+ * @param grid Grid to clear
+ */
+
+void tileGridClear(TileGrid* grid) {
+    size_t num_tiles = (size_t)grid->tile_rows * grid->tile_cols;
+    for (size_t t = 0; t < num_tiles; t++) {
+        if (tileOwned(grid, grid->tiles[t])) free(grid->tiles[t]);
+        grid->tiles[t] = (int*)sidewalk_tile;
+    }
+    grid->materialised = 0;
+}
+
+/**
+ * Turns every tile back into the sidewalk sentinel, keeping the storage
+ * of the materialised ones for tileMaterialise to hand out again
+ * 
+ * Every buffer is either in use or spare, so there are never more than
+ * one per tile.
+ * 
+ * @param grid Grid to clear
+ */
+
+void tileGridRecycle(TileGrid* grid) {
+    size_t num_tiles = (size_t)grid->tile_rows * grid->tile_cols;
+    if (!grid->spare) {
+        grid->spare = malloc(MAX(num_tiles, 1) * sizeof(int*));
+        if (!grid->spare) {
+            tileGridClear(grid);
+            return;
+        }
+    }
+
+    for (size_t t = 0; t < num_tiles; t++) {
+        if (tileOwned(grid, grid->tiles[t])) grid->spare[grid->num_spare++] = grid->tiles[t];
+        grid->tiles[t] = (int*)sidewalk_tile;
+    }
+    grid->materialised = 0;
+}
+
+/**
+ * Frees the tiles, the spare tiles and the tile table (tiles inside a city
+ * file mapping are left to the unmap)
+ * 
+ * @param grid Grid to free
+ */
+
+void tileGridFree(TileGrid* grid) {
+    if (!grid->tiles) return;
+    tileGridClear(grid);
+    for (size_t i = 0; i < grid->num_spare; i++) {
+        free(grid->spare[i]);
+    }
+    free(grid->spare);
+    grid->spare = NULL;
+    grid->num_spare = 0;
+    free(grid->tiles);
+    grid->tiles = NULL;
+}
+
+// Takes a recycled tile buffer, or NULL if none is left (safe between rasterising threads)
+static int* tileTakeSpare(TileGrid* grid) {
+    size_t count = __atomic_load_n(&grid->num_spare, __ATOMIC_RELAXED);
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&grid->num_spare, &count, count - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return grid->spare[count - 1];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Gives a tile its own storage before its first non-sidewalk write
+ * 
+ * @param grid Grid holding the tile
+ * @param tile Index of the tile in the tile table
+ * @return The tile's cells, or NULL on allocation failure
+ */
+
+static int* tileMaterialise(TileGrid* grid, size_t tile) {
+    int* cells = grid->tiles[tile];
+    if (cells != sidewalk_tile) return cells;
+
+    cells = tileTakeSpare(grid);
+    if (!cells) cells = malloc(MAP_TILE_CELLS * sizeof(int));
+    if (!cells) return NULL;
+    memcpy(cells, sidewalk_tile, MAP_TILE_CELLS * sizeof(int));
+    grid->tiles[tile] = cells;
+    __atomic_add_fetch(&grid->materialised, 1, __ATOMIC_RELAXED);
+    return cells;
+}
+
+// Value of a cell
+static inline int tileGet(const TileGrid* grid, int col, int row) {
+    return grid->tiles[(size_t)(row >> MAP_TILE_SHIFT) * grid->tile_cols + (col >> MAP_TILE_SHIFT)]
+                      [((row & MAP_TILE_MASK) << MAP_TILE_SHIFT) | (col & MAP_TILE_MASK)];
+}
+
+// Writes a cell, materialising its tile unless a sidewalk goes onto the sentinel
+static inline void tileSet(TileGrid* grid, int col, int row, int value) {
+    size_t tile = (size_t)(row >> MAP_TILE_SHIFT) * grid->tile_cols + (col >> MAP_TILE_SHIFT);
+    int* cells = grid->tiles[tile];
+    if (cells == sidewalk_tile) {
+        if (value == SIDEWALK) return;
+        cells = tileMaterialise(grid, tile);
+        if (!cells) return;
+    }
+    cells[((row & MAP_TILE_MASK) << MAP_TILE_SHIFT) | (col & MAP_TILE_MASK)] = value;
+}
+
+// Writes value into cells [col_begin, col_end) of a row, one tile segment at a time
+static void tileFillRow(TileGrid* grid, int row, int col_begin, int col_end, int value) {
+    int col = col_begin;
+    while (col < col_end) {
+        int segment_end = MIN(col_end, (col | MAP_TILE_MASK) + 1);
+        size_t tile = (size_t)(row >> MAP_TILE_SHIFT) * grid->tile_cols + (col >> MAP_TILE_SHIFT);
+        int* cells = grid->tiles[tile];
+        if (cells != sidewalk_tile || value != SIDEWALK) {
+            cells = tileMaterialise(grid, tile);
+            if (cells) {
+                int* run = &cells[(row & MAP_TILE_MASK) << MAP_TILE_SHIFT];
+                for (int c = col; c < segment_end; c++) {
+                    run[c & MAP_TILE_MASK] = value;
+                }
+            }
+        }
+        col = segment_end;
+    }
+}
+
+// The MAP_TILE_SIZE cells of `row` stored in tile column tile_col (fewer are valid in the last column)
+static inline const int* tileRun(const TileGrid* grid, int tile_col, int row) {
+    return &grid->tiles[(size_t)(row >> MAP_TILE_SHIFT) * grid->tile_cols + tile_col][(row & MAP_TILE_MASK) << MAP_TILE_SHIFT];
+}
+
+// Whether a tile is the shared sidewalk sentinel
+static inline bool tileIsSidewalk(const TileGrid* grid, int tile_row, int tile_col) {
+    return grid->tiles[(size_t)tile_row * grid->tile_cols + tile_col] == sidewalk_tile;
+}
+
+// -------------------- MAP FUNCTIONS --------------------
+
+/**
+ * Initialises the bookkeeping fields of a map with no cells yet
+ * 
+ * Shared by createMap() and mapLoad(): everything but the tile table.
+ * 
+ * @param map Map to initialise
+ * @param rows Number of rows
+ * @param cols Number of columns
+ */
+
+static void mapInitFields(Map* map, int rows, int cols) {
+    map->rows = rows;
+    map->cols = cols;
+    map->road_width = 1;
+    map->grid.tiles = NULL;
+    map->free_taxi_field = NULL;
+    map->bitbfs = NULL;
+    map->coop_bfs = NULL;
+    map->coop_dial = NULL;
+    map->congestion = NULL;
+    map->epoch = __atomic_add_fetch(&map_epoch_counter, 1, __ATOMIC_RELAXED);
+    map->squares = NULL;
+    map->num_squares = 0;
+    map->road_cells = NULL;
+    map->num_road_cells = 0;
+    map->curb_cells = NULL;
+    map->num_curb_cells = 0;
+    map->road_component = NULL;
+    map->num_components = 0;
+    map->index_mapped = false;
+    map->mapping = NULL;
+    map->mapping_bytes = 0;
+    pthread_mutex_init(&map->lock, NULL);
+}
+
+/**
+ * Computes the map size that fits the terminal
+ * 
+ * @param rows Output: terminal rows scaled by MAP_VERTICAL_PROPORTION
+ * @param cols Output: terminal columns scaled by MAP_HORIZONTAL_PROPORTION
+ * @return false if terminal dimensions cannot be obtained
+ */
+
+bool terminalMapSize(int* rows, int* cols) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
+        return false;
+    }
+
+    // Scale the terminal size by 0.6
+    *rows = (int)(ws.ws_row * MAP_VERTICAL_PROPORTION);
+    *cols = (int)(ws.ws_col * MAP_HORIZONTAL_PROPORTION);
+    return true;
+}
+
+/**
+ * Creates a new map structure based on terminal dimensions
+ * 
+ * Dynamically allocates and initializes a map structure by:
+ * - Using the fixed sim_rows x sim_cols size when set, else the terminal
+ *   size (see terminalMapSize)
+ * - Allocating the tile table, with every tile on the shared SIDEWALK (1)
+ *   sentinel; cell storage only appears where something else is written
+ * 
+ * @return Pointer to newly created Map structure
+ * @note Returns NULL if terminal dimensions cannot be obtained
+ */
+
+Map* createMap() {
+    int scaled_rows = sim_rows, scaled_cols = sim_cols;
+    if ((scaled_rows <= 0 || scaled_cols <= 0) && !terminalMapSize(&scaled_rows, &scaled_cols)) {
+        return NULL;
+    }
+
+    Map* map = malloc(sizeof(Map));
+    mapInitFields(map, scaled_rows, scaled_cols);
+    tileGridInit(&map->grid, map->rows, map->cols);
+
+    return map;
+}
+
+/**
+ * Frees all memory associated with a map
+ * 
+ * Safely deallocates map resources by:
+ * - Freeing the materialised tiles and the tile table
+ * - Unmapping a loaded city file
+ * - Freeing the squares and road indexes
+ * - Freeing the free taxi distance field, bitboard search states and congestion map
+ * - Freeing the map structure itself
+ * 
+ * @param map Pointer to Map structure to deallocate
+ * @note Handles NULL pointer safely
+ */
+
+void freeMap(Map* map) {
+    if (!map) return;
+
+    tileGridFree(&map->grid);
+    mapReleaseIndex(map);
+    if (map->mapping) {
+        munmap(map->mapping, map->mapping_bytes);
+    }
+    taxiFieldFree(map->free_taxi_field);
+    bitbfsFree(map->bitbfs);
+    bitbfsFree(map->coop_bfs);
+    dialFieldFree(map->coop_dial);
+    congestionFree(map->congestion);
+    pthread_mutex_destroy(&map->lock);
+    free(map);
+}
+
+/**
+ * Writes a single map cell and keeps derived structures in sync
+ * 
+ * All runtime changes to the map (taxis, passengers) go through here so
+ * the free taxi distance field can be repaired incrementally. Terrain edits
+ * (ROAD <-> SIDEWALK) start a new map epoch, invalidating cached routes.
+ * 
+ * @param map Pointer to Map structure
+ * @param col X coordinate of the cell
+ * @param row Y coordinate of the cell
+ * @param value New cell value
+ */
+
+void mapSetCell(Map* map, int col, int row, int value) {
+    int old_value = tileGet(&map->grid, col, row);
+    if (old_value != value && (old_value == ROAD || old_value == SIDEWALK) && (value == ROAD || value == SIDEWALK)) {
+        map->epoch = __atomic_add_fetch(&map_epoch_counter, 1, __ATOMIC_RELAXED);
+    }
+
+    tileSet(&map->grid, col, row, value);
+    if (map->free_taxi_field) {
+        taxiFieldUpdate(map->free_taxi_field, col, row, value);
+    }
+    if (map->bitbfs) {
+        bitbfsSetCell(map->bitbfs, col, row, value);
+    }
+    if (map->coop_bfs) {
+        bitbfsSetCell(map->coop_bfs, col, row, value);
+    }
+}
+
+// Bucket of a spatial hash cell (size is a power of two)
+static int squareHash(int cell_x, int cell_y, int size) {
+    return (int)(((unsigned int)cell_x * 73856093u ^ (unsigned int)cell_y * 19349663u) & (unsigned int)(size - 1));
+}
+
+/**
+ * Generates a city map with buildings and roads
+ * 
+ * Creates a procedural city layout by:
+ * 1. Generating random building squares with:
+ *    - Random positions and sizes within min/max constraints
+ *    - Minimum distance between buildings, checked against a spatial hash
+ *    - Border roads around each building
+ * 2. Connecting buildings with roads using MST algorithm
+ * 3. Rasterising sidewalks, squares and roads in row bands (in parallel
+ *    on large maps)
+ * 4. Indexing road cells, curbs and road components (see mapBuildIndex)
+ * 
+ * @param map Pointer to Map structure to generate
+ * @param rng Random stream the layout is drawn from
+ * @param num_squares Number of buildings to generate
+ * @param road_width Width of roads in cells
+ * @param border_width Width of building borders
+ * @param min_size Minimum building dimension
+ * @param max_size Maximum building dimension
+ * @param min_distance Minimum spacing between buildings
+ */
+
+void generateMap(Map* map, Rng* rng, int num_squares, int road_width, int border_width, int min_size, int max_size, int min_distance) {
+    PerfSample perf;
+    perfBegin(&perf);
+    map->road_width = road_width;
+    map->epoch = __atomic_add_fetch(&map_epoch_counter, 1, __ATOMIC_RELAXED);
+
+    if (min_size <= 0 || max_size < min_size || map->rows <= 0 || map->cols <= 0) {
+        return;
+    }
+
+    int max_possible_size = MIN(map->cols, map->rows) - 2 * border_width;
+    if (max_size > max_possible_size) {
+        max_size = max_possible_size;
+        min_size = MIN(min_size, max_size);
+    }
+
+    // Spatial hash of square centres with cells of side min_distance: a
+    // square can only be too close to squares in the 3x3 surrounding cells
+    int hash_size = 1;
+    while (hash_size < 2 * num_squares) hash_size <<= 1;
+
+    int slots = MAX(num_squares, 1);
+    Square* squares = malloc(slots * sizeof(Square));
+    int* roads = malloc(slots * 4 * sizeof(int));
+    int* hash_head = malloc(hash_size * sizeof(int));
+    int* hash_next = malloc(slots * sizeof(int));
+    if (!squares || !roads || !hash_head || !hash_next) {
+        free(squares);
+        free(roads);
+        free(hash_head);
+        free(hash_next);
+        return;
+    }
+    for (int i = 0; i < hash_size; i++) {
+        hash_head[i] = -1;
+    }
+
+    int count = 0, attempts = 0;
+
+    // Generate squares (blocks)
+    while (count < num_squares && attempts < MAX_ATTEMPTS * num_squares) {
+        int size = rngBelow(rng, max_size - min_size + 1) + min_size;
+
+        int max_col = map->cols - size - border_width;
+        int max_row = map->rows - size - border_width;
+
+        int current_distance = min_distance;
+        if (max_col <= 0 || max_row <= 0) {
+            current_distance = 0;
+            max_col = map->cols - size;
+            max_row = map->rows - size;
+            if (max_col <= 0 || max_row <= 0) break;
+        }
+
+        Square q = {
+            .x = rngBelow(rng, max_col + 1),
+            .y = rngBelow(rng, max_row + 1),
+            .size = size
+        };
+
+        int center_x = q.x + q.size / 2;
+        int center_y = q.y + q.size / 2;
+        bool valid = true;
+        if (current_distance > 0) {
+            int cell_x = center_x / min_distance;
+            int cell_y = center_y / min_distance;
+            for (int gy = cell_y - 1; gy <= cell_y + 1 && valid; gy++) {
+                for (int gx = cell_x - 1; gx <= cell_x + 1 && valid; gx++) {
+                    for (int i = hash_head[squareHash(gx, gy, hash_size)]; i != -1; i = hash_next[i]) {
+                        int dx = abs(center_x - (squares[i].x + squares[i].size / 2));
+                        int dy = abs(center_y - (squares[i].y + squares[i].size / 2));
+                        if (dx < current_distance && dy < current_distance) {
+                            valid = false;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (valid) {
+            if (min_distance > 0) {
+                int bucket = squareHash(center_x / min_distance, center_y / min_distance, hash_size);
+                hash_next[count] = hash_head[bucket];
+                hash_head[bucket] = count;
+            }
+            squares[count++] = q;
+            attempts = 0;
+        } else {
+            attempts++;
+        }
+    }
+
+    // Connect squares using MST logic, then draw everything
+    int num_roads = connectSquaresMST(squares, count, map->rows, map->cols, roads);
+    rasterizeMap(map, squares, count, roads, num_roads, border_width);
+
+    // Keep the squares and index the roads for the spawn samplers and city files
+    mapReleaseIndex(map);
+    map->squares = squares;
+    map->num_squares = count;
+    mapBuildIndex(map);
+
+    free(roads);
+    free(hash_head);
+    free(hash_next);
+    perfEnd(PERF_REGION_GENERATE, &perf);
+}
+
+/**
+ * Prints the average trip time under each routing mode
+ * 
+ * Lets congestion-aware routing be compared with plain BFS routing on the
+ * same fleet: toggle the mode with 'c' and let a few trips complete in each.
+ * 
+ * @param center Control center holding the trip statistics
+ */
+
+void print_trip_times(ControlCenter* center) {
+    lockAcquire(&center->lock, LOCK_CENTER);
+
+    const char* names[2] = {"BFS", "congestion"};
+    printf("Routing: %s |", center->congestion_routing ? "congestion-aware" : "BFS");
+    for (int mode = 0; mode < 2; mode++) {
+        double avg_s = center->trips[mode] ? center->trip_ns[mode] / 1e9 / center->trips[mode] : 0.0;
+        printf(" %s: %lu trips, avg %.1f s", names[mode], center->trips[mode], avg_s);
+    }
+    printf("\n---------------------------------------\n");
+
+    lockRelease(&center->lock, LOCK_CENTER);
+}
+
+/**
+ * Prints the raw numerical representation of the map
+ * 
+ * Debug function that displays:
+ * - Each cell's numerical value
+ * - Matrix layout with rows and columns
+ * 
+ * @param map Pointer to Map structure to display
+ */
+
+void printLogicalMap(Map* map) {
+    if (headless) return;
+    for (int i = 0; i < map->rows; i++) {
+        for (int j = 0; j < map->cols; j++) {
+            printf("%d", tileGet(&map->grid, j, i));
+        }
+        printf("\n");
+    }
+}
+
+const char* message_type_to_abbreviation(MessageType type) {
+    switch (type) {
+        case CREATE_PASSENGER: return "[CP]";
+        case DELETE_PASSENGER: return "[DP]";
+        case RESET_MAP: return "[RM]";
+        case EXIT_PROGRAM: return "[EP]";
+        case PATHFIND_REQUEST: return "[PFR]";
+        case RANDOM_REQUEST: return "[RR]";
+        case ROUTE_PLAN: return "[RP]";
+        case EXIT: return "[EX]";
+        case STATUS_REQUEST: return "[SR]";
+        case CREATE_TAXI: return "[CT]";
+        case DESTROY_TAXI: return "[DT]";
+        case SPAWN_TAXI: return "[ST]";
+        case MOVE_TO: return "[MOV]";
+        case FINISH: return "[FIN]";
+        case PRINT_LOGICO: return "[PL]";
+        case GOT_PASSENGER: return "[GP]";
+        case ARRIVED_AT_DESTINATION: return "[AD]";
+        case REFRESH_PASSENGERS: return "[RPAS]";
+        case SAVE_MAP: return "[SM]";
+        case LOAD_MAP: return "[LM]";
+        case TOGGLE_CONGESTION: return "[TC]";
+        case CHECKPOINT: return "[CK]";
+        case RETIRE_TAXI: return "[RT]";
+        case MAP_READY: return "[MR]";
+        case ROUTE_BLOCKED: return "[RB]";
+        default: return "[UNK]";
+    }
+}
+
+// Full name of a message type, as shown on trace timelines
+const char* message_type_to_name(MessageType type) {
+    switch (type) {
+        case CREATE_PASSENGER: return "CREATE_PASSENGER";
+        case DELETE_PASSENGER: return "DELETE_PASSENGER";
+        case RESET_MAP: return "RESET_MAP";
+        case EXIT_PROGRAM: return "EXIT_PROGRAM";
+        case PATHFIND_REQUEST: return "PATHFIND_REQUEST";
+        case RANDOM_REQUEST: return "RANDOM_REQUEST";
+        case ROUTE_PLAN: return "ROUTE_PLAN";
+        case EXIT: return "EXIT";
+        case STATUS_REQUEST: return "STATUS_REQUEST";
+        case CREATE_TAXI: return "CREATE_TAXI";
+        case DESTROY_TAXI: return "DESTROY_TAXI";
+        case SPAWN_TAXI: return "SPAWN_TAXI";
+        case MOVE_TO: return "MOVE_TO";
+        case FINISH: return "FINISH";
+        case PRINT_LOGICO: return "PRINT_LOGICO";
+        case GOT_PASSENGER: return "GOT_PASSENGER";
+        case ARRIVED_AT_DESTINATION: return "ARRIVED_AT_DESTINATION";
+        case REFRESH_PASSENGERS: return "REFRESH_PASSENGERS";
+        case SAVE_MAP: return "SAVE_MAP";
+        case LOAD_MAP: return "LOAD_MAP";
+        case TOGGLE_CONGESTION: return "TOGGLE_CONGESTION";
+        case CHECKPOINT: return "CHECKPOINT";
+        case RETIRE_TAXI: return "RETIRE_TAXI";
+        case MAP_READY: return "MAP_READY";
+        case ROUTE_BLOCKED: return "ROUTE_BLOCKED";
+        default: return "UNKNOWN";
+    }
+}
+
+// Prints the seed and the record/replay state under the map
+void print_schedule() {
+    printf("Seed: %llu", (unsigned long long)sim_seed);
+    switch (__atomic_load_n(&schedule.mode, __ATOMIC_ACQUIRE)) {
+        case SCHED_RECORD:
+            printf(" | Recording %s: %lu events", schedule.path, schedule.events);
+            break;
+        case SCHED_REPLAY:
+            printf(" | Replaying %s: event %lu", schedule.path, schedule.events);
+            break;
+        default:
+            if (schedule.status[0]) {
+                printf(" | %s", schedule.status);
+            }
+            break;
+    }
+    printf("\n");
+}
+
+/**
+ * Prints the head of a message queue and its counters
+ * 
+ * Only the first six messages are walked (under the lock, to name them);
+ * the depth and the other figures come from the queue's atomic counters,
+ * so the cost does not grow with the queue.
+ * 
+ * @param thread_name Consumer of the queue
+ * @param queue Queue to print
+ */
+
+void print_message_queue(const char* thread_name, MessageQueue* queue) {
+    static const double percentiles[] = {50, 99};
+
+    printf("Thread %s:\n", thread_name);
+
+    lockAcquire(&queue->lock, LOCK_QUEUE);
+    int shown = 0;
+    for (Message* current = queue->head; current && shown < 6; current = current->next) {
+        printf("%s", message_type_to_abbreviation(current->type));
+        shown++;
+    }
+    lockRelease(&queue->lock, LOCK_QUEUE);
+
+    unsigned long depth = __atomic_load_n(&queue->depth, __ATOMIC_RELAXED);
+    if (depth > (unsigned long)shown) {
+        printf(" + %lu", depth - shown);
+    } else if (shown == 0) {
+        printf("[EMPTY]");
+    }
+
+    uint64_t sojourn[2];
+    hdrPercentiles(&queue->sojourn, percentiles, sojourn, 2);
+    printf("\nDepth %lu (max %lu) | in %lu, out %lu, dropped %lu | wait p50 %.1f ms, p99 %.1f ms",
+           depth, __atomic_load_n(&queue->high_water, __ATOMIC_RELAXED),
+           __atomic_load_n(&queue->enqueued, __ATOMIC_RELAXED), __atomic_load_n(&queue->dequeued, __ATOMIC_RELAXED),
+           __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED), sojourn[0] / 1e3, sojourn[1] / 1e3);
+
+    printf("\n---------------------------------------\n");
+}
+
+// Prints the taxi queue whose messages wait longest (p99), the likely bottleneck of the fleet
+void print_taxi_queues(ControlCenter* center) {
+    static const double percentiles[] = {99};
+    int worst_id = 0;
+    uint64_t worst_p99 = 0;
+    unsigned long worst_depth = 0;
+
+    for (int i = 0; i < center->numTaxis; i++) {
+        if (!center->taxis[i]) continue; // Being torn down
+        MessageQueue* queue = &center->taxis[i]->queue;
+        uint64_t p99;
+        hdrPercentiles(&queue->sojourn, percentiles, &p99, 1);
+        if (!worst_id || p99 > worst_p99) {
+            worst_id = center->taxis[i]->id;
+            worst_p99 = p99;
+        }
+        worst_depth = MAX(worst_depth, __atomic_load_n(&queue->high_water, __ATOMIC_RELAXED));
+    }
+    if (worst_id) {
+        printf("Taxi queues: slowest Taxi %d (wait p99 %.1f ms) | max depth %lu\n", worst_id, worst_p99 / 1e3, worst_depth);
+    }
+}
+
+void renderMap(Map* map, ControlCenter* center, Visualizer* visualizer) {
+    if (!map || !map->grid.tiles || headless) {
+        return;
+    }
+    long long span = traceStart();
+    PerfSample perf;
+    perfBegin(&perf);
+
+    printf("\033[H\033[J"); 
+    for (int i = 0; i < map->rows; i++) {
+        for (int j = 0; j < map->cols; j++) {
+            int value = tileGet(&map->grid, j, i);
+            switch (value) {
+                case SIDEWALK:
+                    printf(SIDEWALK_EMOJI);
+                    break;
+                case ROAD:
+                    printf(ROAD_EMOJI);
+                    break;
+                case DESTINATION:
+                    printf(DESTINATION_EMOJI);
+                    break;
+                case PASSENGER:
+                    printf(PASSENGER_EMOJI);
+                    break;
+                case TAXI:
+                    printf(TAXI_EMOJI);
+                    break;
+                default:
+                    if (value >= R_PASSENGER && value < R_PASSENGER + 100) {
+                        printf(PASSENGER_EMOJI);
+                        break;
+                    }
+                    if (value >= R_TAXI_FREE && value < R_TAXI_OCCUPIED + 100) {
+                        printf(TAXI_EMOJI);
+                        break;
+                    }
+                    if (value >= R_PASSENGER_POINT && value < R_PASSENGER_POINT + 100) {
+                        printf(PASSENGER_POINT_EMOJI);
+                        break;
+                    }
+                    if (value >= R_PASSENGER_DEST && value < R_PASSENGER_DEST + 100) {
+                        printf(DESTINATION_EMOJI);
+                        break;
+                    }
+                    printf("?"); 
+                    break;
+            }
+        }
+        printf("\n");
+    }
+
+    printf("\n--- Message Queues ---\n");
+    print_message_queue("ControlCenter", &center->queue);
+    print_message_queue("Visualizer", &visualizer->queue);
+    lockAcquire(&center->lock, LOCK_CENTER);
+    if (center->numTaxis > 0 && center->taxis[0]) {
+        print_message_queue("Taxi 1", &center->taxis[0]->queue);
+    }
+    print_taxi_queues(center);
+    lockRelease(&center->lock, LOCK_CENTER);
+    if (visualizer->route_cache) {
+        print_route_cache(visualizer->route_cache);
+    }
+    print_trip_times(center);
+    print_demand(center);
+    print_trip_log();
+    print_metrics();
+    print_lock_profile();
+    printf("Route repairs: %lu\n", visualizer->route_repairs);
+    printf("Map tiles: %zu/%zu materialised\n", map->grid.materialised,
+           (size_t)map->grid.tile_rows * map->grid.tile_cols);
+    if (visualizer->city_status[0]) {
+        printf("City file: %s\n", visualizer->city_status);
+    }
+    static const double reset_percentiles[] = {50, 99};
+    uint64_t reset_us[2];
+    uint64_t resets = hdrPercentiles(&visualizer->resets, reset_percentiles, reset_us, 2);
+    if (resets > 0) {
+        printf("Map reset: last %lld us (%s), p50 %llu us, p99 %llu us (n=%llu)\n", visualizer->last_reset_us,
+               visualizer->last_reset_in_place ? "in place" : "rebuilt", (unsigned long long)reset_us[0],
+               (unsigned long long)reset_us[1], (unsigned long long)resets);
+    }
+    print_checkpoint();
+    print_schedule();
+    perfEnd(PERF_REGION_RENDER, &perf);
+    traceSpan("render", "renderMap", span);
+}
+
+/**
+ * Finds a path between two points using BFS algorithm
+ * 
+ * Calculates shortest path through road network by:
+ * 1. Initializing BFS queue and visited matrix
+ * 2. Exploring neighbors (up/down/left/right)
+ * 3. Tracking parent nodes to reconstruct path
+ * 4. Handling special destination ranges (100-599)
+ * 
+ * @param start_col Starting X coordinate
+ * @param start_row Starting Y coordinate
+ * @param maze The map grid to navigate
+ * @param num_cols Width of map
+ * @param num_rows Height of map
+ * @param path Output path (start -> destination)
+ * @param destination Target value range (e.g., R_TAXI_FREE)
+ * @return 0 on success, 1 if no path found
+ */
+
+int findPath(int start_col, int start_row, const TileGrid* maze, int num_cols, int num_rows,
+                    PathData* path, int destination) {
+    long long span = traceStart();
+    PerfSample perf;
+    perfBegin(&perf);
+
+    // BFS queue
+    Node *queue = malloc(num_cols * num_rows * sizeof(Node));
+    int start = 0, end = 0;
+
+    // Visited matrix
+    int **visited = malloc(num_rows * sizeof(int *));
+    for (int row = 0; row < num_rows; row++) {
+        visited[row] = malloc(num_cols * sizeof(int));
+        for (int col = 0; col < num_cols; col++) {
+            visited[row][col] = -1;
+        }
+    }
+
+    route_stats.allocations += 2 + num_rows;
+
+    // Add the starting node
+    queue[end++] = (Node){.x = start_col, .y = start_row, .parent_index = -1};
+    visited[start_row][start_col] = 0;
+
+    // Directions for moving (left, right, up, down)
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+
+    // BFS loop
+    while (start < end) {
+        Node current = queue[start++];
+
+        // Check if it's the destination
+        if (tileGet(maze, current.x, current.y) >= destination && tileGet(maze, current.x, current.y) < destination + 100) {
+            // Walk the parents back to the start, then flip to start -> destination
+            pathClear(path);
+            bool stored = true;
+            for (int index = start - 1; stored && index != -1; index = queue[index].parent_index) {
+                stored = pathAppendCell(path, queue[index].x, queue[index].y);
+            }
+            pathReverse(path);
+            route_stats.expanded += start;
+
+            // Free memory
+            for (int row = 0; row < num_rows; row++) free(visited[row]);
+            free(visited);
+            free(queue);
+            perfEnd(PERF_REGION_BFS, &perf);
+            traceSpan("route", "findPath", span);
+            return stored ? 0 : 1;
+        }
+
+        // Explore neighbors
+        for (int i = 0; i < 4; i++) {
+            int new_col = current.x + delta_col[i];
+            int new_row = current.y + delta_row[i];
+
+            // Check bounds
+            if (new_col < 0 || new_col >= num_cols || new_row < 0 || new_row >= num_rows) {
+                continue;
+            }
+
+            // Check if it's a valid path and not visited
+            if ((tileGet(maze, new_col, new_row) == ROAD ||( tileGet(maze, new_col, new_row) >= destination && tileGet(maze, new_col, new_row) < destination + 100)) &&
+                visited[new_row][new_col] == -1) {
+                visited[new_row][new_col] = start - 1;
+                queue[end++] = (Node){.x = new_col, .y = new_row, .parent_index = start - 1};
+            }
+        }
+    }
+
+    // Free memory on failure
+    route_stats.expanded += start;
+    for (int row = 0; row < num_rows; row++) free(visited[row]);
+    free(visited);
+    free(queue);
+    perfEnd(PERF_REGION_BFS, &perf);
+    traceSpan("route", "findPath", span);
+    return 1;
+}
+
+/**
+ * Finds path between specific coordinates using BFS
+ * 
+ * Specialized version of findPath that navigates to exact coordinates
+ * rather than destination ranges. Used for taxi-passenger routing.
+ * 
+ * @param start_col Starting X coordinate
+ * @param start_row Starting Y coordinate
+ * @param dest_col Destination X coordinate
+ * @param dest_row Destination Y coordinate
+ * @param maze The map grid to navigate
+ * @param num_cols Width of map
+ * @param num_rows Height of map
+ * @param path Output path (start -> destination)
+ * @return 0 on success, 1 if no path found
+ */
+
+int findPathCoordinates(int start_col, int start_row, int dest_col, int dest_row,
+                               const TileGrid* maze, int num_cols, int num_rows,
+                               PathData* path) {
+    long long span = traceStart();
+    PerfSample perf;
+    perfBegin(&perf);
+
+    // BFS queue
+    Node *queue = malloc(num_cols * num_rows * sizeof(Node));
+    int start = 0, end = 0;
+
+    // Visited matrix
+    int **visited = malloc(num_rows * sizeof(int *));
+    for (int row = 0; row < num_rows; row++) {
+        visited[row] = malloc(num_cols * sizeof(int));
+        for (int col = 0; col < num_cols; col++) {
+            visited[row][col] = -1;
+        }
+    }
+
+    route_stats.allocations += 2 + num_rows;
+
+    // Add the starting node
+    queue[end++] = (Node){.x = start_col, .y = start_row, .parent_index = -1};
+    visited[start_row][start_col] = 0;
+
+    // Directions for moving (left, right, up, down)
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+
+    // BFS loop
+    while (start < end) {
+        Node current = queue[start++];
+
+        // Check if it's the destination
+        if (current.x == dest_col && current.y == dest_row) {
+            // Walk the parents back to the start, then flip to start -> destination
+            pathClear(path);
+            bool stored = true;
+            for (int index = start - 1; stored && index != -1; index = queue[index].parent_index) {
+                stored = pathAppendCell(path, queue[index].x, queue[index].y);
+            }
+            pathReverse(path);
+            route_stats.expanded += start;
+
+            // Free memory
+            for (int row = 0; row < num_rows; row++) free(visited[row]);
+            free(visited);
+            free(queue);
+            perfEnd(PERF_REGION_BFS, &perf);
+            traceSpan("route", "findPathCoordinates", span);
+            return stored ? 0 : 1;
+        }
+
+        // Explore neighbors
+        for (int i = 0; i < 4; i++) {
+            int new_col = current.x + delta_col[i];
+            int new_row = current.y + delta_row[i];
+
+            // Check bounds
+            if (new_col < 0 || new_col >= num_cols || new_row < 0 || new_row >= num_rows) {
+                continue;
+            }
+
+            // Check if it's a valid path and not visited
+            if ((tileGet(maze, new_col, new_row) == ROAD || (new_col == dest_col && new_row == dest_row)) &&
+                visited[new_row][new_col] == -1) {
+                visited[new_row][new_col] = start - 1;
+                queue[end++] = (Node){.x = new_col, .y = new_row, .parent_index = start - 1};
+            }
+        }
+    }
+
+    // Free memory on failure
+    route_stats.expanded += start;
+    for (int row = 0; row < num_rows; row++) free(visited[row]);
+    free(visited);
+    free(queue);
+    perfEnd(PERF_REGION_BFS, &perf);
+    traceSpan("route", "findPathCoordinates", span);
+    return 1;
+}
+
+/**
+ * Marks a calculated path on the map grid
+ * 
+ * Annotates the path with directional markers (→, ←, ↑, ↓) by:
+ * - Analyzing each step's direction
+ * - Setting appropriate directional constants
+ * - Preserving destination marker
+ * 
+ * @param maze The map grid to annotate
+ * @param path Path to mark
+ */
+
+void markPath(TileGrid* maze, const PathData* path) {
+    if (path == NULL || path->tamanho_solucao <= 0 || maze == NULL) {
+        return;
+    }
+
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+    int current_x = path->start_x;
+    int current_y = path->start_y;
+
+    for (int i = 0; i < path->num_segments; i++) {
+        RouteSegment segment = path->segments[i];
+        if (segment.op >= ROUTE_PICKUP) continue;
+
+        // Determine direction
+        int marker = (segment.op == ROUTE_RIGHT) ? RIGHT : // →
+                     (segment.op == ROUTE_LEFT) ? LEFT :   // ←
+                     (segment.op == ROUTE_DOWN) ? DOWN :   // ↓
+                     UP;                                   // ↑
+        for (unsigned int step = 0; step < segment.run; step++) {
+            tileSet(maze, current_x, current_y, marker);
+            current_x += delta_col[segment.op];
+            current_y += delta_row[segment.op];
+        }
+    }
+
+    // Keep the destination marker
+    tileSet(maze, path->end_x, path->end_y, DESTINATION);
+}
+
+/**
+ * Draws a building square on the map with borders
+ * 
+ * Creates a building by:
+ * 1. Drawing top/bottom borders (horizontal roads)
+ * 2. Drawing left/right borders (vertical roads)
+ * 3. Leaving center area as sidewalk (1)
+ * Only rows inside [row_begin, row_end) are written, so bands can be
+ * drawn by different threads.
+ * 
+ * @param map Pointer to Map structure
+ * @param q Square parameters (position, size)
+ * @param borderWidth Width of border roads
+ * @param row_begin First row to draw
+ * @param row_end Row after the last one to draw
+ */
+
+static void drawSquare(Map *map, Square q, int borderWidth, int row_begin, int row_end) {
+    int first_row = MAX(q.y, row_begin);
+    int last_row = MIN(MIN(q.y + q.size, map->rows), row_end);
+    int last_col = MIN(q.x + q.size, map->cols);
+
+    for (int row = first_row; row < last_row; row++) {
+        // Top and bottom: the whole row is border
+        if (row < q.y + borderWidth || row >= q.y + q.size - borderWidth) {
+            tileFillRow(&map->grid, row, q.x, last_col, ROAD);
+            continue;
+        }
+
+        // Sides: draw the left and right borders
+        for (int i = 0; i < borderWidth; i++) {
+            if (q.x + i < map->cols) {
+                tileSet(&map->grid, q.x + i, row, ROAD);
+            }
+            if (q.x + q.size - i - 1 < map->cols) {
+                tileSet(&map->grid, q.x + q.size - i - 1, row, ROAD);
+            }
+        }
+    }
+}
+
+/**
+ * Draws a road segment between two points
+ * 
+ * Creates either horizontal or vertical road segments with:
+ * - Proper road width handling
+ * - Boundary checking
+ * - Center-aligned road placement
+ * Only rows inside [row_begin, row_end) are written.
+ * 
+ * @param map Pointer to Map structure
+ * @param x1 Starting X coordinate
+ * @param y1 Starting Y coordinate
+ * @param x2 Ending X coordinate
+ * @param y2 Ending Y coordinate
+ * @param row_begin First row to draw
+ * @param row_end Row after the last one to draw
+ */
+
+static void drawRoad(Map *map, int x1, int y1, int x2, int y2, int row_begin, int row_end) {
+    row_begin = MAX(row_begin, 0);
+    row_end = MIN(row_end, map->rows);
+
+    // Horizontal leg at y1, from x1 up to (not including) x2
+    if (x1 != x2) {
+        int first_col = MAX((x2 > x1) ? x1 : x2 + 1, 0);
+        int last_col = MIN((x2 > x1) ? x2 - 1 : x1, map->cols - 1);
+        for (int k = 0; k < map->road_width; k++) {
+            int y = y1 + k - map->road_width / 2;
+            if (y < row_begin || y >= row_end) continue;
+            tileFillRow(&map->grid, y, first_col, last_col + 1, ROAD);
+        }
+    }
+
+    // Vertical leg at x2, from y1 up to (not including) y2
+    if (y1 != y2) {
+        int first_row = MAX((y2 > y1) ? y1 : y2 + 1, row_begin);
+        int last_row = MIN((y2 > y1) ? y2 - 1 : y1, row_end - 1);
+        for (int y = first_row; y <= last_row; y++) {
+            for (int k = 0; k < map->road_width; k++) {
+                int x = x2 + k - map->road_width / 2;
+                if (x >= 0 && x < map->cols) {
+                    tileSet(&map->grid, x, y, ROAD);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Sorts MST candidates by weight with a counting sort
+ * 
+ * Weights are Manhattan distances, so they are bounded by rows + cols and
+ * a counting sort beats qsort on the millions of candidates of a large
+ * city. The sort is stable, which keeps the tree deterministic.
+ * 
+ * @param edges Candidates to sort in place
+ * @param num_edges Number of candidates
+ * @param max_weight Largest possible weight
+ * @return true on success, false if scratch memory could not be allocated
+ */
+
+static bool sortSquareEdges(SquareEdge* edges, int num_edges, int max_weight) {
+    int* counts = calloc(max_weight + 2, sizeof(int));
+    SquareEdge* sorted = malloc(MAX(num_edges, 1) * sizeof(SquareEdge));
+    if (!counts || !sorted) {
+        free(counts);
+        free(sorted);
+        return false;
+    }
+
+    for (int e = 0; e < num_edges; e++) {
+        counts[edges[e].weight + 1]++;
+    }
+    for (int w = 1; w <= max_weight + 1; w++) {
+        counts[w] += counts[w - 1];
+    }
+    for (int e = 0; e < num_edges; e++) {
+        sorted[counts[edges[e].weight]++] = edges[e];
+    }
+
+    memcpy(edges, sorted, num_edges * sizeof(SquareEdge));
+    free(counts);
+    free(sorted);
+    return true;
+}
+
+// Union-find root with path halving
+static int squareRoot(int* parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+/**
+ * Connects buildings using Minimum Spanning Tree algorithm
+ * 
+ * Creates efficient road network by:
+ * 1. Bucketing building centres in a uniform grid (about one per cell)
+ * 2. Collecting candidate edges between squares in nearby grid cells
+ * 3. Running Kruskal's algorithm over the candidates sorted by weight
+ * 4. Widening the neighbourhood, with only edges between different
+ *    components, until every square is connected
+ * Roads are written as endpoint quadruples; the caller draws them.
+ * 
+ * @param squares Array of building squares
+ * @param num_squares Number of buildings
+ * @param rows Map rows
+ * @param cols Map columns
+ * @param roads Output with room for 4 * num_squares ints (x1, y1, x2, y2)
+ * @return Number of roads written
+ */
+
+static int connectSquaresMST(const Square *squares, int num_squares, int rows, int cols, int *roads) {
+    if (num_squares <= 1 || squares == NULL) return 0;
+
+    int cell = 1;
+    while ((long long)cell * cell * num_squares < (long long)rows * cols) cell++;
+    int grid_cols = cols / cell + 1;
+    int grid_rows = rows / cell + 1;
+
+    int *head = malloc((size_t)grid_cols * grid_rows * sizeof(int));
+    int *next = malloc(num_squares * sizeof(int));
+    int *parent = malloc(num_squares * sizeof(int));
+    int capacity = num_squares * 9;
+    SquareEdge *edges = malloc(capacity * sizeof(SquareEdge));
+    if (!head || !next || !parent || !edges) {
+        free(head);
+        free(next);
+        free(parent);
+        free(edges);
+        return 0;
+    }
+
+    for (int i = 0; i < grid_cols * grid_rows; i++) {
+        head[i] = -1;
+    }
+    for (int i = 0; i < num_squares; i++) {
+        int gx = (squares[i].x + squares[i].size / 2) / cell;
+        int gy = (squares[i].y + squares[i].size / 2) / cell;
+        next[i] = head[gy * grid_cols + gx];
+        head[gy * grid_cols + gx] = i;
+        parent[i] = i;
+    }
+
+    int components = num_squares, num_roads = 0;
+    for (int radius = 1; components > 1; radius *= 2) {
+        int num_edges = 0;
+
+        for (int i = 0; i < num_squares; i++) {
+            int cx = squares[i].x + squares[i].size / 2;
+            int cy = squares[i].y + squares[i].size / 2;
+            int gx = cx / cell, gy = cy / cell;
+            int root = squareRoot(parent, i);
+
+            for (int ny = MAX(gy - radius, 0); ny <= MIN(gy + radius, grid_rows - 1); ny++) {
+                for (int nx = MAX(gx - radius, 0); nx <= MIN(gx + radius, grid_cols - 1); nx++) {
+                    for (int j = head[ny * grid_cols + nx]; j != -1; j = next[j]) {
+                        if (j <= i || squareRoot(parent, j) == root) continue;
+
+                        if (num_edges == capacity) {
+                            SquareEdge *grown = realloc(edges, capacity * 2 * sizeof(SquareEdge));
+                            if (!grown) continue;
+                            edges = grown;
+                            capacity *= 2;
+                        }
+                        int dx = abs(cx - (squares[j].x + squares[j].size / 2));
+                        int dy = abs(cy - (squares[j].y + squares[j].size / 2));
+                        edges[num_edges++] = (SquareEdge){ .weight = dx + dy, .a = i, .b = j };
+                    }
+                }
+            }
+        }
+
+        if (!sortSquareEdges(edges, num_edges, rows + cols)) break;
+
+        // Kruskal's algorithm
+        for (int e = 0; e < num_edges && components > 1; e++) {
+            int ra = squareRoot(parent, edges[e].a);
+            int rb = squareRoot(parent, edges[e].b);
+            if (ra == rb) continue;
+
+            parent[rb] = ra;
+            components--;
+            int *road = &roads[4 * num_roads++];
+            findConnectionPoints(squares[edges[e].a], squares[edges[e].b], &road[0], &road[1], &road[2], &road[3]);
+        }
+
+        // The whole grid was already in range
+        if (radius >= grid_cols && radius >= grid_rows) break;
+    }
+
+    free(head);
+    free(next);
+    free(parent);
+    free(edges);
+    return num_roads;
+}
+
+/**
+ * Rasterises one band of map rows
+ * 
+ * Draws every square and road clipped to the band onto the cleared grid.
+ * Used directly for small maps and as a thread body for large ones.
+ * 
+ * @param arg Pointer to the MapBand to draw
+ * @return NULL
+ */
+
+static void* rasterizeBand(void* arg) {
+    MapBand* band = (MapBand*)arg;
+    Map* map = band->map;
+
+    for (int i = 0; i < band->num_squares; i++) {
+        drawSquare(map, band->squares[i], band->border_width, band->row_begin, band->row_end);
+    }
+
+    for (int i = 0; i < band->num_roads; i++) {
+        const int* road = &band->roads[4 * i];
+        drawRoad(map, road[0], road[1], road[2], road[3], band->row_begin, band->row_end);
+    }
+    return NULL;
+}
+
+/**
+ * Draws the generated squares and roads onto the map
+ * 
+ * Clears the grid back to sidewalk tiles first. Maps with at least
+ * MAPGEN_PARALLEL_MIN_CELLS cells are split into bands of whole tile
+ * rows, one per online CPU (up to MAPGEN_MAX_THREADS). Bands never share
+ * a tile, so the threads need no locking; a band whose thread cannot be
+ * started is drawn on the calling thread.
+ * 
+ * @param map Pointer to Map structure
+ * @param squares Accepted squares
+ * @param num_squares Number of squares
+ * @param roads Road endpoints from connectSquaresMST
+ * @param num_roads Number of roads
+ * @param border_width Width of building borders
+ */
+
+static void rasterizeMap(Map* map, const Square* squares, int num_squares, const int* roads, int num_roads, int border_width) {
+    tileGridRecycle(&map->grid); // A regenerated map draws into the tiles of the previous city
+
+    int num_threads = 1;
+    if ((long long)map->rows * map->cols >= MAPGEN_PARALLEL_MIN_CELLS) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (int)MIN(MAX(cpus, 1), MAPGEN_MAX_THREADS);
+        num_threads = MIN(num_threads, map->grid.tile_rows);
+    }
+
+    MapBand bands[MAPGEN_MAX_THREADS];
+    pthread_t threads[MAPGEN_MAX_THREADS];
+    bool started[MAPGEN_MAX_THREADS];
+
+    for (int t = 0; t < num_threads; t++) {
+        bands[t] = (MapBand){
+            .map = map,
+            .squares = squares,
+            .num_squares = num_squares,
+            .roads = roads,
+            .num_roads = num_roads,
+            .border_width = border_width,
+            .row_begin = MIN(map->grid.tile_rows * t / num_threads * MAP_TILE_SIZE, map->rows),
+            .row_end = MIN(map->grid.tile_rows * (t + 1) / num_threads * MAP_TILE_SIZE, map->rows)
+        };
+        started[t] = t > 0 && pthread_create(&threads[t], NULL, rasterizeBand, &bands[t]) == 0;
+    }
+
+    // The calling thread draws the first band and any band left unstarted
+    for (int t = 0; t < num_threads; t++) {
+        if (!started[t]) rasterizeBand(&bands[t]);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+}
+
+/**
+ * Calculates connection points between two buildings
+ * 
+ * Determines optimal road attachment points by:
+ * - Comparing relative positions (horizontal/vertical dominance)
+ * - Selecting midpoints on appropriate sides
+ * 
+ * @param a First building square
+ * @param b Second building square
+ * @param px1 Output for first point's X
+ * @param py1 Output for first point's Y
+ * @param px2 Output for second point's X
+ * @param py2 Output for second point's Y
+ */
+
+static void findConnectionPoints(Square a, Square b, int *px1, int *py1, int *px2, int *py2)
+{
+    // Pontos médios nas bordas (otimizado)
+    int a_center_x = a.x + a.size / 2; // coluna
+    int a_center_y = a.y + a.size / 2; // linha
+    int b_center_x = b.x + b.size / 2;
+    int b_center_y = b.y + b.size / 2;
+
+    // Determina a direção relativa entre quadrados
+    int delta_x = b_center_x - a_center_x;
+    int delta_y = b_center_y - a_center_y;
+
+    // Escolhe pontos de conexão baseado na posição relativa
+    if (abs(delta_x) > abs(delta_y))
+    {
+    // Conectar horizontalmente
+    *px1 = (delta_x > 0) ? (a.x + a.size - 1) : a.x; // Direita ou esquerda
+    *py1 = a_center_y;
+    *px2 = (delta_x > 0) ? b.x : (b.x + b.size - 1);
+    *py2 = b_center_y;
+    }
+    else
+    {
+    // Conectar verticalmente
+    *px1 = a_center_x;
+    *py1 = (delta_y > 0) ? (a.y + a.size - 1) : a.y; // Base ou topo
+    *px2 = b_center_x;
+    *py2 = (delta_y > 0) ? b.y : (b.y + b.size - 1);
+}
+}
+
+/**
+ * Finds random accessible point on road network
+ * 
+ * Locates valid spawn points by:
+ * - Random sampling with maximum attempts (over the road index when built)
+ * - Checking for ROAD (0) cell type
+ * 
+ * @param map Pointer to Map structure
+ * @param rng Random stream to sample with
+ * @param random_x Output for found X coordinate
+ * @param random_y Output for found Y coordinate
+ * @return true if valid point found, false otherwise
+ */
+
+bool find_random_free_point(Map* map, Rng* rng, int* random_x, int* random_y) {
+    const int max_attempts = 1000;
+    int attempts = 0;
+
+    if (!map || !map->grid.tiles) {
+        return false;
+    }
+
+    // Sample road cells directly: buildings no longer eat the attempts
+    if (map->num_road_cells > 0) {
+        for (attempts = 0; attempts < max_attempts; attempts++) {
+            uint32_t cell = map->road_cells[rngBelow(rng, map->num_road_cells)];
+            if (cell >= (uint32_t)map->rows * (uint32_t)map->cols) continue;
+
+            *random_x = cell % map->cols;
+            *random_y = cell / map->cols;
+            if (tileGet(&map->grid, *random_x, *random_y) == ROAD) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    do {
+        *random_x = rngBelow(rng, map->cols);
+        *random_y = rngBelow(rng, map->rows);
+        attempts++;
+    } while (tileGet(&map->grid, *random_x, *random_y) != ROAD && attempts < max_attempts);
+
+    if (attempts >= max_attempts) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Checks that a cell is a free curb: ROAD (0) with a SIDEWALK (1) neighbour
+ * 
+ * @param map Pointer to Map structure
+ * @param col X coordinate of the road cell
+ * @param row Y coordinate of the road cell
+ * @param sidewalk_x Output for the adjacent sidewalk X
+ * @param sidewalk_y Output for the adjacent sidewalk Y
+ * @return true if the cell is a free curb
+ */
+
+static bool curbSidewalk(Map* map, int col, int row, int* sidewalk_x, int* sidewalk_y) {
+    // Check if the point is free (ROAD)
+    if (tileGet(&map->grid, col, row) != ROAD) {
+        return false;
+    }
+
+    // Check all adjacent points for a SIDEWALK
+    int delta_x[] = {0, 0, -1, 1};
+    int delta_y[] = {-1, 1, 0, 0};
+
+    for (int i = 0; i < 4; i++) {
+        int adj_x = col + delta_x[i];
+        int adj_y = row + delta_y[i];
+
+        // Ensure the adjacent point is within bounds
+        if (adj_x >= 0 && adj_x < map->cols && adj_y >= 0 && adj_y < map->rows) {
+            // Check if the adjacent point is a SIDEWALK
+            if (tileGet(&map->grid, adj_x, adj_y) == SIDEWALK) {
+                *sidewalk_x = adj_x;
+                *sidewalk_y = adj_y;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Finds road point adjacent to sidewalk
+ * 
+ * Locates passenger pickup/dropoff points by:
+ * - Finding road cells (0) next to sidewalk cells (1), drawn from the curb
+ *   index when built
+ * - Valid for both passenger origins and destinations
+ * 
+ * @param map Pointer to Map structure
+ * @param rng Random stream to sample with
+ * @param free_x Output for road X coordinate
+ * @param free_y Output for road Y coordinate
+ * @param sidewalk_x Output for adjacent sidewalk X
+ * @param sidewalk_y Output for adjacent sidewalk Y
+ * @return true if valid point found, false otherwise
+ */
+
+bool find_random_free_point_adjacent_to_sidewalk(Map* map, Rng* rng, int* free_x, int* free_y, int* sidewalk_x, int* sidewalk_y) {
+    const int max_attempts = MAX_ATTEMPTS;
+    int attempts = 0;
+
+    if (!map || !map->grid.tiles) {
+        return false;
+    }
+
+    do {
+        // Generate a random free point
+        if (map->num_curb_cells > 0) {
+            uint32_t cell = map->curb_cells[rngBelow(rng, map->num_curb_cells)];
+            if (cell >= (uint32_t)map->rows * (uint32_t)map->cols) {
+                attempts++;
+                continue;
+            }
+            *free_x = cell % map->cols;
+            *free_y = cell / map->cols;
+        } else {
+            *free_x = rngBelow(rng, map->cols);
+            *free_y = rngBelow(rng, map->rows);
+        }
+
+        if (curbSidewalk(map, *free_x, *free_y, sidewalk_x, sidewalk_y)) {
+            return true;
+        }
+
+        attempts++;
+    } while (attempts < max_attempts);
+
+    return false;
+}
+
+/**
+ * Weighs the curbs of a map around randomly placed hotspots
+ * 
+ * Hotspots sit on curbs drawn from the hotspot stream. Each curb weighs 1
+ * plus DEMAND_HOTSPOT_PEAK * (1 - d^2 / r^2) for every hotspot within the
+ * radius r, in fixed point.
+ * 
+ * @param weights Weights to (re)build
+ * @param map Map whose curb index is weighted
+ * @param rng Hotspot random stream
+ * @param num_hotspots Hotspots to place (at most DEMAND_MAX_HOTSPOTS)
+ * @return false if the map has no curb index or the table cannot be allocated
+ */
+
+bool curbWeightsBuild(CurbWeights* weights, Map* map, Rng* rng, int num_hotspots) {
+    weights->epoch = 0;
+    if (map->num_curb_cells == 0) return false;
+
+    if (weights->count < map->num_curb_cells || !weights->cumulative) {
+        uint64_t* cumulative = realloc(weights->cumulative, map->num_curb_cells * sizeof(uint64_t));
+        if (!cumulative) return false;
+        weights->cumulative = cumulative;
+    }
+    weights->count = map->num_curb_cells;
+
+    weights->num_hotspots = MIN(num_hotspots, DEMAND_MAX_HOTSPOTS);
+    for (int h = 0; h < weights->num_hotspots; h++) {
+        uint32_t cell = map->curb_cells[rngBelow(rng, map->num_curb_cells)];
+        weights->hotspot_x[h] = cell % map->cols;
+        weights->hotspot_y[h] = cell / map->cols;
+    }
+
+    long long radius = MAX(MIN(map->rows, map->cols) / DEMAND_HOTSPOT_RADIUS_DIVISOR, 2);
+    long long radius_sq = radius * radius;
+    const uint64_t unit = 1024; // Fixed-point weight of a curb away from every hotspot
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < weights->count; i++) {
+        int col = map->curb_cells[i] % map->cols;
+        int row = map->curb_cells[i] / map->cols;
+        uint64_t weight = unit;
+        for (int h = 0; h < weights->num_hotspots; h++) {
+            long long dx = col - weights->hotspot_x[h];
+            long long dy = row - weights->hotspot_y[h];
+            long long d_sq = dx * dx + dy * dy;
+            if (d_sq < radius_sq) {
+                weight += unit * DEMAND_HOTSPOT_PEAK * (uint64_t)(radius_sq - d_sq) / (uint64_t)radius_sq;
+            }
+        }
+        total += weight;
+        weights->cumulative[i] = total;
+    }
+    weights->epoch = map->epoch;
+    return true;
+}
+
+/**
+ * Finds a passenger spawn point, weighted towards the demand hotspots
+ * 
+ * Falls back to find_random_free_point_adjacent_to_sidewalk when there are
+ * no hotspots (demand_hotspots == 0) or the curbs cannot be weighted. The
+ * weights are rebuilt when the map's terrain epoch changes.
+ * 
+ * @param visualizer Visualizer owning the weights and random streams
+ * @param map Pointer to Map structure
+ * @param free_x Output for road X coordinate
+ * @param free_y Output for road Y coordinate
+ * @param sidewalk_x Output for adjacent sidewalk X
+ * @param sidewalk_y Output for adjacent sidewalk Y
+ * @return true if valid point found, false otherwise
+ */
+
+bool find_demand_point(Visualizer* visualizer, Map* map, int* free_x, int* free_y, int* sidewalk_x, int* sidewalk_y) {
+    CurbWeights* weights = &visualizer->curb_weights;
+    if (demand_hotspots <= 0 || !map || !map->grid.tiles ||
+        (weights->epoch != map->epoch && !curbWeightsBuild(weights, map, &visualizer->hotspot_rng, demand_hotspots))) {
+        return find_random_free_point_adjacent_to_sidewalk(map, &visualizer->spawn_rng, free_x, free_y, sidewalk_x, sidewalk_y);
+    }
+
+    uint64_t total = weights->cumulative[weights->count - 1];
+    for (int attempts = 0; attempts < MAX_ATTEMPTS; attempts++) {
+        uint64_t pick = rngNext(&visualizer->spawn_rng) % total;
+
+        // First curb whose running sum passes the pick
+        uint32_t low = 0, high = weights->count - 1;
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            if (weights->cumulative[mid] > pick) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+
+        uint32_t cell = map->curb_cells[low];
+        if (cell >= (uint32_t)map->rows * (uint32_t)map->cols) continue;
+        *free_x = cell % map->cols;
+        *free_y = cell / map->cols;
+        if (curbSidewalk(map, *free_x, *free_y, sidewalk_x, sidewalk_y)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Moves a trace point to the nearest free curb
+ * 
+ * Searches square rings of growing radius, up to TRIPS_SNAP_RADIUS cells,
+ * so a trace recorded on another street layout still lands on this map.
+ * 
+ * @param map Pointer to Map structure
+ * @param col In: X coordinate of the trace point; out: of the curb
+ * @param row In: Y coordinate of the trace point; out: of the curb
+ * @param sidewalk_x Output for adjacent sidewalk X
+ * @param sidewalk_y Output for adjacent sidewalk Y
+ * @return false if no free curb is that close
+ */
+
+bool snap_to_curb(Map* map, int* col, int* row, int* sidewalk_x, int* sidewalk_y) {
+    if (!map || !map->grid.tiles) return false;
+
+    for (int radius = 0; radius <= TRIPS_SNAP_RADIUS; radius++) {
+        for (int dy = -radius; dy <= radius; dy++) {
+            // Only the ring's border: the inside was searched at smaller radii
+            int step = (dy == -radius || dy == radius) ? 1 : MAX(2 * radius, 1);
+            for (int dx = -radius; dx <= radius; dx += step) {
+                int x = *col + dx, y = *row + dy;
+                if (x < 0 || x >= map->cols || y < 0 || y >= map->rows) continue;
+                if (curbSidewalk(map, x, y, sidewalk_x, sidewalk_y)) {
+                    *col = x;
+                    *row = y;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// -------------------- CITY FILE FUNCTIONS --------------------
+
+// Terrain under a cell: passengers and their destinations stand on sidewalks, everything else on road
+static int terrainValue(int value) {
+    return (value == SIDEWALK || (value >= R_PASSENGER && value < R_PASSENGER_DEST + 100)) ? SIDEWALK : ROAD;
+}
+
+/**
+ * Releases the squares and road indexes of a map
+ * 
+ * Generated maps own them; for a loaded city they point into the file
+ * mapping, which freeMap() unmaps separately.
+ * 
+ * @param map Pointer to Map structure
+ */
+
+static void mapReleaseIndex(Map* map) {
+    if (!map->index_mapped) {
+        free(map->squares);
+        free(map->road_cells);
+        free(map->curb_cells);
+        free(map->road_component);
+    }
+    map->squares = NULL;
+    map->num_squares = 0;
+    map->road_cells = NULL;
+    map->num_road_cells = 0;
+    map->curb_cells = NULL;
+    map->num_curb_cells = 0;
+    map->road_component = NULL;
+    map->num_components = 0;
+    map->index_mapped = false;
+}
+
+// Union-find root over road cell positions, with path halving
+static uint32_t roadComponentRoot(uint32_t* parent, uint32_t i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Joins two road cell sets; the smaller position stays root so labels follow scan order
+static void roadComponentUnion(uint32_t* parent, uint32_t a, uint32_t b) {
+    uint32_t ra = roadComponentRoot(parent, a);
+    uint32_t rb = roadComponentRoot(parent, b);
+    if (ra < rb) parent[rb] = ra;
+    else if (rb < ra) parent[ra] = rb;
+}
+
+/**
+ * Builds the road indexes of a freshly generated map
+ * 
+ * Computes, from the terrain alone:
+ * - road_cells: every road cell in row-major order
+ * - curb_cells: road cells with a sidewalk neighbour
+ * - road_component: 4-connected component labels, numbered in scan order
+ * Components use union-find over road positions, joining each cell with
+ * its left neighbour and, through a second cursor one row behind, with
+ * the cell above, so no per-cell scratch grid is needed.
+ * 
+ * @param map Pointer to Map structure (indexes must have been released)
+ * @return true if the indexes were built, false on allocation failure
+ *         or maps too large for 32-bit cell indices
+ */
+
+static bool mapBuildIndex(Map* map) {
+    if ((unsigned long long)map->rows * map->cols > UINT32_MAX) return false;
+
+    const TileGrid* grid = &map->grid;
+    uint32_t rows = map->rows, cols = map->cols;
+    uint32_t num_roads = 0, num_curbs = 0;
+    for (uint32_t row = 0; row < rows; row++) {
+        for (int tile_col = 0; tile_col < grid->tile_cols; tile_col++) {
+            if (tileIsSidewalk(grid, row >> MAP_TILE_SHIFT, tile_col)) continue;
+
+            const int* cells = tileRun(grid, tile_col, row);
+            int width = MIN(MAP_TILE_SIZE, (int)cols - tile_col * MAP_TILE_SIZE);
+            for (int i = 0; i < width; i++) {
+                if (terrainValue(cells[i]) == ROAD) num_roads++;
+            }
+        }
+    }
+
+    uint32_t* roads = malloc(MAX(num_roads, 1) * sizeof(uint32_t));
+    uint32_t* curbs = malloc(MAX(num_roads, 1) * sizeof(uint32_t));
+    uint32_t* component = malloc(MAX(num_roads, 1) * sizeof(uint32_t));
+    uint32_t* parent = malloc(MAX(num_roads, 1) * sizeof(uint32_t));
+    if (!roads || !curbs || !component || !parent) {
+        free(roads);
+        free(curbs);
+        free(component);
+        free(parent);
+        return false;
+    }
+
+    uint32_t n = 0, above = 0;
+    for (uint32_t row = 0; row < rows; row++) {
+        for (uint32_t col = 0; col < cols; col++) {
+            // Whole sidewalk tiles hold no road
+            if ((col & MAP_TILE_MASK) == 0 && tileIsSidewalk(grid, row >> MAP_TILE_SHIFT, col >> MAP_TILE_SHIFT)) {
+                col |= MAP_TILE_MASK;
+                continue;
+            }
+            if (terrainValue(tileGet(grid, col, row)) != ROAD) continue;
+
+            uint32_t cell = row * cols + col;
+            roads[n] = cell;
+            parent[n] = n;
+
+            if (col > 0 && n > 0 && roads[n - 1] == cell - 1) {
+                roadComponentUnion(parent, n, n - 1);
+            }
+            if (row > 0) {
+                while (roads[above] < cell - cols) above++;
+                if (roads[above] == cell - cols) roadComponentUnion(parent, n, above);
+            }
+
+            bool curb = (row > 0 && terrainValue(tileGet(grid, col, row - 1)) == SIDEWALK) ||
+                        (row + 1 < rows && terrainValue(tileGet(grid, col, row + 1)) == SIDEWALK) ||
+                        (col > 0 && terrainValue(tileGet(grid, col - 1, row)) == SIDEWALK) ||
+                        (col + 1 < cols && terrainValue(tileGet(grid, col + 1, row)) == SIDEWALK);
+            if (curb) curbs[num_curbs++] = cell;
+            n++;
+        }
+    }
+
+    // Roots are the first cell of their component, so one pass numbers them
+    uint32_t num_components = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t root = roadComponentRoot(parent, i);
+        component[i] = (root == i) ? ++num_components : component[root];
+    }
+    free(parent);
+
+    map->road_cells = roads;
+    map->num_road_cells = n;
+    map->curb_cells = curbs;
+    map->num_curb_cells = num_curbs;
+    map->road_component = component;
+    map->num_components = num_components;
+    map->index_mapped = false;
+    return true;
+}
+
+// Component label of a road cell, 0 when the cell is not indexed
+static uint32_t mapRoadComponent(const Map* map, int x, int y) {
+    if (x < 0 || y < 0 || x >= map->cols || y >= map->rows) return 0;
+
+    uint32_t cell = (uint32_t)y * map->cols + x;
+    uint32_t low = 0, high = map->num_road_cells;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (map->road_cells[mid] < cell) low = mid + 1;
+        else high = mid;
+    }
+    return (low < map->num_road_cells && map->road_cells[low] == cell) ? map->road_component[low] : 0;
+}
+
+/**
+ * Checks whether two road cells can reach each other
+ * 
+ * Uses the component index, so unreachable trips are rejected before any
+ * search runs. Maps without an index (or cells outside it) are assumed
+ * connected, which keeps the old behaviour.
+ * 
+ * @param map Pointer to Map structure
+ * @param x1, y1 First road cell
+ * @param x2, y2 Second road cell
+ * @return false only if the cells are known to be in different components
+ */
+
+bool mapSameComponent(const Map* map, int x1, int y1, int x2, int y2) {
+    if (!map || map->num_components <= 1) return true;
+
+    uint32_t a = mapRoadComponent(map, x1, y1);
+    uint32_t b = mapRoadComponent(map, x2, y2);
+    return a == 0 || b == 0 || a == b;
+}
+
+// Rounds a file offset up to the 8-byte section alignment
+static uint64_t cityAlign(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+// Pads a section of `bytes` bytes with zeros up to the next section
+static bool cityWritePadding(FILE* file, uint64_t bytes) {
+    static const char padding[8] = {0};
+    uint64_t pad = cityAlign(bytes) - bytes;
+    return pad == 0 || fwrite(padding, 1, pad, file) == pad;
+}
+
+// Writes one section and its padding
+static bool cityWriteSection(FILE* file, const void* data, uint64_t bytes) {
+    if (bytes > 0 && fwrite(data, 1, bytes, file) != bytes) return false;
+    return cityWritePadding(file, bytes);
+}
+
+/**
+ * Saves the map as a city file
+ * 
+ * Writes the terrain (runtime markers such as taxis and passengers are
+ * reduced to the road or sidewalk under them), the squares and the road
+ * indexes. Only tiles holding road are stored. The file is written next
+ * to the target and renamed over it, so a crash never leaves a truncated
+ * city behind.
+ * 
+ * @param map Pointer to Map structure
+ * @param path Destination file
+ * @return true on success, false on I/O failure
+ */
+
+bool mapSave(Map* map, const char* path) {
+    if (!map || !map->grid.tiles || !path) return false;
+
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) return false;
+
+    const TileGrid* grid = &map->grid;
+    size_t num_tiles = (size_t)grid->tile_rows * grid->tile_cols;
+    uint64_t tile_bytes = MAP_TILE_CELLS * sizeof(int32_t);
+    uint64_t* table = calloc(MAX(num_tiles, 1), sizeof(uint64_t));
+    int32_t* tile_buffer = malloc(tile_bytes);
+    if (!table || !tile_buffer) {
+        free(table);
+        free(tile_buffer);
+        return false;
+    }
+
+    CityFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CITY_FILE_MAGIC, sizeof(header.magic));
+    header.version = CITY_FILE_VERSION;
+    header.header_bytes = sizeof(CityFileHeader);
+    header.endian = CITY_FILE_ENDIAN;
+    header.rows = map->rows;
+    header.cols = map->cols;
+    header.road_width = map->road_width;
+    header.num_squares = map->num_squares;
+    header.num_road_cells = map->num_road_cells;
+    header.num_curb_cells = map->num_curb_cells;
+    header.num_components = map->num_components;
+    header.tile_size = MAP_TILE_SIZE;
+    header.tile_table_offset = cityAlign(sizeof(CityFileHeader));
+    header.tiles_offset = header.tile_table_offset + cityAlign(num_tiles * sizeof(uint64_t));
+
+    // Store only the tiles with some road under the runtime markers
+    for (size_t t = 0; t < num_tiles; t++) {
+        const int* cells = grid->tiles[t];
+        if (cells == sidewalk_tile) continue;
+
+        for (int i = 0; i < MAP_TILE_CELLS; i++) {
+            if (terrainValue(cells[i]) == ROAD) {
+                table[t] = header.tiles_offset + header.num_stored_tiles++ * tile_bytes;
+                break;
+            }
+        }
+    }
+
+    header.squares_offset = header.tiles_offset + header.num_stored_tiles * tile_bytes;
+    header.roads_offset = header.squares_offset + cityAlign((uint64_t)map->num_squares * sizeof(Square));
+    header.curbs_offset = header.roads_offset + cityAlign((uint64_t)map->num_road_cells * sizeof(uint32_t));
+    header.components_offset = header.curbs_offset + cityAlign((uint64_t)map->num_curb_cells * sizeof(uint32_t));
+    header.file_bytes = header.components_offset + cityAlign((uint64_t)map->num_road_cells * sizeof(uint32_t));
+
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) {
+        free(table);
+        free(tile_buffer);
+        return false;
+    }
+
+    bool ok = cityWriteSection(file, &header, sizeof(header));
+    ok = ok && cityWriteSection(file, table, num_tiles * sizeof(uint64_t));
+    for (size_t t = 0; ok && t < num_tiles; t++) {
+        if (table[t] == 0) continue;
+        for (int i = 0; i < MAP_TILE_CELLS; i++) {
+            tile_buffer[i] = terrainValue(grid->tiles[t][i]);
+        }
+        ok = cityWriteSection(file, tile_buffer, tile_bytes);
+    }
+    ok = ok && cityWriteSection(file, map->squares, (uint64_t)map->num_squares * sizeof(Square));
+    ok = ok && cityWriteSection(file, map->road_cells, (uint64_t)map->num_road_cells * sizeof(uint32_t));
+    ok = ok && cityWriteSection(file, map->curb_cells, (uint64_t)map->num_curb_cells * sizeof(uint32_t));
+    ok = ok && cityWriteSection(file, map->road_component, (uint64_t)map->num_road_cells * sizeof(uint32_t));
+
+    free(table);
+    free(tile_buffer);
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
+
+// Checks that `count` records of `size` bytes at `offset` lie inside the file
+static bool citySectionValid(const CityFileHeader* header, uint64_t offset, uint64_t count, uint64_t size) {
+    if (offset % 8 != 0 || offset < header->header_bytes || offset > header->file_bytes) return false;
+    return count <= (header->file_bytes - offset) / size;
+}
+
+/**
+ * Loads a city file saved by mapSave()
+ * 
+ * The file is mapped privately (copy-on-write) and used in place: stored
+ * tiles, squares and road indexes all point into the mapping, so loading
+ * costs a header check and a tile table pass, whatever the city size.
+ * Cells written at runtime get private copies and never reach the file.
+ * The header, version, section bounds and tile offsets are validated; the
+ * cells themselves are trusted to hold terrain as written by mapSave().
+ * 
+ * @param path City file to load
+ * @return New Map, or NULL if the file is missing, truncated or from
+ *         another format version
+ */
+
+Map* mapLoad(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CityFileHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    void* mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    const CityFileHeader* header = (const CityFileHeader*)mapping;
+    uint64_t cells = (uint64_t)(header->rows > 0 ? header->rows : 0) * (uint64_t)(header->cols > 0 ? header->cols : 0);
+    uint64_t num_tiles = (uint64_t)((header->rows > 0 ? header->rows : 0) + MAP_TILE_MASK) / MAP_TILE_SIZE *
+                         (((header->cols > 0 ? header->cols : 0) + MAP_TILE_MASK) / MAP_TILE_SIZE);
+    uint64_t tile_bytes = MAP_TILE_CELLS * sizeof(int32_t);
+    bool valid = memcmp(header->magic, CITY_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == CITY_FILE_VERSION &&
+                 header->endian == CITY_FILE_ENDIAN &&
+                 header->header_bytes == sizeof(CityFileHeader) &&
+                 header->file_bytes == (uint64_t)st.st_size &&
+                 header->rows > 0 && header->cols > 0 && cells <= UINT32_MAX &&
+                 header->num_squares >= 0 &&
+                 header->num_road_cells <= cells && header->num_curb_cells <= header->num_road_cells &&
+                 header->tile_size == MAP_TILE_SIZE &&
+                 citySectionValid(header, header->tile_table_offset, num_tiles, sizeof(uint64_t)) &&
+                 citySectionValid(header, header->tiles_offset, header->num_stored_tiles, tile_bytes) &&
+                 citySectionValid(header, header->squares_offset, header->num_squares, sizeof(Square)) &&
+                 citySectionValid(header, header->roads_offset, header->num_road_cells, sizeof(uint32_t)) &&
+                 citySectionValid(header, header->curbs_offset, header->num_curb_cells, sizeof(uint32_t)) &&
+                 citySectionValid(header, header->components_offset, header->num_road_cells, sizeof(uint32_t));
+
+    // Every stored tile must start on a tile boundary inside the tiles section
+    char* base = (char*)mapping;
+    const uint64_t* table = valid ? (const uint64_t*)(base + header->tile_table_offset) : NULL;
+    uint64_t tiles_end = valid ? header->tiles_offset + header->num_stored_tiles * tile_bytes : 0;
+    for (uint64_t t = 0; valid && t < num_tiles; t++) {
+        valid = table[t] == 0 ||
+                (table[t] >= header->tiles_offset && table[t] < tiles_end &&
+                 (table[t] - header->tiles_offset) % tile_bytes == 0);
+    }
+
+    Map* map = valid ? malloc(sizeof(Map)) : NULL;
+    if (map) {
+        mapInitFields(map, header->rows, header->cols);
+        if (!tileGridInit(&map->grid, map->rows, map->cols)) {
+            free(map);
+            map = NULL;
+        }
+    }
+    if (!map) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    map->road_width = header->road_width;
+    map->grid.mapped_begin = base;
+    map->grid.mapped_end = base + st.st_size;
+    for (uint64_t t = 0; t < num_tiles; t++) {
+        if (table[t] == 0) continue;
+        map->grid.tiles[t] = (int*)(base + table[t]);
+        map->grid.materialised++;
+    }
+
+    map->squares = (Square*)(base + header->squares_offset);
+    map->num_squares = header->num_squares;
+    map->road_cells = (uint32_t*)(base + header->roads_offset);
+    map->num_road_cells = header->num_road_cells;
+    map->curb_cells = (uint32_t*)(base + header->curbs_offset);
+    map->num_curb_cells = header->num_curb_cells;
+    map->road_component = (uint32_t*)(base + header->components_offset);
+    map->num_components = header->num_components;
+    map->index_mapped = true;
+    map->mapping = mapping;
+    map->mapping_bytes = st.st_size;
+    return map;
+}
+
+// -------------------- BITBOARD BFS FUNCTIONS --------------------
+
+/**
+ * Allocates a zeroed bitboard for a rows x cols grid
+ * 
+ * @param rows Number of rows
+ * @param cols Number of columns
+ * @return Pointer to new Bitboard, or NULL on allocation failure
+ */
+
+Bitboard* bitboardCreate(int rows, int cols) {
+    Bitboard* board = malloc(sizeof(Bitboard));
+    if (!board) return NULL;
+
+    board->rows = rows;
+    board->cols = cols;
+    board->words = ((cols + 63) / 64 + 3) & ~3;
+    board->stride = board->words + 2;
+    board->data = calloc((size_t)(rows + 2) * board->stride, sizeof(uint64_t));
+    route_stats.allocations += 2;
+    if (!board->data) {
+        free(board);
+        return NULL;
+    }
+    return board;
+}
+
+void bitboardFree(Bitboard* board) {
+    if (!board) return;
+    free(board->data);
+    free(board);
+}
+
+void bitboardClear(Bitboard* board) {
+    memset(board->data, 0, (size_t)(board->rows + 2) * board->stride * sizeof(uint64_t));
+}
+
+// Returns the first payload word of a row (row -1 and row rows are the guard rows)
+static inline uint64_t* bitboardRow(const Bitboard* board, int row) {
+    return board->data + (size_t)(row + 1) * board->stride + 1;
+}
+
+static inline void bitboardSet(Bitboard* board, int col, int row) {
+    bitboardRow(board, row)[col >> 6] |= (uint64_t)1 << (col & 63);
+}
+
+static inline bool bitboardTest(const Bitboard* board, int col, int row) {
+    return (bitboardRow(board, row)[col >> 6] >> (col & 63)) & 1;
+}
+
+/**
+ * Loads cells whose value lies in [low, high) from the map grid
+ * 
+ * A tile is exactly one bitboard word wide, so each tile row becomes one
+ * word; sidewalk sentinel tiles are filled without reading any cells.
+ * 
+ * @param board Bitboard to overwrite (must match the grid dimensions)
+ * @param maze The map grid
+ * @param low Inclusive lower bound of accepted cell values
+ * @param high Exclusive upper bound of accepted cell values
+ */
+
+void bitboardFromMatrix(Bitboard* board, const TileGrid* maze, int low, int high) {
+    bool sidewalk_in_range = SIDEWALK >= low && SIDEWALK < high;
+
+    for (int row = 0; row < board->rows; row++) {
+        uint64_t* bits = bitboardRow(board, row);
+        memset(bits, 0, board->words * sizeof(uint64_t));
+
+        for (int tile_col = 0; tile_col < maze->tile_cols; tile_col++) {
+            int width = MIN(MAP_TILE_SIZE, board->cols - tile_col * MAP_TILE_SIZE);
+            uint64_t valid = (width == 64) ? ~(uint64_t)0 : (((uint64_t)1 << width) - 1);
+
+            if (tileIsSidewalk(maze, row >> MAP_TILE_SHIFT, tile_col)) {
+                bits[tile_col] = sidewalk_in_range ? valid : 0;
+                continue;
+            }
+
+            const int* cells = tileRun(maze, tile_col, row);
+            uint64_t word = 0;
+            for (int i = 0; i < width; i++) {
+                word |= (uint64_t)(cells[i] >= low && cells[i] < high) << i;
+            }
+            bits[tile_col] = word;
+        }
+    }
+}
+
+// Offset of the word holding a cell in the board data (guard rows and words included)
+static inline int bitboardOffset(const Bitboard* board, int col, int row) {
+    return (row + 1) * board->stride + 1 + (col >> 6);
+}
+
+// BFS layer of a visited cell (dist has 64 slots per board word)
+static inline int bitbfsDist(const BitBFS* bfs, int col, int row) {
+    return bfs->dist[(size_t)bitboardOffset(bfs->visited, col, row) * 64 + (col & 63)];
+}
+
+// Converts a board word offset and a bit in it back to cell coordinates
+static inline void bitbfsLocate(const BitBFS* bfs, int offset, uint64_t bits, int* col, int* row) {
+    int stride = bfs->passable->stride;
+    if (col) *col = (offset % stride - 1) * 64 + __builtin_ctzll(bits);
+    if (row) *row = offset / stride - 1;
+}
+
+/**
+ * Creates a BFS context sized for a rows x cols map
+ * 
+ * @param rows Number of map rows
+ * @param cols Number of map columns
+ * @return Pointer to new BitBFS, or NULL on allocation failure
+ */
+
+BitBFS* bitbfsCreate(int rows, int cols) {
+    BitBFS* bfs = calloc(1, sizeof(BitBFS));
+    if (!bfs) return NULL;
+
+    bfs->passable = bitboardCreate(rows, cols);
+    bfs->targets = bitboardCreate(rows, cols);
+    bfs->visited = bitboardCreate(rows, cols);
+    bfs->frontier = bitboardCreate(rows, cols);
+    bfs->next = bitboardCreate(rows, cols);
+    if (!bfs->passable || !bfs->targets || !bfs->visited || !bfs->frontier || !bfs->next) {
+        bitbfsFree(bfs);
+        return NULL;
+    }
+
+    // Every board word, guards included, can enter the frontier lists
+    size_t slots = (size_t)(rows + 2) * bfs->passable->stride;
+    bfs->dist = malloc(slots * 64 * sizeof(int));
+    bfs->active = malloc(slots * sizeof(int));
+    bfs->touched = malloc(slots * sizeof(int));
+    route_stats.allocations += 3;
+    if (!bfs->dist || !bfs->active || !bfs->touched) {
+        bitbfsFree(bfs);
+        return NULL;
+    }
+
+    bfs->target_low = bfs->target_high = 0;
+    bfs->pass_low = bfs->pass_high = 0;
+    bfs->num_active = 0;
+    bfs->visited_lo = INT_MAX;
+    bfs->visited_hi = -1;
+    return bfs;
+}
+
+void bitbfsFree(BitBFS* bfs) {
+    if (!bfs) return;
+    bitboardFree(bfs->passable);
+    bitboardFree(bfs->targets);
+    bitboardFree(bfs->visited);
+    bitboardFree(bfs->frontier);
+    bitboardFree(bfs->next);
+    free(bfs->dist);
+    free(bfs->active);
+    free(bfs->touched);
+    free(bfs);
+}
+
+/**
+ * Loads the passable and target boards from the map grid
+ * 
+ * Targets are the cells whose value lies in [target_low, target_high);
+ * passable cells are ROAD cells, the targets (as in findPath) and the cells
+ * whose value lies in [pass_low, pass_high). Pass an empty range to skip
+ * either.
+ * 
+ * @param bfs BFS context
+ * @param maze The map grid
+ * @param target_low Inclusive lower bound of target cell values
+ * @param target_high Exclusive upper bound of target cell values
+ * @param pass_low Inclusive lower bound of further passable cell values
+ * @param pass_high Exclusive upper bound of further passable cell values
+ */
+
+void bitbfsLoad(BitBFS* bfs, const TileGrid* maze, int target_low, int target_high, int pass_low, int pass_high) {
+    bitboardFromMatrix(bfs->targets, maze, target_low, target_high);
+    bitboardFromMatrix(bfs->passable, maze, ROAD, ROAD + 1);
+    bitboardFromMatrix(bfs->next, maze, pass_low, pass_high);
+    for (int row = 0; row < bfs->passable->rows; row++) {
+        uint64_t* p = bitboardRow(bfs->passable, row);
+        uint64_t* t = bitboardRow(bfs->targets, row);
+        uint64_t* extra = bitboardRow(bfs->next, row);
+        for (int i = 0; i < bfs->passable->words; i++) p[i] |= t[i] | extra[i];
+    }
+    bitboardClear(bfs->next);
+    bfs->target_low = target_low;
+    bfs->target_high = target_high;
+    bfs->pass_low = pass_low;
+    bfs->pass_high = pass_high;
+}
+
+// Keeps the loaded boards in step with a map write (see mapSetCell)
+void bitbfsSetCell(BitBFS* bfs, int col, int row, int value) {
+    int offset = bitboardOffset(bfs->passable, col, row);
+    uint64_t bit = (uint64_t)1 << (col & 63);
+    bool target = value >= bfs->target_low && value < bfs->target_high;
+    bool pass = value >= bfs->pass_low && value < bfs->pass_high;
+
+    if (target) bfs->targets->data[offset] |= bit;
+    else bfs->targets->data[offset] &= ~bit;
+    if (target || pass || value == ROAD) bfs->passable->data[offset] |= bit;
+    else bfs->passable->data[offset] &= ~bit;
+}
+
+// Adds a source cell at layer 0 to the current search
+void bitbfsAddSource(BitBFS* bfs, int col, int row) {
+    int offset = bitboardOffset(bfs->frontier, col, row);
+    uint64_t bit = (uint64_t)1 << (col & 63);
+
+    if (!bfs->frontier->data[offset]) {
+        bfs->active[bfs->num_active++] = offset;
+    }
+    bfs->frontier->data[offset] |= bit;
+    bfs->visited->data[offset] |= bit;
+    bfs->dist[(size_t)offset * 64 + (col & 63)] = 0;
+    bfs->visited_lo = MIN(bfs->visited_lo, offset);
+    bfs->visited_hi = MAX(bfs->visited_hi, offset);
+}
+
+/**
+ * Clears the search state and adds a source cell at layer 0
+ * 
+ * Only the words the previous search touched are cleared, so a context kept
+ * alive between searches costs nothing per query beyond the search itself.
+ * Call once per search, then bitbfsAddSource() for extra sources.
+ * Pass a negative col to start with no sources.
+ * 
+ * @param bfs BFS context
+ * @param col Source X coordinate
+ * @param row Source Y coordinate
+ */
+
+void bitbfsStart(BitBFS* bfs, int col, int row) {
+    if (bfs->visited_hi >= bfs->visited_lo) {
+        memset(bfs->visited->data + bfs->visited_lo, 0,
+               (size_t)(bfs->visited_hi - bfs->visited_lo + 1) * sizeof(uint64_t));
+    }
+    for (int i = 0; i < bfs->num_active; i++) {
+        bfs->frontier->data[bfs->active[i]] = 0;
+    }
+    bfs->num_active = 0;
+    bfs->visited_lo = INT_MAX;
+    bfs->visited_hi = -1;
+    bfs->layer = 0;
+    bfs->layer_limit = INT_MAX;
+    if (col >= 0 && row >= 0) {
+        bitbfsAddSource(bfs, col, row);
+    }
+}
+
+/**
+ * Expands one frontier row into the next layer
+ * 
+ * Computes (left | right | up | down) & passable & ~visited for a row,
+ * stores it into out and merges it into visited. Uses AVX2 or SSE2 when
+ * the compiler targets them, otherwise plain 64-bit words.
+ * 
+ * @return Non-zero if any new cell was reached in this row
+ */
+
+static uint64_t bitbfsExpandRow(const uint64_t* up, const uint64_t* cur, const uint64_t* down,
+                                const uint64_t* passable, uint64_t* visited, uint64_t* out, int words) {
+    uint64_t any = 0;
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < words; i += 4) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(cur + i));
+        __m256i l = _mm256_loadu_si256((const __m256i*)(cur + i - 1));
+        __m256i r = _mm256_loadu_si256((const __m256i*)(cur + i + 1));
+        __m256i reach = _mm256_or_si256(_mm256_slli_epi64(c, 1), _mm256_srli_epi64(l, 63));
+        reach = _mm256_or_si256(reach, _mm256_or_si256(_mm256_srli_epi64(c, 1), _mm256_slli_epi64(r, 63)));
+        reach = _mm256_or_si256(reach, _mm256_loadu_si256((const __m256i*)(up + i)));
+        reach = _mm256_or_si256(reach, _mm256_loadu_si256((const __m256i*)(down + i)));
+        __m256i v = _mm256_loadu_si256((const __m256i*)(visited + i));
+        reach = _mm256_andnot_si256(v, _mm256_and_si256(reach, _mm256_loadu_si256((const __m256i*)(passable + i))));
+        _mm256_storeu_si256((__m256i*)(out + i), reach);
+        _mm256_storeu_si256((__m256i*)(visited + i), _mm256_or_si256(v, reach));
+        acc = _mm256_or_si256(acc, reach);
+    }
+    any = !_mm256_testz_si256(acc, acc);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < words; i += 2) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(cur + i));
+        __m128i l = _mm_loadu_si128((const __m128i*)(cur + i - 1));
+        __m128i r = _mm_loadu_si128((const __m128i*)(cur + i + 1));
+        __m128i reach = _mm_or_si128(_mm_slli_epi64(c, 1), _mm_srli_epi64(l, 63));
+        reach = _mm_or_si128(reach, _mm_or_si128(_mm_srli_epi64(c, 1), _mm_slli_epi64(r, 63)));
+        reach = _mm_or_si128(reach, _mm_loadu_si128((const __m128i*)(up + i)));
+        reach = _mm_or_si128(reach, _mm_loadu_si128((const __m128i*)(down + i)));
+        __m128i v = _mm_loadu_si128((const __m128i*)(visited + i));
+        reach = _mm_andnot_si128(v, _mm_and_si128(reach, _mm_loadu_si128((const __m128i*)(passable + i))));
+        _mm_storeu_si128((__m128i*)(out + i), reach);
+        _mm_storeu_si128((__m128i*)(visited + i), _mm_or_si128(v, reach));
+        acc = _mm_or_si128(acc, reach);
+    }
+    any = _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF;
+#else
+    for (int i = 0; i < words; i++) {
+        uint64_t reach = (cur[i] << 1) | (cur[i - 1] >> 63) |
+                         (cur[i] >> 1) | (cur[i + 1] << 63) |
+                         up[i] | down[i];
+        reach &= passable[i] & ~visited[i];
+        out[i] = reach;
+        visited[i] |= reach;
+        any |= reach;
+    }
+#endif
+    return any;
+}
+
+// Ors bits into a word of the next layer, listing the word the first time it turns non-zero
+static inline void bitbfsScatter(uint64_t* next, int offset, uint64_t bits, int* touched, int* num_touched) {
+    if (!bits) return;
+    if (!next[offset]) touched[(*num_touched)++] = offset;
+    next[offset] |= bits;
+}
+
+/**
+ * Runs the bit-parallel BFS from the seeded sources
+ * 
+ * Only the words listed in the active frontier are expanded per layer:
+ * 1. Each frontier word pushes its bits left/right and into the words
+ *    above/below, masked with passable and unvisited cells
+ * 2. A layer whose frontier covers at least 1/BITBFS_DENSE_SHARE of its
+ *    row band runs the whole band through the SIMD row kernel instead
+ * 3. The layer number of every newly reached cell is recorded in dist
+ * 4. The search stops early when stop_at_target is set and a target bit is
+ *    reached, or after layer_limit
+ * 
+ * A stopped search can be resumed by calling bitbfsRun again. Guard words
+ * are never passable, so the scatter needs no bounds checks.
+ * 
+ * @param bfs BFS context (passable, targets and sources already loaded)
+ * @param stop_at_target Stop at the first layer that touches a target cell
+ * @param hit_col Output for the reached target X coordinate (may be NULL)
+ * @param hit_row Output for the reached target Y coordinate (may be NULL)
+ * @return true if a target was reached, false if the search was exhausted
+ */
+
+bool bitbfsRun(BitBFS* bfs, bool stop_at_target, int* hit_col, int* hit_row) {
+    int rows = bfs->passable->rows;
+    int words = bfs->passable->words;
+    int stride = bfs->passable->stride;
+    const uint64_t* passable = bfs->passable->data;
+    const uint64_t* targets = bfs->targets->data;
+    uint64_t* visited = bfs->visited->data;
+    long long span = traceStart();
+    PerfSample perf;
+    perfBegin(&perf);
+
+    // A source may already be a target
+    if (stop_at_target) {
+        for (int i = 0; i < bfs->num_active; i++) {
+            int offset = bfs->active[i];
+            uint64_t hit = bfs->frontier->data[offset] & targets[offset];
+            if (hit) {
+                bitbfsLocate(bfs, offset, hit, hit_col, hit_row);
+                perfEnd(PERF_REGION_BFS, &perf);
+                traceSpan("route", "bitbfsRun", span);
+                return true;
+            }
+        }
+    }
+
+    while (bfs->num_active > 0 && bfs->layer < bfs->layer_limit) {
+        int layer = ++bfs->layer;
+        uint64_t* frontier = bfs->frontier->data;
+        uint64_t* next = bfs->next->data;
+        int* touched = bfs->touched;
+        int num_touched = 0;
+        bool found = false;
+
+        int first = INT_MAX, last = -1;
+        for (int a = 0; a < bfs->num_active; a++) {
+            first = MIN(first, bfs->active[a]);
+            last = MAX(last, bfs->active[a]);
+        }
+        int first_row = MAX(first / stride - 2, 0);
+        int last_row = MIN(last / stride, rows - 1);
+
+        if ((long)bfs->num_active * BITBFS_DENSE_SHARE >= (long)(last_row - first_row + 1) * words) {
+            for (int row = first_row; row <= last_row; row++) {
+                uint64_t* out = bitboardRow(bfs->next, row);
+                if (!bitbfsExpandRow(bitboardRow(bfs->frontier, row - 1), bitboardRow(bfs->frontier, row),
+                                     bitboardRow(bfs->frontier, row + 1), bitboardRow(bfs->passable, row),
+                                     bitboardRow(bfs->visited, row), out, words)) {
+                    continue;
+                }
+                int base = (row + 1) * stride + 1;
+                for (int i = 0; i < words; i++) {
+                    if (out[i]) touched[num_touched++] = base + i;
+                }
+            }
+        } else {
+            for (int a = 0; a < bfs->num_active; a++) {
+                int offset = bfs->active[a];
+                uint64_t f = frontier[offset];
+                int neighbours[5] = {offset, offset - 1, offset + 1, offset - stride, offset + stride};
+                uint64_t reach[5] = {(f << 1) | (f >> 1), f << 63, f >> 63, f, f};
+                for (int n = 0; n < 5; n++) {
+                    int o = neighbours[n];
+                    bitbfsScatter(next, o, reach[n] & passable[o] & ~visited[o], touched, &num_touched);
+                }
+            }
+        }
+
+        // Record distance layers for backtracking
+        for (int t = 0; t < num_touched; t++) {
+            int offset = touched[t];
+            uint64_t w = next[offset];
+            visited[offset] |= w;
+            bfs->visited_lo = MIN(bfs->visited_lo, offset);
+            bfs->visited_hi = MAX(bfs->visited_hi, offset);
+            if (stop_at_target && !found && (w & targets[offset])) {
+                found = true;
+                bitbfsLocate(bfs, offset, w & targets[offset], hit_col, hit_row);
+            }
+            route_stats.expanded += __builtin_popcountll(w);
+            int* slots = bfs->dist + (size_t)offset * 64;
+            while (w) {
+                slots[__builtin_ctzll(w)] = layer;
+                w &= w - 1;
+            }
+        }
+
+        // Clear the old frontier words (keeping next all-zero) and swap in the new layer
+        for (int a = 0; a < bfs->num_active; a++) {
+            frontier[bfs->active[a]] = 0;
+        }
+        Bitboard* swap = bfs->frontier;
+        bfs->frontier = bfs->next;
+        bfs->next = swap;
+        bfs->touched = bfs->active;
+        bfs->active = touched;
+        bfs->num_active = num_touched;
+
+        if (found) {
+            perfEnd(PERF_REGION_BFS, &perf);
+            traceSpan("route", "bitbfsRun", span);
+            return true;
+        }
+    }
+    perfEnd(PERF_REGION_BFS, &perf);
+    traceSpan("route", "bitbfsRun", span);
+    return false;
+}
+
+/**
+ * Reconstructs a shortest path from the sources to a reached cell
+ * 
+ * Walks the recorded distance layers downhill from (col, row) to layer 0
+ * and writes the path in source -> cell order.
+ * 
+ * @param bfs BFS context after bitbfsRun()
+ * @param col Reached X coordinate
+ * @param row Reached Y coordinate
+ * @param path Output path (dist + 1 cells)
+ * @return Path length in cells, or -1 if the path could not be stored
+ */
+
+int bitbfsBacktrack(const BitBFS* bfs, int col, int row, PathData* path) {
+    int cols = bfs->passable->cols;
+    int rows = bfs->passable->rows;
+    int d = bitbfsDist(bfs, col, row);
+
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+
+    pathClear(path);
+    bool stored = pathAppendCell(path, col, row);
+    while (stored && d > 0) {
+        for (int i = 0; i < 4; i++) {
+            int new_col = col + delta_col[i];
+            int new_row = row + delta_row[i];
+            if (new_col < 0 || new_col >= cols || new_row < 0 || new_row >= rows) {
+                continue;
+            }
+            if (bitboardTest(bfs->visited, new_col, new_row) && bitbfsDist(bfs, new_col, new_row) == d - 1) {
+                col = new_col;
+                row = new_row;
+                break;
+            }
+        }
+        d--;
+        stored = pathAppendCell(path, col, row);
+    }
+    pathReverse(path);
+    return stored ? path->tamanho_solucao : -1;
+}
+
+/**
+ * Bitboard equivalent of findPath for large maps
+ * 
+ * Same contract as findPath: searches from the start cell through ROAD
+ * cells for the nearest cell whose value lies in [destination, destination + 100)
+ * and writes the path in start -> destination order. The boards live in
+ * map->bitbfs, created on the first search and kept in step by mapSetCell,
+ * so a query only pays for the words its frontier reaches.
+ * 
+ * @param map The map (its bitbfs is created or reloaded as needed)
+ * @param start_col Start X coordinate
+ * @param start_row Start Y coordinate
+ * @param path Output path
+ * @param destination Base value of the target cell range
+ * @return 0 on success, 1 if no path found
+ */
+
+int findPathBitboard(Map* map, int start_col, int start_row, PathData* path, int destination) {
+    if (!map->bitbfs) {
+        map->bitbfs = bitbfsCreate(map->rows, map->cols);
+        if (!map->bitbfs) return 1;
+        bitbfsLoad(map->bitbfs, &map->grid, destination, destination + 100, 0, 0);
+    } else if (map->bitbfs->target_low != destination) {
+        bitbfsLoad(map->bitbfs, &map->grid, destination, destination + 100, 0, 0);
+    }
+    BitBFS* bfs = map->bitbfs;
+
+    bitbfsStart(bfs, start_col, start_row);
+
+    int hit_col, hit_row;
+    if (!bitbfsRun(bfs, true, &hit_col, &hit_row)) {
+        return 1;
+    }
+    return bitbfsBacktrack(bfs, hit_col, hit_row, path) < 0 ? 1 : 0;
+}
+
+// -------------------- FREE TAXI DISTANCE FIELD --------------------
+
+#define FIELD_BLOCKED 0
+#define FIELD_ROAD 1
+#define FIELD_SOURCE 2
+
+// Classifies a matrix value for the free taxi field
+static unsigned char taxiFieldKind(int value) {
+    if (value == ROAD) return FIELD_ROAD;
+    if (value >= R_TAXI_FREE && value < R_TAXI_FREE + 100) return FIELD_SOURCE;
+    return FIELD_BLOCKED;
+}
+
+void taxiFieldFree(TaxiField* field) {
+    if (!field) return;
+    free(field->dist);
+    free(field->kind);
+    free(field->stack);
+    free(field->stack_dist);
+    free(field->invalid);
+    free(field->heap_keys);
+    free(field->heap_cells);
+    free(field);
+}
+
+/**
+ * Creates an empty free taxi distance field
+ * 
+ * @param rows Number of map rows
+ * @param cols Number of map columns
+ * @return Pointer to new TaxiField, or NULL on allocation failure
+ */
+
+TaxiField* taxiFieldCreate(int rows, int cols) {
+    TaxiField* field = calloc(1, sizeof(TaxiField));
+    if (!field) return NULL;
+
+    field->rows = rows;
+    field->cols = cols;
+    field->dist = malloc((size_t)rows * cols * sizeof(int));
+    field->kind = calloc((size_t)rows * cols, sizeof(unsigned char));
+    field->stack = malloc((size_t)rows * cols * sizeof(int));
+    field->stack_dist = malloc((size_t)rows * cols * sizeof(int));
+    field->invalid = malloc((size_t)rows * cols * sizeof(int));
+    field->heap_capacity = 256;
+    field->heap_keys = malloc(field->heap_capacity * sizeof(int));
+    field->heap_cells = malloc(field->heap_capacity * sizeof(int));
+
+    if (!field->dist || !field->kind || !field->stack || !field->stack_dist || !field->invalid ||
+        !field->heap_keys || !field->heap_cells) {
+        taxiFieldFree(field);
+        return NULL;
+    }
+    return field;
+}
+
+/**
+ * Rebuilds the whole field from the map grid
+ * 
+ * Seeds a multi-source bitboard BFS with every free taxi cell and expands
+ * it through ROAD cells. Used once per map; afterwards the field is kept
+ * up to date with taxiFieldUpdate().
+ * 
+ * @param field Field to rebuild
+ * @param maze The map grid
+ * @return false if the BFS cannot be allocated; every cell is then left
+ *         unreachable, so the caller must stop using the field
+ */
+
+bool taxiFieldBuild(TaxiField* field, const TileGrid* maze) {
+    int rows = field->rows, cols = field->cols;
+    BitBFS* bfs = bitbfsCreate(rows, cols);
+
+    for (int row = 0; row < rows; row++) {
+        for (int tile_col = 0; tile_col < maze->tile_cols; tile_col++) {
+            const int* cells = tileRun(maze, tile_col, row);
+            int first_col = tile_col * MAP_TILE_SIZE;
+            int last_col = MIN(first_col + MAP_TILE_SIZE, cols);
+            for (int col = first_col; col < last_col; col++) {
+                field->kind[(size_t)row * cols + col] = taxiFieldKind(cells[col - first_col]);
+                field->dist[(size_t)row * cols + col] = INT_MAX;
+            }
+        }
+    }
+    if (!bfs) return false;
+
+    bitboardFromMatrix(bfs->passable, maze, ROAD, ROAD + 1);
+    bitbfsStart(bfs, -1, -1);
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            if (field->kind[(size_t)row * cols + col] == FIELD_SOURCE) {
+                bitbfsAddSource(bfs, col, row);
+            }
+        }
+    }
+    bitbfsRun(bfs, false, NULL, NULL);
+
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            if (bitboardTest(bfs->visited, col, row)) {
+                field->dist[(size_t)row * cols + col] = bitbfsDist(bfs, col, row);
+            }
+        }
+    }
+    bitbfsFree(bfs);
+    return true;
+}
+
+// Pushes a (distance, cell) pair onto the field's min-heap
+static void taxiFieldPush(TaxiField* field, int key, int cell) {
+    if (field->heap_size == field->heap_capacity) {
+        field->heap_capacity *= 2;
+        field->heap_keys = realloc(field->heap_keys, field->heap_capacity * sizeof(int));
+        field->heap_cells = realloc(field->heap_cells, field->heap_capacity * sizeof(int));
+        route_stats.allocations += 2;
+    }
+    int i = field->heap_size++;
+    while (i > 0 && field->heap_keys[(i - 1) / 2] > key) {
+        field->heap_keys[i] = field->heap_keys[(i - 1) / 2];
+        field->heap_cells[i] = field->heap_cells[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    field->heap_keys[i] = key;
+    field->heap_cells[i] = cell;
+}
+
+// Pops the smallest (distance, cell) pair from the field's min-heap
+static void taxiFieldPop(TaxiField* field, int* key, int* cell) {
+    *key = field->heap_keys[0];
+    *cell = field->heap_cells[0];
+
+    int last_key = field->heap_keys[--field->heap_size];
+    int last_cell = field->heap_cells[field->heap_size];
+    int i = 0;
+    while (2 * i + 1 < field->heap_size) {
+        int child = 2 * i + 1;
+        if (child + 1 < field->heap_size && field->heap_keys[child + 1] < field->heap_keys[child]) {
+            child++;
+        }
+        if (field->heap_keys[child] >= last_key) break;
+        field->heap_keys[i] = field->heap_keys[child];
+        field->heap_cells[i] = field->heap_cells[child];
+        i = child;
+    }
+    field->heap_keys[i] = last_key;
+    field->heap_cells[i] = last_cell;
+}
+
+// Best distance a passable cell can get from its neighbours (INT_MAX if none)
+static int taxiFieldSupport(const TaxiField* field, int cell) {
+    int col = cell % field->cols, row = cell / field->cols;
+    int best = INT_MAX;
+
+    if (col > 0 && field->dist[cell - 1] < best) best = field->dist[cell - 1];
+    if (col < field->cols - 1 && field->dist[cell + 1] < best) best = field->dist[cell + 1];
+    if (row > 0 && field->dist[cell - field->cols] < best) best = field->dist[cell - field->cols];
+    if (row < field->rows - 1 && field->dist[cell + field->cols] < best) best = field->dist[cell + field->cols];
+
+    return best == INT_MAX ? INT_MAX : best + 1;
+}
+
+/**
+ * Applies a single cell change to the field incrementally
+ * 
+ * Repairs distances in two waves, touching only the affected region:
+ * 1. Raise: if the cell lost a source or became blocked, invalidate every
+ *    cell whose distance was only supported through it
+ * 2. Lower: re-seed the invalidated cells (and the changed cell) from
+ *    their valid neighbours and propagate decreases in distance order
+ * 
+ * @param field Field to update
+ * @param col X coordinate of the changed cell
+ * @param row Y coordinate of the changed cell
+ * @param value New matrix value of the cell
+ */
+
+void taxiFieldUpdate(TaxiField* field, int col, int row, int value) {
+    int cols = field->cols;
+    int cell = row * cols + col;
+    unsigned char old_kind = field->kind[cell];
+    unsigned char new_kind = taxiFieldKind(value);
+    if (old_kind == new_kind) return;
+
+    field->kind[cell] = new_kind;
+    int invalid = 0;
+
+    // Raise wave: cells are invalidated (set to INT_MAX) as they are pushed
+    if (old_kind == FIELD_SOURCE || new_kind == FIELD_BLOCKED) {
+        int top = 0;
+        if (field->dist[cell] != INT_MAX) {
+            field->stack[top] = cell;
+            field->stack_dist[top++] = field->dist[cell];
+            field->dist[cell] = INT_MAX;
+        }
+
+        while (top > 0) {
+            top--;
+            int u = field->stack[top];
+            int du = field->stack_dist[top];
+
+            int ucol = u % cols, urow = u / cols;
+            int neighbours[4] = {
+                ucol > 0 ? u - 1 : -1,
+                ucol < cols - 1 ? u + 1 : -1,
+                urow > 0 ? u - cols : -1,
+                urow < field->rows - 1 ? u + cols : -1
+            };
+            for (int i = 0; i < 4; i++) {
+                int v = neighbours[i];
+                if (v < 0 || field->kind[v] != FIELD_ROAD || field->dist[v] != du + 1) continue;
+                if (taxiFieldSupport(field, v) == field->dist[v]) continue;
+                field->stack[top] = v;
+                field->stack_dist[top++] = field->dist[v];
+                field->invalid[invalid++] = v;
+                field->dist[v] = INT_MAX;
+            }
+        }
+    }
+
+    // Lower wave
+    field->heap_size = 0;
+    if (new_kind == FIELD_SOURCE) {
+        field->dist[cell] = 0;
+        taxiFieldPush(field, 0, cell);
+    } else if (new_kind == FIELD_ROAD) {
+        field->dist[cell] = taxiFieldSupport(field, cell);
+        if (field->dist[cell] != INT_MAX) taxiFieldPush(field, field->dist[cell], cell);
+    }
+    for (int i = 0; i < invalid; i++) {
+        int v = field->invalid[i];
+        if (field->kind[v] != FIELD_ROAD) continue;
+        field->dist[v] = taxiFieldSupport(field, v);
+        if (field->dist[v] != INT_MAX) taxiFieldPush(field, field->dist[v], v);
+    }
+
+    while (field->heap_size > 0) {
+        int du, u;
+        taxiFieldPop(field, &du, &u);
+        if (du > field->dist[u]) continue;
+
+        int ucol = u % cols, urow = u / cols;
+        int neighbours[4] = {
+            ucol > 0 ? u - 1 : -1,
+            ucol < cols - 1 ? u + 1 : -1,
+            urow > 0 ? u - cols : -1,
+            urow < field->rows - 1 ? u + cols : -1
+        };
+        for (int i = 0; i < 4; i++) {
+            int v = neighbours[i];
+            if (v < 0 || field->kind[v] != FIELD_ROAD || field->dist[v] <= du + 1) continue;
+            field->dist[v] = du + 1;
+            taxiFieldPush(field, du + 1, v);
+        }
+    }
+}
+
+/**
+ * Finds the path from a cell to its nearest free taxi by walking the field
+ * 
+ * Same output as findPath(..., R_TAXI_FREE): the start cell itself need
+ * not be a road, the path runs start -> taxi and ends on a free taxi cell.
+ * Runs in O(path length) without flooding the map.
+ * 
+ * @param field Up-to-date free taxi field
+ * @param start_col Starting X coordinate
+ * @param start_row Starting Y coordinate
+ * @param path Output path (start -> taxi)
+ * @return 0 on success, 1 if no free taxi is reachable
+ */
+
+int taxiFieldNearest(const TaxiField* field, int start_col, int start_row, PathData* path) {
+    int cols = field->cols;
+    int cell = start_row * cols + start_col;
+
+    pathClear(path);
+    if (!pathAppendCell(path, start_col, start_row)) return 1;
+    if (field->kind[cell] == FIELD_SOURCE) {
+        return 0;
+    }
+
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+
+    // Step onto the neighbour closest to a taxi, then go downhill
+    int col = start_col, row = start_row;
+    int want = INT_MAX;
+    do {
+        int best_col = -1, best_row = -1, best = INT_MAX;
+        for (int i = 0; i < 4; i++) {
+            int new_col = col + delta_col[i];
+            int new_row = row + delta_row[i];
+            if (new_col < 0 || new_col >= cols || new_row < 0 || new_row >= field->rows) {
+                continue;
+            }
+            int d = field->dist[new_row * cols + new_col];
+            if (d < best && (want == INT_MAX || d == want)) {
+                best = d;
+                best_col = new_col;
+                best_row = new_row;
+            }
+        }
+        if (best == INT_MAX) return 1;
+
+        col = best_col;
+        row = best_row;
+        if (!pathAppendCell(path, col, row)) return 1;
+        route_stats.expanded++;
+        want = best - 1;
+    } while (want >= 0);
+
+    return 0;
+}
+
+// -------------------- ROUTE CACHE FUNCTIONS --------------------
+
+// Returns a monotonic timestamp in nanoseconds
+long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Creates an empty route cache
+ * 
+ * @return Pointer to new RouteCache, or NULL on allocation failure
+ */
+
+RouteCache* routeCacheCreate() {
+    RouteCache* cache = calloc(1, sizeof(RouteCache));
+    if (!cache) return NULL;
+
+    for (int i = 0; i < ROUTE_CACHE_BUCKETS; i++) {
+        cache->buckets[i] = -1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/**
+ * Drops every cached route
+ * 
+ * Called on RESET_MAP; statistics are kept so the report covers the whole run.
+ * 
+ * @param cache Route cache to clear
+ */
+
+void routeCacheClear(RouteCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < ROUTE_CACHE_SLOTS; i++) {
+        pathFree(cache->slots[i].path);
+        cache->slots[i].path = NULL;
+        cache->slots[i].used = false;
+    }
+    for (int i = 0; i < ROUTE_CACHE_BUCKETS; i++) {
+        cache->buckets[i] = -1;
+    }
+    cache->hand = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void routeCacheFree(RouteCache* cache) {
+    if (!cache) return;
+    routeCacheClear(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static unsigned int routeCacheBucket(int src_x, int src_y, int dst_x, int dst_y, unsigned long epoch) {
+    unsigned int h = 2166136261u;
+    int parts[5] = {src_x, src_y, dst_x, dst_y, (int)epoch};
+    for (int i = 0; i < 5; i++) {
+        h = (h ^ (unsigned int)parts[i]) * 16777619u;
+    }
+    return h % ROUTE_CACHE_BUCKETS;
+}
+
+// Unlinks a slot from its bucket chain and releases its path
+static void routeCacheEvict(RouteCache* cache, int slot) {
+    RouteCacheEntry* entry = &cache->slots[slot];
+    int* link = &cache->buckets[routeCacheBucket(entry->src_x, entry->src_y, entry->dst_x, entry->dst_y, entry->epoch)];
+    while (*link != slot) {
+        link = &cache->slots[*link].next;
+    }
+    *link = entry->next;
+    pathFree(entry->path);
+    entry->path = NULL;
+    entry->used = false;
+}
+
+/**
+ * Looks up a route and copies it into path
+ * 
+ * A cached route is only returned if its inner cells are still ROAD (or
+ * taxis, when taxis_passable is set), so a hit is always passable right
+ * now. It is not always shortest: taxis and passengers leaving cells do
+ * not start a new epoch, and the BFS may find a shorter route through them.
+ * 
+ * @param cache Route cache
+ * @param map Current map (provides the epoch and live cell values)
+ * @param path Output path
+ * @param taxis_passable Accept inner cells currently holding a taxi
+ * @return true on a valid hit, false otherwise
+ */
+
+static bool routeCacheLookup(RouteCache* cache, Map* map, int src_x, int src_y, int dst_x, int dst_y,
+                             PathData* path, bool taxis_passable) {
+    bool found = false;
+
+    pthread_mutex_lock(&cache->lock);
+    int slot = cache->buckets[routeCacheBucket(src_x, src_y, dst_x, dst_y, map->epoch)];
+    while (slot != -1) {
+        RouteCacheEntry* entry = &cache->slots[slot];
+        if (entry->epoch == map->epoch && entry->src_x == src_x && entry->src_y == src_y &&
+            entry->dst_x == dst_x && entry->dst_y == dst_y) {
+            break;
+        }
+        slot = entry->next;
+    }
+
+    if (slot != -1) {
+        RouteCacheEntry* entry = &cache->slots[slot];
+        PathCursor cursor;
+        int event, visited = 1;
+        found = true;
+
+        pathCursorInit(&cursor, entry->path);
+        while (pathCursorNext(&cursor, &event)) {
+            if (event != -1 || ++visited == entry->path->tamanho_solucao) continue;
+            int value = tileGet(&map->grid, cursor.col, cursor.row);
+            if (value != ROAD && !(taxis_passable && value >= R_TAXI_FREE && value < R_TAXI_OCCUPIED + 100)) {
+                found = false;
+                break;
+            }
+        }
+
+        if (found) {
+            entry->referenced = true;
+            found = pathCopy(path, entry->path);
+        } else {
+            cache->stale++;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+/**
+ * Stores a route, evicting with the CLOCK policy when the cache is full
+ * 
+ * Routes are kept in the run-length PathData encoding, so a cached route
+ * costs a few bytes per turn rather than per cell.
+ */
+
+static void routeCacheInsert(RouteCache* cache, unsigned long epoch, const PathData* route) {
+    if (route->tamanho_solucao <= 0) return;
+
+    PathData* copy = pathCreate();
+    if (!copy) return;
+    if (!pathCopy(copy, route)) {
+        pathFree(copy);
+        return;
+    }
+
+    int src_x = route->start_x, src_y = route->start_y;
+    int dst_x = route->end_x, dst_y = route->end_y;
+
+    pthread_mutex_lock(&cache->lock);
+
+    // Replace an existing entry for the same key (e.g. one found stale)
+    unsigned int bucket = routeCacheBucket(src_x, src_y, dst_x, dst_y, epoch);
+    for (int slot = cache->buckets[bucket]; slot != -1; slot = cache->slots[slot].next) {
+        RouteCacheEntry* entry = &cache->slots[slot];
+        if (entry->epoch == epoch && entry->src_x == src_x && entry->src_y == src_y &&
+            entry->dst_x == dst_x && entry->dst_y == dst_y) {
+            routeCacheEvict(cache, slot);
+            break;
+        }
+    }
+
+    // CLOCK: advance the hand, clearing reference bits, until a victim is found
+    while (cache->slots[cache->hand].used && cache->slots[cache->hand].referenced &&
+           cache->slots[cache->hand].epoch == epoch) {
+        cache->slots[cache->hand].referenced = false;
+        cache->hand = (cache->hand + 1) % ROUTE_CACHE_SLOTS;
+    }
+    int slot = cache->hand;
+    cache->hand = (cache->hand + 1) % ROUTE_CACHE_SLOTS;
+    if (cache->slots[slot].used) {
+        routeCacheEvict(cache, slot);
+    }
+
+    RouteCacheEntry* entry = &cache->slots[slot];
+    entry->src_x = src_x;
+    entry->src_y = src_y;
+    entry->dst_x = dst_x;
+    entry->dst_y = dst_y;
+    entry->epoch = epoch;
+    entry->path = copy;
+    entry->referenced = false;
+    entry->used = true;
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = slot;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Cached front end for findPathCoordinates
+ * 
+ * Same contract as findPathCoordinates, keyed on (start, destination, map
+ * epoch), except that a hit may be longer than a fresh BFS once cells have
+ * been freed within the epoch (see routeCacheLookup). Misses run the BFS
+ * and store the result; hit and miss latencies are accumulated for the
+ * status report.
+ * 
+ * @param cache Route cache (NULL runs the BFS directly)
+ * @param map Current map
+ * @param path Output path (start -> destination)
+ * @return 0 on success, 1 if no path found
+ */
+
+int findPathCoordinatesCached(RouteCache* cache, Map* map, int start_col, int start_row, int dest_col, int dest_row,
+                              PathData* path) {
+    if (!cache) {
+        return findPathCoordinates(start_col, start_row, dest_col, dest_row, &map->grid, map->cols, map->rows, path);
+    }
+
+    long long started = monotonic_ns();
+    if (routeCacheLookup(cache, map, start_col, start_row, dest_col, dest_row, path, false)) {
+        pthread_mutex_lock(&cache->lock);
+        cache->hits++;
+        cache->hit_ns += monotonic_ns() - started;
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    int result = findPathCoordinates(start_col, start_row, dest_col, dest_row, &map->grid, map->cols, map->rows, path);
+    if (result == 0) {
+        routeCacheInsert(cache, map->epoch, path);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->misses++;
+    cache->miss_ns += monotonic_ns() - started;
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+/**
+ * Prints route cache hit rate and estimated latency savings
+ * 
+ * @param cache Route cache to report on
+ */
+
+void print_route_cache(RouteCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+
+    unsigned long lookups = cache->hits + cache->misses;
+    double hit_rate = lookups ? 100.0 * cache->hits / lookups : 0.0;
+    double avg_hit_us = cache->hits ? cache->hit_ns / 1000.0 / cache->hits : 0.0;
+    double avg_miss_us = cache->misses ? cache->miss_ns / 1000.0 / cache->misses : 0.0;
+    double saved_ms = cache->hits * (avg_miss_us - avg_hit_us) / 1000.0;
+
+    printf("Route cache: %lu hits / %lu misses (%.1f%%), %lu stale\n", cache->hits, cache->misses, hit_rate, cache->stale);
+    printf("Hit %.1f us, miss %.1f us, saved %.1f ms\n", avg_hit_us, avg_miss_us, saved_ms > 0 ? saved_ms : 0.0);
+    printf("---------------------------------------\n");
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// -------------------- CONGESTION FUNCTIONS --------------------
+
+/**
+ * Creates an empty congestion map (every road cell at unit cost)
+ * 
+ * @param rows Number of rows in the map
+ * @param cols Number of columns in the map
+ * @return Pointer to new CongestionMap, or NULL on allocation failure
+ */
+
+CongestionMap* congestionCreate(int rows, int cols) {
+    CongestionMap* congestion = calloc(1, sizeof(CongestionMap));
+    if (!congestion) return NULL;
+
+    congestion->rows = rows;
+    congestion->cols = cols;
+    congestion->density = calloc((size_t)rows * cols, sizeof(float));
+    congestion->stamp = calloc((size_t)rows * cols, sizeof(long));
+    if (!congestion->density || !congestion->stamp) {
+        congestionFree(congestion);
+        return NULL;
+    }
+
+    // Ticks until a saturated cell decays below one penalty point
+    double level = CONGESTION_MAX_PENALTY + 1;
+    while (level >= 1.0) {
+        level *= CONGESTION_DECAY;
+        congestion->memory++;
+    }
+    congestion->active_until = -1;
+    congestion->origin_ns = simNowNs();
+    return congestion;
+}
+
+// Forgets all traffic (the terrain under it was replaced)
+void congestionClear(CongestionMap* congestion) {
+    memset(congestion->density, 0, (size_t)congestion->rows * congestion->cols * sizeof(float));
+    memset(congestion->stamp, 0, (size_t)congestion->rows * congestion->cols * sizeof(long));
+    congestion->active_until = -1;
+}
+
+void congestionFree(CongestionMap* congestion) {
+    if (!congestion) return;
+    free(congestion->density);
+    free(congestion->stamp);
+    free(congestion);
+}
+
+// Current congestion tick (see simTickNs)
+long congestionNow(const CongestionMap* congestion) {
+    return (long)((simNowNs() - congestion->origin_ns) / simTickNs());
+}
+
+// Density of a cell decayed to the given tick
+static float congestionDensity(const CongestionMap* congestion, int cell, long now) {
+    long age = now - congestion->stamp[cell];
+    if (congestion->density[cell] == 0.0f || age >= congestion->memory) return 0.0f;
+
+    double factor = 1.0, base = CONGESTION_DECAY;
+    for (; age > 0; age >>= 1) {
+        if (age & 1) factor *= base;
+        base *= base;
+    }
+    return (float)(congestion->density[cell] * factor);
+}
+
+/**
+ * Records one tick of traffic on a cell
+ * 
+ * Called for every taxi move and wait the visualizer applies. Density above
+ * the level that earns CONGESTION_MAX_PENALTY is clipped so a busy corridor
+ * recovers within congestion->memory ticks once traffic leaves it.
+ * 
+ * @param congestion Congestion map
+ * @param col X coordinate of the cell
+ * @param row Y coordinate of the cell
+ */
+
+void congestionRecord(CongestionMap* congestion, int col, int row) {
+    if (col < 0 || col >= congestion->cols || row < 0 || row >= congestion->rows) return;
+
+    long now = congestionNow(congestion);
+    int cell = row * congestion->cols + col;
+    float density = congestionDensity(congestion, cell, now) + 1.0f;
+    float saturated = (float)(CONGESTION_MAX_PENALTY + 1) / CONGESTION_WEIGHT;
+
+    congestion->density[cell] = MIN(density, saturated);
+    congestion->stamp[cell] = now;
+    congestion->active_until = MAX(congestion->active_until, now + congestion->memory);
+}
+
+// True while some cell may still cost more than 1
+bool congestionActive(const CongestionMap* congestion, long now) {
+    return congestion && now < congestion->active_until;
+}
+
+// Cost of moving onto a cell: 1 plus the congestion penalty (at most CONGESTION_MAX_PENALTY)
+int congestionCost(const CongestionMap* congestion, int col, int row, long now) {
+    if (now >= congestion->active_until) return 1;
+    int penalty = (int)(congestionDensity(congestion, row * congestion->cols + col, now) * CONGESTION_WEIGHT);
+    return 1 + MIN(penalty, CONGESTION_MAX_PENALTY);
+}
+
+// True if every cell of the path is at unit cost (so a shortest route stays cheapest)
+static bool congestionPathIsFree(const CongestionMap* congestion, const PathData* path, long now) {
+    PathCursor cursor;
+    int event;
+    pathCursorInit(&cursor, path);
+    do {
+        if (congestionCost(congestion, cursor.col, cursor.row, now) > 1) return false;
+    } while (pathCursorNext(&cursor, &event));
+    return true;
+}
+
+/**
+ * Creates an empty weighted cost field for a map
+ * 
+ * @param rows Number of rows in the map
+ * @param cols Number of columns in the map
+ * @return Pointer to new DialField, or NULL on allocation failure
+ */
+
+DialField* dialFieldCreate(int rows, int cols) {
+    DialField* field = calloc(1, sizeof(DialField));
+    if (!field) return NULL;
+    field->rows = rows;
+    field->cols = cols;
+    field->dist = malloc((size_t)rows * cols * sizeof(int));
+    field->touched = malloc((size_t)rows * cols * sizeof(int));
+    route_stats.allocations += 3;
+    if (!field->dist || !field->touched) {
+        dialFieldFree(field);
+        return NULL;
+    }
+    for (size_t i = 0; i < (size_t)rows * cols; i++) {
+        field->dist[i] = INT_MAX;
+    }
+    return field;
+}
+
+void dialFieldFree(DialField* field) {
+    if (!field) return;
+    for (int b = 0; b < CONGESTION_MAX_PENALTY + 2; b++) {
+        free(field->bucket[b]);
+    }
+    free(field->dist);
+    free(field->touched);
+    free(field);
+}
+
+/**
+ * Weighted distance field to a destination using Dial's bucket queue
+ * 
+ * Moving onto a cell costs congestionCost(), a small integer between 1 and
+ * CONGESTION_MAX_PENALTY + 1, so pending cells fit in a circular array of
+ * CONGESTION_MAX_PENALTY + 2 buckets indexed by distance. Popping is O(1)
+ * instead of the O(log n) of a binary heap; stale entries are skipped.
+ * 
+ * The search stops once every cell costing at most the start's cost plus
+ * slack is settled; costs beyond that are left unsettled (not final). Only
+ * the cells the previous search wrote are reset, so a query costs the area
+ * it settles rather than the whole map.
+ * 
+ * @param field Field of the map's size (dist is overwritten)
+ * @param passable Cells the route may use
+ * @param congestion Congestion map pricing the cells
+ * @param now Tick the prices are taken at
+ * @param dest_col Destination X coordinate
+ * @param dest_row Destination Y coordinate
+ * @param start_col Start X coordinate
+ * @param start_row Start Y coordinate
+ * @param slack Cost beyond the start's that must still be settled
+ * @return 0 on success, 1 on allocation failure
+ */
+
+int dialDistanceField(DialField* field, const Bitboard* passable, const CongestionMap* congestion, long now,
+                      int dest_col, int dest_row, int start_col, int start_row, int slack) {
+    enum { BUCKETS = CONGESTION_MAX_PENALTY + 2 };
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+    int rows = passable->rows, cols = passable->cols;
+    int* dist = field->dist;
+    int pending = 0, result = 0;
+
+    for (int i = 0; i < field->num_touched; i++) {
+        dist[field->touched[i]] = INT_MAX;
+    }
+    field->num_touched = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        field->bucket_size[b] = 0;
+    }
+
+    int dest = dest_row * cols + dest_col;
+    int start = start_row * cols + start_col;
+    if (!field->bucket[0]) {
+        field->bucket_capacity[0] = 64;
+        field->bucket[0] = malloc(field->bucket_capacity[0] * sizeof(int));
+        route_stats.allocations++;
+        if (!field->bucket[0]) {
+            field->bucket_capacity[0] = 0;
+            return 1;
+        }
+    }
+    dist[dest] = 0;
+    field->touched[field->num_touched++] = dest;
+    field->bucket[0][field->bucket_size[0]++] = dest;
+    pending = 1;
+
+    int limit = INT_MAX;
+    for (int d = 0; pending > 0 && d <= limit; ) {
+        int b = d % BUCKETS;
+        if (field->bucket_size[b] == 0) {
+            d++;
+            continue;
+        }
+
+        int cell = field->bucket[b][--field->bucket_size[b]];
+        pending--;
+        if (dist[cell] != d) continue; // Improved after it was queued
+        route_stats.expanded++;
+        if (cell == start) {
+            limit = (d > INT_MAX - slack) ? INT_MAX : d + slack;
+        }
+
+        int col = cell % cols, row = cell / cols;
+        int cost = d + congestionCost(congestion, col, row, now);
+        for (int i = 0; i < 4; i++) {
+            int new_col = col + delta_col[i];
+            int new_row = row + delta_row[i];
+            if (new_col < 0 || new_col >= cols || new_row < 0 || new_row >= rows) continue;
+            if (!bitboardTest(passable, new_col, new_row)) continue;
+
+            int next = new_row * cols + new_col;
+            if (cost >= dist[next]) continue;
+
+            int nb = cost % BUCKETS;
+            if (field->bucket_size[nb] == field->bucket_capacity[nb]) {
+                int capacity = field->bucket_capacity[nb] ? field->bucket_capacity[nb] * 2 : 64;
+                int* grown = realloc(field->bucket[nb], capacity * sizeof(int));
+                route_stats.allocations++;
+                if (!grown) {
+                    result = 1;
+                    pending = 0;
+                    break;
+                }
+                field->bucket[nb] = grown;
+                field->bucket_capacity[nb] = capacity;
+            }
+            if (dist[next] == INT_MAX) {
+                field->touched[field->num_touched++] = next;
+            }
+            dist[next] = cost;
+            field->bucket[nb][field->bucket_size[nb]++] = next;
+            pending++;
+        }
+    }
+    return result;
+}
+
+// -------------------- RESERVATION TABLE FUNCTIONS --------------------
+
+/**
+ * Creates an empty space-time reservation table
+ * 
+ * @return Pointer to new ReservationTable, or NULL on allocation failure
+ */
+
+ReservationTable* reservationCreate() {
+    ReservationTable* table = calloc(1, sizeof(ReservationTable));
+    if (!table) return NULL;
+
+    table->capacity = 1024;
+    table->slots = calloc(table->capacity, sizeof(Reservation));
+    if (!table->slots) {
+        free(table);
+        return NULL;
+    }
+    for (int i = 0; i <= MAX_TAXIS; i++) {
+        table->occupied_cell[i] = -1;
+        table->reserved_until[i] = -1;
+    }
+    table->origin_ns = simNowNs();
+    pthread_mutex_init(&table->lock, NULL);
+    return table;
+}
+
+void reservationFree(ReservationTable* table) {
+    if (!table) return;
+    pthread_mutex_destroy(&table->lock);
+    free(table->slots);
+    free(table);
+}
+
+// Current simulation tick (see simTickNs)
+long reservationNow(ReservationTable* table) {
+    return (long)((simNowNs() - table->origin_ns) / simTickNs());
+}
+
+static unsigned int reservationHash(int cell, long tick, int capacity) {
+    unsigned long long h = (unsigned long long)(unsigned int)cell * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)tick * 0xC2B2AE3D27D4EB4FULL;
+    return (unsigned int)(h >> 32) & (capacity - 1);
+}
+
+// Returns the taxi holding (cell, tick), or 0 if free (lock held)
+static int reservationOwner(const ReservationTable* table, int cell, long tick) {
+    unsigned int i = reservationHash(cell, tick, table->capacity);
+    while (table->slots[i].taxi_id != 0) {
+        if (table->slots[i].cell == cell && table->slots[i].tick == tick) {
+            return table->slots[i].taxi_id;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return 0;
+}
+
+// Inserts a reservation; false if another taxi holds the slot or the table is at half load (lock held)
+static bool reservationPut(ReservationTable* table, int cell, long tick, int taxi_id) {
+    if ((table->count + 1) * 2 >= table->capacity) return false; // A rehash failed to grow it
+    unsigned int i = reservationHash(cell, tick, table->capacity);
+    while (table->slots[i].taxi_id != 0) {
+        if (table->slots[i].cell == cell && table->slots[i].tick == tick) {
+            return table->slots[i].taxi_id == taxi_id;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+    table->slots[i] = (Reservation){.cell = cell, .tick = tick, .taxi_id = taxi_id};
+    table->count++;
+    return true;
+}
+
+/**
+ * Rebuilds the hash table, dropping expired entries
+ * 
+ * Also drops every reservation of drop_id and renames rename_from to
+ * rename_to (pass 0 to skip either). Grows the table until the live
+ * entries plus extra fit at under half load. Out of memory, the old table
+ * is kept with the drop and rename applied in place (dropped entries get
+ * tick -1, which no lookup asks for, and leave at the next rehash).
+ * 
+ * @return false if the table could not be rebuilt
+ */
+
+static bool reservationRehash(ReservationTable* table, long now, int drop_id, int rename_from, int rename_to, long extra) {
+    Reservation* old = table->slots;
+    int old_capacity = table->capacity;
+
+    int live = 0;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].taxi_id != 0 && old[i].tick >= now && old[i].taxi_id != drop_id) live++;
+    }
+    int capacity = old_capacity;
+    while ((live + extra) * 2 >= capacity) capacity *= 2;
+
+    Reservation* slots = calloc(capacity, sizeof(Reservation));
+    if (!slots) {
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i].taxi_id == 0) continue;
+            if (old[i].taxi_id == drop_id) old[i].tick = -1;
+            if (rename_from && old[i].taxi_id == rename_from) old[i].taxi_id = rename_to;
+        }
+        return false;
+    }
+    table->slots = slots;
+    table->capacity = capacity;
+    table->count = 0;
+
+    for (int i = 0; i < old_capacity; i++) {
+        Reservation r = old[i];
+        if (r.taxi_id == 0 || r.tick < now || r.taxi_id == drop_id) continue;
+        if (rename_from && r.taxi_id == rename_from) r.taxi_id = rename_to;
+        reservationPut(table, r.cell, r.tick, r.taxi_id);
+    }
+    free(old);
+    return true;
+}
+
+// Drops every reservation held by a taxi (before it replans or exits)
+void reservationRelease(ReservationTable* table, int taxi_id) {
+    pthread_mutex_lock(&table->lock);
+    reservationRehash(table, reservationNow(table), taxi_id, 0, 0, 0);
+    table->reserved_until[taxi_id] = -1;
+    pthread_mutex_unlock(&table->lock);
+}
+
+/**
+ * Releases a taxi's reservations, keeping a copy for reservationRestore
+ * 
+ * For replans that may fail: the taxi keeps driving its old route, so it
+ * must get that route's claims back rather than drive unreserved.
+ * 
+ * @param table Reservation table
+ * @param taxi_id Taxi about to replan
+ * @param count Output: number of entries copied
+ * @param until Output: the taxi's reserved_until
+ * @return Copied entries (free() them), NULL if none or out of memory
+ */
+
+static Reservation* reservationTake(ReservationTable* table, int taxi_id, int* count, long* until) {
+    pthread_mutex_lock(&table->lock);
+    long now = reservationNow(table);
+    int held = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->slots[i].taxi_id == taxi_id && table->slots[i].tick >= now) held++;
+    }
+    Reservation* saved = held ? malloc(held * sizeof(Reservation)) : NULL;
+    *count = 0;
+    for (int i = 0; saved && i < table->capacity; i++) {
+        if (table->slots[i].taxi_id == taxi_id && table->slots[i].tick >= now) saved[(*count)++] = table->slots[i];
+    }
+    *until = table->reserved_until[taxi_id];
+    reservationRehash(table, now, taxi_id, 0, 0, 0);
+    table->reserved_until[taxi_id] = -1;
+    pthread_mutex_unlock(&table->lock);
+    return saved;
+}
+
+// Gives a taxi back the reservations reservationTake copied, dropping any made since
+static void reservationRestore(ReservationTable* table, int taxi_id, const Reservation* saved, int count, long until) {
+    pthread_mutex_lock(&table->lock);
+    reservationRehash(table, reservationNow(table), taxi_id, 0, 0, count);
+    table->reserved_until[taxi_id] = -1;
+    for (int i = 0; i < count; i++) {
+        if (!reservationPut(table, saved[i].cell, saved[i].tick, taxi_id)) break;
+    }
+    if (count > 0) table->reserved_until[taxi_id] = until;
+    pthread_mutex_unlock(&table->lock);
+}
+
+/**
+ * Checks that a cell is usable by a taxi over a range of ticks (lock held)
+ * 
+ * A cell is unavailable if another taxi reserved any tick in [from, to),
+ * or if another taxi is parked on it with no plan reaching that far.
+ */
+
+static bool reservationCellFree(const ReservationTable* table, int taxi_id, int cell, long from, long to) {
+    for (long tick = from; tick < to; tick++) {
+        int owner = reservationOwner(table, cell, tick);
+        if (owner != 0 && owner != taxi_id) return false;
+    }
+    for (int id = 1; id <= MAX_TAXIS; id++) {
+        if (id != taxi_id && table->occupied_cell[id] == cell && table->reserved_until[id] < to) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Walks the first RESERVATION_WINDOW steps of a path
+ * 
+ * Either checks that every step is free (reserve == false) or records the
+ * reservations for them (reserve == true). Step k occupies ticks
+ * [start_tick + k * ticks_per_step, start_tick + (k + 1) * ticks_per_step).
+ * Reserving stops at the first tick another taxi holds: its slot is never
+ * taken over.
+ * 
+ * @return false if a step is held by another taxi
+ */
+
+static bool reservationWalkPath(ReservationTable* table, int taxi_id, int ticks_per_step, long start_tick,
+                                const PathData* path, bool reserve) {
+    PathCursor cursor;
+    int event, step = 0;
+    pathCursorInit(&cursor, path);
+
+    do {
+        int cell = RESERVATION_CELL(cursor.col, cursor.row);
+        long from = start_tick + (long)step * ticks_per_step;
+        if (reserve) {
+            for (long tick = from; tick < from + ticks_per_step; tick++) {
+                if (!reservationPut(table, cell, tick, taxi_id)) return false;
+                table->reserved_until[taxi_id] = MAX(table->reserved_until[taxi_id], tick + 1);
+            }
+        } else if (step > 0 && !reservationCellFree(table, taxi_id, cell, from, from + ticks_per_step)) {
+            return false;
+        }
+
+        // Advance to the next step, skipping pickup/drop-off events
+        do {
+            if (!pathCursorNext(&cursor, &event)) return true;
+        } while (event == ROUTE_PICKUP || event == ROUTE_DROPOFF);
+        step++;
+    } while (step <= RESERVATION_WINDOW);
+
+    return true;
+}
+
+// Reserves the window of a planned route, growing the table as needed (lock held);
+// when the table cannot grow, nothing is reserved and the taxi drives unreserved
+static bool reservationReservePath(ReservationTable* table, int taxi_id, int ticks_per_step, long start_tick,
+                                   const PathData* path) {
+    long needed = (long)(RESERVATION_WINDOW + 1) * ticks_per_step;
+    if ((table->count + needed) * 2 >= table->capacity &&
+        !reservationRehash(table, reservationNow(table), 0, 0, 0, needed)) {
+        return false;
+    }
+    return reservationWalkPath(table, taxi_id, ticks_per_step, start_tick, path, true);
+}
+
+/**
+ * Records the cell a taxi stands on, unless another taxi stands there
+ * 
+ * Called by the taxi thread before each move. A taxi never drives onto
+ * another taxi's cell: it waits and, every RESERVATION_MAX_WAITS ticks, asks
+ * the visualizer for a way around (ROUTE_BLOCKED).
+ * 
+ * @param table Reservation table
+ * @param taxi_id Moving taxi
+ * @param col X coordinate of the target cell (-1 to vacate)
+ * @param row Y coordinate of the target cell
+ * @return true if the taxi now holds the cell, false if another taxi does
+ */
+
+bool reservationOccupy(ReservationTable* table, int taxi_id, int col, int row) {
+    int cell = (col < 0) ? -1 : RESERVATION_CELL(col, row);
+
+    pthread_mutex_lock(&table->lock);
+    for (int id = 1; cell >= 0 && id <= MAX_TAXIS; id++) {
+        if (id != taxi_id && table->occupied_cell[id] == cell) {
+            pthread_mutex_unlock(&table->lock);
+            return false;
+        }
+    }
+    table->occupied_cell[taxi_id] = cell;
+    pthread_mutex_unlock(&table->lock);
+    return true;
+}
+
+// Cooperative search helpers: cost to the destination (INT_MAX if unreachable)
+static int coopDistance(const CoopField* field, int col, int row) {
+    if (field->dist) return field->dist[(size_t)row * field->cols + col];
+    return bitboardTest(field->bfs->visited, col, row) ? bitbfsDist(field->bfs, col, row) : INT_MAX;
+}
+
+// Cost of moving onto (col, row)
+static int coopStepCost(const CoopField* field, int col, int row) {
+    return field->congestion ? congestionCost(field->congestion, col, row, field->now) : 1;
+}
+
+// Appends the downhill walk from (col, row) to the destination of the field (false: out of memory)
+static bool coopAppendGradient(PathData* path, const CoopField* field, int col, int row) {
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+    int d = coopDistance(field, col, row);
+
+    while (d > 0) {
+        bool moved = false;
+        for (int i = 0; i < 4 && !moved; i++) {
+            int new_col = col + delta_col[i];
+            int new_row = row + delta_row[i];
+            if (new_col < 0 || new_col >= field->cols || new_row < 0 || new_row >= field->rows) {
+                continue;
+            }
+            int new_d = coopDistance(field, new_col, new_row);
+            if (new_d != INT_MAX && new_d + coopStepCost(field, new_col, new_row) == d) {
+                col = new_col;
+                row = new_row;
+                d = new_d;
+                moved = true;
+            }
+        }
+        if (!moved) break;
+        if (!pathAppendCell(path, col, row)) return false;
+    }
+    return true;
+}
+
+/**
+ * Plans a route that avoids other taxis' reservations (WHCA*-style)
+ * 
+ * Other taxis are not walls: the planner works in space-time by:
+ * 1. Computing the cost to the destination (taxi cells passable): plain road
+ *    distance out to the start plus RESERVATION_WINDOW layers, or
+ *    congestion-weighted cost (Dial's algorithm) while traffic has raised the
+ *    price of some cells
+ * 2. Trying the cached or straight cheapest route if its first
+ *    RESERVATION_WINDOW steps are free
+ * 3. Otherwise running a time-expanded BFS over (cell, step) for the window,
+ *    allowing waits and skipping reserved cells and swaps
+ * 4. Finishing from the best window cell along the cost gradient
+ * 5. Reserving the cells of the first RESERVATION_WINDOW steps for this taxi,
+ *    up to the first one another taxi holds (nothing when the window search
+ *    found no free move: the plain route is returned unreserved)
+ * 
+ * Callers release the taxi's previous route with reservationRelease() first,
+ * or with reservationTake() when a failed plan leaves the taxi on it; a second leg planned with a later start_tick keeps the first leg's claims.
+ * Cached routes are only reused while they avoid every congested cell, and
+ * only unweighted routes are stored.
+ * 
+ * @param cache Route cache (may be NULL)
+ * @param table Reservation table (NULL falls back to findPathCoordinatesCached)
+ * @param map Current map
+ * @param congestion Congestion map pricing cells (NULL for unweighted routing)
+ * @param taxi_id Taxi the route is for
+ * @param ticks_per_step Ticks the taxi spends per cell at its current speed
+ * @param start_tick Tick at which the taxi starts the route
+ * @param path Output path (start -> destination, may contain ROUTE_WAIT)
+ * @return 0 on success, 1 if no path found
+ */
+
+int findPathCooperative(RouteCache* cache, ReservationTable* table, Map* map, const CongestionMap* congestion,
+                        int taxi_id, int ticks_per_step, long start_tick,
+                        int start_col, int start_row, int dest_col, int dest_row, PathData* path) {
+    if (!table || taxi_id < 1 || taxi_id > MAX_TAXIS) {
+        return findPathCoordinatesCached(cache, map, start_col, start_row, dest_col, dest_row, path);
+    }
+
+    int cols = map->cols;
+    long long span = traceStart();
+    long long started = monotonic_ns();
+    long now = congestion ? congestionNow(congestion) : 0;
+    bool weighted = congestionActive(congestion, now);
+
+    // Fast path: a cached route whose window is still free (and, under traffic, still cheapest)
+    if (cache && routeCacheLookup(cache, map, start_col, start_row, dest_col, dest_row, path, true) &&
+        (!weighted || congestionPathIsFree(congestion, path, now))) {
+        pthread_mutex_lock(&table->lock);
+        bool free_window = reservationWalkPath(table, taxi_id, ticks_per_step, start_tick, path, false);
+        if (free_window) {
+            reservationReservePath(table, taxi_id, ticks_per_step, start_tick, path);
+        }
+        pthread_mutex_unlock(&table->lock);
+
+        if (free_window) {
+            pthread_mutex_lock(&cache->lock);
+            cache->hits++;
+            cache->hit_ns += monotonic_ns() - started;
+            pthread_mutex_unlock(&cache->lock);
+            traceSpan("route", "findPathCooperative", span);
+            return 0;
+        }
+    }
+
+    // Cost to the destination over road and taxi cells; the boards live on the map
+    if (!map->coop_bfs) {
+        map->coop_bfs = bitbfsCreate(map->rows, cols);
+        if (!map->coop_bfs) {
+            traceSpan("route", "findPathCooperative", span);
+            return 1;
+        }
+        bitbfsLoad(map->coop_bfs, &map->grid, 0, 0, R_TAXI_FREE, R_TAXI_OCCUPIED + 100);
+    }
+    BitBFS* bfs = map->coop_bfs;
+    CoopField field = {map->rows, cols, NULL, bfs, NULL, now};
+
+    // The start cell is passable for this search only
+    uint64_t* start_word = bfs->passable->data + bitboardOffset(bfs->passable, start_col, start_row);
+    uint64_t start_bit = (uint64_t)1 << (start_col & 63);
+    uint64_t saved_word = *start_word;
+    *start_word |= start_bit;
+
+    // Weighted: settled out to the start plus the most the window can stray
+    if (weighted && !map->coop_dial) {
+        map->coop_dial = dialFieldCreate(map->rows, cols);
+    }
+    if (weighted && map->coop_dial &&
+        dialDistanceField(map->coop_dial, bfs->passable, congestion, now, dest_col, dest_row, start_col, start_row,
+                          RESERVATION_WINDOW * (CONGESTION_MAX_PENALTY + 1)) == 0) {
+        field.dist = map->coop_dial->dist;
+        field.congestion = congestion;
+    } else {
+        // Search from the destination until the start is reached, then only as far
+        // as the window can stray: no cell it may enter is further away than that
+        weighted = false;
+        uint64_t* target_word = bfs->targets->data + bitboardOffset(bfs->targets, start_col, start_row);
+        *target_word |= start_bit;
+        bitbfsStart(bfs, dest_col, dest_row);
+        bool reached = bitbfsRun(bfs, true, NULL, NULL);
+        *target_word &= ~start_bit;
+        if (reached) {
+            bfs->layer_limit = bfs->layer + RESERVATION_WINDOW;
+            bitbfsRun(bfs, false, NULL, NULL);
+        }
+    }
+    *start_word = saved_word;
+
+    if (coopDistance(&field, start_col, start_row) == INT_MAX) {
+        traceSpan("route", "findPathCooperative", span);
+        return 1;
+    }
+
+    // Straight cheapest route; shortest routes are cached for later queries
+    pathClear(path);
+    if (!pathAppendCell(path, start_col, start_row) || !coopAppendGradient(path, &field, start_col, start_row)) {
+        traceSpan("route", "findPathCooperative", span);
+        return 1;
+    }
+    if (cache && !weighted) {
+        routeCacheInsert(cache, map->epoch, path);
+    }
+
+    pthread_mutex_lock(&table->lock);
+    bool reserve = true;
+    if (!reservationWalkPath(table, taxi_id, ticks_per_step, start_tick, path, false)) {
+        // Time-expanded BFS over the reservation window
+        int delta_col[] = {0, 0, -1, 1, 0};
+        int delta_row[] = {-1, 1, 0, 0, 0};
+        enum { SPAN = 2 * RESERVATION_WINDOW + 1 };
+        int capacity = 256, count = 0;
+        int* entry_cell = malloc(capacity * sizeof(int));
+        int* entry_parent = malloc(capacity * sizeof(int));
+        int seen[SPAN * SPAN] = {0}; // Window cells around the start, by last step reached
+        route_stats.allocations += 2;
+        if (!entry_cell || !entry_parent) {
+            free(entry_cell);
+            free(entry_parent);
+            pthread_mutex_unlock(&table->lock);
+            traceSpan("route", "findPathCooperative", span);
+            return 1;
+        }
+        int layer_begin = 0, layer_end = 1, best = -1;
+        bool failed = false;
+
+        entry_cell[count] = start_row * cols + start_col;
+        entry_parent[count++] = -1;
+        int last_layer_begin = 0, last_layer_end = 1;
+
+        for (int step = 0; step < RESERVATION_WINDOW && best == -1 && !failed && layer_begin < layer_end; step++) {
+            long from = start_tick + (long)(step + 1) * ticks_per_step;
+            for (int e = layer_begin; e < layer_end && best == -1 && !failed; e++) {
+                int cell = entry_cell[e];
+                int col = cell % cols, row = cell / cols;
+                route_stats.expanded++;
+
+                for (int i = 0; i < 5; i++) { // four moves and a wait
+                    int new_col = col + delta_col[i];
+                    int new_row = row + delta_row[i];
+                    if (new_col < 0 || new_col >= cols || new_row < 0 || new_row >= map->rows) continue;
+                    if (coopDistance(&field, new_col, new_row) == INT_MAX) continue;
+
+                    int next = new_row * cols + new_col;
+                    int window_cell = (new_row - start_row + RESERVATION_WINDOW) * SPAN +
+                                      (new_col - start_col + RESERVATION_WINDOW);
+                    if (seen[window_cell] == step + 1) continue;
+                    int key = RESERVATION_CELL(new_col, new_row);
+                    if (!reservationCellFree(table, taxi_id, key, from, from + ticks_per_step)) continue;
+
+                    // Do not swap cells with a taxi coming the other way
+                    int other = reservationOwner(table, key, from - ticks_per_step);
+                    if (i < 4 && other != 0 && other != taxi_id &&
+                        reservationOwner(table, RESERVATION_CELL(col, row), from) == other) continue;
+
+                    seen[window_cell] = step + 1;
+                    if (count == capacity) {
+                        int* cells = realloc(entry_cell, capacity * 2 * sizeof(int));
+                        if (cells) entry_cell = cells;
+                        int* parents = realloc(entry_parent, capacity * 2 * sizeof(int));
+                        if (parents) entry_parent = parents;
+                        route_stats.allocations += 2;
+                        if (!cells || !parents) {
+                            failed = true;
+                            break;
+                        }
+                        capacity *= 2;
+                    }
+                    entry_cell[count] = next;
+                    entry_parent[count++] = e;
+                    if (new_col == dest_col && new_row == dest_row) {
+                        best = count - 1;
+                        break;
+                    }
+                }
+            }
+            if (layer_end < count) {
+                last_layer_begin = layer_end;
+                last_layer_end = count;
+            }
+            layer_begin = layer_end;
+            layer_end = count;
+        }
+
+        // Out of window: continue from the window cell closest to the destination
+        if (best == -1 && !failed && last_layer_begin > 0) {
+            for (int e = last_layer_begin; e < last_layer_end; e++) {
+                int cell = entry_cell[e];
+                if (best == -1 || coopDistance(&field, cell % cols, cell / cols) <
+                                  coopDistance(&field, entry_cell[best] % cols, entry_cell[best] / cols)) {
+                    best = e;
+                }
+            }
+        }
+
+        int* chain = NULL;
+        int steps = 0;
+        if (best != -1 && !failed) {
+            for (int e = best; e != -1; e = entry_parent[e]) steps++;
+            chain = malloc(steps * sizeof(int));
+            route_stats.allocations++;
+            failed = !chain;
+        }
+        if (chain) {
+            for (int e = best, i = steps - 1; e != -1; e = entry_parent[e], i--) chain[i] = entry_cell[e];
+
+            pathClear(path);
+            bool stored = pathAppendCell(path, start_col, start_row);
+            for (int i = 1; stored && i < steps; i++) {
+                if (chain[i] == chain[i - 1]) {
+                    stored = pathAppendWait(path, 1);
+                } else {
+                    stored = pathAppendCell(path, chain[i] % cols, chain[i] / cols);
+                }
+            }
+            stored = stored && coopAppendGradient(path, &field, chain[steps - 1] % cols, chain[steps - 1] / cols);
+            failed = !stored;
+            free(chain);
+        }
+        reserve = best != -1;
+
+        free(entry_cell);
+        free(entry_parent);
+        if (failed) {
+            pthread_mutex_unlock(&table->lock);
+            traceSpan("route", "findPathCooperative", span);
+            return 1;
+        }
+    }
+
+    if (reserve) {
+        reservationReservePath(table, taxi_id, ticks_per_step, start_tick, path);
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    if (cache) {
+        pthread_mutex_lock(&cache->lock);
+        cache->misses++;
+        cache->miss_ns += monotonic_ns() - started;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    traceSpan("route", "findPathCooperative", span);
+    return 0;
+}
+
+// -------------------- INCREMENTAL ROUTE REPAIR FUNCTIONS --------------------
+
+/**
+ * Creates an empty D* Lite search state for a map
+ * 
+ * @param rows Number of rows in the map
+ * @param cols Number of columns in the map
+ * @return Pointer to new DStarLite, or NULL on allocation failure
+ */
+
+DStarLite* dstarCreate(int rows, int cols) {
+    DStarLite* d = calloc(1, sizeof(DStarLite));
+    if (!d) return NULL;
+
+    size_t cells = (size_t)rows * cols;
+    d->rows = rows;
+    d->cols = cols;
+    d->g = malloc(cells * sizeof(int));
+    d->rhs = malloc(cells * sizeof(int));
+    d->heap_pos = malloc(cells * sizeof(int));
+    d->stamp = calloc(cells, sizeof(unsigned int));
+    d->mark = calloc(cells, sizeof(unsigned int));
+    d->heap_capacity = 256;
+    d->heap_cells = malloc(d->heap_capacity * sizeof(int));
+    d->heap_k1 = malloc(d->heap_capacity * sizeof(int));
+    d->heap_k2 = malloc(d->heap_capacity * sizeof(int));
+    route_stats.allocations += 9;
+    if (!d->g || !d->rhs || !d->heap_pos || !d->stamp || !d->mark ||
+        !d->heap_cells || !d->heap_k1 || !d->heap_k2) {
+        dstarFree(d);
+        return NULL;
+    }
+    return d;
+}
+
+void dstarFree(DStarLite* d) {
+    if (!d) return;
+    free(d->g);
+    free(d->rhs);
+    free(d->heap_pos);
+    free(d->stamp);
+    free(d->mark);
+    free(d->heap_cells);
+    free(d->heap_k1);
+    free(d->heap_k2);
+    free(d);
+}
+
+// Brings a cell into the current generation (g = rhs = infinity, not queued)
+static void dstarTouch(DStarLite* d, int cell) {
+    if (d->stamp[cell] != d->generation) {
+        d->stamp[cell] = d->generation;
+        d->g[cell] = DSTAR_INF;
+        d->rhs[cell] = DSTAR_INF;
+        d->heap_pos[cell] = -1;
+    }
+}
+
+static int dstarG(const DStarLite* d, int cell) {
+    return d->stamp[cell] == d->generation ? d->g[cell] : DSTAR_INF;
+}
+
+// Cells a leg may drive through: road, other taxis and its own endpoints
+static bool dstarPassable(const DStarLite* d, const TileGrid* maze, int col, int row) {
+    int value = tileGet(maze, col, row);
+    if (value == ROAD || (value >= R_TAXI_FREE && value < R_TAXI_OCCUPIED + 100)) return true;
+    return (col == d->goal_col && row == d->goal_row) || (col == d->start_col && row == d->start_row);
+}
+
+static void dstarKey(const DStarLite* d, int cell, int* k1, int* k2) {
+    int cost = MIN(d->g[cell], d->rhs[cell]);
+    *k1 = cost + abs(cell % d->cols - d->start_col) + abs(cell / d->cols - d->start_row) + d->km;
+    *k2 = cost;
+}
+
+static bool dstarKeyLess(int a1, int a2, int b1, int b2) {
+    return a1 < b1 || (a1 == b1 && a2 < b2);
+}
+
+// Open list: binary min-heap on (k1, k2) with per-cell positions for updates
+static void dstarHeapSwap(DStarLite* d, int i, int j) {
+    int cell = d->heap_cells[i], k1 = d->heap_k1[i], k2 = d->heap_k2[i];
+    d->heap_cells[i] = d->heap_cells[j];
+    d->heap_k1[i] = d->heap_k1[j];
+    d->heap_k2[i] = d->heap_k2[j];
+    d->heap_cells[j] = cell;
+    d->heap_k1[j] = k1;
+    d->heap_k2[j] = k2;
+    d->heap_pos[d->heap_cells[i]] = i;
+    d->heap_pos[d->heap_cells[j]] = j;
+}
+
+static void dstarHeapSift(DStarLite* d, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!dstarKeyLess(d->heap_k1[i], d->heap_k2[i], d->heap_k1[parent], d->heap_k2[parent])) break;
+        dstarHeapSwap(d, i, parent);
+        i = parent;
+    }
+    while (1) {
+        int smallest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < d->heap_size; child++) {
+            if (dstarKeyLess(d->heap_k1[child], d->heap_k2[child], d->heap_k1[smallest], d->heap_k2[smallest])) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) break;
+        dstarHeapSwap(d, i, smallest);
+        i = smallest;
+    }
+}
+
+static void dstarHeapPut(DStarLite* d, int cell, int k1, int k2) {
+    int i = d->heap_pos[cell];
+    if (i < 0) {
+        if (d->heap_size == d->heap_capacity) {
+            int capacity = d->heap_capacity * 2;
+            int* cells = realloc(d->heap_cells, capacity * sizeof(int));
+            if (cells) d->heap_cells = cells;
+            int* k1s = realloc(d->heap_k1, capacity * sizeof(int));
+            if (k1s) d->heap_k1 = k1s;
+            int* k2s = realloc(d->heap_k2, capacity * sizeof(int));
+            if (k2s) d->heap_k2 = k2s;
+            route_stats.allocations += 3;
+            if (!cells || !k1s || !k2s) return;
+            d->heap_capacity = capacity;
+        }
+        i = d->heap_size++;
+        d->heap_cells[i] = cell;
+        d->heap_pos[cell] = i;
+    }
+    d->heap_k1[i] = k1;
+    d->heap_k2[i] = k2;
+    dstarHeapSift(d, i);
+}
+
+static void dstarHeapRemove(DStarLite* d, int cell) {
+    int i = d->heap_pos[cell];
+    if (i < 0) return;
+
+    int last = --d->heap_size;
+    if (i != last) {
+        dstarHeapSwap(d, i, last);
+        d->heap_pos[cell] = -1;
+        dstarHeapSift(d, i);
+    } else {
+        d->heap_pos[cell] = -1;
+    }
+}
+
+// Recomputes rhs of a cell from its neighbours and requeues it if inconsistent
+static void dstarUpdateVertex(DStarLite* d, const TileGrid* maze, int cell) {
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+    int col = cell % d->cols, row = cell / d->cols;
+
+    dstarTouch(d, cell);
+    if (col != d->goal_col || row != d->goal_row) {
+        int best = DSTAR_INF;
+        if (dstarPassable(d, maze, col, row)) {
+            for (int i = 0; i < 4; i++) {
+                int new_col = col + delta_col[i];
+                int new_row = row + delta_row[i];
+                if (new_col < 0 || new_col >= d->cols || new_row < 0 || new_row >= d->rows) continue;
+                if (!dstarPassable(d, maze, new_col, new_row)) continue;
+                int g = dstarG(d, new_row * d->cols + new_col);
+                if (g < DSTAR_INF) best = MIN(best, g + 1);
+            }
+        }
+        d->rhs[cell] = best;
+    }
+
+    if (d->g[cell] != d->rhs[cell]) {
+        int k1, k2;
+        dstarKey(d, cell, &k1, &k2);
+        dstarHeapPut(d, cell, k1, k2);
+    } else {
+        dstarHeapRemove(d, cell);
+    }
+}
+
+static void dstarUpdateNeighbours(DStarLite* d, const TileGrid* maze, int cell) {
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+    int col = cell % d->cols, row = cell / d->cols;
+
+    for (int i = 0; i < 4; i++) {
+        int new_col = col + delta_col[i];
+        int new_row = row + delta_row[i];
+        if (new_col < 0 || new_col >= d->cols || new_row < 0 || new_row >= d->rows) continue;
+        dstarUpdateVertex(d, maze, new_row * d->cols + new_col);
+    }
+}
+
+// Expands inconsistent cells until the start's cost is settled
+static void dstarComputeShortestPath(DStarLite* d, const TileGrid* maze) {
+    int start = d->start_row * d->cols + d->start_col;
+    dstarTouch(d, start);
+
+    while (d->heap_size > 0) {
+        int top = d->heap_cells[0];
+        int old_k1 = d->heap_k1[0], old_k2 = d->heap_k2[0];
+        int start_k1, start_k2, new_k1, new_k2;
+        dstarKey(d, start, &start_k1, &start_k2);
+        if (!dstarKeyLess(old_k1, old_k2, start_k1, start_k2) && d->rhs[start] <= d->g[start]) break;
+        route_stats.expanded++;
+
+        dstarKey(d, top, &new_k1, &new_k2);
+        if (dstarKeyLess(old_k1, old_k2, new_k1, new_k2)) {
+            dstarHeapPut(d, top, new_k1, new_k2); // Key grew as the start moved
+        } else if (d->g[top] > d->rhs[top]) {
+            d->g[top] = d->rhs[top]; // Overconsistent: settle it
+            dstarHeapRemove(d, top);
+            dstarUpdateNeighbours(d, maze, top);
+        } else {
+            d->g[top] = DSTAR_INF; // Underconsistent: raise it and its dependants
+            dstarUpdateVertex(d, maze, top);
+            dstarUpdateNeighbours(d, maze, top);
+        }
+    }
+}
+
+// Cost of the best route from the current start (DSTAR_INF if none); the
+// search may stop with the start overconsistent, so its rhs is the answer
+int dstarCost(const DStarLite* d) {
+    int start = d->start_row * d->cols + d->start_col;
+    return d->stamp[start] == d->generation ? d->rhs[start] : DSTAR_INF;
+}
+
+/**
+ * Plans a leg from scratch with D* Lite
+ * 
+ * Reuses the state's arrays: starting a new generation makes every cell
+ * look unvisited without clearing them.
+ * 
+ * @param d Search state
+ * @param maze Map grid
+ * @param start_col Starting X coordinate
+ * @param start_row Starting Y coordinate
+ * @param goal_col Goal X coordinate
+ * @param goal_row Goal Y coordinate
+ * @return 0 if the goal is reachable, 1 otherwise
+ */
+
+int dstarPlan(DStarLite* d, const TileGrid* maze, int start_col, int start_row, int goal_col, int goal_row) {
+    long long span = traceStart();
+    if (++d->generation == 0) {
+        memset(d->stamp, 0, (size_t)d->rows * d->cols * sizeof(unsigned int));
+        d->generation = 1;
+    }
+    d->start_col = d->last_col = start_col;
+    d->start_row = d->last_row = start_row;
+    d->goal_col = goal_col;
+    d->goal_row = goal_row;
+    d->km = 0;
+    d->heap_size = 0;
+
+    int goal = goal_row * d->cols + goal_col;
+    int k1, k2;
+    dstarTouch(d, goal);
+    d->rhs[goal] = 0;
+    dstarKey(d, goal, &k1, &k2);
+    dstarHeapPut(d, goal, k1, k2);
+    dstarComputeShortestPath(d, maze);
+    traceSpan("route", "dstarPlan", span);
+
+    return dstarCost(d) < DSTAR_INF ? 0 : 1;
+}
+
+// Moves the search start to the taxi's new cell (keys stay valid through km)
+void dstarMoveStart(DStarLite* d, int col, int row) {
+    d->km += abs(col - d->last_col) + abs(row - d->last_row);
+    d->start_col = d->last_col = col;
+    d->start_row = d->last_row = row;
+}
+
+/**
+ * Repairs a leg after one cell changed routability
+ * 
+ * Only the cell and its neighbours are requeued, and the search expands
+ * just the cells whose cost actually changes. Cells the search never
+ * reached cannot affect the route and are skipped outright.
+ * 
+ * @param d Search state
+ * @param maze Map grid (already holding the new value)
+ * @param col X coordinate of the changed cell
+ * @param row Y coordinate of the changed cell
+ * @return true if the search state was updated
+ */
+
+bool dstarCellChanged(DStarLite* d, const TileGrid* maze, int col, int row) {
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+    int cell = row * d->cols + col;
+
+    bool reached = d->stamp[cell] == d->generation;
+    for (int i = 0; i < 4 && !reached; i++) {
+        int new_col = col + delta_col[i];
+        int new_row = row + delta_row[i];
+        if (new_col < 0 || new_col >= d->cols || new_row < 0 || new_row >= d->rows) continue;
+        reached = d->stamp[new_row * d->cols + new_col] == d->generation;
+    }
+    if (!reached) return false;
+
+    dstarUpdateVertex(d, maze, cell);
+    dstarUpdateNeighbours(d, maze, cell);
+    dstarComputeShortestPath(d, maze);
+    return true;
+}
+
+/**
+ * Extracts the current best route of a leg
+ * 
+ * @param d Search state
+ * @param maze Map grid
+ * @param path Output path (start -> goal)
+ * @return 0 on success, 1 if the goal is unreachable
+ */
+
+int dstarExtract(const DStarLite* d, const TileGrid* maze, PathData* path) {
+    int delta_col[] = {0, 0, -1, 1};
+    int delta_row[] = {-1, 1, 0, 0};
+    int col = d->start_col, row = d->start_row;
+    int steps = dstarCost(d);
+
+    pathClear(path);
+    if (steps >= DSTAR_INF || !pathAppendCell(path, col, row)) return 1;
+
+    while ((col != d->goal_col || row != d->goal_row) && steps-- > 0) {
+        int best_col = -1, best_row = -1, best_g = DSTAR_INF;
+        for (int i = 0; i < 4; i++) {
+            int new_col = col + delta_col[i];
+            int new_row = row + delta_row[i];
+            if (new_col < 0 || new_col >= d->cols || new_row < 0 || new_row >= d->rows) continue;
+            if (!dstarPassable(d, maze, new_col, new_row)) continue;
+            int g = dstarG(d, new_row * d->cols + new_col);
+            if (g < best_g) {
+                best_g = g;
+                best_col = new_col;
+                best_row = new_row;
+            }
+        }
+        if (best_col < 0) return 1;
+        col = best_col;
+        row = best_row;
+        if (!pathAppendCell(path, col, row)) return 1;
+    }
+    return (col == d->goal_col && row == d->goal_row) ? 0 : 1;
+}
+
+// Remembers which cells the route sent for this leg uses
+static void dstarMarkPath(DStarLite* d, const PathData* path) {
+    if (++d->mark_generation == 0) {
+        memset(d->mark, 0, (size_t)d->rows * d->cols * sizeof(unsigned int));
+        d->mark_generation = 1;
+    }
+
+    PathCursor cursor;
+    int event;
+    pathCursorInit(&cursor, path);
+    d->mark[cursor.row * d->cols + cursor.col] = d->mark_generation;
+    while (pathCursorNext(&cursor, &event)) {
+        if (event != -1) continue;
+        d->mark[cursor.row * d->cols + cursor.col] = d->mark_generation;
+    }
+}
+
+// Cells routes may use (road and taxis); flips of this trigger repairs
+static bool routableValue(int value) {
+    return value == ROAD || (value >= R_TAXI_FREE && value < R_TAXI_OCCUPIED + 100);
+}
+
+/**
+ * Starts tracking a freshly planned route so it can be repaired in flight
+ * 
+ * Each leg gets its own D* Lite state seeded with a search from the leg's
+ * start; the cells of the planned legs are marked so a change on them is
+ * recognised in O(1).
+ * 
+ * @param visualizer Visualizer owning the route states
+ * @param map Current map
+ * @param taxi_id Taxi driving the route
+ * @param passenger_id Passenger ID sent with the route (0 when cruising)
+ * @param ticks_per_step Ticks per cell at the taxi's speed
+ * @param legs Planned legs in driving order (1 or 2)
+ * @param events Waypoint event ending each leg (-1 for none)
+ * @param num_legs Number of legs
+ */
+
+void inflightTrack(Visualizer* visualizer, Map* map, int taxi_id, int passenger_id, int ticks_per_step,
+                   PathData** legs, const int* events, int num_legs) {
+    if (taxi_id < 1 || taxi_id > MAX_TAXIS) return;
+
+    InflightRoute* route = &visualizer->inflight[taxi_id];
+    route->num_legs = 0;
+    for (int l = 0; l < num_legs; l++) {
+        DStarLite* d = route->legs[l];
+        if (d && (d->rows != map->rows || d->cols != map->cols)) {
+            dstarFree(d);
+            d = route->legs[l] = NULL;
+        }
+        if (!d) {
+            d = route->legs[l] = dstarCreate(map->rows, map->cols);
+            if (!d) return;
+        }
+        if (dstarPlan(d, &map->grid, legs[l]->start_x, legs[l]->start_y, legs[l]->end_x, legs[l]->end_y) != 0) {
+            return;
+        }
+        dstarMarkPath(d, legs[l]);
+        route->leg_event[l] = events[l];
+    }
+    route->num_legs = num_legs;
+    route->leg = 0;
+    route->passenger_id = passenger_id;
+    route->ticks_per_step = ticks_per_step;
+}
+
+// Stops tracking a taxi's route
+void inflightForget(Visualizer* visualizer, int taxi_id) {
+    if (taxi_id >= 1 && taxi_id <= MAX_TAXIS) {
+        visualizer->inflight[taxi_id].num_legs = 0;
+    }
+}
+
+// Stops tracking every route (taxi IDs are about to change, or the map is gone)
+void inflightForgetAll(Visualizer* visualizer, bool free_states) {
+    for (int id = 0; id <= MAX_TAXIS; id++) {
+        visualizer->inflight[id].num_legs = 0;
+        for (int l = 0; l < 2 && free_states; l++) {
+            dstarFree(visualizer->inflight[id].legs[l]);
+            visualizer->inflight[id].legs[l] = NULL;
+        }
+    }
+}
+
+/**
+ * Follows a taxi along its tracked route
+ * 
+ * @param visualizer Visualizer owning the route states
+ * @param taxi_id Taxi that moved
+ * @param col X coordinate of its new cell
+ * @param row Y coordinate of its new cell
+ */
+
+void inflightMoved(Visualizer* visualizer, int taxi_id, int col, int row) {
+    if (taxi_id < 1 || taxi_id > MAX_TAXIS) return;
+
+    InflightRoute* route = &visualizer->inflight[taxi_id];
+    if (route->num_legs == 0) return;
+
+    DStarLite* d = route->legs[route->leg];
+    if (abs(col - d->start_col) + abs(row - d->start_row) != 1) {
+        route->num_legs = 0; // Lost track of the taxi; its next plan starts over
+        return;
+    }
+    dstarMoveStart(d, col, row);
+
+    if (col == d->goal_col && row == d->goal_row && ++route->leg == route->num_legs) {
+        route->num_legs = 0;
+    }
+}
+
+// Sends the repaired remainder of a taxi's route as a new ROUTE_PLAN, reserving
+// its window only if no other taxi holds any of it (the taxi waits out conflicts)
+static void inflightResend(Visualizer* visualizer, Map* map, int taxi_id) {
+    InflightRoute* route = &visualizer->inflight[taxi_id];
+    PathData* path = pathCreate();
+    PathData* leg_path = pathCreate();
+
+    for (int l = route->leg; l < route->num_legs; l++) {
+        if (dstarExtract(route->legs[l], &map->grid, leg_path) != 0) {
+            pathFree(path);
+            pathFree(leg_path);
+            return;
+        }
+        dstarMarkPath(route->legs[l], leg_path);
+        if (!pathAppendPath(path, leg_path) ||
+            (route->leg_event[l] >= 0 && !pathAppendEvent(path, route->leg_event[l]))) {
+            pathFree(path);
+            pathFree(leg_path);
+            return;
+        }
+    }
+    pathFree(leg_path);
+
+    ReservationTable* table = visualizer->center->reservations;
+    if (table) {
+        reservationRelease(table, taxi_id);
+        pthread_mutex_lock(&table->lock);
+        long now = reservationNow(table);
+        if (reservationWalkPath(table, taxi_id, route->ticks_per_step, now, path, false)) {
+            reservationReservePath(table, taxi_id, route->ticks_per_step, now, path);
+        }
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    visualizer->route_repairs++;
+    enqueue_message(visualizer->control_queue, ROUTE_PLAN, path->start_x, path->start_y, taxi_id, route->passenger_id, path);
+}
+
+/**
+ * Repairs tracked routes after a cell changed routability
+ * 
+ * Every remaining leg's search is updated locally. A taxi only gets a new
+ * route when the cell blocks a leg it was sent: the repair is unit-cost and
+ * blind to reservations and congestion, so a cheaper way it opens would
+ * undo the detours the route was planned with.
+ * 
+ * @param visualizer Visualizer owning the route states
+ * @param map Current map (already holding the new value)
+ * @param col X coordinate of the changed cell
+ * @param row Y coordinate of the changed cell
+ */
+
+void inflightCellChanged(Visualizer* visualizer, Map* map, int col, int row) {
+    int cell = row * map->cols + col;
+
+    for (int id = 1; id <= MAX_TAXIS; id++) {
+        InflightRoute* route = &visualizer->inflight[id];
+        bool repair = false, reachable = true;
+
+        for (int l = route->leg; l < route->num_legs; l++) {
+            DStarLite* d = route->legs[l];
+            if (!dstarCellChanged(d, &map->grid, col, row)) continue;
+
+            if (d->mark[cell] == d->mark_generation && !dstarPassable(d, &map->grid, col, row)) repair = true;
+            if (dstarCost(d) >= DSTAR_INF) reachable = false;
+        }
+
+        if (repair && reachable) {
+            inflightResend(visualizer, map, id);
+        }
+    }
+}
+
+// Writes a map cell from the visualizer, repairing routes if its routability flips
+static void visualizerSetCell(Visualizer* visualizer, Map* map, int col, int row, int value) {
+    bool was_routable = routableValue(tileGet(&map->grid, col, row));
+    mapSetCell(map, col, row, value);
+    if (was_routable != routableValue(value)) {
+        inflightCellChanged(visualizer, map, col, row);
+    }
+}
+
+// -------------------- METRICS FUNCTIONS --------------------
+
+static LifecycleMetrics lifecycle_metrics; // Zeroed: every histogram starts empty
+
+// Index of the bucket counting value (value < 2^HDR_MAX_MAGNITUDE)
+static size_t hdrIndex(uint64_t value) {
+    int magnitude = 63 - __builtin_clzll(value | 1);
+    int shift = magnitude > HDR_SUB_BUCKET_BITS ? magnitude - HDR_SUB_BUCKET_BITS : 0;
+    return ((size_t)shift << HDR_SUB_BUCKET_BITS) + (size_t)(value >> shift);
+}
+
+// Largest value counted by the bucket at index
+static uint64_t hdrHighestValue(size_t index) {
+    int shift = index < 2 * HDR_SUB_BUCKETS ? 0 : (int)(index >> HDR_SUB_BUCKET_BITS) - 1;
+    uint64_t sub_bucket = index - ((size_t)shift << HDR_SUB_BUCKET_BITS);
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+/**
+ * Records a value in an HDR histogram without locking
+ * 
+ * @param h Histogram to record into
+ * @param value Value to count (clamped to the histogram's range)
+ */
+
+void hdrRecord(HdrHistogram* h, uint64_t value) {
+    uint64_t limit = (1ull << HDR_MAX_MAGNITUDE) - 1;
+    if (value > limit) value = limit;
+
+    __atomic_fetch_add(&h->counts[hdrIndex(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELEASE); // Last: readers never see more values than counts
+}
+
+/**
+ * Reads several percentiles of an HDR histogram in one walk
+ * 
+ * Safe while other threads record; the result then reflects some of their
+ * values and not others.
+ * 
+ * @param h Histogram to read
+ * @param percentiles Percentiles to read (0-100), ascending
+ * @param values Output: the value at each percentile (0 for an empty histogram)
+ * @param count Number of percentiles
+ * @return Values recorded when the walk started
+ */
+
+uint64_t hdrPercentiles(const HdrHistogram* h, const double* percentiles, uint64_t* values, int count) {
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_ACQUIRE);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint64_t seen = 0;
+    int next = 0;
+
+    for (size_t i = 0; i < HDR_COUNTS && next < count && total > 0; i++) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        while (next < count && seen > 0) {
+            double rank = percentiles[next] / 100.0 * total;
+            if (seen < rank) break;
+            values[next++] = MIN(hdrHighestValue(i), max);
+        }
+    }
+    while (next < count) {
+        values[next++] = total > 0 ? max : 0;
+    }
+    return total;
+}
+
+// Records a duration in microseconds (negative durations count as 0)
+static void metricsRecordNs(int metric, long long ns) {
+    hdrRecord(&lifecycle_metrics.histograms[metric], ns > 0 ? (uint64_t)(ns / 1000) : 0);
+}
+
+/**
+ * Moves a taxi between free and occupied, accounting its idle time
+ * 
+ * @param taxi Taxi changing state (its lock held)
+ * @param free New availability
+ * @param now Simulation time of the change
+ */
+
+static void taxiSetFree(Taxi* taxi, bool free, long long now) {
+    if (taxi->isFree) {
+        taxi->idle_ns += now - taxi->state_since_ns;
+    }
+    taxi->state_since_ns = now;
+    taxi->isFree = free;
+}
+
+/**
+ * Starts a new route for a taxi
+ * 
+ * Bumps the taxi's route epoch, so every route message (MOVE_TO, FINISH,
+ * GOT_PASSENGER) sent for an earlier route becomes stale and the taxi
+ * discards it on its own. The control center never waits for the taxi.
+ * 
+ * @param taxi Taxi receiving the route
+ * @param passenger Passenger the route serves (0 for a wander trip)
+ * @return Epoch to tag the route's messages with (in extra_x)
+ */
+
+int taxiBeginRoute(Taxi* taxi, int passenger) {
+    long long now = simNowNs();
+
+    pthread_mutex_lock(&taxi->lock);
+    int epoch = ++taxi->route_epoch;
+    if (passenger != 0) {
+        taxiSetFree(taxi, false, now);
+        taxi->currentPassenger = passenger;
+    }
+    pthread_mutex_unlock(&taxi->lock);
+    return epoch;
+}
+
+/**
+ * Checks that a route message belongs to the taxi's current route
+ * 
+ * A stale message is counted as dropped by the taxi's queue.
+ * 
+ * @param taxi Taxi handling the message
+ * @param msg Route message (epoch in extra_x)
+ * @param passenger Set to the passenger of the route, read with the epoch
+ * @return true if the message is current
+ */
+
+bool taxiRouteCurrent(Taxi* taxi, const Message* msg, int* passenger) {
+    pthread_mutex_lock(&taxi->lock);
+    bool current = msg->extra_x == taxi->route_epoch;
+    *passenger = taxi->currentPassenger;
+    pthread_mutex_unlock(&taxi->lock);
+
+    if (!current) {
+        __atomic_add_fetch(&taxi->queue.dropped, 1, __ATOMIC_RELAXED);
+    }
+    return current;
+}
+
+/**
+ * Frees a taxi at the end of a route, unless a newer route was sent
+ * 
+ * @param taxi Taxi finishing its route
+ * @param epoch Epoch of the route's FINISH
+ * @return true if the taxi is now free
+ */
+
+bool taxiFinishRoute(Taxi* taxi, int epoch) {
+    long long now = simNowNs();
+
+    pthread_mutex_lock(&taxi->lock);
+    bool current = epoch == taxi->route_epoch;
+    if (current) {
+        taxiSetFree(taxi, true, now);
+    }
+    pthread_mutex_unlock(&taxi->lock);
+
+    if (!current) {
+        __atomic_add_fetch(&taxi->queue.dropped, 1, __ATOMIC_RELAXED);
+    }
+    return current;
+}
+
+/**
+ * Samples the idle ratio of every taxi since its previous sample
+ * 
+ * Each taxi adds one value to the METRIC_IDLE histogram: the per mille of
+ * the interval it spent free.
+ * 
+ * @param center Control center owning the fleet
+ */
+
+void metricsSampleIdle(ControlCenter* center) {
+    long long now = simNowNs();
+
+    lockAcquire(&center->lock, LOCK_CENTER);
+    for (int i = 0; i < center->numTaxis; i++) {
+        Taxi* taxi = center->taxis[i];
+        pthread_mutex_lock(&taxi->lock);
+        long long idle_ns = taxi->idle_ns + (taxi->isFree ? now - taxi->state_since_ns : 0);
+        long long span_ns = now - taxi->sampled_ns;
+        if (span_ns > 0) {
+            hdrRecord(&lifecycle_metrics.histograms[METRIC_IDLE],
+                      (uint64_t)((idle_ns - taxi->sampled_idle_ns) * 1000 / span_ns));
+        }
+        taxi->sampled_ns = now;
+        taxi->sampled_idle_ns = idle_ns;
+        pthread_mutex_unlock(&taxi->lock);
+    }
+    lockRelease(&center->lock, LOCK_CENTER);
+}
+
+/**
+ * Appends a percentile snapshot of every lifecycle metric to metrics_file
+ * 
+ * Histograms are cumulative, so consecutive lines show how p50/p99 move as
+ * dispatch or routing settings change.
+ */
+
+void metricsSnapshot() {
+    static const char* names[METRIC_COUNT] = {"wait", "eta_error", "trip", "retire", "idle"};
+    static const double percentiles[] = {50, 90, 99};
+
+    if (!metrics_file) return;
+
+    fprintf(metrics_file, "t=%.1fs snapshot=%lu", simNowNs() / 1e9, ++lifecycle_metrics.snapshots);
+    for (int metric = 0; metric < METRIC_COUNT; metric++) {
+        uint64_t values[3];
+        const HdrHistogram* h = &lifecycle_metrics.histograms[metric];
+        uint64_t total = hdrPercentiles(h, percentiles, values, 3);
+        if (metric == METRIC_IDLE) {
+            fprintf(metrics_file, " | %s n=%llu p50=%.1f%% p90=%.1f%% p99=%.1f%%", names[metric],
+                    (unsigned long long)total, values[0] / 10.0, values[1] / 10.0, values[2] / 10.0);
+        } else {
+            double mean_s = total ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e6 / total : 0.0;
+            fprintf(metrics_file, " | %s n=%llu p50=%.3fs p90=%.3fs p99=%.3fs max=%.3fs mean=%.3fs", names[metric],
+                    (unsigned long long)total, values[0] / 1e6, values[1] / 1e6, values[2] / 1e6,
+                    __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e6, mean_s);
+        }
+    }
+    fprintf(metrics_file, "\n");
+    fflush(metrics_file);
+}
+
+// Prints p50/p99 of the lifecycle metrics under the map
+void print_metrics() {
+    static const char* names[METRIC_COUNT] = {"Wait", "ETA error", "Trip", "Retire", "Idle"};
+    static const double percentiles[] = {50, 99};
+
+    for (int metric = 0; metric < METRIC_COUNT; metric++) {
+        uint64_t values[2];
+        uint64_t total = hdrPercentiles(&lifecycle_metrics.histograms[metric], percentiles, values, 2);
+        if (metric == METRIC_IDLE) {
+            printf("%s p50 %.0f%% p99 %.0f%% (n=%llu)\n", names[metric], values[0] / 10.0, values[1] / 10.0,
+                   (unsigned long long)total);
+        } else if (metric == METRIC_RETIRE) {
+            printf("%s p50 %.1f ms p99 %.1f ms (n=%llu) | ", names[metric], values[0] / 1e3, values[1] / 1e3,
+                   (unsigned long long)total);
+        } else {
+            printf("%s p50 %.1f s p99 %.1f s (n=%llu) | ", names[metric], values[0] / 1e6, values[1] / 1e6,
+                   (unsigned long long)total);
+        }
+    }
+}
+
+// -------------------- TRACE FUNCTIONS --------------------
+
+static TraceRing* trace_rings = NULL; // Every thread's ring, newest first (kept until the export)
+static int trace_ring_count = 0;
+static unsigned long trace_lost = 0; // Spans of threads beyond TRACE_MAX_RINGS
+static long long trace_origin_ns = 0; // Time 0 of the exported timeline
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceRing* trace_ring = NULL; // Ring of the calling thread
+static __thread bool trace_registered = false; // ... once it asked for one
+static __thread char trace_thread_name[sizeof(((TraceRing*)0)->name)] = "thread";
+
+// Returns the calling thread's ring, registering it on first use (NULL past TRACE_MAX_RINGS)
+static TraceRing* traceRing() {
+    if (trace_registered) return trace_ring;
+    trace_registered = true;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_ring_count < TRACE_MAX_RINGS) {
+        trace_ring = calloc(1, sizeof(TraceRing));
+        if (trace_ring) {
+            trace_ring->tid = ++trace_ring_count;
+            memcpy(trace_ring->name, trace_thread_name, sizeof(trace_ring->name));
+            trace_ring->next = trace_rings;
+            trace_rings = trace_ring;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return trace_ring;
+}
+
+// Names the calling thread on the timeline (call at thread start)
+void traceThreadName(const char* name) {
+    snprintf(trace_thread_name, sizeof(trace_thread_name), "%s", name);
+    if (trace_ring) {
+        memcpy(trace_ring->name, trace_thread_name, sizeof(trace_ring->name));
+    }
+}
+
+// Opens a span: returns its start time, or 0 when tracing is off
+long long traceStart() {
+    return trace_file_path ? monotonic_ns() : 0;
+}
+
+/**
+ * Closes a span opened by traceStart and stores it in the thread's ring
+ * 
+ * Only the owning thread writes its ring, so no lock is taken; when the
+ * ring is full the oldest spans are overwritten.
+ * 
+ * @param category Chrome trace category (e.g. "message", "route", "lock")
+ * @param name Span name (a string literal: only the pointer is kept)
+ * @param started Value returned by traceStart (0: nothing recorded)
+ */
+
+void traceSpan(const char* category, const char* name, long long started) {
+    if (!started) return;
+
+    TraceRing* ring = traceRing();
+    if (!ring) {
+        __atomic_add_fetch(&trace_lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    TraceEvent* event = &ring->events[ring->head % TRACE_RING_EVENTS];
+    event->name = name;
+    event->category = category;
+    event->start_ns = started;
+    event->duration_ns = monotonic_ns() - started;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes every ring as Chrome/Perfetto trace-event JSON and frees them
+ * 
+ * Spans become complete ("X") events in microseconds since the tracer
+ * started, one track per thread, named by traceThreadName. Call once the
+ * traced threads have stopped.
+ * 
+ * @param path Output file
+ * @return false if the file could not be written
+ */
+
+bool traceExport(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"seed\": %llu, \"lost_spans\": %lu},\n\"traceEvents\": [\n",
+            (unsigned long long)sim_seed, __atomic_load_n(&trace_lost, __ATOMIC_RELAXED));
+    fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"TaxiChaos\"}}");
+
+    pthread_mutex_lock(&trace_lock);
+    for (TraceRing* ring = trace_rings; ring; ) {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                ring->tid, ring->name);
+        for (unsigned long i = first; i < head; i++) {
+            const TraceEvent* event = &ring->events[i % TRACE_RING_EVENTS];
+            fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    event->name, event->category, ring->tid, (event->start_ns - trace_origin_ns) / 1000.0,
+                    event->duration_ns / 1000.0);
+        }
+
+        TraceRing* next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    trace_rings = NULL;
+    trace_ring = NULL; // Later spans of this thread are counted as lost
+    pthread_mutex_unlock(&trace_lock);
+
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+// -------------------- LOCK PROFILE FUNCTIONS --------------------
+
+static LockProfile lock_profiles[LOCK_CLASSES];
+static const char* const lock_names[LOCK_CLASSES] = {"center->lock", "map->lock", "queue->lock", "pause_mutex"};
+static long long lock_profile_origin_ns = 0; // Start of the profiled window
+static __thread long long lock_held_since[LOCK_CLASSES][LOCK_MAX_NESTING]; // Hold start of each lock the thread holds
+static __thread int lock_held_depth[LOCK_CLASSES];
+
+// Starts timing a hold of a lock class by the calling thread
+static void lockHoldBegin(int lock, long long now) {
+    int depth = lock_held_depth[lock]++;
+    if (depth < LOCK_MAX_NESTING) {
+        lock_held_since[lock][depth] = now;
+    }
+}
+
+// Ends the innermost hold of a lock class by the calling thread
+static void lockHoldEnd(int lock) {
+    if (lock_held_depth[lock] <= 0) return;
+    int depth = --lock_held_depth[lock];
+    if (depth < LOCK_MAX_NESTING) {
+        hdrRecord(&lock_profiles[lock].hold, monotonic_ns() - lock_held_since[lock][depth]);
+    }
+}
+
+/**
+ * Locks a profiled mutex
+ * 
+ * Counts the acquisition and, when the mutex was already held, the wait
+ * (also recorded as a "lock" span when tracing). The hold lasts until
+ * lockRelease.
+ * 
+ * @param mutex Mutex to lock
+ * @param lock Its class (LOCK_*)
+ */
+
+void lockAcquire(pthread_mutex_t* mutex, int lock) {
+    LockProfile* profile = &lock_profiles[lock];
+    long long started = monotonic_ns();
+
+    if (pthread_mutex_trylock(mutex) != 0) {
+        pthread_mutex_lock(mutex);
+        long long acquired = monotonic_ns();
+        __atomic_add_fetch(&profile->contended, 1, __ATOMIC_RELAXED);
+        hdrRecord(&profile->wait, acquired - started);
+        traceSpan("lock", lock_names[lock], trace_file_path ? started : 0);
+        started = acquired;
+    }
+    __atomic_add_fetch(&profile->acquisitions, 1, __ATOMIC_RELAXED);
+    lockHoldBegin(lock, started);
+}
+
+// Unlocks a mutex taken with lockAcquire, recording the hold
+void lockRelease(pthread_mutex_t* mutex, int lock) {
+    lockHoldEnd(lock);
+    pthread_mutex_unlock(mutex);
+}
+
+// Waits on a condition variable; the time asleep does not count as holding the mutex
+void lockWait(pthread_cond_t* cond, pthread_mutex_t* mutex, int lock) {
+    lockHoldEnd(lock);
+    pthread_cond_wait(cond, mutex);
+    lockHoldBegin(lock, monotonic_ns());
+}
+
+// Index of the lock with the most total wait
+static int lockMostContended() {
+    int worst = 0;
+    for (int lock = 1; lock < LOCK_CLASSES; lock++) {
+        if (__atomic_load_n(&lock_profiles[lock].wait.sum, __ATOMIC_RELAXED) >
+            __atomic_load_n(&lock_profiles[worst].wait.sum, __ATOMIC_RELAXED)) {
+            worst = lock;
+        }
+    }
+    return worst;
+}
+
+/**
+ * Writes the lock contention report
+ * 
+ * One row per lock: acquisitions, share contended, wait and hold
+ * percentiles and totals since the program started.
+ * 
+ * @param path Output file
+ * @return false if the file could not be written
+ */
+
+bool lockProfileWrite(const char* path) {
+    static const double percentiles[] = {50, 99};
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+
+    double elapsed_s = (monotonic_ns() - lock_profile_origin_ns) / 1e9;
+    fprintf(file, "Lock contention over %.1f s (seed %llu); times in us\n", elapsed_s, (unsigned long long)sim_seed);
+    fprintf(file, "%-13s %10s %10s %6s | %9s %9s %9s %10s | %9s %9s %9s %10s\n", "lock", "acquired", "contended", "%",
+            "wait p50", "p99", "max", "total ms", "hold p50", "p99", "max", "total ms");
+    for (int lock = 0; lock < LOCK_CLASSES; lock++) {
+        const LockProfile* profile = &lock_profiles[lock];
+        unsigned long acquisitions = __atomic_load_n(&profile->acquisitions, __ATOMIC_RELAXED);
+        unsigned long contended = __atomic_load_n(&profile->contended, __ATOMIC_RELAXED);
+        uint64_t wait[2], hold[2];
+        hdrPercentiles(&profile->wait, percentiles, wait, 2);
+        hdrPercentiles(&profile->hold, percentiles, hold, 2);
+
+        fprintf(file, "%-13s %10lu %10lu %5.1f%% | %9.1f %9.1f %9.1f %10.1f | %9.1f %9.1f %9.1f %10.1f\n",
+                lock_names[lock], acquisitions, contended, acquisitions ? 100.0 * contended / acquisitions : 0.0,
+                wait[0] / 1e3, wait[1] / 1e3, profile->wait.max / 1e3, profile->wait.sum / 1e6,
+                hold[0] / 1e3, hold[1] / 1e3, profile->hold.max / 1e3, profile->hold.sum / 1e6);
+    }
+    return fclose(file) == 0;
+}
+
+// Prints the most contended lock under the map
+void print_lock_profile() {
+    static const double percentiles[] = {99};
+    int lock = lockMostContended();
+    const LockProfile* profile = &lock_profiles[lock];
+    unsigned long acquisitions = __atomic_load_n(&profile->acquisitions, __ATOMIC_RELAXED);
+    unsigned long contended = __atomic_load_n(&profile->contended, __ATOMIC_RELAXED);
+    uint64_t wait, hold;
+    hdrPercentiles(&profile->wait, percentiles, &wait, 1);
+    hdrPercentiles(&profile->hold, percentiles, &hold, 1);
+
+    printf("Locks: most waited %s, %lu/%lu contended, wait p99 %.1f us, hold p99 %.1f us ('b': %s)\n",
+           lock_names[lock], contended, acquisitions, wait / 1e3, hold / 1e3, LOCK_PROFILE_FILE_PATH);
+}
+
+// -------------------- PERF COUNTER FUNCTIONS --------------------
+
+static PerfRegion perf_regions[PERF_REGIONS];
+static const char* const perf_region_names[PERF_REGIONS] = {"bfs", "renderMap", "generateMap", "dispatch"};
+static const uint64_t perf_configs[PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+};
+static int perf_errno = 0; // Why a counter could not be opened (0: every one opened)
+static pthread_key_t perf_key; // Closes a thread's counters when it exits
+static pthread_once_t perf_key_once = PTHREAD_ONCE_INIT;
+static __thread PerfThread* perf_thread = NULL; // Counters of the calling thread
+static __thread bool perf_opened = false; // ... once it tried to open them
+
+// Closes the counters of an exiting thread
+static void perfThreadClose(void* arg) {
+    PerfThread* thread = (PerfThread*)arg;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (thread->fds[i] >= 0) close(thread->fds[i]);
+    }
+    free(thread);
+}
+
+static void perfKeyCreate() {
+    pthread_key_create(&perf_key, perfThreadClose);
+}
+
+/**
+ * Opens the calling thread's counter group on first use
+ * 
+ * Cycles lead the group, so one read() returns every counter. A counter
+ * the CPU or kernel refuses is left out of the group; without cycles
+ * nothing is counted and regions only report calls and time.
+ * 
+ * @return The thread's counters, or NULL when unavailable
+ */
+
+static PerfThread* perfThread() {
+    if (perf_opened) return perf_thread;
+    perf_opened = true;
+
+    PerfThread* thread = malloc(sizeof(PerfThread));
+    if (!thread) return NULL;
+    thread->count = 0;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1; // Allowed at the default perf_event_paranoid
+        attr.exclude_hv = 1;
+
+        int leader = i == 0 ? -1 : thread->fds[0];
+        thread->fds[i] = (i == 0 || thread->fds[0] >= 0) ?
+                         (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0) : -1;
+        if (thread->fds[i] < 0) {
+            __atomic_store_n(&perf_errno, errno ? errno : ENOENT, __ATOMIC_RELAXED);
+            thread->slot[i] = -1;
+        } else {
+            thread->slot[i] = thread->count++;
+        }
+    }
+    if (thread->fds[0] < 0) {
+        free(thread);
+        return NULL;
+    }
+
+    pthread_once(&perf_key_once, perfKeyCreate);
+    pthread_setspecific(perf_key, thread);
+    perf_thread = thread;
+    return thread;
+}
+
+// Reads the calling thread's counters into sample; false if it has none
+static bool perfRead(PerfSample* sample) {
+    PerfThread* thread = perfThread();
+    if (!thread) return false;
+
+    uint64_t buffer[1 + PERF_COUNTERS];
+    if (read(thread->fds[0], buffer, sizeof(buffer)) < (ssize_t)((1 + thread->count) * sizeof(uint64_t))) {
+        return false;
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        sample->values[i] = thread->slot[i] >= 0 ? buffer[1 + thread->slot[i]] : 0;
+    }
+    return true;
+}
+
+// Opens a region: samples the time and, when available, the counters (no-op without --perf)
+void perfBegin(PerfSample* sample) {
+    sample->ns = 0;
+    if (!perf_enabled) return;
+    sample->counted = perfRead(sample);
+    sample->ns = monotonic_ns();
+}
+
+/**
+ * Closes a region opened by perfBegin and adds its deltas to the region totals
+ * 
+ * @param region PERF_REGION_*
+ * @param start Sample taken by perfBegin (ns == 0: nothing recorded)
+ */
+
+void perfEnd(int region, const PerfSample* start) {
+    if (!start->ns) return;
+
+    long long now = monotonic_ns();
+    PerfRegion* totals = &perf_regions[region];
+    PerfSample end;
+    __atomic_add_fetch(&totals->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->ns, now - start->ns, __ATOMIC_RELAXED);
+    if (start->counted && perfRead(&end)) {
+        __atomic_add_fetch(&totals->counted, 1, __ATOMIC_RELAXED);
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            __atomic_add_fetch(&totals->values[i], end.values[i] - start->values[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Writes the per-call counter report of every region
+ * 
+ * Counters are averaged over the calls that were counted; without
+ * hardware counters (no PMU, perf_event_paranoid, seccomp) the report
+ * says why and keeps calls and time per call.
+ * 
+ * @param path Output file
+ * @return false if the file could not be written
+ */
+
+bool perfReportWrite(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+
+    int error = __atomic_load_n(&perf_errno, __ATOMIC_RELAXED);
+    fprintf(file, "Hardware counters per call (seed %llu)", (unsigned long long)sim_seed);
+    if (error) {
+        fprintf(file, "; some counters unavailable: %s", strerror(error));
+    }
+    fprintf(file, "\n%-12s %10s %12s %14s %14s %6s %14s %14s\n", "region", "calls", "ns/call", "cycles/call",
+            "instr/call", "IPC", "cache-miss/call", "branch-miss/call");
+
+    for (int region = 0; region < PERF_REGIONS; region++) {
+        const PerfRegion* totals = &perf_regions[region];
+        unsigned long calls = __atomic_load_n(&totals->calls, __ATOMIC_RELAXED);
+        unsigned long counted = __atomic_load_n(&totals->counted, __ATOMIC_RELAXED);
+        fprintf(file, "%-12s %10lu %12.0f", perf_region_names[region], calls,
+                calls ? (double)totals->ns / calls : 0.0);
+        if (counted == 0) {
+            fprintf(file, " %14s %14s %6s %14s %14s\n", "-", "-", "-", "-", "-");
+            continue;
+        }
+        const uint64_t* v = totals->values;
+        fprintf(file, " %14.0f %14.0f %6.2f %14.1f %14.1f\n", (double)v[PERF_CYCLES] / counted,
+                (double)v[PERF_INSTRUCTIONS] / counted, v[PERF_CYCLES] ? (double)v[PERF_INSTRUCTIONS] / v[PERF_CYCLES] : 0.0,
+                (double)v[PERF_CACHE_MISSES] / counted, (double)v[PERF_BRANCH_MISSES] / counted);
+    }
+    return fclose(file) == 0;
+}
+
+// -------------------- CHECKPOINT FUNCTIONS --------------------
+
+static CheckpointWriter checkpoint_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Lowest taxi ID neither in the fleet nor held by a retiring taxi (center->lock held)
+static int centerFreeTaxiId(const ControlCenter* center) {
+    bool taken[MAX_TAXIS + 2] = {false};
+    for (int i = 0; i < center->numTaxis; i++) {
+        taken[center->taxis[i]->id] = true;
+    }
+    for (int i = 0; i < center->numRetiring; i++) {
+        taken[center->retiring[i]->id] = true;
+    }
+    int id = 1;
+    while (taken[id]) id++;
+    return id;
+}
+
+/**
+ * Allocates a taxi of the control center, not yet started nor stored
+ * 
+ * @param center Control center the taxi reports to
+ * @return New Taxi with the lowest free ID, or NULL on allocation failure
+ */
+
+static Taxi* taxiCreate(ControlCenter* center) {
+    Taxi* taxi = malloc(sizeof(Taxi));
+    if (!taxi) return NULL;
+
+    taxi->id = centerFreeTaxiId(center);
+    taxi->x = -1;
+    taxi->y = -1;
+    taxi->isFree = true;
+    taxi->currentPassenger = -1;
+    taxi->visualizerQueue = center->visualizerQueue;
+    taxi->control_queue = &center->queue;
+    taxi->route_epoch = 0;
+    taxi->reservations = center->reservations;
+    taxi->idle_ns = 0;
+    taxi->state_since_ns = simNowNs();
+    taxi->sampled_ns = taxi->state_since_ns;
+    taxi->sampled_idle_ns = 0;
+    taxi->retiring = false;
+    taxi->retire_ns = 0;
+    pthread_mutex_init(&taxi->lock, NULL);
+    init_queue(&taxi->queue);
+    taxi->queue.actor = SCHED_ACTOR_TAXI + center->taxis_created++;
+    return taxi;
+}
+
+// Appends bytes to a checkpoint image, returning where they went (NULL data: zeros)
+static void* checkpointReserve(CheckpointBuffer* buffer, const void* data, size_t bytes) {
+    if (buffer->failed) return NULL;
+    if (buffer->size + bytes > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 65536;
+        while (buffer->size + bytes > capacity) capacity *= 2;
+        char* grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            buffer->failed = true;
+            return NULL;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+
+    void* at = buffer->data + buffer->size;
+    if (data) {
+        memcpy(at, data, bytes);
+    } else {
+        memset(at, 0, bytes);
+    }
+    buffer->size += bytes;
+    return at;
+}
+
+// Pads a checkpoint image to the next section and returns the section's offset
+static uint64_t checkpointSection(CheckpointBuffer* buffer) {
+    checkpointReserve(buffer, NULL, cityAlign(buffer->size) - buffer->size);
+    return buffer->size;
+}
+
+// Stores what a message's pointer refers to (false: it refers to something gone)
+static bool checkpointMessagePointer(const Message* msg, ControlCenter* center, Passenger** passengers,
+                                     int num_passengers, CheckpointMessage* record, CheckpointBuffer* payload) {
+    record->ref = -1;
+    if (!msg->pointer) return true;
+
+    switch (msg->type) {
+        case CREATE_PASSENGER:
+            for (int i = 0; i < num_passengers; i++) {
+                if (passengers[i] == msg->pointer) record->ref = i;
+            }
+            return record->ref >= 0;
+
+        case MOVE_TO:
+        case SPAWN_TAXI:
+            for (int i = 0; i < center->numTaxis; i++) {
+                Taxi* taxi = center->taxis[i];
+                if (msg->pointer == (msg->type == MOVE_TO ? (void*)taxi : (void*)&taxi->queue)) record->ref = i;
+            }
+            return record->ref >= 0;
+
+        case ROUTE_PLAN: {
+            const PathData* path = msg->pointer;
+            int32_t fields[] = {path->start_x, path->start_y, path->end_x, path->end_y, path->tamanho_solucao};
+            record->payload = payload->size / sizeof(int32_t);
+            record->payload_words = 5 + path->num_segments;
+            checkpointReserve(payload, fields, sizeof(fields));
+            for (int s = 0; s < path->num_segments; s++) {
+                uint32_t word = path->segments[s].op | (uint32_t)path->segments[s].run << 3;
+                checkpointReserve(payload, &word, sizeof(word));
+            }
+            return true;
+        }
+
+        case PATHFIND_REQUEST: {
+            const int* destinations = msg->pointer;
+            record->payload = payload->size / sizeof(int32_t);
+            record->payload_words = 4;
+            checkpointReserve(payload, destinations, 4 * sizeof(int32_t));
+            return true;
+        }
+
+        default:
+            return true;
+    }
+}
+
+// Stores a queue's current and pending messages (checkpoint requests and blocked-route notes are not kept)
+static uint32_t checkpointQueue(CheckpointBuffer* buffer, CheckpointBuffer* payload, MessageQueue* queue, int queue_id,
+                                ControlCenter* center, Passenger** passengers, int num_passengers) {
+    uint32_t count = 0;
+    lockAcquire(&queue->lock, LOCK_QUEUE);
+    Message* msg = queue->current ? queue->current : queue->head;
+    while (msg) {
+        CheckpointMessage record;
+        memset(&record, 0, sizeof(record));
+        record.queue = queue_id;
+        record.type = msg->type;
+        record.data_x = msg->data_x;
+        record.data_y = msg->data_y;
+        record.extra_x = msg->extra_x;
+        record.extra_y = msg->extra_y;
+        if (msg->type != CHECKPOINT && msg->type != ROUTE_BLOCKED &&
+            checkpointMessagePointer(msg, center, passengers, num_passengers, &record, payload)) {
+            checkpointReserve(buffer, &record, sizeof(record));
+            count++;
+        }
+        msg = (msg == queue->current) ? queue->head : msg->next;
+    }
+    lockRelease(&queue->lock, LOCK_QUEUE);
+    return count;
+}
+
+/**
+ * Copies the whole simulation into a checkpoint image
+ * 
+ * Runs with the world stopped (see schedStopWorld) and the center lock
+ * held, so only memory is touched here; the file is written afterwards.
+ * 
+ * @param buffer Empty image to fill
+ * @param map Current map
+ * @param visualizer Visualizer (and, through it, the control center)
+ * @return true on success, false on allocation failure
+ */
+
+static bool checkpointCapture(CheckpointBuffer* buffer, Map* map, Visualizer* visualizer) {
+    ControlCenter* center = visualizer->center;
+    ReservationTable* table = center->reservations;
+    CongestionMap* congestion = map->congestion;
+    CheckpointBuffer payload = {0};
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_FILE_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_FILE_VERSION;
+    header.header_bytes = sizeof(CheckpointHeader);
+    header.endian = CITY_FILE_ENDIAN;
+    header.tile_size = MAP_TILE_SIZE;
+    header.seed = sim_seed;
+    header.clock_ns = simNowNs();
+    header.time_scale = sim_time_scale;
+    header.map_rng = visualizer->map_rng.state;
+    header.spawn_rng = visualizer->spawn_rng.state;
+    header.rows = map->rows;
+    header.cols = map->cols;
+    header.road_width = map->road_width;
+    header.num_squares = map->num_squares;
+    header.congestion_routing = center->congestion_routing;
+    header.taxis_created = center->taxis_created;
+    for (int mode = 0; mode < 2; mode++) {
+        header.trips[mode] = center->trips[mode];
+        header.trip_ns[mode] = center->trip_ns[mode];
+    }
+    header.route_repairs = visualizer->route_repairs;
+    checkpointReserve(buffer, NULL, sizeof(header));
+
+    // Tiles: the index of every stored tile, then their cells (all map values fit 16 bits)
+    const TileGrid* grid = &map->grid;
+    size_t num_tiles = (size_t)grid->tile_rows * grid->tile_cols;
+    header.tile_index_offset = checkpointSection(buffer);
+    for (size_t t = 0; t < num_tiles; t++) {
+        if (grid->tiles[t] == sidewalk_tile) continue;
+        uint32_t index = (uint32_t)t;
+        checkpointReserve(buffer, &index, sizeof(index));
+        header.num_stored_tiles++;
+    }
+    header.tiles_offset = checkpointSection(buffer);
+    for (size_t t = 0; t < num_tiles; t++) {
+        if (grid->tiles[t] == sidewalk_tile) continue;
+        uint16_t* cells = checkpointReserve(buffer, NULL, MAP_TILE_CELLS * sizeof(uint16_t));
+        if (!cells) break;
+        for (int i = 0; i < MAP_TILE_CELLS; i++) {
+            cells[i] = (uint16_t)grid->tiles[t][i];
+        }
+    }
+
+    header.squares_offset = checkpointSection(buffer);
+    checkpointReserve(buffer, map->squares, (size_t)map->num_squares * sizeof(Square));
+
+    // Fleet; taxi->lock is taken before table->lock everywhere, so the cells come after
+    header.taxis_offset = checkpointSection(buffer);
+    for (int i = 0; i < center->numTaxis; i++) {
+        Taxi* taxi = center->taxis[i];
+        CheckpointTaxi record;
+        memset(&record, 0, sizeof(record));
+        record.id = taxi->id;
+        record.x = taxi->x;
+        record.y = taxi->y;
+        record.is_free = taxi->isFree;
+        record.current_passenger = taxi->currentPassenger;
+        record.actor = taxi->queue.actor;
+        record.occupied_cell = -1;
+        record.reserved_until = -1;
+        pthread_mutex_lock(&taxi->lock);
+        record.idle_ns = taxi->idle_ns;
+        record.state_since_ns = taxi->state_since_ns;
+        record.route_epoch = taxi->route_epoch;
+        record.sampled_ns = taxi->sampled_ns;
+        record.sampled_idle_ns = taxi->sampled_idle_ns;
+        pthread_mutex_unlock(&taxi->lock);
+        checkpointReserve(buffer, &record, sizeof(record));
+        header.num_taxis++;
+    }
+
+    // Each taxi's cell in the reservation table, then the table itself
+    if (table) pthread_mutex_lock(&table->lock);
+    if (table && !buffer->failed) {
+        CheckpointTaxi* records = (CheckpointTaxi*)(buffer->data + header.taxis_offset);
+        for (uint32_t i = 0; i < header.num_taxis; i++) {
+            records[i].occupied_cell = table->occupied_cell[records[i].id];
+            records[i].reserved_until = table->reserved_until[records[i].id];
+        }
+    }
+    header.reservations_offset = checkpointSection(buffer);
+    if (table) {
+        header.reservation_origin_ns = table->origin_ns;
+        for (int i = 0; i < table->capacity; i++) {
+            if (table->slots[i].taxi_id == 0) continue;
+            CheckpointReservation record = {table->slots[i].cell, table->slots[i].taxi_id, table->slots[i].tick};
+            checkpointReserve(buffer, &record, sizeof(record));
+            header.num_reservations++;
+        }
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    Passenger* passengers[MAX_PASSENGERS];
+    int num_passengers = 0;
+    header.passengers_offset = checkpointSection(buffer);
+    for (int i = 0; i < center->numPassengers; i++) {
+        Passenger* passenger = center->passengers[i];
+        if (!passenger) continue;
+        CheckpointPassenger record;
+        memset(&record, 0, sizeof(record));
+        record.id = passenger->id;
+        record.x_sidewalk = passenger->x_sidewalk;
+        record.y_sidewalk = passenger->y_sidewalk;
+        record.x_road = passenger->x_road;
+        record.y_road = passenger->y_road;
+        record.x_sidewalk_dest = passenger->x_sidewalk_dest;
+        record.y_sidewalk_dest = passenger->y_sidewalk_dest;
+        record.x_road_dest = passenger->x_road_dest;
+        record.y_road_dest = passenger->y_road_dest;
+        record.is_free = passenger->isFree;
+        record.trip_congestion_aware = passenger->trip_congestion_aware;
+        record.trip_started_ns = passenger->trip_started_ns;
+        record.spawned_ns = passenger->spawned_ns;
+        record.picked_up_ns = passenger->picked_up_ns;
+        record.pickup_eta_ns = passenger->pickup_eta_ns;
+        record.taxi_id = passenger->taxi_id;
+        record.route_cells = passenger->route_cells;
+        record.detours = passenger->detours;
+        checkpointReserve(buffer, &record, sizeof(record));
+        passengers[num_passengers++] = passenger;
+    }
+    header.num_passengers = num_passengers;
+
+    header.routes_offset = checkpointSection(buffer);
+    for (int id = 1; id <= MAX_TAXIS; id++) {
+        const InflightRoute* route = &visualizer->inflight[id];
+        if (route->num_legs == 0) continue;
+        CheckpointRoute record;
+        memset(&record, 0, sizeof(record));
+        record.taxi_id = id;
+        record.num_legs = route->num_legs;
+        record.leg = route->leg;
+        record.passenger_id = route->passenger_id;
+        record.ticks_per_step = route->ticks_per_step;
+        for (int l = route->leg; l < route->num_legs; l++) {
+            const DStarLite* d = route->legs[l];
+            record.leg_event[l] = route->leg_event[l];
+            record.start_col[l] = d->start_col;
+            record.start_row[l] = d->start_row;
+            record.goal_col[l] = d->goal_col;
+            record.goal_row[l] = d->goal_row;
+        }
+        checkpointReserve(buffer, &record, sizeof(record));
+        header.num_routes++;
+    }
+
+    header.congestion_offset = checkpointSection(buffer);
+    if (congestion) {
+        long now = congestionNow(congestion);
+        header.congestion_origin_ns = congestion->origin_ns;
+        header.congestion_active_until = congestion->active_until;
+        for (size_t cell = 0; now < congestion->active_until && cell < (size_t)map->rows * map->cols; cell++) {
+            if (congestion->density[cell] == 0.0f || now - congestion->stamp[cell] >= congestion->memory) continue;
+            CheckpointCongestion record = {(uint32_t)cell, congestion->density[cell], congestion->stamp[cell]};
+            checkpointReserve(buffer, &record, sizeof(record));
+            header.num_congested++;
+        }
+    }
+
+    header.messages_offset = checkpointSection(buffer);
+    header.num_messages += checkpointQueue(buffer, &payload, &center->queue, CHECKPOINT_QUEUE_CENTER,
+                                           center, passengers, num_passengers);
+    header.num_messages += checkpointQueue(buffer, &payload, &visualizer->queue, CHECKPOINT_QUEUE_VISUALIZER,
+                                           center, passengers, num_passengers);
+    for (int i = 0; i < center->numTaxis; i++) {
+        header.num_messages += checkpointQueue(buffer, &payload, &center->taxis[i]->queue, CHECKPOINT_QUEUE_TAXI + i,
+                                               center, passengers, num_passengers);
+    }
+
+    header.payload_offset = checkpointSection(buffer);
+    header.num_payload_words = payload.size / sizeof(int32_t);
+    if (payload.failed) buffer->failed = true;
+    if (payload.size) checkpointReserve(buffer, payload.data, payload.size);
+    free(payload.data);
+    header.file_bytes = checkpointSection(buffer);
 
-    pthread_mutex_unlock(&queue->lock);
-    return msg;
+    if (buffer->failed) return false;
+    memcpy(buffer->data, &header, sizeof(header));
+    return true;
 }
 
-// Cleanup the queue
-void cleanup_queue(MessageQueue* queue) {
-    pthread_mutex_lock(&queue->lock); // Lock the queue to ensure thread safety
+// Sets the checkpoint line shown under the map (printf-style)
+static void checkpointSetStatus(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&checkpoint_writer.lock);
+    vsnprintf(checkpoint_writer.status, sizeof(checkpoint_writer.status), format, args);
+    pthread_mutex_unlock(&checkpoint_writer.lock);
+    va_end(args);
+}
 
-    Message* current = queue->head;
-    while (current != NULL) {
-        Message* next = current->next; // Save the next message
-        free(current);                 // Free the current message
-        current = next;                // Move to the next message
+// Writes the captured image next to the checkpoint file and renames it over it
+static void* checkpointWriterThread(void* arg) {
+    (void)arg;
+    traceThreadName("checkpoint writer");
+    CheckpointBuffer* image = &checkpoint_writer.image;
+
+    char temp_path[PATH_MAX];
+    bool ok = snprintf(temp_path, sizeof(temp_path), "%s.tmp", checkpoint_file_path) < (int)sizeof(temp_path);
+    FILE* file = ok ? fopen(temp_path, "wb") : NULL;
+    ok = file && fwrite(image->data, 1, image->size, file) == image->size;
+    if (file) {
+        ok = (fclose(file) == 0) && ok;
+        if (!ok || rename(temp_path, checkpoint_file_path) != 0) {
+            unlink(temp_path);
+            ok = false;
+        }
     }
 
-    // Reset the queue
-    queue->head = NULL;
-    queue->tail = NULL;
+    if (ok) {
+        checkpointSetStatus("Checkpoint: wrote %s (%.0f KB, world stopped %.2f ms)", checkpoint_file_path,
+                            image->size / 1024.0, checkpoint_writer.pause_ns / 1e6);
+    } else {
+        checkpointSetStatus("Could not write checkpoint %s", checkpoint_file_path);
+    }
 
-    pthread_mutex_unlock(&queue->lock); // Unlock the queue
+    pthread_mutex_lock(&checkpoint_writer.lock);
+    free(image->data);
+    memset(image, 0, sizeof(*image));
+    checkpoint_writer.writing = false;
+    pthread_mutex_unlock(&checkpoint_writer.lock);
+    return NULL;
 }
 
-// -------------------- MAP FUNCTIONS --------------------
+// Waits for the checkpoint writer, if one was started
+void checkpointJoinWriter() {
+    pthread_mutex_lock(&checkpoint_writer.lock);
+    bool started = checkpoint_writer.started;
+    checkpoint_writer.started = false;
+    pthread_mutex_unlock(&checkpoint_writer.lock);
+
+    if (started) {
+        pthread_join(checkpoint_writer.thread, NULL);
+    }
+}
 
 /**
- * Creates a new map structure based on terminal dimensions
+ * Writes a checkpoint of the running simulation to checkpoint_file_path
  * 
- * Dynamically allocates and initializes a map structure by:
- * - Getting terminal dimensions using ioctl
- * - Scaling dimensions by MAP_VERTICAL_PROPORTION and MAP_HORIZONTAL_PROPORTION
- * - Allocating matrix memory
- * - Initializing all cells to SIDEWALK (1)
+ * Called by the visualizer in a step of its own. The world is stopped only
+ * while the state is copied into memory; a background thread writes the
+ * file (through a temporary file, so a crash keeps the previous checkpoint).
+ * Threads waiting inside a step (a taxi sleeping between moves) have not
+ * acted on their message yet, so it is stored as still pending. Skipped
+ * while the control center is removing taxis or the previous checkpoint is
+ * still being written, or while the fleet waits to respawn after a reset.
  * 
- * @return Pointer to newly created Map structure
- * @note Returns NULL if terminal dimensions cannot be obtained
+ * @param visualizer Visualizer taking the checkpoint
+ * @param map Current map
  */
 
-Map* createMap() {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
-        return NULL;
+void checkpointTake(Visualizer* visualizer, Map* map) {
+    pthread_mutex_lock(&checkpoint_writer.lock);
+    bool writing = checkpoint_writer.writing;
+    pthread_mutex_unlock(&checkpoint_writer.lock);
+    if (writing) {
+        checkpointSetStatus("Checkpoint skipped: %s is still being written", checkpoint_file_path);
+        return;
+    }
+    checkpointJoinWriter();
+
+    CheckpointBuffer image = {0};
+    bool retiring = false, captured = false;
+    schedLeave(); // The world stops between steps
+    long long begin = monotonic_ns();
+    schedStopWorld();
+    lockAcquire(&visualizer->center->lock, LOCK_CENTER);
+    retiring = visualizer->center->numRetiring > 0 || visualizer->center->resetting;
+    if (!retiring) {
+        captured = checkpointCapture(&image, map, visualizer);
+    }
+    lockRelease(&visualizer->center->lock, LOCK_CENTER);
+    schedResumeWorld();
+    long long pause_ns = monotonic_ns() - begin;
+    schedResume();
+
+    if (!captured) {
+        free(image.data);
+        checkpointSetStatus("Checkpoint %s skipped: %s", checkpoint_file_path,
+                            retiring ? "taxis are being removed or respawned" : "out of memory");
+        return;
     }
 
-    // Scale the terminal size by 0.6
-    int scaled_rows = (int)(ws.ws_row * MAP_VERTICAL_PROPORTION);
-    int scaled_cols = (int)(ws.ws_col * MAP_HORIZONTAL_PROPORTION);
-
-    Map* map = malloc(sizeof(Map));
-    map->rows = scaled_rows;
-    map->cols = scaled_cols;
-    map->road_width = 1;
-
-    map->matrix = malloc(map->rows * sizeof(int*));
-    for (int i = 0; i < map->rows; i++) {
-        map->matrix[i] = malloc(map->cols * sizeof(int));
-        for (int j = 0; j < map->cols; j++) {
-            map->matrix[i][j] = SIDEWALK;
-        }
+    pthread_mutex_lock(&checkpoint_writer.lock);
+    checkpoint_writer.image = image;
+    checkpoint_writer.pause_ns = pause_ns;
+    checkpoint_writer.writing = true;
+    checkpoint_writer.started = pthread_create(&checkpoint_writer.thread, NULL, checkpointWriterThread, NULL) == 0;
+    if (!checkpoint_writer.started) {
+        free(image.data);
+        memset(&checkpoint_writer.image, 0, sizeof(checkpoint_writer.image));
+        checkpoint_writer.writing = false;
     }
+    pthread_mutex_unlock(&checkpoint_writer.lock);
+}
 
-    return map;
+// Prints the outcome of the last checkpoint under the map
+void print_checkpoint() {
+    pthread_mutex_lock(&checkpoint_writer.lock);
+    if (checkpoint_writer.status[0]) {
+        printf("%s\n", checkpoint_writer.status);
+    }
+    pthread_mutex_unlock(&checkpoint_writer.lock);
 }
 
-/**
- * Frees all memory associated with a map
- * 
- * Safely deallocates map resources by:
- * - Freeing each row of the matrix
- * - Freeing the matrix pointer array
- * - Freeing the map structure itself
- * 
- * @param map Pointer to Map structure to deallocate
- * @note Handles NULL pointer safely
- */
+// Checks that `count` records of `size` bytes at `offset` lie inside the checkpoint
+static bool checkpointSectionValid(const CheckpointHeader* header, uint64_t offset, uint64_t count, uint64_t size) {
+    if (offset % 8 != 0 || offset < header->header_bytes || offset > header->file_bytes) return false;
+    return count <= (header->file_bytes - offset) / size;
+}
 
-void freeMap(Map* map) {
-    if (!map) return;
+// Checks what a checkpointed message refers to against the rest of the checkpoint
+static bool checkpointMessageValid(const CheckpointHeader* header, const CheckpointMessage* record, const int32_t* payload) {
+    if (record->queue < 0 || record->queue >= CHECKPOINT_QUEUE_TAXI + (int32_t)header->num_taxis) return false;
+    if (record->type > CHECKPOINT || record->ref < -1) return false;
+    if (record->payload_words > header->num_payload_words ||
+        record->payload > header->num_payload_words - record->payload_words) return false;
+
+    switch (record->type) {
+        case CREATE_PASSENGER: return record->ref < (int32_t)header->num_passengers;
+        case MOVE_TO: return record->ref < (int32_t)header->num_taxis;
+        case SPAWN_TAXI: return record->ref >= 0 && record->ref < (int32_t)header->num_taxis;
+        case PATHFIND_REQUEST: return record->payload_words == 0 || record->payload_words == 4;
+        case ROUTE_PLAN:
+            if (record->payload_words == 0) return true;
+            if (record->payload_words < 5) return false;
+            for (uint32_t w = 5; w < record->payload_words; w++) {
+                if ((payload[record->payload + w] & 7) > ROUTE_WAIT) return false;
+            }
+            return true;
+        default: return true;
+    }
+}
 
-    for (int i = 0; i < map->rows; i++) {
-        free(map->matrix[i]);
+// Rebuilds the object a checkpointed message pointed to
+static void* checkpointMessageObject(const CheckpointMessage* record, const int32_t* payload, ControlCenter* center) {
+    const int32_t* words = payload + record->payload;
+    switch (record->type) {
+        case CREATE_PASSENGER: return record->ref >= 0 ? center->passengers[record->ref] : NULL;
+        case MOVE_TO: return record->ref >= 0 ? center->taxis[record->ref] : NULL;
+        case SPAWN_TAXI: return &center->taxis[record->ref]->queue;
+        case PATHFIND_REQUEST: {
+            if (record->payload_words == 0) return NULL;
+            int* destinations = malloc(4 * sizeof(int));
+            if (destinations) memcpy(destinations, words, 4 * sizeof(int));
+            return destinations;
+        }
+        case ROUTE_PLAN: {
+            if (record->payload_words == 0) return NULL;
+            PathData* path = pathCreate();
+            if (!path) return NULL;
+            path->start_x = words[0];
+            path->start_y = words[1];
+            path->end_x = words[2];
+            path->end_y = words[3];
+            path->tamanho_solucao = words[4];
+            for (uint32_t w = 5; w < record->payload_words; w++) {
+                if (!pathPushSegment(path, (uint32_t)words[w] & 7, (uint32_t)words[w] >> 3)) {
+                    pathFree(path);
+                    return NULL;
+                }
+            }
+            return path;
+        }
+        default: return NULL;
     }
-    free(map->matrix);
-    free(map);
 }
 
 /**
- * Generates a city map with buildings and roads
+ * Restores a checkpoint written by checkpointTake
  * 
- * Creates a procedural city layout by:
- * 1. Clearing existing map (setting all cells to SIDEWALK)
- * 2. Generating random building squares with:
- *    - Random positions and sizes within min/max constraints
- *    - Minimum distance between buildings
- *    - Border roads around each building
- * 3. Connecting buildings with roads using MST algorithm
+ * Called before any simulation thread starts: rebuilds the map (handed to
+ * the visualizer through restored_map), the passengers, the fleet with its
+ * reservations and in-flight routes, the congestion map and every pending
+ * message, sets the random streams and moves the simulation clock to the
+ * checkpoint's time, then starts the taxi threads. The header, section
+ * bounds and every index the records hold are validated before anything
+ * is built.
  * 
- * @param map Pointer to Map structure to generate
- * @param num_squares Number of buildings to generate
- * @param road_width Width of roads in cells
- * @param border_width Width of building borders
- * @param min_size Minimum building dimension
- * @param max_size Maximum building dimension
- * @param min_distance Minimum spacing between buildings
+ * @param path Checkpoint file
+ * @param center Freshly initialised control center
+ * @param visualizer Freshly initialised visualizer
+ * @return true if restored, false if the file is missing, invalid or from
+ *         another format version, or memory runs out
  */
 
-void generateMap(Map* map, int num_squares, int road_width, int border_width, int min_size, int max_size, int min_distance) {
-    map->road_width = road_width;
-    srand(time(NULL));
+bool checkpointRestore(const char* path, ControlCenter* center, Visualizer* visualizer) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
 
-    if (min_size <= 0 || max_size < min_size || map->rows <= 0 || map->cols <= 0) {
-        return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CheckpointHeader)) {
+        close(fd);
+        return false;
     }
-
-    int max_possible_size = MIN(map->cols, map->rows) - 2 * border_width;
-    if (max_size > max_possible_size) {
-        max_size = max_possible_size;
-        min_size = MIN(min_size, max_size);
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    const char* base = mapping;
+    const CheckpointHeader* header = mapping;
+    uint64_t cells = (uint64_t)(header->rows > 0 ? header->rows : 0) * (uint64_t)(header->cols > 0 ? header->cols : 0);
+    uint64_t num_tiles = (uint64_t)((header->rows > 0 ? header->rows : 0) + MAP_TILE_MASK) / MAP_TILE_SIZE *
+                         (((header->cols > 0 ? header->cols : 0) + MAP_TILE_MASK) / MAP_TILE_SIZE);
+    bool valid = memcmp(header->magic, CHECKPOINT_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == CHECKPOINT_FILE_VERSION &&
+                 header->endian == CITY_FILE_ENDIAN &&
+                 header->header_bytes == sizeof(CheckpointHeader) &&
+                 header->time_scale > 0 &&
+                 header->file_bytes == (uint64_t)st.st_size &&
+                 header->tile_size == MAP_TILE_SIZE &&
+                 header->rows > 0 && header->cols > 0 && cells <= UINT32_MAX &&
+                 header->num_squares >= 0 && header->num_stored_tiles <= num_tiles &&
+                 header->num_taxis <= MAX_TAXIS && header->num_passengers <= MAX_PASSENGERS &&
+                 header->num_routes <= MAX_TAXIS && header->num_congested <= cells &&
+                 checkpointSectionValid(header, header->tile_index_offset, header->num_stored_tiles, sizeof(uint32_t)) &&
+                 checkpointSectionValid(header, header->tiles_offset, header->num_stored_tiles, MAP_TILE_CELLS * sizeof(uint16_t)) &&
+                 checkpointSectionValid(header, header->squares_offset, header->num_squares, sizeof(Square)) &&
+                 checkpointSectionValid(header, header->taxis_offset, header->num_taxis, sizeof(CheckpointTaxi)) &&
+                 checkpointSectionValid(header, header->passengers_offset, header->num_passengers, sizeof(CheckpointPassenger)) &&
+                 checkpointSectionValid(header, header->routes_offset, header->num_routes, sizeof(CheckpointRoute)) &&
+                 checkpointSectionValid(header, header->reservations_offset, header->num_reservations, sizeof(CheckpointReservation)) &&
+                 checkpointSectionValid(header, header->congestion_offset, header->num_congested, sizeof(CheckpointCongestion)) &&
+                 checkpointSectionValid(header, header->messages_offset, header->num_messages, sizeof(CheckpointMessage)) &&
+                 checkpointSectionValid(header, header->payload_offset, header->num_payload_words, sizeof(int32_t));
+
+    const uint32_t* tile_index = valid ? (const uint32_t*)(base + header->tile_index_offset) : NULL;
+    const uint16_t* tiles = valid ? (const uint16_t*)(base + header->tiles_offset) : NULL;
+    const CheckpointTaxi* taxis = valid ? (const CheckpointTaxi*)(base + header->taxis_offset) : NULL;
+    const CheckpointPassenger* passengers = valid ? (const CheckpointPassenger*)(base + header->passengers_offset) : NULL;
+    const CheckpointRoute* routes = valid ? (const CheckpointRoute*)(base + header->routes_offset) : NULL;
+    const CheckpointReservation* reservations = valid ? (const CheckpointReservation*)(base + header->reservations_offset) : NULL;
+    const CheckpointCongestion* congested = valid ? (const CheckpointCongestion*)(base + header->congestion_offset) : NULL;
+    const CheckpointMessage* messages = valid ? (const CheckpointMessage*)(base + header->messages_offset) : NULL;
+    const int32_t* payload = valid ? (const int32_t*)(base + header->payload_offset) : NULL;
+
+    for (uint32_t i = 0; valid && i < header->num_stored_tiles; i++) {
+        valid = tile_index[i] < num_tiles;
     }
-
-    Square squares[num_squares];
-    int count = 0, attempts = 0;
-
-    // Clear the map (initialize with sidewalks)
-    for (int i = 0; i < map->rows; i++) {
-        for (int j = 0; j < map->cols; j++) {
-            map->matrix[i][j] = SIDEWALK;
+    bool id_taken[MAX_TAXIS + 1] = {false}; // IDs are unique, with gaps left by retired taxis
+    for (uint32_t i = 0; valid && i < header->num_taxis; i++) {
+        valid = taxis[i].id >= 1 && taxis[i].id <= MAX_TAXIS && !id_taken[taxis[i].id] &&
+                taxis[i].x >= -1 && taxis[i].x < header->cols && taxis[i].y >= -1 && taxis[i].y < header->rows;
+        if (valid) id_taken[taxis[i].id] = true;
+    }
+    for (uint32_t i = 0; valid && i < header->num_routes; i++) {
+        const CheckpointRoute* route = &routes[i];
+        valid = route->taxi_id >= 1 && route->taxi_id <= MAX_TAXIS && route->num_legs >= 1 && route->num_legs <= 2 &&
+                route->leg >= 0 && route->leg < route->num_legs;
+        for (int l = valid ? route->leg : 2; valid && l < route->num_legs; l++) {
+            valid = route->start_col[l] >= 0 && route->start_col[l] < header->cols &&
+                    route->start_row[l] >= 0 && route->start_row[l] < header->rows &&
+                    route->goal_col[l] >= 0 && route->goal_col[l] < header->cols &&
+                    route->goal_row[l] >= 0 && route->goal_row[l] < header->rows;
         }
     }
+    for (uint32_t i = 0; valid && i < header->num_reservations; i++) {
+        valid = reservations[i].taxi_id >= 1 && reservations[i].taxi_id <= MAX_TAXIS;
+    }
+    for (uint32_t i = 0; valid && i < header->num_congested; i++) {
+        valid = congested[i].cell < cells;
+    }
+    for (uint32_t i = 0; valid && i < header->num_messages; i++) {
+        valid = checkpointMessageValid(header, &messages[i], payload);
+    }
+    if (!valid) {
+        munmap(mapping, st.st_size);
+        return false;
+    }
 
-    // Generate squares (blocks)
-    while (count < num_squares && attempts < MAX_ATTEMPTS * num_squares) {
-        int size = rand() % (max_size - min_size + 1) + min_size;
+    // The simulation clock carries on from the checkpoint, at its speed
+    sim_seed = header->seed;
+    sim_time_scale = MAX(SIM_MIN_TIME_SCALE, header->time_scale);
+    schedule.origin_ns = monotonic_ns() - header->clock_ns;
+    visualizer->map_rng.state = header->map_rng;
+    visualizer->spawn_rng.state = header->spawn_rng;
+    visualizer->route_repairs = header->route_repairs;
 
-        int max_col = map->cols - size - border_width;
-        int max_row = map->rows - size - border_width;
+    // Map: stored tiles, squares and the road indexes derived from them
+    Map* map = malloc(sizeof(Map));
+    bool ok = map != NULL;
+    if (ok) {
+        mapInitFields(map, header->rows, header->cols);
+        ok = tileGridInit(&map->grid, map->rows, map->cols);
+        map->road_width = header->road_width;
+    }
+    for (uint32_t i = 0; ok && i < header->num_stored_tiles; i++) {
+        int* cells_out = tileMaterialise(&map->grid, tile_index[i]);
+        ok = cells_out != NULL;
+        for (int c = 0; ok && c < MAP_TILE_CELLS; c++) {
+            cells_out[c] = tiles[(size_t)i * MAP_TILE_CELLS + c];
+        }
+    }
+    if (ok && header->num_squares > 0) {
+        map->squares = malloc((size_t)header->num_squares * sizeof(Square));
+        ok = map->squares != NULL;
+        if (ok) {
+            memcpy(map->squares, base + header->squares_offset, (size_t)header->num_squares * sizeof(Square));
+            map->num_squares = header->num_squares;
+        }
+    }
+    ok = ok && mapBuildIndex(map);
 
-        int current_distance = min_distance;
-        if (max_col <= 0 || max_row <= 0) {
-            current_distance = 0;
-            max_col = map->cols - size;
-            max_row = map->rows - size;
-            if (max_col <= 0 || max_row <= 0) break;
+    // Congestion map, clocked like the one it was taken from
+    if (ok) {
+        map->congestion = congestionCreate(map->rows, map->cols);
+        ok = map->congestion != NULL;
+    }
+    if (ok) {
+        map->congestion->origin_ns = header->congestion_origin_ns;
+        map->congestion->active_until = header->congestion_active_until;
+        for (uint32_t i = 0; i < header->num_congested; i++) {
+            map->congestion->density[congested[i].cell] = congested[i].density;
+            map->congestion->stamp[congested[i].cell] = congested[i].stamp;
         }
+    }
 
-        Square q = {
-            .x = rand() % (max_col + 1),
-            .y = rand() % (max_row + 1),
-            .size = size
-        };
+    for (uint32_t i = 0; ok && i < header->num_passengers; i++) {
+        Passenger* passenger = malloc(sizeof(Passenger));
+        ok = passenger != NULL;
+        if (!ok) break;
+        passenger->id = passengers[i].id;
+        passenger->x_sidewalk = passengers[i].x_sidewalk;
+        passenger->y_sidewalk = passengers[i].y_sidewalk;
+        passenger->x_road = passengers[i].x_road;
+        passenger->y_road = passengers[i].y_road;
+        passenger->isFree = passengers[i].is_free;
+        passenger->x_sidewalk_dest = passengers[i].x_sidewalk_dest;
+        passenger->y_sidewalk_dest = passengers[i].y_sidewalk_dest;
+        passenger->x_road_dest = passengers[i].x_road_dest;
+        passenger->y_road_dest = passengers[i].y_road_dest;
+        passenger->trip_started_ns = passengers[i].trip_started_ns;
+        passenger->trip_congestion_aware = passengers[i].trip_congestion_aware;
+        passenger->spawned_ns = passengers[i].spawned_ns;
+        passenger->picked_up_ns = passengers[i].picked_up_ns;
+        passenger->pickup_eta_ns = passengers[i].pickup_eta_ns;
+        passenger->taxi_id = passengers[i].taxi_id;
+        passenger->route_cells = passengers[i].route_cells;
+        passenger->detours = passengers[i].detours;
+        center->passengers[center->numPassengers++] = passenger;
+    }
 
-        bool valid = true;
-        for (int i = 0; i < count; i++) {
-            int dx = abs((q.x + q.size / 2) - (squares[i].x + squares[i].size / 2));
-            int dy = abs((q.y + q.size / 2) - (squares[i].y + squares[i].size / 2));
-            if (dx < current_distance && dy < current_distance) {
-                valid = false;
-                break;
+    for (uint32_t i = 0; ok && i < header->num_taxis; i++) {
+        Taxi* taxi = taxiCreate(center);
+        ok = taxi != NULL;
+        if (!ok) break;
+        taxi->id = taxis[i].id;
+        taxi->x = taxis[i].x;
+        taxi->y = taxis[i].y;
+        taxi->isFree = taxis[i].is_free;
+        taxi->currentPassenger = taxis[i].current_passenger;
+        taxi->route_epoch = taxis[i].route_epoch;
+        taxi->queue.actor = taxis[i].actor;
+        taxi->idle_ns = taxis[i].idle_ns;
+        taxi->state_since_ns = taxis[i].state_since_ns;
+        taxi->sampled_ns = taxis[i].sampled_ns;
+        taxi->sampled_idle_ns = taxis[i].sampled_idle_ns;
+        center->taxis[center->numTaxis++] = taxi;
+    }
+    center->taxis_created = header->taxis_created;
+    center->congestion_routing = header->congestion_routing;
+    for (int mode = 0; mode < 2; mode++) {
+        center->trips[mode] = header->trips[mode];
+        center->trip_ns[mode] = header->trip_ns[mode];
+    }
+
+    // Reservation table: the same entries on the same tick origin
+    ReservationTable* table = center->reservations;
+    if (ok && table) {
+        int capacity = 1024;
+        while ((long)header->num_reservations * 2 >= capacity) capacity *= 2;
+        Reservation* slots = calloc(capacity, sizeof(Reservation));
+        ok = slots != NULL;
+        if (ok) {
+            free(table->slots);
+            table->slots = slots;
+            table->capacity = capacity;
+            table->count = 0;
+            table->origin_ns = header->reservation_origin_ns;
+            for (uint32_t i = 0; i < header->num_reservations; i++) {
+                reservationPut(table, reservations[i].cell, reservations[i].tick, reservations[i].taxi_id);
+            }
+            for (uint32_t i = 0; i < header->num_taxis; i++) {
+                table->occupied_cell[taxis[i].id] = taxis[i].occupied_cell;
+                table->reserved_until[taxis[i].id] = taxis[i].reserved_until;
             }
         }
+    }
 
-        if (valid) {
-            squares[count++] = q;
-            drawSquare(map, q, border_width);
-            attempts = 0;
+    // In-flight routes: each remaining leg is searched again on the restored map
+    PathData* leg_path = ok ? pathCreate() : NULL;
+    for (uint32_t i = 0; ok && leg_path && i < header->num_routes; i++) {
+        const CheckpointRoute* record = &routes[i];
+        InflightRoute* route = &visualizer->inflight[record->taxi_id];
+        bool planned = true;
+        for (int l = record->leg; planned && l < record->num_legs; l++) {
+            DStarLite* d = route->legs[l] = dstarCreate(map->rows, map->cols);
+            planned = d && dstarPlan(d, &map->grid, record->start_col[l], record->start_row[l],
+                                     record->goal_col[l], record->goal_row[l]) == 0 &&
+                      dstarExtract(d, &map->grid, leg_path) == 0;
+            if (planned) {
+                dstarMarkPath(d, leg_path);
+                route->leg_event[l] = record->leg_event[l];
+            }
+        }
+        if (planned) {
+            route->num_legs = record->num_legs;
+            route->leg = record->leg;
+            route->passenger_id = record->passenger_id;
+            route->ticks_per_step = record->ticks_per_step;
+        }
+    }
+    pathFree(leg_path);
+
+    // Pending messages, back on their queues in order
+    for (uint32_t i = 0; ok && i < header->num_messages; i++) {
+        const CheckpointMessage* record = &messages[i];
+        MessageQueue* queue = record->queue == CHECKPOINT_QUEUE_CENTER ? &center->queue :
+                              record->queue == CHECKPOINT_QUEUE_VISUALIZER ? &visualizer->queue :
+                              &center->taxis[record->queue - CHECKPOINT_QUEUE_TAXI]->queue;
+        Message* msg = malloc(sizeof(Message));
+        ok = msg != NULL;
+        if (!ok) break;
+        msg->type = (MessageType)record->type;
+        msg->data_x = record->data_x;
+        msg->data_y = record->data_y;
+        msg->extra_x = record->extra_x;
+        msg->extra_y = record->extra_y;
+        msg->pointer = checkpointMessageObject(record, payload, center);
+        msg->next = NULL;
+        if (queue->tail == NULL) {
+            queue->head = queue->tail = msg;
         } else {
-            attempts++;
+            queue->tail->next = msg;
+            queue->tail = msg;
         }
+        queueCountIn(queue, msg);
+    }
+
+    munmap(mapping, st.st_size);
+    if (!ok) return false;
+
+    visualizer->restored_map = map;
+    for (int i = 0; i < center->numTaxis; i++) {
+        center->taxis[i]->thread_id = create_taxi_thread(center->taxis[i]);
+    }
+    return true;
+}
+
+// -------------------- TRIP LOG FUNCTIONS --------------------
+
+static TripLog trip_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Appends v as a zigzag LEB128 varint (at most 10 bytes)
+static size_t tripLogPutVarint(uint8_t* out, int64_t v) {
+    uint64_t u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    size_t n = 0;
+    while (u >= 0x80) {
+        out[n++] = (uint8_t)(u | 0x80);
+        u >>= 7;
     }
+    out[n++] = (uint8_t)u;
+    return n;
+}
 
-    // Connect squares using MST logic
-    if (count > 0) {
-        connectSquaresMST(map, squares, count);
+// Reads a zigzag LEB128 varint; 0 bytes if it runs past end
+static size_t tripLogGetVarint(const uint8_t* in, const uint8_t* end, int64_t* v) {
+    uint64_t u = 0;
+    for (size_t n = 0; n < 10 && in + n < end; n++) {
+        u |= (uint64_t)(in[n] & 0x7f) << (7 * n);
+        if (!(in[n] & 0x80)) {
+            *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+            return n + 1;
+        }
     }
+    return 0;
 }
 
 /**
- * Prints the raw numerical representation of the map
- * 
- * Debug function that displays:
- * - Each cell's numerical value
- * - Matrix layout with rows and columns
+ * Encodes one column of a block
  * 
- * @param map Pointer to Map structure to display
+ * @param values Column values
+ * @param rows Number of values
+ * @param encoding TRIPLOG_ENCODING_* bits
+ * @param out Output bytes (room for 20 bytes per value)
+ * @return Bytes written
  */
 
-void printLogicalMap(Map* map) {
-    for (int i = 0; i < map->rows; i++) {
-        for (int j = 0; j < map->cols; j++) {
-            printf("%d", map->matrix[i][j]);
+static size_t tripLogEncode(const int64_t* values, int rows, int encoding, uint8_t* out) {
+    size_t n = 0;
+    int64_t previous = 0, run_value = 0;
+    int run = 0;
+    for (int i = 0; i < rows; i++) {
+        int64_t v = (encoding & TRIPLOG_ENCODING_DELTA) ? values[i] - previous : values[i];
+        previous = values[i];
+        if (!(encoding & TRIPLOG_ENCODING_RLE)) {
+            n += tripLogPutVarint(out + n, v);
+        } else if (run > 0 && v == run_value) {
+            run++;
+        } else {
+            if (run > 0) {
+                n += tripLogPutVarint(out + n, run_value);
+                n += tripLogPutVarint(out + n, run);
+            }
+            run_value = v;
+            run = 1;
         }
-        printf("\n");
     }
+    if (run > 0) {
+        n += tripLogPutVarint(out + n, run_value);
+        n += tripLogPutVarint(out + n, run);
+    }
+    return n;
 }
 
-const char* message_type_to_abbreviation(MessageType type) {
-    switch (type) {
-        case CREATE_PASSENGER: return "[CP]";
-        case DELETE_PASSENGER: return "[DP]";
-        case RESET_MAP: return "[RM]";
-        case EXIT_PROGRAM: return "[EP]";
-        case PATHFIND_REQUEST: return "[PFR]";
-        case RANDOM_REQUEST: return "[RR]";
-        case ROUTE_PLAN: return "[RP]";
-        case EXIT: return "[EX]";
-        case STATUS_REQUEST: return "[SR]";
-        case CREATE_TAXI: return "[CT]";
-        case DESTROY_TAXI: return "[DT]";
-        case SPAWN_TAXI: return "[ST]";
-        case MOVE_TO: return "[MOV]";
-        case FINISH: return "[FIN]";
-        case PRINT_LOGICO: return "[PL]";
-        case DROP: return "[DRP]";
-        case GOT_PASSENGER: return "[GP]";
-        case ARRIVED_AT_DESTINATION: return "[AD]";
-        case REFRESH_PASSENGERS: return "[RPAS]";
-        default: return "[UNK]";
+/**
+ * Decodes one column of a block
+ * 
+ * @param in Column bytes
+ * @param size Number of bytes
+ * @param encoding TRIPLOG_ENCODING_* bits it was written with
+ * @param values Output values
+ * @param rows Number of values expected
+ * @return false if the bytes do not hold exactly `rows` values
+ */
+
+static bool tripLogDecode(const uint8_t* in, size_t size, int encoding, int64_t* values, int rows) {
+    const uint8_t* end = in + size;
+    int64_t previous = 0;
+    int i = 0;
+    while (in < end && i < rows) {
+        int64_t v, run = 1;
+        size_t n = tripLogGetVarint(in, end, &v);
+        if (n == 0) return false;
+        in += n;
+        if (encoding & TRIPLOG_ENCODING_RLE) {
+            n = tripLogGetVarint(in, end, &run);
+            if (n == 0 || run <= 0 || run > rows - i) return false;
+            in += n;
+        }
+        for (; run > 0; run--, i++) {
+            values[i] = (encoding & TRIPLOG_ENCODING_DELTA) ? previous + v : v;
+            previous = values[i];
+        }
     }
+    return in == end && i == rows;
 }
 
-void print_message_queue(const char* thread_name, MessageQueue* queue) {
-    pthread_mutex_lock(&queue->lock);
+// Encodes a block, each column in whichever encoding is smallest, and appends it to the file
+static bool tripLogWriteBlock(TripLog* log, const TripLogBlock* block, uint8_t* payload, uint8_t* scratch) {
+    TripLogBlockHeader header;
+    memset(&header, 0, sizeof(header));
+    header.rows = block->rows;
+    header.first_dropped_off_us = block->values[TRIPLOG_COL_DROPPED_OFF_US][0];
+    header.last_dropped_off_us = block->values[TRIPLOG_COL_DROPPED_OFF_US][block->rows - 1];
+
+    size_t size = 0;
+    for (int column = 0; column < TRIPLOG_COLUMNS; column++) {
+        size_t best = tripLogEncode(block->values[column], block->rows, 0, payload + size);
+        for (int encoding = 1; encoding <= (TRIPLOG_ENCODING_DELTA | TRIPLOG_ENCODING_RLE); encoding++) {
+            size_t n = tripLogEncode(block->values[column], block->rows, encoding, scratch);
+            if (n < best) {
+                memcpy(payload + size, scratch, n);
+                best = n;
+                header.encoding[column] = encoding;
+            }
+        }
+        header.column_bytes[column] = best;
+        size += best;
+    }
+    header.payload_bytes = size;
 
-    printf("Thread %s:\n", thread_name);
+    if (fwrite(&header, sizeof(header), 1, log->file) != 1 || fwrite(payload, 1, size, log->file) != size ||
+        fflush(log->file) != 0) {
+        return false;
+    }
+    pthread_mutex_lock(&log->lock);
+    log->blocks++;
+    log->raw_bytes += (unsigned long long)block->rows * TRIPLOG_COLUMNS * sizeof(int64_t);
+    log->file_bytes += sizeof(header) + size;
+    pthread_mutex_unlock(&log->lock);
+    return true;
+}
 
-    Message* current = queue->head;
-    int count = 0;
-    int remaining = 0;
+// Writer thread: encodes and writes queued blocks until stopped with an empty queue
+static void* tripLogThread(void* arg) {
+    TripLog* log = (TripLog*)arg;
+    traceThreadName("trip log");
+    uint8_t* payload = malloc((size_t)TRIPLOG_COLUMNS * TRIPLOG_BLOCK_ROWS * 20);
+    uint8_t* scratch = malloc((size_t)TRIPLOG_BLOCK_ROWS * 20);
+    bool failed = !payload || !scratch;
+
+    pthread_mutex_lock(&log->lock);
+    while (true) {
+        while (!log->pending && !log->stop) {
+            pthread_cond_wait(&log->cond, &log->lock);
+        }
+        TripLogBlock* block = log->pending;
+        if (!block) break;
+        log->pending = block->next;
+        if (!log->pending) log->pending_tail = NULL;
+        log->num_pending--;
+        pthread_mutex_unlock(&log->lock);
+
+        long long started = traceStart();
+        if (!failed && !tripLogWriteBlock(log, block, payload, scratch)) {
+            failed = true;
+            pthread_mutex_lock(&log->lock);
+            snprintf(log->status, sizeof(log->status), "Trip log: could not write %s", log->path);
+            pthread_mutex_unlock(&log->lock);
+        }
+        traceSpan("trip log", "write block", started);
 
-    while (current) {
-        if (count < 6) {
-            printf("%s", message_type_to_abbreviation(current->type));
+        pthread_mutex_lock(&log->lock);
+        if (!log->spare) {
+            block->rows = 0;
+            log->spare = block;
         } else {
-            remaining++;
+            free(block);
         }
-        current = current->next;
-        count++;
     }
+    pthread_mutex_unlock(&log->lock);
 
-    if (count > 6) {
-        printf(" + %d", remaining);
-    } else if (count == 0) {
-        printf("[EMPTY]");
-    }
-
-    printf("\n---------------------------------------\n");
-
-    pthread_mutex_unlock(&queue->lock);
+    free(payload);
+    free(scratch);
+    return NULL;
 }
 
-void renderMap(Map* map, ControlCenter* center, Visualizer* visualizer) {
-    if (!map || !map->matrix) {
-        return;
-    }
+/**
+ * Creates the trip log file and starts its writer thread
+ * 
+ * @param log Trip log with path set
+ * @return false if the file could not be created
+ */
 
-    printf("\033[H\033[J"); 
-    for (int i = 0; i < map->rows; i++) {
-        for (int j = 0; j < map->cols; j++) {
-            switch (map->matrix[i][j]) {
-                case SIDEWALK:
-                    printf(SIDEWALK_EMOJI);
-                    break;
-                case ROAD:
-                    printf(ROAD_EMOJI);
-                    break;
-                case DESTINATION:
-                    printf(DESTINATION_EMOJI);
-                    break;
-                case PASSENGER:
-                    printf(PASSENGER_EMOJI);
-                    break;
-                case TAXI:
-                    printf(TAXI_EMOJI);
-                    break;
-                default:
-                    if (map->matrix[i][j] >= R_PASSENGER && map->matrix[i][j] < R_PASSENGER + 100) {
-                        printf(PASSENGER_EMOJI);
-                        break;
-                    }
-                    if (map->matrix[i][j] >= R_TAXI_FREE && map->matrix[i][j] < R_TAXI_OCCUPIED + 100) {
-                        printf(TAXI_EMOJI);
-                        break;
-                    }
-                    if (map->matrix[i][j] >= R_PASSENGER_POINT && map->matrix[i][j] < R_PASSENGER_POINT + 100) {
-                        printf(PASSENGER_POINT_EMOJI);
-                        break;
-                    }
-                    if (map->matrix[i][j] >= R_PASSENGER_DEST && map->matrix[i][j] < R_PASSENGER_DEST + 100) {
-                        printf(DESTINATION_EMOJI);
-                        break;
-                    }
-                    printf("?"); 
-                    break;
-            }
-        }
-        printf("\n");
+bool tripLogOpen(TripLog* log) {
+    static const char* names[TRIPLOG_COLUMNS] = {
+        "trip", "passenger", "taxi", "spawned_us", "assigned_us", "picked_up_us", "dropped_off_us",
+        "origin_col", "origin_row", "dest_col", "dest_row", "route_cells", "detours", "congestion",
+    };
+    TripLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRIPLOG_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRIPLOG_FILE_VERSION;
+    header.columns = TRIPLOG_COLUMNS;
+    header.block_rows = TRIPLOG_BLOCK_ROWS;
+    for (int column = 0; column < TRIPLOG_COLUMNS; column++) {
+        strncpy(header.names[column], names[column], TRIPLOG_NAME_BYTES - 1);
     }
 
-    printf("\n--- Message Queues ---\n");
-    print_message_queue("ControlCenter", &center->queue);
-    print_message_queue("Visualizer", &visualizer->queue);
-    if (center->numTaxis > 0 && center->taxis[0]) {
-        print_message_queue("Taxi 1", &center->taxis[0]->queue);
+    log->file = fopen(log->path, "wb");
+    if (!log->file) return false;
+    if (fwrite(&header, sizeof(header), 1, log->file) != 1) {
+        fclose(log->file);
+        log->file = NULL;
+        return false;
+    }
+    log->file_bytes = sizeof(header);
+    log->started = pthread_create(&log->thread, NULL, tripLogThread, log) == 0;
+    if (!log->started) {
+        fclose(log->file);
+        log->file = NULL;
+    }
+    return log->started;
+}
+
+// Queues the filling block for the writer (log->lock held)
+static void tripLogQueue(TripLog* log) {
+    log->filling->next = NULL;
+    if (log->pending_tail) {
+        log->pending_tail->next = log->filling;
+    } else {
+        log->pending = log->filling;
     }
+    log->pending_tail = log->filling;
+    log->num_pending++;
+    log->filling = NULL;
+    pthread_cond_signal(&log->cond);
 }
 
 /**
- * Finds a path between two points using BFS algorithm
+ * Appends the record of a completed trip
  * 
- * Calculates shortest path through road network by:
- * 1. Initializing BFS queue and visited matrix
- * 2. Exploring neighbors (up/down/left/right)
- * 3. Tracking parent nodes to reconstruct path
- * 4. Handling special destination ranges (100-599)
+ * Called by the control center on ARRIVED_AT_DESTINATION; only copies the
+ * trip into the filling block.
  * 
- * @param start_col Starting X coordinate
- * @param start_row Starting Y coordinate
- * @param maze The map matrix to navigate
- * @param num_cols Width of map
- * @param num_rows Height of map
- * @param solutionCol Output array for path X coordinates
- * @param solutionRow Output array for path Y coordinates
- * @param solution_size Output pointer for path length
- * @param destination Target value range (e.g., R_TAXI_FREE)
- * @return 0 on success, 1 if no path found
+ * @param log Open trip log
+ * @param passenger Passenger just dropped off
+ * @param dropped_off_ns Simulation time of the drop-off
  */
 
-int findPath(int start_col, int start_row, int **maze, int num_cols, int num_rows,
-                    int solutionCol[], int solutionRow[], int *solution_size, int destination) {
-    // BFS queue
-    Node *queue = malloc(num_cols * num_rows * sizeof(Node));
-    int start = 0, end = 0;
-
-    // Visited matrix
-    int **visited = malloc(num_rows * sizeof(int *));
-    for (int row = 0; row < num_rows; row++) {
-        visited[row] = malloc(num_cols * sizeof(int));
-        for (int col = 0; col < num_cols; col++) {
-            visited[row][col] = -1;
+void tripLogAppend(TripLog* log, const Passenger* passenger, long long dropped_off_ns) {
+    pthread_mutex_lock(&log->lock);
+    if (!log->started) {
+        pthread_mutex_unlock(&log->lock);
+        return;
+    }
+    if (log->filling && log->filling->rows == TRIPLOG_BLOCK_ROWS) {
+        if (log->num_pending >= TRIPLOG_MAX_PENDING) {
+            log->dropped++; // The writer is behind
+            pthread_mutex_unlock(&log->lock);
+            return;
         }
+        tripLogQueue(log);
+    }
+    if (!log->filling) {
+        log->filling = log->spare ? log->spare : malloc(sizeof(TripLogBlock));
+        log->spare = NULL;
+        if (!log->filling) {
+            log->dropped++;
+            pthread_mutex_unlock(&log->lock);
+            return;
+        }
+        log->filling->rows = 0;
     }
 
-    // Add the starting node
-    queue[end++] = (Node){.x = start_col, .y = start_row, .parent_index = -1};
-    visited[start_row][start_col] = 0;
-
-    // Directions for moving (left, right, up, down)
-    int delta_col[] = {0, 0, -1, 1};
-    int delta_row[] = {-1, 1, 0, 0};
-
-    // BFS loop
-    while (start < end) {
-        Node current = queue[start++];
+    TripLogBlock* block = log->filling;
+    int row = block->rows++;
+    block->values[TRIPLOG_COL_TRIP][row] = ++log->trips;
+    block->values[TRIPLOG_COL_PASSENGER][row] = passenger->id;
+    block->values[TRIPLOG_COL_TAXI][row] = passenger->taxi_id;
+    block->values[TRIPLOG_COL_SPAWNED_US][row] = passenger->spawned_ns / 1000;
+    block->values[TRIPLOG_COL_ASSIGNED_US][row] = passenger->trip_started_ns / 1000;
+    block->values[TRIPLOG_COL_PICKED_UP_US][row] = passenger->picked_up_ns / 1000;
+    block->values[TRIPLOG_COL_DROPPED_OFF_US][row] = dropped_off_ns / 1000;
+    block->values[TRIPLOG_COL_ORIGIN_COL][row] = passenger->x_road;
+    block->values[TRIPLOG_COL_ORIGIN_ROW][row] = passenger->y_road;
+    block->values[TRIPLOG_COL_DEST_COL][row] = passenger->x_road_dest;
+    block->values[TRIPLOG_COL_DEST_ROW][row] = passenger->y_road_dest;
+    block->values[TRIPLOG_COL_ROUTE_CELLS][row] = passenger->route_cells;
+    block->values[TRIPLOG_COL_DETOURS][row] = passenger->detours;
+    block->values[TRIPLOG_COL_CONGESTION][row] = passenger->trip_congestion_aware;
+    if (block->rows == TRIPLOG_BLOCK_ROWS && log->num_pending < TRIPLOG_MAX_PENDING) {
+        tripLogQueue(log);
+    }
+    pthread_mutex_unlock(&log->lock);
+}
 
-        // Check if it's the destination
-        if (maze[current.y][current.x] >= destination && maze[current.y][current.x] < destination + 100) {
-            // Count the path length
-            int counter = 0;
-            int index = start - 1;
-            while (index != -1) {
-                counter++;
-                index = queue[index].parent_index;
-            }
+// Writes the last partial block, stops the writer and closes the file
+void tripLogClose(TripLog* log) {
+    pthread_mutex_lock(&log->lock);
+    bool started = log->started;
+    if (log->filling && log->filling->rows > 0) {
+        tripLogQueue(log);
+    }
+    log->stop = true;
+    pthread_cond_signal(&log->cond);
+    pthread_mutex_unlock(&log->lock);
 
-            // Fill the path in the correct order (start -> destination)
-            *solution_size = counter;
-            index = start - 1;
-            for (int i = counter - 1; i >= 0; i--) {
-                solutionCol[i] = queue[index].x;
-                solutionRow[i] = queue[index].y;
-                index = queue[index].parent_index;
-            }
+    if (started) {
+        pthread_join(log->thread, NULL);
+    }
+    pthread_mutex_lock(&log->lock);
+    log->started = false;
+    free(log->filling);
+    free(log->spare);
+    log->filling = log->spare = NULL;
+    pthread_mutex_unlock(&log->lock);
+    if (log->file && fclose(log->file) != 0) {
+        fprintf(stderr, "Failed to write trip log %s\n", log->path);
+    }
+    log->file = NULL;
+}
 
-            // Free memory
-            for (int row = 0; row < num_rows; row++) free(visited[row]);
-            free(visited);
-            free(queue);
-            return 0;
+// Prints the trip log's progress and compression
+void print_trip_log() {
+    if (!trip_log.path) return;
+    pthread_mutex_lock(&trip_log.lock);
+    if (trip_log.status[0]) {
+        printf("%s\n", trip_log.status);
+    } else {
+        printf("Trip log: %s | %lu trips, %lu dropped | %lu blocks written, %.1f KB", trip_log.path, trip_log.trips,
+               trip_log.dropped, trip_log.blocks, trip_log.file_bytes / 1024.0);
+        if (trip_log.raw_bytes) {
+            printf(" (%.1fx smaller than raw)", (double)trip_log.raw_bytes / trip_log.file_bytes);
         }
+        printf("\n");
+    }
+    pthread_mutex_unlock(&trip_log.lock);
+}
 
-        // Explore neighbors
-        for (int i = 0; i < 4; i++) {
-            int new_col = current.x + delta_col[i];
-            int new_row = current.y + delta_row[i];
-
-            // Check bounds
-            if (new_col < 0 || new_col >= num_cols || new_row < 0 || new_row >= num_rows) {
-                continue;
-            }
+/**
+ * Prints a trip log as CSV, one line per trip
+ * 
+ * @param path Trip log file
+ * @param out Output stream
+ * @return false if the file is not a trip log or is damaged
+ */
 
-            // Check if it's a valid path and not visited
-            if ((maze[new_row][new_col] == ROAD ||( maze[new_row][new_col] >= destination && maze[new_row][new_col] < destination + 100)) &&
-                visited[new_row][new_col] == -1) {
-                visited[new_row][new_col] = start - 1;
-                queue[end++] = (Node){.x = new_col, .y = new_row, .parent_index = start - 1};
+bool tripLogDump(const char* path, FILE* out) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    TripLogHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, TRIPLOG_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+              header.version == TRIPLOG_FILE_VERSION && header.columns == TRIPLOG_COLUMNS &&
+              header.block_rows > 0 && header.block_rows <= TRIPLOG_BLOCK_ROWS;
+    TripLogBlock* block = ok ? malloc(sizeof(TripLogBlock)) : NULL;
+    uint8_t* payload = ok ? malloc((size_t)TRIPLOG_COLUMNS * TRIPLOG_BLOCK_ROWS * 20) : NULL;
+    ok = ok && block && payload;
+
+    for (int column = 0; ok && column < TRIPLOG_COLUMNS; column++) {
+        fprintf(out, "%.*s%s", TRIPLOG_NAME_BYTES, header.names[column], column + 1 < TRIPLOG_COLUMNS ? "," : "\n");
+    }
+    TripLogBlockHeader block_header;
+    size_t got;
+    while (ok && (got = fread(&block_header, 1, sizeof(block_header), file)) > 0) {
+        ok = got == sizeof(block_header) && block_header.rows > 0 && block_header.rows <= header.block_rows &&
+             block_header.payload_bytes <= (size_t)TRIPLOG_COLUMNS * TRIPLOG_BLOCK_ROWS * 20 &&
+             fread(payload, 1, block_header.payload_bytes, file) == block_header.payload_bytes;
+        size_t offset = 0;
+        for (int column = 0; ok && column < TRIPLOG_COLUMNS; column++) {
+            size_t size = block_header.column_bytes[column];
+            ok = size <= block_header.payload_bytes - offset &&
+                 tripLogDecode(payload + offset, size, block_header.encoding[column], block->values[column], block_header.rows);
+            offset += size;
+        }
+        for (uint32_t row = 0; ok && row < block_header.rows; row++) {
+            for (int column = 0; column < TRIPLOG_COLUMNS; column++) {
+                fprintf(out, "%lld%s", (long long)block->values[column][row], column + 1 < TRIPLOG_COLUMNS ? "," : "\n");
             }
         }
     }
+    ok = ok && !ferror(file);
 
-    // Free memory on failure
-    for (int row = 0; row < num_rows; row++) free(visited[row]);
-    free(visited);
-    free(queue);
-    return 1;
+    free(block);
+    free(payload);
+    fclose(file);
+    return ok;
 }
 
+// -------------------- DEMAND FUNCTIONS --------------------
+
+static DemandConfig demand_config = {
+    .profile = { [0 ... DEMAND_PROFILE_HOURS - 1] = 1.0 },
+    .profile_name = "flat",
+    .day_s = DEMAND_DEFAULT_DAY_SEC,
+};
+
+// Hourly multipliers of the "commute" profile: quiet nights, morning and evening peaks
+static const double demand_commute_profile[DEMAND_PROFILE_HOURS] = {
+    0.3, 0.2, 0.1, 0.1, 0.2, 0.5, 1.2, 2.4, 2.8, 1.6, 1.0, 1.0,
+    1.2, 1.1, 1.0, 1.1, 1.5, 2.4, 2.6, 1.8, 1.3, 1.0, 0.7, 0.5
+};
+
 /**
- * Finds path between specific coordinates using BFS
+ * Sets the demand profile from an option value
  * 
- * Specialized version of findPath that navigates to exact coordinates
- * rather than destination ranges. Used for taxi-passenger routing.
+ * Takes "flat", "commute" or up to DEMAND_PROFILE_HOURS comma-separated
+ * multipliers (a shorter list repeats over the day). The multipliers are
+ * scaled to a mean of 1, so the average rate stays demand_config.rate.
  * 
- * @param start_col Starting X coordinate
- * @param start_row Starting Y coordinate
- * @param dest_col Destination X coordinate
- * @param dest_row Destination Y coordinate
- * @param maze The map matrix to navigate
- * @param num_cols Width of map
- * @param num_rows Height of map
- * @param solutionCol Output array for path X coordinates
- * @param solutionRow Output array for path Y coordinates
- * @param solution_size Output pointer for path length
- * @return 0 on success, 1 if no path found
+ * @param value Option value
+ * @return false if the value is not a profile
  */
 
-int findPathCoordinates(int start_col, int start_row, int dest_col, int dest_row,
-                               int **maze, int num_cols, int num_rows,
-                               int solutionCol[], int solutionRow[], int *solution_size) {
-    // BFS queue
-    Node *queue = malloc(num_cols * num_rows * sizeof(Node));
-    int start = 0, end = 0;
-
-    // Visited matrix
-    int **visited = malloc(num_rows * sizeof(int *));
-    for (int row = 0; row < num_rows; row++) {
-        visited[row] = malloc(num_cols * sizeof(int));
-        for (int col = 0; col < num_cols; col++) {
-            visited[row][col] = -1;
+bool demandSetProfile(const char* value) {
+    double profile[DEMAND_PROFILE_HOURS];
+    int count = 0;
+    if (strcmp(value, "flat") == 0) {
+        profile[count++] = 1.0;
+    } else if (strcmp(value, "commute") == 0) {
+        for (; count < DEMAND_PROFILE_HOURS; count++) profile[count] = demand_commute_profile[count];
+    } else {
+        const char* p = value;
+        while (*p && count < DEMAND_PROFILE_HOURS) {
+            char* end;
+            double multiplier = strtod(p, &end);
+            if (end == p || multiplier < 0) return false;
+            profile[count++] = multiplier;
+            p = (*end == ',') ? end + 1 : end;
+            if (*end && *end != ',') return false;
         }
     }
+    if (count == 0) return false;
 
-    // Add the starting node
-    queue[end++] = (Node){.x = start_col, .y = start_row, .parent_index = -1};
-    visited[start_row][start_col] = 0;
+    double sum = 0;
+    for (int h = 0; h < DEMAND_PROFILE_HOURS; h++) {
+        demand_config.profile[h] = profile[h % count];
+        sum += demand_config.profile[h];
+    }
+    if (sum <= 0) return false;
+    for (int h = 0; h < DEMAND_PROFILE_HOURS; h++) {
+        demand_config.profile[h] *= DEMAND_PROFILE_HOURS / sum;
+    }
+    demand_config.profile_name = (strcmp(value, "flat") == 0 || strcmp(value, "commute") == 0) ? value : "custom";
+    return true;
+}
 
-    // Directions for moving (left, right, up, down)
-    int delta_col[] = {0, 0, -1, 1};
-    int delta_row[] = {-1, 1, 0, 0};
+// Hour of the simulated day at a time of the demand clock
+static int demandHour(long long clock_ns) {
+    double day_ns = demand_config.day_s * 1e9;
+    long long into_day = clock_ns % (long long)day_ns;
+    return (int)(into_day * DEMAND_PROFILE_HOURS / day_ns) % DEMAND_PROFILE_HOURS;
+}
 
-    // BFS loop
-    while (start < end) {
-        Node current = queue[start++];
+// Passengers per second the profile asks for at a time of the demand clock
+double demandRate(long long clock_ns) {
+    return demand_config.rate * demand_config.profile[demandHour(clock_ns)];
+}
 
-        // Check if it's the destination
-        if (current.x == dest_col && current.y == dest_row) {
-            // Count the path length
-            int counter = 0;
-            int index = start - 1;
-            while (index != -1) {
-                counter++;
-                index = queue[index].parent_index;
-            }
+static bool demand_stop = false; // Set at shutdown: the demand and trace threads return
 
-            // Fill the path in the correct order (start -> destination)
-            *solution_size = counter;
-            index = start - 1;
-            for (int i = counter - 1; i >= 0; i--) {
-                solutionCol[i] = queue[index].x;
-                solutionRow[i] = queue[index].y;
-                index = queue[index].parent_index;
-            }
+/**
+ * Advances the clock of a passenger source to now
+ * 
+ * Waits out a pause first, which does not count on the clock.
+ * 
+ * @param clock_ns Clock to advance
+ * @param last_ns Monotonic time it was last advanced at
+ * @return false once demand_stop is set
+ */
 
-            // Free memory
-            for (int row = 0; row < num_rows; row++) free(visited[row]);
-            free(visited);
-            free(queue);
-            return 0;
-        }
+static bool demandAdvance(long long* clock_ns, long long* last_ns) {
+    lockAcquire(&pause_mutex, LOCK_PAUSE);
+    bool waited = false;
+    while (isPaused && !__atomic_load_n(&demand_stop, __ATOMIC_ACQUIRE)) {
+        lockWait(&pause_cond, &pause_mutex, LOCK_PAUSE);
+        waited = true;
+    }
+    lockRelease(&pause_mutex, LOCK_PAUSE);
 
-        // Explore neighbors
-        for (int i = 0; i < 4; i++) {
-            int new_col = current.x + delta_col[i];
-            int new_row = current.y + delta_row[i];
+    long long now_ns = monotonic_ns();
+    if (!waited) *clock_ns += now_ns - *last_ns;
+    *last_ns = now_ns;
+    return !__atomic_load_n(&demand_stop, __ATOMIC_ACQUIRE);
+}
 
-            // Check bounds
-            if (new_col < 0 || new_col >= num_cols || new_row < 0 || new_row >= num_rows) {
-                continue;
-            }
+// Sleeps until the next request is due, between DEMAND_MIN_SLEEP_NS and DEMAND_MAX_SLEEP_NS
+static void demandSleep(long long wait_ns) {
+    long long sleep_ns = MIN(MAX(wait_ns, DEMAND_MIN_SLEEP_NS), DEMAND_MAX_SLEEP_NS);
+    struct timespec ts = {.tv_sec = sleep_ns / 1000000000LL, .tv_nsec = sleep_ns % 1000000000LL};
+    nanosleep(&ts, NULL);
+}
 
-            // Check if it's a valid path and not visited
-            if ((maze[new_row][new_col] == ROAD || (new_col == dest_col && new_row == dest_row)) &&
-                visited[new_row][new_col] == -1) {
-                visited[new_row][new_col] = start - 1;
-                queue[end++] = (Node){.x = new_col, .y = new_row, .parent_index = start - 1};
+// Natural logarithm of x in (0, 1] without libm (the program links only pthread)
+static double demandLog(double x) {
+    int exponent = 0;
+    while (x < 0.5) {
+        x *= 2;
+        exponent--;
+    }
+    // ln x = 2 atanh((x - 1) / (x + 1)), |z| <= 1/3 converges fast
+    double z = (x - 1) / (x + 1), z2 = z * z, term = z, sum = 0;
+    for (int k = 1; k < 40; k += 2) {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + exponent * 0.69314718055994530942;
+}
+
+// Exponential wait in ns for a Poisson process of the given rate per second
+static long long demandExponentialNs(Rng* rng, double rate) {
+    double u = ((rngNext(rng) >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+    return (long long)(-demandLog(u) / rate * 1e9);
+}
+
+/**
+ * Passenger demand generator thread
+ * 
+ * Requests passengers as a Poisson process whose rate follows the hourly
+ * profile of a simulated day. Arrivals are drawn at the profile's peak rate
+ * and each is kept with probability rate(t) / peak (thinning), so the rate
+ * can change within a gap. Every arrival enters through the same external
+ * CREATE_PASSENGER event as the 'p' key; arrivals due within
+ * DEMAND_MIN_SLEEP_NS of each other are sent in one wake-up, so thousands
+ * per second cost no more than a sleep per millisecond. The demand clock
+ * stops while the simulation is paused.
+ * 
+ * @param arg ControlCenter pointer passed as void*
+ * @return NULL once demand_stop is set
+ */
+
+void* demand_thread(void* arg) {
+    ControlCenter* center = (ControlCenter*)arg;
+    traceThreadName("demand");
+
+    Rng rng;
+    rngSeed(&rng, sim_seed, RNG_STREAM_DEMAND);
+    double peak = 0;
+    for (int h = 0; h < DEMAND_PROFILE_HOURS; h++) {
+        peak = MAX(peak, demand_config.rate * demand_config.profile[h]);
+    }
+    if (peak <= 0) return NULL;
+
+    long long clock_ns = 0;
+    long long next_ns = demandExponentialNs(&rng, peak);
+    long long last_ns = monotonic_ns();
+    while (demandAdvance(&clock_ns, &last_ns)) {
+        __atomic_store_n(&demand_config.clock_ns, clock_ns, __ATOMIC_RELAXED);
+
+        while (next_ns <= clock_ns) {
+            if ((rngNext(&rng) >> 11) * (1.0 / 9007199254740992.0) * peak < demandRate(next_ns)) {
+                externalEvent(&center->queue, CREATE_PASSENGER);
+                __atomic_add_fetch(&demand_config.requested, 1, __ATOMIC_RELAXED);
             }
+            next_ns += demandExponentialNs(&rng, peak);
         }
+        demandSleep(next_ns - clock_ns);
     }
 
-    // Free memory on failure
-    for (int row = 0; row < num_rows; row++) free(visited[row]);
-    free(visited);
-    free(queue);
-    return 1;
+    return NULL;
 }
 
+static TripTrace trip_trace = {
+    .speed = 1.0,
+};
+
 /**
- * Marks a calculated path on the map matrix
+ * Opens a trip trace and reads its header
  * 
- * Annotates the path with directional markers (→, ←, ↑, ↓) by:
- * - Analyzing each step's direction
- * - Setting appropriate directional constants
- * - Preserving destination marker
+ * A file starting with TRIPS_FILE_MAGIC holds TripRecords; anything else
+ * is CSV with one "time_s,origin_col,origin_row,dest_col,dest_row" request
+ * per line (a header line and lines starting with '#' are skipped).
  * 
- * @param maze The map matrix to annotate
- * @param solutionX Array of path X coordinates
- * @param solutionY Array of path Y coordinates
- * @param solution_size Length of path
+ * @param trace Trace with path set
+ * @return false if the file cannot be opened or its header is wrong
  */
 
-void markPath(int **maze, int solutionX[], int solutionY[], int solution_size) {
-    if (solution_size <= 0 || maze == NULL || solutionX == NULL || solutionY == NULL) {
-        return;
+bool tripTraceOpen(TripTrace* trace) {
+    trace->file = fopen(trace->path, "rb");
+    trace->chunk = malloc(TRIPS_CHUNK_BYTES + 1); // + 1 ends a last line without a newline
+    trace->ahead = malloc(TRIPS_LOOKAHEAD * sizeof(TripRequest));
+    trace->chunk_len = trace->chunk_pos = 0;
+    trace->ahead_head = trace->ahead_count = 0;
+    trace->origin_us = -1;
+    if (!trace->file || !trace->chunk || !trace->ahead) {
+        snprintf(trace->status, sizeof(trace->status), "Could not open %s", trace->path);
+        return false;
     }
 
-    for (int i = 0; i < solution_size - 1; i++) {
-        int current_x = solutionX[i];
-        int current_y = solutionY[i];
-        int next_x = solutionX[i + 1];
-        int next_y = solutionY[i + 1];
-
-        // Determine direction
-        if (next_x == current_x + 1 && next_y == current_y) {
-            maze[current_y][current_x] = RIGHT; // →
-        } else if (next_x == current_x - 1 && next_y == current_y) {
-            maze[current_y][current_x] = LEFT; // ←
-        } else if (next_y == current_y + 1 && next_x == current_x) {
-            maze[current_y][current_x] = DOWN; // ↓
-        } else if (next_y == current_y - 1 && next_x == current_x) {
-            maze[current_y][current_x] = UP; // ↑
-        }
+    char magic[8];
+    uint32_t header[2];
+    size_t got = fread(magic, 1, sizeof(magic), trace->file);
+    trace->binary = got == sizeof(magic) && memcmp(magic, TRIPS_FILE_MAGIC, sizeof(magic)) == 0;
+    if (!trace->binary) {
+        memcpy(trace->chunk, magic, got); // CSV: the bytes are the first line
+        trace->chunk_len = got;
+        return true;
+    }
+    if (fread(header, sizeof(header), 1, trace->file) != 1 || header[0] != TRIPS_FILE_VERSION ||
+        header[1] != sizeof(TripRecord)) {
+        snprintf(trace->status, sizeof(trace->status), "%s is not a version %d trip trace", trace->path, TRIPS_FILE_VERSION);
+        return false;
     }
+    return true;
+}
 
-    // Keep the destination marker
-    int last_x = solutionX[solution_size - 1];
-    int last_y = solutionY[solution_size - 1];
-    maze[last_y][last_x] = DESTINATION;
+// Frees the read buffers and closes the trace
+void tripTraceClose(TripTrace* trace) {
+    if (trace->file) fclose(trace->file);
+    free(trace->chunk);
+    free(trace->ahead);
+    trace->file = NULL;
+    trace->chunk = NULL;
+    trace->ahead = NULL;
+}
+
+// Reads more of the trace behind the unparsed bytes; false at the end of the file
+static bool tripTraceFill(TripTrace* trace) {
+    memmove(trace->chunk, trace->chunk + trace->chunk_pos, trace->chunk_len - trace->chunk_pos);
+    trace->chunk_len -= trace->chunk_pos;
+    trace->chunk_pos = 0;
+    size_t got = fread(trace->chunk + trace->chunk_len, 1, TRIPS_CHUNK_BYTES - trace->chunk_len, trace->file);
+    trace->chunk_len += got;
+    return got > 0;
 }
 
 /**
- * Draws a building square on the map with borders
- * 
- * Creates a building by:
- * 1. Drawing top/bottom borders (horizontal roads)
- * 2. Drawing left/right borders (vertical roads)
- * 3. Leaving center area as sidewalk (1)
+ * Parses the next request of the trace
  * 
- * @param map Pointer to Map structure
- * @param q Square parameters (position, size)
- * @param borderWidth Width of border roads
+ * @param trace Open trace
+ * @param request Output request
+ * @return 1 on a request, 0 on a line or record that is skipped, -1 at the end
  */
 
-static void drawSquare(Map *map, Square q, int borderWidth) {
-    // Top: draw the top border
-    for (int i = 0; i < borderWidth; i++) {
-        for (int col = q.x; col < q.x + q.size && col < map->cols; col++) {
-            if (q.y + i < map->rows) {
-                map->matrix[q.y + i][col] = ROAD;
-            }
-        }
+static int tripTraceNext(TripTrace* trace, TripRequest* request) {
+    if (trace->binary) {
+        if (trace->chunk_len - trace->chunk_pos < sizeof(TripRecord) && !tripTraceFill(trace)) return -1;
+        if (trace->chunk_len - trace->chunk_pos < sizeof(TripRecord)) return -1; // A torn last record
+        TripRecord record;
+        memcpy(&record, trace->chunk + trace->chunk_pos, sizeof(record));
+        trace->chunk_pos += sizeof(record);
+        *request = (TripRequest){record.time_us, record.origin_col, record.origin_row, record.dest_col, record.dest_row};
+        return 1;
     }
 
-    // Bottom: draw the bottom border
-    for (int i = 0; i < borderWidth; i++) {
-        for (int col = q.x; col < q.x + q.size && col < map->cols; col++) {
-            if (q.y + q.size - i - 1 < map->rows) {
-                map->matrix[q.y + q.size - i - 1][col] = ROAD;
+    // The next full line, reading more until there is one
+    char* line = trace->chunk + trace->chunk_pos;
+    char* newline = memchr(line, '\n', trace->chunk_len - trace->chunk_pos);
+    if (!newline) {
+        bool more = trace->chunk_len - trace->chunk_pos < TRIPS_CHUNK_BYTES && tripTraceFill(trace);
+        line = trace->chunk;
+        newline = memchr(line, '\n', trace->chunk_len);
+        if (!newline && more) return 0; // Still filling the buffer
+        if (!newline) {
+            if (trace->chunk_len == 0) return -1;
+            if (trace->chunk_len >= TRIPS_CHUNK_BYTES) { // A line longer than the buffer
+                trace->chunk_pos = trace->chunk_len;
+                return 0;
             }
+            trace->chunk[trace->chunk_len] = '\0'; // Last line without a newline
+            newline = trace->chunk + trace->chunk_len;
+            trace->chunk_len++;
         }
     }
+    *newline = '\0';
+    trace->chunk_pos = (size_t)(newline - trace->chunk) + 1;
 
-    // Sides: draw the left and right borders
-    for (int i = 0; i < borderWidth; i++) {
-        for (int row = q.y; row < q.y + q.size && row < map->rows; row++) {
-            if (q.x + i < map->cols) {
-                map->matrix[row][q.x + i] = ROAD;
-            }
-            if (q.x + q.size - i - 1 < map->cols) {
-                map->matrix[row][q.x + q.size - i - 1] = ROAD;
-            }
+    if (line[0] == '#' || line[0] == '\0' || line[0] == '\r' || newline - line > TRIPS_MAX_LINE) {
+        return 0;
+    }
+    double time_s;
+    if (sscanf(line, "%lf,%d,%d,%d,%d", &time_s, &request->origin_col, &request->origin_row,
+               &request->dest_col, &request->dest_row) != 5) {
+        if (trace->read > 0 || trace->rejected > 0) trace->rejected++; // Else the header line
+        return 0;
+    }
+    request->time_us = (long long)(time_s * 1e6);
+    return 1;
+}
+
+// Parses requests into the look-ahead ring until it is full or the trace ends
+static void tripTraceReadAhead(TripTrace* trace) {
+    while (trace->file && trace->ahead_count < TRIPS_LOOKAHEAD) {
+        TripRequest request;
+        int result = tripTraceNext(trace, &request);
+        if (result < 0) {
+            fclose(trace->file);
+            trace->file = NULL;
+            break;
+        }
+        if (result == 0) continue;
+
+        trace->read++;
+        bool degenerate = request.origin_col < 0 || request.origin_row < 0 || request.dest_col < 0 || request.dest_row < 0 ||
+                          (request.origin_col == request.dest_col && request.origin_row == request.dest_row);
+        if (degenerate) {
+            trace->rejected++;
+            continue;
         }
+        if (trace->origin_us < 0) trace->origin_us = request.time_us;
+        trace->ahead[(trace->ahead_head + trace->ahead_count++) % TRIPS_LOOKAHEAD] = request;
     }
 }
 
 /**
- * Draws a road segment between two points
+ * Trip trace replay thread
  * 
- * Creates either horizontal or vertical road segments with:
- * - Proper road width handling
- * - Boundary checking
- * - Center-aligned road placement
+ * Streams trace->path and sends every request to the control center as an
+ * external CREATE_PASSENGER carrying its origin and destination cells,
+ * when the trace clock (time since the first request, times
+ * trace->speed) reaches it. Parsing stays up to TRIPS_LOOKAHEAD requests
+ * ahead of the clock, refilled at half; requests due within
+ * DEMAND_MIN_SLEEP_NS are sent in one wake-up. The clock stops while the
+ * simulation is paused.
  * 
- * @param map Pointer to Map structure
- * @param x1 Starting X coordinate
- * @param y1 Starting Y coordinate
- * @param x2 Ending X coordinate
- * @param y2 Ending Y coordinate
+ * @param arg ControlCenter pointer passed as void*
+ * @return NULL at the end of the trace or once demand_stop is set
  */
 
-static void drawRoad(Map *map, int x1, int y1, int x2, int y2) {
-    if (x1 != x2) {
-        int step = (x2 > x1) ? 1 : -1;
-        for (int x = x1; x != x2; x += step) {
-            for (int k = 0; k < map->road_width; k++) {
-                int y = y1 + k - map->road_width / 2;
-                if (x >= 0 && x < map->cols && y >= 0 && y < map->rows) {
-                    map->matrix[y][x] = ROAD;
-                }
+void* trips_thread(void* arg) {
+    ControlCenter* center = (ControlCenter*)arg;
+    TripTrace* trace = &trip_trace;
+    traceThreadName("trips");
+
+    if (tripTraceOpen(trace)) {
+        tripTraceReadAhead(trace);
+        long long clock_ns = 0;
+        long long last_ns = monotonic_ns();
+        while (trace->ahead_count > 0 && demandAdvance(&clock_ns, &last_ns)) {
+            __atomic_store_n(&trace->clock_ns, clock_ns, __ATOMIC_RELAXED);
+            long long clock_us = (long long)(clock_ns / 1000 * trace->speed);
+
+            while (trace->ahead_count > 0 && trace->ahead[trace->ahead_head].time_us - trace->origin_us <= clock_us) {
+                TripRequest* request = &trace->ahead[trace->ahead_head];
+                externalRequest(&center->queue, CREATE_PASSENGER, request->origin_col, request->origin_row,
+                                request->dest_col, request->dest_row);
+                __atomic_add_fetch(&trace->injected, 1, __ATOMIC_RELAXED);
+                trace->ahead_head = (trace->ahead_head + 1) % TRIPS_LOOKAHEAD;
+                trace->ahead_count--;
+            }
+            if (trace->ahead_count <= TRIPS_LOOKAHEAD / 2) {
+                tripTraceReadAhead(trace);
+            }
+            if (trace->ahead_count > 0) {
+                long long due_us = trace->ahead[trace->ahead_head].time_us - trace->origin_us;
+                demandSleep((long long)((due_us - clock_us) * 1000 / trace->speed));
             }
         }
     }
 
-    if (y1 != y2) {
-        int step = (y2 > y1) ? 1 : -1;
-        for (int y = y1; y != y2; y += step) {
-            for (int k = 0; k < map->road_width; k++) {
-                int x = x2 + k - map->road_width / 2;
-                if (x >= 0 && x < map->cols && y >= 0 && y < map->rows) {
-                    map->matrix[y][x] = ROAD;
-                }
-            }
+    tripTraceClose(trace);
+    __atomic_store_n(&trace->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Prints the demand generator's current rate, how much of it was shed and
+ * how far the trip trace got
+ * 
+ * @param center Control center counting the requests turned away
+ */
+
+void print_demand(ControlCenter* center) {
+    if (demand_config.rate <= 0 && demand_hotspots <= 0 && !trip_trace.path) return;
+
+    lockAcquire(&center->lock, LOCK_CENTER);
+    unsigned long shed = center->passengers_shed;
+    unsigned long unplaced = center->passengers_unplaced;
+    int waiting = center->numPassengers;
+    lockRelease(&center->lock, LOCK_CENTER);
+
+    if (trip_trace.path) {
+        TripTrace* trace = &trip_trace;
+        long long clock_ns = __atomic_load_n(&trace->clock_ns, __ATOMIC_RELAXED);
+        bool done = __atomic_load_n(&trace->done, __ATOMIC_ACQUIRE);
+        printf("Trip trace: %s (%s, %.2fx) | read %lu, injected %lu, rejected %lu, unplaced %lu | at %.1f s | %s\n",
+               trace->path, trace->binary ? "binary" : "csv", trace->speed,
+               __atomic_load_n(&trace->read, __ATOMIC_RELAXED), __atomic_load_n(&trace->injected, __ATOMIC_RELAXED),
+               __atomic_load_n(&trace->rejected, __ATOMIC_RELAXED), unplaced, clock_ns * trace->speed / 1e9,
+               !done ? "streaming" : trace->status[0] ? trace->status : "done");
+        if (demand_config.rate <= 0 && demand_hotspots <= 0) return;
+    }
+
+    if (demand_config.rate > 0) {
+        long long clock_ns = __atomic_load_n(&demand_config.clock_ns, __ATOMIC_RELAXED);
+        printf("Demand: %.1f/s at %02d:00 (%s, %.0f s days) | requested %lu, shed %lu | passengers %d/%d | hotspots %d\n",
+               demandRate(clock_ns), demandHour(clock_ns), demand_config.profile_name, demand_config.day_s,
+               __atomic_load_n(&demand_config.requested, __ATOMIC_RELAXED), shed, waiting, MAX_PASSENGERS,
+               demand_hotspots);
+    } else {
+        printf("Demand: 'p' only | shed %lu | passengers %d/%d | hotspots %d\n", shed, waiting, MAX_PASSENGERS,
+               demand_hotspots);
+    }
+}
+
+// -------------------- BENCHMARK FUNCTIONS --------------------
+
+static BenchConfig bench_config = {
+    .taxis = MAX_TAXIS,
+    .rate = 1.0,
+    .duration_s = 30.0,
+};
+
+// Reads the benchmark counters of the running simulation
+static void benchSample(ControlCenter* center, BenchSample* sample) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    sample->cpu_user_ns = usage.ru_utime.tv_sec * 1000000000LL + usage.ru_utime.tv_usec * 1000LL;
+    sample->cpu_system_ns = usage.ru_stime.tv_sec * 1000000000LL + usage.ru_stime.tv_usec * 1000LL;
+
+    lockAcquire(&center->lock, LOCK_CENTER);
+    sample->messages = __atomic_load_n(&center->queue.dequeued, __ATOMIC_RELAXED) +
+                       __atomic_load_n(&center->visualizerQueue->dequeued, __ATOMIC_RELAXED);
+    for (int i = 0; i < center->numTaxis; i++) {
+        if (center->taxis[i]) {
+            sample->messages += __atomic_load_n(&center->taxis[i]->queue.dequeued, __ATOMIC_RELAXED);
         }
     }
+    sample->trips = center->trips[0] + center->trips[1];
+    sample->shed = center->passengers_shed;
+    sample->unplaced = center->passengers_unplaced;
+    lockRelease(&center->lock, LOCK_CENTER);
+    sample->demand = __atomic_load_n(&demand_config.requested, __ATOMIC_RELAXED);
+    sample->traced = __atomic_load_n(&trip_trace.injected, __ATOMIC_RELAXED);
+
+    sample->routes = __atomic_load_n(&center->routes, __ATOMIC_RELAXED);
+    sample->dispatches = __atomic_load_n(&center->dispatches, __ATOMIC_RELAXED);
+    sample->passengers = __atomic_load_n(&center->passengers_created, __ATOMIC_RELAXED);
+    sample->ns = monotonic_ns();
+}
+
+/**
+ * Writes the benchmark report as one JSON object
+ * 
+ * Rates are per second of the measured window; CPU time is the process's
+ * over the same window and peak RSS is the process's high-water mark.
+ * 
+ * @param start Sample taken when the window opened
+ * @param stop Sample taken when it closed
+ * @param fleet Taxis running when the window opened
+ * @param requested Passengers requested during the window
+ * @return false if the report could not be written
+ */
+
+static bool benchReport(const BenchSample* start, const BenchSample* stop, int fleet, unsigned long requested) {
+    static const double percentiles[] = {50, 99};
+    FILE* out = bench_config.output ? fopen(bench_config.output, "w") : stdout;
+    if (!out) return false;
+
+    double elapsed_s = (stop->ns - start->ns) / 1e9;
+    double cpu_user_s = (stop->cpu_user_ns - start->cpu_user_ns) / 1e9;
+    double cpu_system_s = (stop->cpu_system_ns - start->cpu_system_ns) / 1e9;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t wait[2], trip[2];
+    hdrPercentiles(&lifecycle_metrics.histograms[METRIC_WAIT], percentiles, wait, 2);
+    hdrPercentiles(&lifecycle_metrics.histograms[METRIC_TRIP], percentiles, trip, 2);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"seed\": %llu,\n", (unsigned long long)sim_seed);
+    fprintf(out, "  \"rows\": %d,\n  \"cols\": %d,\n", sim_rows, sim_cols);
+    fprintf(out, "  \"taxis\": %d,\n", fleet);
+    fprintf(out, "  \"arrival_rate\": %.3f,\n", bench_config.rate);
+    fprintf(out, "  \"time_scale\": %.3f,\n", sim_time_scale);
+    fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed_s);
+    fprintf(out, "  \"passengers_requested\": %lu,\n", requested);
+    fprintf(out, "  \"demand_rate\": %.3f,\n", demand_config.rate);
+    fprintf(out, "  \"demand_requested\": %lu,\n", stop->demand - start->demand);
+    fprintf(out, "  \"trace_injected\": %lu,\n", stop->traced - start->traced);
+    fprintf(out, "  \"passengers_created\": %lu,\n", stop->passengers - start->passengers);
+    fprintf(out, "  \"passengers_shed\": %lu,\n", stop->shed - start->shed);
+    fprintf(out, "  \"passengers_unplaced\": %lu,\n", stop->unplaced - start->unplaced);
+    fprintf(out, "  \"dispatches\": %lu,\n", stop->dispatches - start->dispatches);
+    fprintf(out, "  \"dispatches_per_sec\": %.3f,\n", (stop->dispatches - start->dispatches) / elapsed_s);
+    fprintf(out, "  \"routes\": %lu,\n", stop->routes - start->routes);
+    fprintf(out, "  \"routes_per_sec\": %.3f,\n", (stop->routes - start->routes) / elapsed_s);
+    fprintf(out, "  \"trips\": %lu,\n", stop->trips - start->trips);
+    fprintf(out, "  \"trips_per_sec\": %.3f,\n", (stop->trips - start->trips) / elapsed_s);
+    fprintf(out, "  \"messages\": %lu,\n", stop->messages - start->messages);
+    fprintf(out, "  \"messages_per_sec\": %.3f,\n", (stop->messages - start->messages) / elapsed_s);
+    fprintf(out, "  \"wait_p50_s\": %.3f,\n  \"wait_p99_s\": %.3f,\n", wait[0] / 1e6, wait[1] / 1e6);
+    fprintf(out, "  \"trip_p50_s\": %.3f,\n  \"trip_p99_s\": %.3f,\n", trip[0] / 1e6, trip[1] / 1e6);
+    fprintf(out, "  \"cpu_user_s\": %.3f,\n  \"cpu_system_s\": %.3f,\n", cpu_user_s, cpu_system_s);
+    fprintf(out, "  \"cpu_utilisation\": %.3f,\n", elapsed_s > 0 ? (cpu_user_s + cpu_system_s) / elapsed_s : 0.0);
+    fprintf(out, "  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+    fprintf(out, "}\n");
+
+    if (out == stdout) {
+        fflush(out);
+        return true;
+    }
+    return fclose(out) == 0;
+}
+
+// Sleeps until a monotonic time
+static void benchSleepUntil(long long ns) {
+    struct timespec ts = {.tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
 }
 
 /**
- * Connects buildings using Minimum Spanning Tree algorithm
+ * Headless benchmark driver, run in place of the input thread
  * 
- * Creates efficient road network by:
- * 1. Calculating building center points
- * 2. Using Prim's algorithm to find MST
- * 3. Drawing roads between connected buildings
+ * Creates the fleet, then requests passengers at bench_config.rate for
+ * bench_config.duration_s seconds through the same external events as the
+ * keyboard, writes the report and quits the program.
  * 
- * @param map Pointer to Map structure
- * @param squares Array of building squares
- * @param num_squares Number of buildings
+ * @param arg ControlCenter pointer passed as void*
+ * @return NULL once the quit is sent
  */
 
-static void connectSquaresMST(Map *map, Square *squares, int num_squares) {
-    if (num_squares <= 0 || squares == NULL) return;
-
-    int *parent = malloc(num_squares * sizeof(int));
-    int *key = malloc(num_squares * sizeof(int));
-    bool *inMST = malloc(num_squares * sizeof(bool));
+void* bench_thread(void* arg) {
+    ControlCenter* center = (ControlCenter*)arg;
+    traceThreadName("benchmark");
 
-    // Initialize MST arrays
-    for (int i = 0; i < num_squares; i++) {
-        key[i] = INT_MAX;
-        inMST[i] = false;
+    for (int i = 0; i < bench_config.taxis; i++) {
+        externalEvent(&center->queue, CREATE_TAXI);
     }
-    key[0] = 0;
-    parent[0] = -1;
-
-    // Prim's algorithm
-    for (int count = 0; count < num_squares - 1; count++) {
-        int minKey = INT_MAX, u = -1;
-
-        for (int v = 0; v < num_squares; v++) {
-            if (!inMST[v] && key[v] < minKey) {
-                minKey = key[v];
-                u = v;
-            }
-        }
 
-        inMST[u] = true;
+    // The window opens once the fleet is on the map
+    long long deadline = monotonic_ns() + BENCH_FLEET_TIMEOUT_SEC * 1000000000LL;
+    int fleet = 0;
+    while (monotonic_ns() < deadline) {
+        lockAcquire(&center->lock, LOCK_CENTER);
+        fleet = center->numTaxis;
+        lockRelease(&center->lock, LOCK_CENTER);
+        if (fleet >= bench_config.taxis) break;
+        usleep(10000);
+    }
 
-        for (int v = 0; v < num_squares; v++) {
-            if (!inMST[v]) {
-                int dx = abs((squares[u].x + squares[u].size / 2) -
-                             (squares[v].x + squares[v].size / 2));
-                int dy = abs((squares[u].y + squares[u].size / 2) -
-                             (squares[v].y + squares[v].size / 2));
-                int weight = dx + dy;
+    BenchSample start, stop;
+    benchSample(center, &start);
+    long long end = start.ns + (long long)(bench_config.duration_s * 1e9);
+    long long interval = bench_config.rate > 0 ? (long long)(1e9 / bench_config.rate) : 0;
+    long long next = start.ns + interval;
+    unsigned long requested = 0;
+
+    while (interval > 0 && next < end) {
+        benchSleepUntil(next);
+        externalEvent(&center->queue, CREATE_PASSENGER);
+        requested++;
+        next += interval;
+    }
+    benchSleepUntil(end);
+    benchSample(center, &stop);
 
-                if (weight < key[v]) {
-                    key[v] = weight;
-                    parent[v] = u;
-                }
-            }
-        }
+    if (!benchReport(&start, &stop, fleet, requested)) {
+        perror("Failed to write benchmark report");
     }
+    externalEvent(&center->queue, EXIT_PROGRAM);
+    return NULL;
+}
 
-    // Connect the squares
-    for (int i = 1; i < num_squares; i++) {
-        int u = parent[i];
-        int x1, y1, x2, y2;
-        findConnectionPoints(squares[u], squares[i], &x1, &y1, &x2, &y2);
-        drawRoad(map, x1, y1, x2, y2);
+// -------------------- PATH BENCHMARK FUNCTIONS --------------------
+
+static PathBenchConfig pathbench_config = {
+    .sizes = PATHBENCH_DEFAULT_SIZES,
+    .densities = PATHBENCH_DEFAULT_DENSITIES,
+    .engines = "all",
+    .seeds = PATHBENCH_DEFAULT_SEEDS,
+    .queries = PATHBENCH_DEFAULT_QUERIES,
+};
+static const char* const pathbench_set_names[PATHBENCH_SETS] = {"pairs", "curb", "taxi"};
+static const char* const pathbench_engine_names[PATHBENCH_ENGINES] = {"bfs", "cached", "dstar", "coop", "bitboard", "field"};
+
+// Engines that answer a query set: point-to-point engines for pairs and curbs, nearest-target ones for taxis
+static bool pathBenchSupports(int engine, int set) {
+    if (set == PATHBENCH_SET_TAXI) {
+        return engine == PATHBENCH_ENGINE_BFS || engine == PATHBENCH_ENGINE_BITBOARD || engine == PATHBENCH_ENGINE_FIELD;
     }
+    return engine != PATHBENCH_ENGINE_BITBOARD && engine != PATHBENCH_ENGINE_FIELD;
+}
 
-    free(parent);
-    free(key);
-    free(inMST);
+// Generates a benchmark map the way createMap() and the visualizer do, at a fixed size
+static Map* pathBenchMap(int rows, int cols, int density, uint64_t seed) {
+    Rng rng;
+    rngSeed(&rng, seed, RNG_STREAM_MAP);
+
+    Map* map = malloc(sizeof(Map));
+    if (!map) return NULL;
+    mapInitFields(map, rows, cols);
+    if (!tileGridInit(&map->grid, rows, cols)) {
+        free(map);
+        return NULL;
+    }
+    int squares = MAX(1, (int)((long long)rows * cols * density / 10000));
+    generateMap(map, &rng, squares, ROAD_WIDTH, BORDER_WIDTH, MIN_SIZE, MAX_SIZE, MIN_DISTANCE);
+    return map;
 }
 
 /**
- * Calculates connection points between two buildings
- * 
- * Determines optimal road attachment points by:
- * - Comparing relative positions (horizontal/vertical dominance)
- * - Selecting midpoints on appropriate sides
+ * Draws a fixed query set on a map
  * 
- * @param a First building square
- * @param b Second building square
- * @param px1 Output for first point's X
- * @param py1 Output for first point's Y
- * @param px2 Output for second point's X
- * @param py2 Output for second point's Y
+ * @param map Benchmark map (no taxis on it yet)
+ * @param rng Random stream of the queries
+ * @param set PATHBENCH_SET_*
+ * @param count Queries wanted
+ * @param queries Output array of count queries
+ * @return Queries drawn (fewer if the map has too few reachable cells)
  */
 
-static void findConnectionPoints(Square a, Square b, int *px1, int *py1, int *px2, int *py2)
-{
-    // Pontos médios nas bordas (otimizado)
-    int a_center_x = a.x + a.size / 2; // coluna
-    int a_center_y = a.y + a.size / 2; // linha
-    int b_center_x = b.x + b.size / 2;
-    int b_center_y = b.y + b.size / 2;
+static int pathBenchQueries(Map* map, Rng* rng, int set, int count, PathBenchQuery* queries) {
+    int drawn = 0;
+    for (int attempts = 0; drawn < count && attempts < count * MAX_ATTEMPTS; attempts++) {
+        PathBenchQuery* q = &queries[drawn];
+        int sidewalk_x, sidewalk_y;
+
+        if (set == PATHBENCH_SET_PAIRS) {
+            if (map->num_road_cells < 2) break;
+            uint32_t a = map->road_cells[rngBelow(rng, map->num_road_cells)];
+            uint32_t b = map->road_cells[rngBelow(rng, map->num_road_cells)];
+            q->start_col = a % map->cols;
+            q->start_row = a / map->cols;
+            q->dest_col = b % map->cols;
+            q->dest_row = b / map->cols;
+        } else if (!find_random_free_point_adjacent_to_sidewalk(map, rng, &q->start_col, &q->start_row, &sidewalk_x, &sidewalk_y) ||
+                   !find_random_free_point_adjacent_to_sidewalk(map, rng, &q->dest_col, &q->dest_row, &sidewalk_x, &sidewalk_y)) {
+            break;
+        }
 
-    // Determina a direção relativa entre quadrados
-    int delta_x = b_center_x - a_center_x;
-    int delta_y = b_center_y - a_center_y;
+        if (set != PATHBENCH_SET_TAXI &&
+            ((q->start_col == q->dest_col && q->start_row == q->dest_row) ||
+             !mapSameComponent(map, q->start_col, q->start_row, q->dest_col, q->dest_row))) {
+            continue;
+        }
+        drawn++;
+    }
+    return drawn;
+}
 
-    // Escolhe pontos de conexão baseado na posição relativa
-    if (abs(delta_x) > abs(delta_y))
-    {
-    // Conectar horizontalmente
-    *px1 = (delta_x > 0) ? (a.x + a.size - 1) : a.x; // Direita ou esquerda
-    *py1 = a_center_y;
-    *px2 = (delta_x > 0) ? b.x : (b.x + b.size - 1);
-    *py2 = b_center_y;
+// Parks MAX_TAXIS free taxis on random road cells that no query starts from
+static void pathBenchPlaceTaxis(Map* map, Rng* rng, const PathBenchQuery* queries, int count) {
+    for (int id = 1, attempts = 0; id <= MAX_TAXIS && map->num_road_cells > 0 && attempts < MAX_ATTEMPTS; attempts++) {
+        uint32_t cell = map->road_cells[rngBelow(rng, map->num_road_cells)];
+        int col = cell % map->cols, row = cell / map->cols;
+        bool taken = tileGet(&map->grid, col, row) != ROAD;
+        for (int i = 0; i < count && !taken; i++) {
+            taken = queries[i].start_col == col && queries[i].start_row == row;
+        }
+        if (!taken) {
+            mapSetCell(map, col, row, R_TAXI_FREE + id++);
+        }
     }
-    else
-    {
-    // Conectar verticalmente
-    *px1 = a_center_x;
-    *py1 = (delta_y > 0) ? (a.y + a.size - 1) : a.y; // Base ou topo
-    *px2 = b_center_x;
-    *py2 = (delta_y > 0) ? b.y : (b.y + b.size - 1);
 }
+
+// Runs one query on one engine; returns whether a route was found
+static bool pathBenchQuery(PathBenchEngines* e, int engine, int set, const PathBenchQuery* q, PathData* path) {
+    Map* map = e->map;
+    switch (engine) {
+        case PATHBENCH_ENGINE_BFS:
+            if (set == PATHBENCH_SET_TAXI) {
+                return findPath(q->start_col, q->start_row, &map->grid, map->cols, map->rows, path, R_TAXI_FREE) == 0;
+            }
+            return findPathCoordinates(q->start_col, q->start_row, q->dest_col, q->dest_row,
+                                       &map->grid, map->cols, map->rows, path) == 0;
+        case PATHBENCH_ENGINE_CACHED:
+            return findPathCoordinatesCached(e->cache, map, q->start_col, q->start_row, q->dest_col, q->dest_row, path) == 0;
+        case PATHBENCH_ENGINE_DSTAR:
+            return dstarPlan(e->dstar, &map->grid, q->start_col, q->start_row, q->dest_col, q->dest_row) == 0 &&
+                   dstarExtract(e->dstar, &map->grid, path) == 0;
+        case PATHBENCH_ENGINE_COOP: {
+            bool found = findPathCooperative(NULL, e->table, map, NULL, 1, 1, 0,
+                                             q->start_col, q->start_row, q->dest_col, q->dest_row, path) == 0;
+            reservationRelease(e->table, 1);
+            return found;
+        }
+        case PATHBENCH_ENGINE_BITBOARD:
+            return findPathBitboard(map, q->start_col, q->start_row, path, R_TAXI_FREE) == 0;
+        case PATHBENCH_ENGINE_FIELD:
+            return taxiFieldNearest(e->field, q->start_col, q->start_row, path) == 0;
+    }
+    return false;
 }
 
 /**
- * Finds random accessible point on road network
+ * Times the enabled engines over one query set
  * 
- * Locates valid spawn points by:
- * - Random sampling with maximum attempts
- * - Checking for ROAD (0) cell type
+ * The BFS runs first and its route lengths are the reference the other
+ * engines are checked against. The cached engine starts each set from an
+ * empty cache, so it only hits on queries the set repeats.
  * 
- * @param map Pointer to Map structure
- * @param random_x Output for found X coordinate
- * @param random_y Output for found Y coordinate
- * @return true if valid point found, false otherwise
+ * @param e Engine state of the map
+ * @param enabled Engines to run, indexed by PATHBENCH_ENGINE_*
+ * @param set PATHBENCH_SET_*
+ * @param queries Query set
+ * @param count Number of queries
+ * @param results Totals to add to, indexed by engine
  */
 
-bool find_random_free_point(Map* map, int* random_x, int* random_y) {
-    const int max_attempts = 1000;
-    int attempts = 0;
-
-    if (!map || !map->matrix) {
-        return false;
+static void pathBenchRunSet(PathBenchEngines* e, const bool* enabled, int set, const PathBenchQuery* queries, int count,
+                            PathBenchResult* results) {
+    PathData* path = pathCreate();
+    int* reference = malloc(MAX(count, 1) * sizeof(int));
+    if (!path || !reference) {
+        pathFree(path);
+        free(reference);
+        return;
     }
 
-    do {
-        *random_x = rand() % map->cols;
-        *random_y = rand() % map->rows;
-        attempts++;
-    } while (map->matrix[*random_y][*random_x] != ROAD && attempts < max_attempts);
+    for (int engine = 0; engine < PATHBENCH_ENGINES; engine++) {
+        if (!enabled[engine] || !pathBenchSupports(engine, set)) continue;
+        if (engine == PATHBENCH_ENGINE_CACHED && e->cache) {
+            routeCacheClear(e->cache);
+        }
 
-    if (attempts >= max_attempts) {
-        return false;
+        PathBenchResult* r = &results[engine];
+        route_stats = (RouteStats){0};
+        long long started = monotonic_ns();
+        for (int i = 0; i < count; i++) {
+            bool found = pathBenchQuery(e, engine, set, &queries[i], path);
+            int length = found ? path->tamanho_solucao : -1;
+            if (engine == PATHBENCH_ENGINE_BFS) {
+                reference[i] = length;
+            } else if (enabled[PATHBENCH_ENGINE_BFS] && length != reference[i]) {
+                r->mismatches++;
+            }
+            if (found) {
+                r->found++;
+                r->length += length;
+            }
+        }
+        r->ns += monotonic_ns() - started;
+        r->queries += count;
+        r->expanded += route_stats.expanded;
+        r->allocations += route_stats.allocations;
     }
 
-    return true;
+    pathFree(path);
+    free(reference);
+}
+
+// Prints one result row, and its JSON object when a report file is open
+static void pathBenchPrint(FILE* json, bool* first, int rows, int cols, int density, int set, int engine,
+                           const PathBenchResult* r) {
+    double queries = r->queries ? (double)r->queries : 1.0;
+    char size[32];
+    snprintf(size, sizeof(size), "%dx%d", rows, cols);
+    printf("%-11s %5d %-5s %-8s %7lu/%-7lu %10.0f %11.1f %9.1f %9.1f %8lu\n", size, density,
+           pathbench_set_names[set], pathbench_engine_names[engine], r->found, r->queries, r->ns / queries,
+           r->expanded / queries, r->allocations / queries, r->found ? (double)r->length / r->found : 0.0, r->mismatches);
+
+    if (!json) return;
+    fprintf(json, "%s    {\"rows\": %d, \"cols\": %d, \"density\": %d, \"set\": \"%s\", \"engine\": \"%s\", ",
+            *first ? "" : ",\n", rows, cols, density, pathbench_set_names[set], pathbench_engine_names[engine]);
+    fprintf(json, "\"queries\": %lu, \"found\": %lu, \"ns_per_query\": %.1f, \"expanded_per_query\": %.1f, ",
+            r->queries, r->found, r->ns / queries, r->expanded / queries);
+    fprintf(json, "\"allocations_per_query\": %.2f, \"mean_length\": %.2f, \"mismatches\": %lu}",
+            r->allocations / queries, r->found ? (double)r->length / r->found : 0.0, r->mismatches);
+    *first = false;
 }
 
 /**
- * Finds road point adjacent to sidewalk
+ * Runs the pathfinding micro-benchmark and prints its table
  * 
- * Locates passenger pickup/dropoff points by:
- * - Finding road cells (0) next to sidewalk cells (1)
- * - Valid for both passenger origins and destinations
+ * For every size and density, generates pathbench_config.seeds maps with
+ * generateMap(), draws the query sets (random road pairs, curb to curb,
+ * curb to the nearest of MAX_TAXIS free taxis) and times every enabled
+ * engine on them, single-threaded. Reports ns, cells expanded and
+ * allocations per query, plus mismatches against the BFS route lengths.
+ * A JSON copy of the table goes to --bench-out when given.
  * 
- * @param map Pointer to Map structure
- * @param free_x Output for road X coordinate
- * @param free_y Output for road Y coordinate
- * @param sidewalk_x Output for adjacent sidewalk X
- * @param sidewalk_y Output for adjacent sidewalk Y
- * @return true if valid point found, false otherwise
+ * @return false on an invalid option or an unwritable report
  */
 
-bool find_random_free_point_adjacent_to_sidewalk(Map* map, int* free_x, int* free_y, int* sidewalk_x, int* sidewalk_y) {
-    const int max_attempts = MAX_ATTEMPTS;
-    int attempts = 0;
+bool pathBenchRun() {
+    bool enabled[PATHBENCH_ENGINES] = {false};
+    char* engines = strdup(pathbench_config.engines);
+    char* save = NULL;
+    for (char* name = strtok_r(engines, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        int engine = 0;
+        while (engine < PATHBENCH_ENGINES && strcmp(name, pathbench_engine_names[engine]) != 0) engine++;
+        if (strcmp(name, "all") == 0) {
+            for (int i = 0; i < PATHBENCH_ENGINES; i++) enabled[i] = true;
+        } else if (engine < PATHBENCH_ENGINES) {
+            enabled[engine] = true;
+        } else {
+            fprintf(stderr, "Unknown routing engine %s (bfs, cached, dstar, coop, bitboard, field or all)\n", name);
+            free(engines);
+            return false;
+        }
+    }
+    free(engines);
+
+    FILE* json = NULL;
+    if (bench_config.output) {
+        json = fopen(bench_config.output, "w");
+        if (!json) return false;
+        fprintf(json, "{\n  \"seed\": %llu,\n  \"seeds\": %d,\n  \"queries\": %d,\n  \"results\": [\n",
+                (unsigned long long)sim_seed, pathbench_config.seeds, pathbench_config.queries);
+    }
+    bool first = true;
 
-    if (!map || !map->matrix) {
-        return false;
+    printf("Pathfinding benchmark: seed %llu, %d map(s) per size and density, %d queries per set\n",
+           (unsigned long long)sim_seed, pathbench_config.seeds, pathbench_config.queries);
+    printf("%-11s %5s %-5s %-8s %15s %10s %11s %9s %9s %8s\n", "size", "dens", "set", "engine", "found",
+           "ns/query", "expanded/q", "allocs/q", "mean len", "mismatch");
+
+    PathBenchQuery* queries[PATHBENCH_SETS];
+    for (int set = 0; set < PATHBENCH_SETS; set++) {
+        queries[set] = malloc(pathbench_config.queries * sizeof(PathBenchQuery));
     }
 
-    do {
-        // Generate a random free point
-        *free_x = rand() % map->cols;
-        *free_y = rand() % map->rows;
+    bool ok = true;
+    char* sizes = strdup(pathbench_config.sizes);
+    char* save_size = NULL;
+    for (char* size = strtok_r(sizes, ",", &save_size); size && ok; size = strtok_r(NULL, ",", &save_size)) {
+        int rows, cols;
+        if (sscanf(size, "%dx%d", &rows, &cols) != 2 || rows <= 0 || cols <= 0) {
+            fprintf(stderr, "--sizes expects ROWSxCOLS[,ROWSxCOLS...], e.g. 64x128,256x256\n");
+            ok = false;
+            break;
+        }
 
-        // Check if the point is free (ROAD)
-        if (map->matrix[*free_y][*free_x] == ROAD) {
-            // Check all adjacent points for a SIDEWALK
-            int delta_x[] = {0, 0, -1, 1};
-            int delta_y[] = {-1, 1, 0, 0};
+        char* densities = strdup(pathbench_config.densities);
+        char* save_density = NULL;
+        for (char* item = strtok_r(densities, ",", &save_density); item; item = strtok_r(NULL, ",", &save_density)) {
+            int density = atoi(item);
+            PathBenchResult results[PATHBENCH_SETS][PATHBENCH_ENGINES];
+            memset(results, 0, sizeof(results));
+
+            for (int s = 0; s < pathbench_config.seeds; s++) {
+                uint64_t seed = sim_seed + s;
+                Map* map = pathBenchMap(rows, cols, density, seed);
+                if (!map) continue;
+
+                Rng rng;
+                rngSeed(&rng, seed, RNG_STREAM_SPAWN);
+                int counts[PATHBENCH_SETS];
+                for (int set = 0; set < PATHBENCH_SETS; set++) {
+                    counts[set] = pathBenchQueries(map, &rng, set, pathbench_config.queries, queries[set]);
+                }
 
-            for (int i = 0; i < 4; i++) {
-                int adj_x = *free_x + delta_x[i];
-                int adj_y = *free_y + delta_y[i];
-
-                // Ensure the adjacent point is within bounds
-                if (adj_x >= 0 && adj_x < map->cols && adj_y >= 0 && adj_y < map->rows) {
-                    // Check if the adjacent point is a SIDEWALK
-                    if (map->matrix[adj_y][adj_x] == SIDEWALK) {
-                        *sidewalk_x = adj_x;
-                        *sidewalk_y = adj_y;
-                        return true;
+                PathBenchEngines e = {map, routeCacheCreate(), dstarCreate(rows, cols), reservationCreate(), NULL};
+                pathBenchRunSet(&e, enabled, PATHBENCH_SET_PAIRS, queries[PATHBENCH_SET_PAIRS], counts[PATHBENCH_SET_PAIRS],
+                                results[PATHBENCH_SET_PAIRS]);
+                pathBenchRunSet(&e, enabled, PATHBENCH_SET_CURB, queries[PATHBENCH_SET_CURB], counts[PATHBENCH_SET_CURB],
+                                results[PATHBENCH_SET_CURB]);
+
+                // Taxis are walls to the point-to-point BFS, so they only go on the map now
+                pathBenchPlaceTaxis(map, &rng, queries[PATHBENCH_SET_TAXI], counts[PATHBENCH_SET_TAXI]);
+                if (enabled[PATHBENCH_ENGINE_FIELD]) {
+                    e.field = taxiFieldCreate(rows, cols);
+                    if (e.field && !taxiFieldBuild(e.field, &map->grid)) {
+                        taxiFieldFree(e.field);
+                        e.field = NULL;
                     }
                 }
+                bool field_enabled = enabled[PATHBENCH_ENGINE_FIELD];
+                enabled[PATHBENCH_ENGINE_FIELD] = field_enabled && e.field;
+                pathBenchRunSet(&e, enabled, PATHBENCH_SET_TAXI, queries[PATHBENCH_SET_TAXI], counts[PATHBENCH_SET_TAXI],
+                                results[PATHBENCH_SET_TAXI]);
+                enabled[PATHBENCH_ENGINE_FIELD] = field_enabled;
+
+                taxiFieldFree(e.field);
+                reservationFree(e.table);
+                dstarFree(e.dstar);
+                routeCacheFree(e.cache);
+                freeMap(map);
             }
-        }
 
-        attempts++;
-    } while (attempts < max_attempts);
+            for (int set = 0; set < PATHBENCH_SETS; set++) {
+                for (int engine = 0; engine < PATHBENCH_ENGINES; engine++) {
+                    if (!enabled[engine] || !pathBenchSupports(engine, set)) continue;
+                    pathBenchPrint(json, &first, rows, cols, density, set, engine, &results[set][engine]);
+                }
+            }
+            fflush(stdout);
+        }
+        free(densities);
+    }
+    free(sizes);
 
-    return false;
+    for (int set = 0; set < PATHBENCH_SETS; set++) {
+        free(queries[set]);
+    }
+    if (json) {
+        fprintf(json, "\n  ]\n}\n");
+        ok = fclose(json) == 0 && ok;
+    }
+    return ok;
 }
 
 // -------------------- THREAD FUNCTIONS --------------------
@@ -1321,7 +10115,7 @@ bool find_random_free_point_adjacent_to_sidewalk(Map* map, int* free_x, int* fre
  */
 
 void refresh_passengers(ControlCenter* center) {
-    pthread_mutex_lock(&center->lock);
+    lockAcquire(&center->lock, LOCK_CENTER);
 
     for (int i = 0; i < center->numPassengers; i++) {
         Passenger* passenger = center->passengers[i];
@@ -1336,6 +10130,11 @@ void refresh_passengers(ControlCenter* center) {
                 }
             }
 
+            // Not placed yet: its first CREATE_PASSENGER is still queued at the visualizer
+            if (passenger->x_sidewalk < 0) {
+                continue;
+            }
+
             if (!assigned) {
                 // Re-send CREATE_PASSENGER with existing coordinates
                 enqueue_message(center->visualizerQueue, CREATE_PASSENGER,
@@ -1345,7 +10144,12 @@ void refresh_passengers(ControlCenter* center) {
         }
     }
 
-    pthread_mutex_unlock(&center->lock);
+    lockRelease(&center->lock, LOCK_CENTER);
+}
+
+// Cancellation cleanup of the input thread
+static void restoreTerminal(void* arg) {
+    tcsetattr(STDIN_FILENO, TCSANOW, (struct termios*)arg);
 }
 
 /**
@@ -1359,7 +10163,8 @@ void refresh_passengers(ControlCenter* center) {
  *   * Passenger creation
  *   * Map reset
  *   * Program control
- * - Restores terminal settings on exit
+ *   (recorded as external events, see externalEvent)
+ * - Restores terminal settings on exit or cancellation
  * 
  * @param arg ControlCenter pointer passed as void*
  * @return NULL on thread exit
@@ -1370,6 +10175,7 @@ void refresh_passengers(ControlCenter* center) {
 
 void* input_thread(void* arg) {
     ControlCenter* center = (ControlCenter*)arg;
+    traceThreadName("input");
 
     // Configure terminal for non-blocking input
     struct termios oldt, newt;
@@ -1377,9 +10183,11 @@ void* input_thread(void* arg) {
     newt = oldt;
     newt.c_lflag &= ~(ICANON | ECHO); // Disable canonical mode and echo
     tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    pthread_cleanup_push(restoreTerminal, &oldt); // A replayed quit cancels this thread
 
     char key;
-    while (1) {
+    bool running = true;
+    while (running) {
         // Non-blocking read
         key = getchar();
 
@@ -1389,65 +10197,233 @@ void* input_thread(void* arg) {
                 key = getchar(); // Get the actual arrow key
                 switch (key) {
                     case 'A': // Up arrow
-                        enqueue_message(&center->queue, CREATE_TAXI, 0, 0, 0, 0, NULL);
+                        externalEvent(&center->queue, CREATE_TAXI);
                         break;
                     case 'B': // Down arrow
-                        enqueue_message(&center->queue, DESTROY_TAXI, 0, 0, 0, 0, NULL);
+                        externalEvent(&center->queue, DESTROY_TAXI);
                         break;
                 }
             } else {
                 // Process other keys
                 switch (key) {
                     case ' ': // Spacebar to toggle pause/play
-                        pthread_mutex_lock(&pause_mutex);
+                        lockAcquire(&pause_mutex, LOCK_PAUSE);
                         isPaused = !isPaused;
                         if (!isPaused) {
                             pthread_cond_broadcast(&pause_cond); // Resume all threads
                         }
-                        pthread_mutex_unlock(&pause_mutex);
+                        lockRelease(&pause_mutex, LOCK_PAUSE);
                         break;
 
                     case 'r': // Reset the map
-                        enqueue_message(&center->queue, RESET_MAP, 0, 0, 0, 0, NULL);
+                        externalEvent(&center->queue, RESET_MAP);
                         break;
 
                     case 'p': // Add a passenger
-                        enqueue_message(&center->queue, CREATE_PASSENGER, 0, 0, 0, 0, NULL);
+                        externalEvent(&center->queue, CREATE_PASSENGER);
                         break;
 
                     case 's': // Status request
-                        enqueue_message(&center->queue, STATUS_REQUEST, 0, 0, 0, 0, NULL);
+                        externalEvent(&center->queue, STATUS_REQUEST);
                         break;
 
                     case 'l': // Print logical map
-                        enqueue_message(center->visualizerQueue, PRINT_LOGICO, 0, 0, 0, 0, NULL);
+                        externalEvent(center->visualizerQueue, PRINT_LOGICO);
+                        break;
+
+                    case 'w': // Save the city file
+                        externalEvent(center->visualizerQueue, SAVE_MAP);
+                        break;
+
+                    case 'o': // Load the city file
+                        externalEvent(&center->queue, LOAD_MAP);
+                        break;
+
+                    case 'c': // Toggle congestion-aware routing
+                        externalEvent(&center->queue, TOGGLE_CONGESTION);
+                        break;
+
+                    case 'k': // Write a checkpoint
+                        externalEvent(center->visualizerQueue, CHECKPOINT);
+                        break;
+
+                    case 'b': // Write the lock contention report (not part of the simulation)
+                        lockProfileWrite(LOCK_PROFILE_FILE_PATH);
                         break;
 
                     case 'q': // Quit the program
-                        pthread_mutex_lock(&pause_mutex);
+                        lockAcquire(&pause_mutex, LOCK_PAUSE);
                         if (isPaused) {
                             isPaused = false; // Unpause the game
                             pthread_cond_broadcast(&pause_cond); // Resume all threads
                         }
-                        pthread_mutex_unlock(&pause_mutex);
+                        lockRelease(&pause_mutex, LOCK_PAUSE);
 
-                        enqueue_message(&center->queue, EXIT_PROGRAM, 0, 0, 0, 0, NULL);
-                        tcsetattr(STDIN_FILENO, TCSANOW, &oldt); // Restore old terminal settings
-                        return NULL;
+                        // Quitting mid-replay ends the replay so the quit goes through
+                        if (__atomic_load_n(&schedule.mode, __ATOMIC_ACQUIRE) == SCHED_REPLAY) {
+                            schedStop(NULL);
+                        }
+                        externalEvent(&center->queue, EXIT_PROGRAM);
+                        running = false;
+                        break;
                     default:
                         break;
                 }
             }
         }
 
-        usleep(500000);
+        if (running) {
+            usleep(500000);
+        }
     }
 
     // Restore old terminal settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+/**
+ * Replays the external events of a replay log
+ * 
+ * Stands in for the input, timer, demand and trace threads while replaying:
+ * injects each logged key press, timer tick or passenger request into its
+ * queue when the log reaches it.
+ * 
+ * @param arg ControlCenter pointer passed as void*
+ * @return NULL once the replay ends
+ */
+
+void* replay_thread(void* arg) {
+    ControlCenter* center = (ControlCenter*)arg;
+    traceThreadName("replay");
+
+    while (schedAcquire(SCHED_ANY, SCHED_EXTERNAL)) {
+        pthread_mutex_lock(&schedule.lock);
+        ReplayEvent event = schedule.next;
+        pthread_mutex_unlock(&schedule.lock);
+
+        MessageQueue* queue = (event.actor == SCHED_ACTOR_VISUALIZER) ? center->visualizerQueue : &center->queue;
+        Message msg = {.type = (MessageType)event.type, .data_x = event.data_x, .data_y = event.data_y,
+                       .extra_x = event.extra_x, .extra_y = event.extra_y};
+        schedNote(queue->actor, SCHED_EXTERNAL, &msg);
+        enqueue_message(queue, msg.type, msg.data_x, msg.data_y, msg.extra_x, msg.extra_y, NULL);
+        schedRelease();
+    }
+    schedRelease(); // The step started after the replay ended
+
     return NULL;
 }
 
+// Lowest passenger ID no waiting or riding passenger has (center->lock held)
+static int centerFreePassengerId(const ControlCenter* center) {
+    bool taken[MAX_PASSENGERS + 2] = {false};
+    for (int i = 0; i < center->numPassengers; i++) {
+        if (center->passengers[i]) taken[center->passengers[i]->id] = true;
+    }
+    int id = 1;
+    while (taken[id]) id++;
+    return id;
+}
+
+/**
+ * Retires a taxi without waiting for it
+ * 
+ * The taxi leaves dispatch at once and gets a priority EXIT. Its route epoch
+ * is bumped, so a move or trip step it is sleeping in is dropped. It keeps
+ * its ID until it acknowledges through the visualizer (RETIRE_TAXI, behind
+ * every move it sent), which hands it to the reaper thread.
+ * 
+ * @param center Control center, locked by the caller
+ * @param index Index of the taxi in center->taxis
+ * @param map_gone The map is being replaced: the taxi has no cell to clear
+ */
+
+static void centerRetireTaxi(ControlCenter* center, int index, bool map_gone) {
+    Taxi* taxi = center->taxis[index];
+
+    pthread_mutex_lock(&taxi->lock);
+    taxi->route_epoch++;
+    taxi->retiring = true;
+    pthread_mutex_unlock(&taxi->lock);
+    taxi->retire_ns = monotonic_ns();
+    priority_enqueue_message(&taxi->queue, EXIT, map_gone, 0, 0, 0, NULL);
+
+    center->retiring[center->numRetiring++] = taxi;
+    for (int i = index; i < center->numTaxis - 1; i++) {
+        center->taxis[i] = center->taxis[i + 1];
+    }
+    center->taxis[--center->numTaxis] = NULL;
+}
+
+/**
+ * Takes every passenger off the center into a NULL-terminated batch
+ * 
+ * CREATE_PASSENGER messages still queued to the visualizer point at them,
+ * so the batch rides behind those messages (RESET_MAP / EXIT) and is only
+ * freed once it comes back with MAP_READY or the visualizer exits. Called
+ * with center->lock held.
+ * 
+ * @param center Control center
+ * @return Batch for passengersFree, or NULL when there was none (or no memory,
+ *         in which case the passengers are leaked rather than freed too early)
+ */
+
+static Passenger** centerTakePassengers(ControlCenter* center) {
+    Passenger** batch = NULL;
+    if (center->numPassengers > 0) {
+        batch = malloc((center->numPassengers + 1) * sizeof(Passenger*));
+    }
+    int count = 0;
+    for (int i = 0; i < center->numPassengers; i++) {
+        if (batch && center->passengers[i] != NULL) {
+            batch[count++] = center->passengers[i];
+        }
+    }
+    if (batch) {
+        batch[count] = NULL;
+    }
+
+    center->numPassengers = 0;
+    for (int i = 0; i < MAX_PASSENGERS; i++) {
+        center->passengers[i] = NULL;
+    }
+    return batch;
+}
+
+/**
+ * Frees a batch from centerTakePassengers
+ * 
+ * @param batch NULL-terminated batch (may be NULL)
+ */
+
+static void passengersFree(Passenger** batch) {
+    if (!batch) {
+        return;
+    }
+    for (int i = 0; batch[i] != NULL; i++) {
+        free(batch[i]);
+    }
+    free(batch);
+}
+
+/**
+ * Joins and frees a retired taxi
+ * 
+ * Its thread has sent RETIRE_TAXI and touches nothing else, so the join
+ * returns as soon as the thread does.
+ * 
+ * @param taxi Taxi off center->retiring
+ */
+
+static void taxiReap(Taxi* taxi) {
+    pthread_join(taxi->thread_id, NULL);
+    metricsRecordNs(METRIC_RETIRE, monotonic_ns() - taxi->retire_ns);
+
+    pthread_mutex_destroy(&taxi->lock);
+    cleanup_queue(&taxi->queue); // Free the route it never drove
+    free(taxi);
+}
+
 /**
  * Main control center processing thread
  * 
@@ -1463,95 +10439,111 @@ void* input_thread(void* arg) {
  * @return NULL on program exit
  * 
  * @note Implements core message processing state machine
- * @warning Holds locks during taxi thread joins
+ * @note Never waits for a taxi: routes are cancelled by epoch and taxis are
+ *       retired asynchronously (see centerRetireTaxi)
  */
 
 void* control_center_thread(void* arg) {
     ControlCenter* center = (ControlCenter*)arg;
+    traceThreadName("control center");
 
     // Access the visualizer queue (assumes it's passed via the center structure)
     MessageQueue* visualizerQueue = center->visualizerQueue;
 
     while (1) {
-        pthread_mutex_lock(&pause_mutex);
+        schedRelease(); // The previous step ends before pausing
+        lockAcquire(&pause_mutex, LOCK_PAUSE);
         while (isPaused) {
-            pthread_cond_wait(&pause_cond, &pause_mutex);
+            lockWait(&pause_cond, &pause_mutex, LOCK_PAUSE);
         }
-        pthread_mutex_unlock(&pause_mutex);
+        lockRelease(&pause_mutex, LOCK_PAUSE);
         // Dequeue a message
-        Message* msg = dequeue_message(&center->queue);
+        Message* msg = schedDequeue(&center->queue);
 
         // Process the message
         switch (msg->type) {
             case CREATE_PASSENGER:
-                pthread_mutex_lock(&center->lock);
+                lockAcquire(&center->lock, LOCK_CENTER);
 
                 if (center->numPassengers >= MAX_PASSENGERS) {
-                    pthread_mutex_unlock(&center->lock);
+                    center->passengers_shed++; // Demand beyond what the map can hold
+                    lockRelease(&center->lock, LOCK_CENTER);
                     break;
                 }
             
                 // Allocate memory for a new passenger
                 Passenger* new_passenger = malloc(sizeof(Passenger));
                 if (!new_passenger) {
-                    pthread_mutex_unlock(&center->lock);
+                    lockRelease(&center->lock, LOCK_CENTER);
                     break;
                 }
             
                 // Assign an ID and initialize the passenger
-                new_passenger->id = center->numPassengers + 1;
+                new_passenger->id = centerFreePassengerId(center);
                 new_passenger->x_sidewalk = -1; // Placeholder values
                 new_passenger->y_sidewalk = -1;
                 new_passenger->x_road = -1;
                 new_passenger->y_road = -1;
+                new_passenger->x_sidewalk_dest = -1;
+                new_passenger->y_sidewalk_dest = -1;
+                new_passenger->x_road_dest = -1;
+                new_passenger->y_road_dest = -1;
+                if (msg->data_x != 0 || msg->data_y != 0 || msg->extra_x != 0 || msg->extra_y != 0) {
+                    // A trace request: the visualizer snaps these road cells to curbs
+                    new_passenger->x_road = msg->data_x;
+                    new_passenger->y_road = msg->data_y;
+                    new_passenger->x_road_dest = msg->extra_x;
+                    new_passenger->y_road_dest = msg->extra_y;
+                }
+                new_passenger->isFree = true;
+                new_passenger->trip_started_ns = 0;
+                new_passenger->trip_congestion_aware = false;
+                new_passenger->spawned_ns = simNowNs();
+                new_passenger->picked_up_ns = 0;
+                new_passenger->pickup_eta_ns = 0;
+                new_passenger->taxi_id = 0;
+                new_passenger->route_cells = 0;
+                new_passenger->detours = 0;
             
                 // Store the passenger in the vector
                 center->passengers[center->numPassengers] = new_passenger;
                 center->numPassengers++;
+                __atomic_add_fetch(&center->passengers_created, 1, __ATOMIC_RELAXED);
             
-                pthread_mutex_unlock(&center->lock);
+                lockRelease(&center->lock, LOCK_CENTER);
             
                 // Forward the passenger pointer to the visualizer
                 enqueue_message(visualizerQueue, CREATE_PASSENGER, 0, 0, 0, 0, new_passenger);
                 break;
 
             case STATUS_REQUEST:
-                pthread_mutex_lock(&center->lock);
+                lockAcquire(&center->lock, LOCK_CENTER);
                 for (int i = 0; i < center->numTaxis; i++) {
                     Taxi* taxi = center->taxis[i];
                     if (taxi != NULL) {
                         priority_enqueue_message(&taxi->queue, STATUS_REQUEST, 0, 0, 0, 0, NULL);
                     }
                 }
-                pthread_mutex_unlock(&center->lock);
+                lockRelease(&center->lock, LOCK_CENTER);
                 break;
 
             case CREATE_TAXI: {
-                pthread_mutex_lock(&center->lock);
+                lockAcquire(&center->lock, LOCK_CENTER);
 
-                if (center->numTaxis >= MAX_TAXIS) {
-                    pthread_mutex_unlock(&center->lock);
+                if (center->numTaxis + center->numRetiring >= MAX_TAXIS) {
+                    lockRelease(&center->lock, LOCK_CENTER);
                     break;
                 }
 
                 // Allocate and initialize a new taxi
-                Taxi* new_taxi = malloc(sizeof(Taxi));
+                Taxi* new_taxi = taxiCreate(center);
                 if (!new_taxi) {
-                    pthread_mutex_unlock(&center->lock);
+                    lockRelease(&center->lock, LOCK_CENTER);
                     break;
                 }
 
-                new_taxi->id = center->numTaxis + 1;
-                new_taxi->x = -1;
-                new_taxi->y = -1;
-                new_taxi->isFree = true;
-                new_taxi->currentPassenger = -1;
-                new_taxi->visualizerQueue = center->visualizerQueue;
-                new_taxi->control_queue = &center->queue;
-                new_taxi->drop_processed = false;
-                pthread_cond_init(&new_taxi->drop_cond, NULL);
-                pthread_mutex_init(&new_taxi->lock, NULL);
-                init_queue(&new_taxi->queue);
+                // Ask the visualizer for a spawn point before the thread runs
+                enqueue_message(center->visualizerQueue, SPAWN_TAXI, new_taxi->x, new_taxi->y, new_taxi->route_epoch, 0, &new_taxi->queue);
 
                 // Create the taxi thread
                 new_taxi->thread_id = create_taxi_thread(new_taxi);
@@ -1559,15 +10551,15 @@ void* control_center_thread(void* arg) {
                 center->taxis[center->numTaxis] = new_taxi;
                 center->numTaxis++;
 
-                pthread_mutex_unlock(&center->lock);
+                lockRelease(&center->lock, LOCK_CENTER);
                 break;
             }
 
             case DESTROY_TAXI: {
-                pthread_mutex_lock(&center->lock);
+                lockAcquire(&center->lock, LOCK_CENTER);
 
                 if (center->numTaxis <= 0) {
-                    pthread_mutex_unlock(&center->lock);
+                    lockRelease(&center->lock, LOCK_CENTER);
                     break;
                 }
 
@@ -1581,94 +10573,77 @@ void* control_center_thread(void* arg) {
                 }
 
                 if (taxi_index_to_destroy == -1) {
-                    pthread_mutex_unlock(&center->lock);
+                    lockRelease(&center->lock, LOCK_CENTER);
                     break;
                 }
 
-                // Get the taxi to destroy
-                Taxi* taxi_to_destroy = center->taxis[taxi_index_to_destroy];
-
-                // Send EXIT message to the taxi
-                enqueue_message(&taxi_to_destroy->queue, EXIT, 0, 0, 0, 0, NULL);
-
-                // Wait for the taxi thread to terminate
-                pthread_join(taxi_to_destroy->thread_id, NULL);
-
-                // Clean up the taxi
-                pthread_mutex_destroy(&taxi_to_destroy->lock);
-                pthread_cond_destroy(&taxi_to_destroy->drop_cond);
-                cleanup_queue(&taxi_to_destroy->queue); // Free all messages in the queue
-                free(taxi_to_destroy);
-
-                // Remove the taxi from the array and shift remaining taxis
-                for (int i = taxi_index_to_destroy; i < center->numTaxis - 1; i++) {
-                    center->taxis[i] = center->taxis[i + 1];
-                    center->taxis[i]->id = i + 1; // Update the ID to maintain consistency
-                }
-                center->taxis[center->numTaxis - 1] = NULL;
-                center->numTaxis--;
+                // The reaper frees it once it has left the map
+                centerRetireTaxi(center, taxi_index_to_destroy, false);
 
-                pthread_mutex_unlock(&center->lock);
+                lockRelease(&center->lock, LOCK_CENTER);
                 break;
             }
 
-            case RESET_MAP: {
-                pthread_mutex_lock(&center->lock);
+            case RESET_MAP:
+            case LOAD_MAP: {
+                lockAcquire(&center->lock, LOCK_CENTER);
 
-                // Send EXIT to all taxis
+                // Keep the fleet: drop every route and take the taxis off the old map.
+                // They respawn when the visualizer sends MAP_READY
+                long long now = simNowNs();
                 for (int i = 0; i < center->numTaxis; i++) {
                     Taxi* taxi = center->taxis[i];
-                    if (taxi != NULL) {
-                        priority_enqueue_message(&taxi->queue, DROP, 0, 0, 0, 0, NULL);
-                        priority_enqueue_message(&taxi->queue, EXIT, 1, 0, 0, 0, NULL);
+                    pthread_mutex_lock(&taxi->lock);
+                    taxi->route_epoch++;
+                    taxiSetFree(taxi, true, now);
+                    taxi->currentPassenger = -1;
+                    taxi->x = -1;
+                    taxi->y = -1;
+                    pthread_mutex_unlock(&taxi->lock);
+                    if (center->reservations) {
+                        reservationOccupy(center->reservations, taxi->id, -1, -1);
+                        reservationRelease(center->reservations, taxi->id);
                     }
                 }
+                center->resetting = true;
 
-                // Wait for all taxi threads to terminate
-                for (int i = 0; i < center->numTaxis; i++) {
-                    Taxi* taxi = center->taxis[i];
-                    if (taxi != NULL) {
-                        pthread_join(taxi->thread_id, NULL);
-
-                        // Clean up the taxi
-                        pthread_mutex_destroy(&taxi->lock);
-                        pthread_cond_destroy(&taxi->drop_cond);
-                        cleanup_queue(&taxi->queue);
-                        free(taxi);
-                    }
-                }
+                // Reset the passenger array and counter; the visualizer hands the
+                // passengers back with MAP_READY, behind every message pointing at them
+                Passenger** stale = centerTakePassengers(center);
+                lockRelease(&center->lock, LOCK_CENTER);
 
-                // Reset the taxi array and counter
-                center->numTaxis = 0;
-                for (int i = 0; i < MAX_TAXIS; i++) {
-                    center->taxis[i] = NULL;
-                }
+                
+                // Forward the RESET_MAP / LOAD_MAP command to the visualizer
+                enqueue_message(visualizerQueue, msg->type, 0, 0, 0, 0, stale);
+                break;
+            }
 
-                // Reset the passenger array and counter
-                for (int i = 0; i < center->numPassengers; i++) {
-                    Passenger* passenger = center->passengers[i];
-                    if (passenger != NULL) {
-                        free(passenger);
-                    }
-                }
-                center->numPassengers = 0;
-                for (int i = 0; i < MAX_PASSENGERS; i++) {
-                    center->passengers[i] = NULL;
+            case MAP_READY:
+                // The new map is up: respawn the fleet on it
+                lockAcquire(&center->lock, LOCK_CENTER);
+                center->resetting = false;
+                for (int i = 0; i < center->numTaxis; i++) {
+                    Taxi* taxi = center->taxis[i];
+                    pthread_mutex_lock(&taxi->lock);
+                    int epoch = taxi->route_epoch;
+                    pthread_mutex_unlock(&taxi->lock);
+                    enqueue_message(visualizerQueue, SPAWN_TAXI, -1, -1, epoch, 0, &taxi->queue);
                 }
-                pthread_mutex_unlock(&center->lock);
+                lockRelease(&center->lock, LOCK_CENTER);
 
-                
-                // Forward the RESET_MAP command to the visualizer
-                enqueue_message(visualizerQueue, RESET_MAP, 0, 0, 0, 0, NULL);
+                // The visualizer is past every message for the old passengers
+                passengersFree(msg->pointer);
                 break;
-            }
 
             case RANDOM_REQUEST:
-                pthread_mutex_lock(&center->lock);
-                pthread_mutex_unlock(&center->lock);
+                lockAcquire(&center->lock, LOCK_CENTER);
+                bool resetting = center->resetting;
+                lockRelease(&center->lock, LOCK_CENTER);
 
-                // Forward the message to the visualizer
-                enqueue_message(visualizerQueue, RANDOM_REQUEST, msg->data_x, msg->data_y, msg->extra_x, 0, NULL);
+                // Forward the message to the visualizer (not while the taxi waits to respawn)
+                if (!resetting) {
+                    enqueue_message(visualizerQueue, RANDOM_REQUEST, msg->data_x, msg->data_y, msg->extra_x, 0, NULL);
+                }
 
                 break;
 
@@ -1677,12 +10652,18 @@ void* control_center_thread(void* arg) {
                 // Extract the PathData structure from the message
                 PathData* path_data = (PathData*)msg->pointer;
 
+                // Planned on the map being replaced: the taxi gets a new route once it respawns
+                if (path_data && __atomic_load_n(&center->resetting, __ATOMIC_RELAXED)) {
+                    pathFree(path_data);
+                    path_data = NULL;
+                }
+
                 if (path_data) {
                     if (path_data->tamanho_solucao == 0) {
                         // Pathfinding failed, send FINISH to the taxi
 
                         // Find the taxi by ID
-                        pthread_mutex_lock(&center->lock);
+                        lockAcquire(&center->lock, LOCK_CENTER);
                         Taxi* taxi = NULL;
                         for (int j = 0; j < center->numTaxis; j++) {
                             if (center->taxis[j]->id == msg->extra_x) {
@@ -1690,15 +10671,19 @@ void* control_center_thread(void* arg) {
                                 break;
                             }
                         }
-                        pthread_mutex_unlock(&center->lock);
+                        lockRelease(&center->lock, LOCK_CENTER);
 
                         if (taxi) {
-                            enqueue_message(&taxi->queue, FINISH, 0, 0, 0, 0, NULL);
+                            // Ends the route the taxi is on, unless a newer one was sent meanwhile
+                            pthread_mutex_lock(&taxi->lock);
+                            int epoch = taxi->route_epoch;
+                            pthread_mutex_unlock(&taxi->lock);
+                            enqueue_message(&taxi->queue, FINISH, 0, 0, epoch, 0, NULL);
                         }
                     } else {
                         // Pathfinding succeeded, send MOVE_TO messages
                         // Find the taxi by ID
-                        pthread_mutex_lock(&center->lock);
+                        lockAcquire(&center->lock, LOCK_CENTER);
                         Taxi* taxi = NULL;
                         for (int j = 0; j < center->numTaxis; j++) {
                             if (center->taxis[j]->id == msg->extra_x) {
@@ -1706,53 +10691,124 @@ void* control_center_thread(void* arg) {
                                 break;
                             }
                         }
-                        pthread_mutex_unlock(&center->lock);
+                        lockRelease(&center->lock, LOCK_CENTER);
 
                         if (taxi) {
-                            pthread_mutex_lock(&taxi->lock);
-                            taxi->drop_processed = false;
-            
-                            priority_enqueue_message(&taxi->queue, DROP, 0, 0, 0, 0, NULL);
-                            while (!taxi->drop_processed) {
-                                pthread_cond_wait(&taxi->drop_cond, &taxi->lock);
-                            }
-                            pthread_mutex_unlock(&taxi->lock);
+                            __atomic_add_fetch(&center->routes, 1, __ATOMIC_RELAXED);
 
+                            // The taxi discards what is left of its previous route by itself
+                            int epoch = taxiBeginRoute(taxi, msg->extra_y);
+
+                            bool assigned = false; // First route of a passenger trip (not a repair)
                             if(msg->extra_y != 0) {
-                                taxi->isFree = false;
-                                taxi->currentPassenger = msg->extra_y;
+                                // Start the trip clock with the routing mode it was planned under
+                                lockAcquire(&center->lock, LOCK_CENTER);
+                                for (int i = 0; i < center->numPassengers; i++) {
+                                    if (center->passengers[i] && center->passengers[i]->id == msg->extra_y) {
+                                        if (center->passengers[i]->trip_started_ns) { // A repaired route
+                                            center->passengers[i]->detours++;
+                                            break;
+                                        }
+                                        center->passengers[i]->taxi_id = taxi->id;
+                                        center->passengers[i]->trip_started_ns = simNowNs();
+                                        center->passengers[i]->trip_congestion_aware = center->congestion_routing;
+                                        assigned = true;
+                                        __atomic_add_fetch(&center->dispatches, 1, __ATOMIC_RELAXED);
+                                        break;
+                                    }
+                                }
+                                lockRelease(&center->lock, LOCK_CENTER);
                             }
                             
-                            // Iterate through the path and send MOVE_TO messages to the taxi
-                            for (int i = 1; i < path_data->tamanho_solucao; i++) {
-                                int next_x = path_data->solucaoX[i];
-                                int next_y = path_data->solucaoY[i];
-                                enqueue_message(&taxi->queue, MOVE_TO, next_x, next_y, 0, 0, NULL);
+                            // Walk the path and send MOVE_TO messages (waypoints become marker coordinates)
+                            PathCursor cursor;
+                            int event;
+                            pathCursorInit(&cursor, path_data);
+
+                            // A moving taxi may be a few cells past the route start by now
+                            pthread_mutex_lock(&taxi->lock);
+                            int at_x = taxi->x, at_y = taxi->y;
+                            pthread_mutex_unlock(&taxi->lock);
+                            int steps = 0, pickup_steps = -1;
+                            if (at_x != cursor.col || at_y != cursor.row) {
+                                PathCursor probe = cursor;
+                                bool found = false;
+                                while (!found && pathCursorNext(&probe, &event) && event != ROUTE_PICKUP && event != ROUTE_DROPOFF) {
+                                    found = probe.col == at_x && probe.row == at_y;
+                                }
+                                if (found) {
+                                    cursor = probe; // Resume from the taxi's cell
+                                } else if (abs(at_x - cursor.col) + abs(at_y - cursor.row) == 1) {
+                                    enqueue_message(&taxi->queue, MOVE_TO, cursor.col, cursor.row, epoch, 0, NULL); // Step back onto the route
+                                    steps++;
+                                }
+                            }
+
+                            while (pathCursorNext(&cursor, &event)) {
+                                if (event == ROUTE_PICKUP) {
+                                    enqueue_message(&taxi->queue, MOVE_TO, WAYPOINT_PICKUP, WAYPOINT_PICKUP, epoch, 0, NULL);
+                                    if (pickup_steps < 0) pickup_steps = steps;
+                                } else if (event == ROUTE_DROPOFF) {
+                                    enqueue_message(&taxi->queue, MOVE_TO, WAYPOINT_DROPOFF, WAYPOINT_DROPOFF, epoch, 0, NULL);
+                                } else {
+                                    enqueue_message(&taxi->queue, MOVE_TO, cursor.col, cursor.row, epoch, 0, NULL);
+                                    steps++;
+                                }
+                            }
+
+                            // ETA of the pickup: one occupied-taxi tick per step
+                            if (assigned) {
+                                long long eta_ns = simNowNs() + (long long)pickup_steps * simTickNs();
+                                lockAcquire(&center->lock, LOCK_CENTER);
+                                for (int i = 0; i < center->numPassengers; i++) {
+                                    if (center->passengers[i] && center->passengers[i]->id == msg->extra_y) {
+                                        if (pickup_steps >= 0) center->passengers[i]->pickup_eta_ns = eta_ns;
+                                        center->passengers[i]->route_cells = steps;
+                                        break;
+                                    }
+                                }
+                                lockRelease(&center->lock, LOCK_CENTER);
                             }
 
                             // Send a FINISH message to the taxi after completing the route
-                            enqueue_message(&taxi->queue, FINISH, 0, 0, 0, 0, NULL);
+                            enqueue_message(&taxi->queue, FINISH, 0, 0, epoch, 0, NULL);
                             if(msg->extra_y != 0) {
-                                enqueue_message(&taxi->queue, GOT_PASSENGER, 0, 0, 0, 0, NULL);
+                                enqueue_message(&taxi->queue, GOT_PASSENGER, 0, 0, epoch, 0, NULL);
                             }
                         }
                     }
 
                     // Free the PathData structure
-                    free(path_data->solucaoX);
-                    free(path_data->solucaoY);
-                    free(path_data);
+                    pathFree(path_data);
                 }
 
                 break;
             }
 
+            case DELETE_PASSENGER: {
+                // The visualizer found no place for a new passenger: it never reached the map
+                lockAcquire(&center->lock, LOCK_CENTER);
+                for (int i = 0; i < center->numPassengers; i++) {
+                    if (center->passengers[i] == msg->pointer) {
+                        free(center->passengers[i]);
+                        for (int j = i; j < center->numPassengers - 1; j++) {
+                            center->passengers[j] = center->passengers[j + 1];
+                        }
+                        center->passengers[--center->numPassengers] = NULL;
+                        center->passengers_unplaced++;
+                        break;
+                    }
+                }
+                lockRelease(&center->lock, LOCK_CENTER);
+                break;
+            }
+
             case GOT_PASSENGER:
             case ARRIVED_AT_DESTINATION: {
                 int passenger_id = msg->data_x % R_PASSENGER; // Extract the passenger ID from the message
                 bool isDestination = (msg->type == ARRIVED_AT_DESTINATION); // Check if it's the destination
 
-                pthread_mutex_lock(&center->lock);
+                lockAcquire(&center->lock, LOCK_CENTER);
 
                 // Find the passenger in the vector
                 Passenger* passenger = NULL;
@@ -1766,6 +10822,19 @@ void* control_center_thread(void* arg) {
                 if (passenger) {
                     if (isDestination) {
 
+                        // Account the trip time to the routing mode that planned it
+                        if (passenger->trip_started_ns) {
+                            int mode = passenger->trip_congestion_aware;
+                            center->trips[mode]++;
+                            center->trip_ns[mode] += simNowNs() - passenger->trip_started_ns;
+                        }
+                        if (passenger->picked_up_ns) {
+                            metricsRecordNs(METRIC_TRIP, simNowNs() - passenger->picked_up_ns);
+                        }
+                        if (trip_log.path) {
+                            tripLogAppend(&trip_log, passenger, simNowNs());
+                        }
+
                         // Send ARRIVED_AT_DESTINATION to the visualizer for the destination
                         enqueue_message(center->visualizerQueue, DELETE_PASSENGER,
                                         passenger->x_sidewalk_dest, passenger->y_sidewalk_dest,
@@ -1788,6 +10857,15 @@ void* control_center_thread(void* arg) {
                         }
                     } else {
 
+                        // The first report counts (the taxi confirms again after its route)
+                        if (!passenger->picked_up_ns) {
+                            passenger->picked_up_ns = simNowNs();
+                            metricsRecordNs(METRIC_WAIT, passenger->picked_up_ns - passenger->spawned_ns);
+                            if (passenger->pickup_eta_ns) {
+                                metricsRecordNs(METRIC_ETA_ERROR, llabs(passenger->picked_up_ns - passenger->pickup_eta_ns));
+                            }
+                        }
+
                         // Send GOT_PASSENGER to the visualizer for the passenger
                         enqueue_message(center->visualizerQueue, DELETE_PASSENGER,
                                         passenger->x_sidewalk, passenger->y_sidewalk,
@@ -1795,56 +10873,38 @@ void* control_center_thread(void* arg) {
                     }
                 }
 
-                pthread_mutex_unlock(&center->lock);
+                lockRelease(&center->lock, LOCK_CENTER);
                 break;
             }
             case REFRESH_PASSENGERS:
                 refresh_passengers(center);
+                metricsSampleIdle(center);
+                metricsSnapshot();
                 break;  
+
+            case TOGGLE_CONGESTION:
+                lockAcquire(&center->lock, LOCK_CENTER);
+                __atomic_store_n(&center->congestion_routing, !center->congestion_routing, __ATOMIC_RELAXED);
+                lockRelease(&center->lock, LOCK_CENTER);
+                break;
             
             case EXIT_PROGRAM:
-                pthread_mutex_lock(&center->lock);
-
-                // Send EXIT message to all taxis with priority
-                for (int i = 0; i < center->numTaxis; i++) {
-                    Taxi* taxi = center->taxis[i];
-                    if (taxi != NULL) {
-                        priority_enqueue_message(&taxi->queue, EXIT, 1, 0, 0, 0, NULL);
-                    }
-                }
-
-                // Wait for all taxi threads to terminate
-                for (int i = 0; i < center->numTaxis; i++) {
-                    Taxi* taxi = center->taxis[i];
-                    if (taxi != NULL) {
-                        pthread_join(taxi->thread_id, NULL);
+                lockAcquire(&center->lock, LOCK_CENTER);
 
-                        // Clean up the taxi
-                        pthread_mutex_destroy(&taxi->lock);
-                        pthread_cond_destroy(&taxi->drop_cond);
-                        cleanup_queue(&taxi->queue);
-                        free(taxi);
-                    }
+                // Retire all taxis; those the visualizer does not see leave are reaped at shutdown
+                while (center->numTaxis > 0) {
+                    centerRetireTaxi(center, center->numTaxis - 1, true);
                 }
 
-                center->numTaxis = 0; // Reset the taxi count
+                // Reset the passenger array and counter; the visualizer frees them on EXIT
+                Passenger** stale = centerTakePassengers(center);
 
-                // Reset the passenger array and counter
-                for (int i = 0; i < center->numPassengers; i++) {
-                    Passenger* passenger = center->passengers[i];
-                    if (passenger != NULL) {
-                        free(passenger);
-                    }
-                }
-                center->numPassengers = 0;
-                for (int i = 0; i < MAX_PASSENGERS; i++) {
-                    center->passengers[i] = NULL;
-                }
                 // Send EXIT message to the visualizer thread
-                enqueue_message(visualizerQueue, EXIT, 0, 0, 0, 0, NULL);
-                pthread_mutex_unlock(&center->lock);
+                enqueue_message(visualizerQueue, EXIT, 0, 0, 0, 0, stale);
+                lockRelease(&center->lock, LOCK_CENTER);
 
                 free(msg);
+                schedRelease();
                 return NULL;
 
             default:
@@ -1857,6 +10917,172 @@ void* control_center_thread(void* arg) {
     return NULL;
 }
 
+/**
+ * Builds the city the visualizer runs on
+ * 
+ * Starts from a restored checkpoint's map if there is one. Otherwise loads
+ * the city file when asked to, falling back to a freshly generated map if
+ * it cannot be loaded. Then builds the per-map runtime structures (free
+ * taxi distance field, congestion map) the map does not have yet.
+ * 
+ * @param visualizer Visualizer holding the generation parameters
+ * @param load Try city_file_path before generating
+ * @return New Map, or NULL if the terminal size cannot be obtained
+ */
+
+static Map* visualizerCreateCity(Visualizer* visualizer, bool load) {
+    Map* map = visualizer->restored_map;
+    visualizer->restored_map = NULL;
+    if (!map && load) {
+        map = mapLoad(city_file_path);
+        snprintf(visualizer->city_status, sizeof(visualizer->city_status),
+                 map ? "Loaded %s" : "Could not load %s, generated a new city", city_file_path);
+    }
+
+    if (!map) {
+        map = createMap();
+        if (!map) return NULL;
+        generateMap(map, &visualizer->map_rng, visualizer->numSquares, visualizer->roadWidth, visualizer->borderWidth,
+                    visualizer->minSize, visualizer->maxSize, visualizer->minDistance);
+    }
+
+    // Build the distance field used to match passengers with free taxis;
+    // without one, PATHFIND_REQUEST searches from each passenger instead
+    map->free_taxi_field = taxiFieldCreate(map->rows, map->cols);
+    if (map->free_taxi_field && !taxiFieldBuild(map->free_taxi_field, &map->grid)) {
+        taxiFieldFree(map->free_taxi_field);
+        map->free_taxi_field = NULL;
+    }
+    if (!map->congestion) {
+        map->congestion = congestionCreate(map->rows, map->cols);
+    }
+    return map;
+}
+
+/**
+ * Regenerates the city into the map it replaces
+ * 
+ * The new terrain is drawn into the tiles of the old one (see
+ * tileGridRecycle), and the free taxi field, the bitboards of
+ * findPathBitboard and findPathCooperative and the congestion map are reset
+ * rather than reallocated. A city loaded from a file, or a terminal that
+ * changed size, needs a new map instead.
+ * 
+ * @param visualizer Visualizer holding the generation parameters
+ * @param map Map to regenerate
+ * @return false if the map cannot be reused
+ */
+
+static bool visualizerResetCity(Visualizer* visualizer, Map* map) {
+    int rows = sim_rows, cols = sim_cols;
+    if ((rows <= 0 || cols <= 0) && !terminalMapSize(&rows, &cols)) {
+        return false;
+    }
+    if (map->mapping || map->index_mapped || rows != map->rows || cols != map->cols) {
+        return false;
+    }
+
+    generateMap(map, &visualizer->map_rng, visualizer->numSquares, visualizer->roadWidth, visualizer->borderWidth,
+                visualizer->minSize, visualizer->maxSize, visualizer->minDistance);
+    if (map->free_taxi_field && !taxiFieldBuild(map->free_taxi_field, &map->grid)) {
+        taxiFieldFree(map->free_taxi_field);
+        map->free_taxi_field = NULL;
+    }
+    BitBFS* searches[] = {map->bitbfs, map->coop_bfs};
+    for (int i = 0; i < 2; i++) {
+        if (searches[i]) {
+            bitbfsLoad(searches[i], &map->grid, searches[i]->target_low, searches[i]->target_high,
+                       searches[i]->pass_low, searches[i]->pass_high);
+        }
+    }
+    if (map->congestion) congestionClear(map->congestion);
+    return true;
+}
+
+// Congestion map the planner should price routes with (NULL when congestion routing is off)
+static const CongestionMap* routingCongestion(Visualizer* visualizer, Map* map) {
+    return __atomic_load_n(&visualizer->center->congestion_routing, __ATOMIC_RELAXED) ? map->congestion : NULL;
+}
+
+/**
+ * Plans a way around the cell a taxi has been waiting for
+ * 
+ * Replans what is left of the taxi's tracked route with the cooperative
+ * planner, which keeps off cells other taxis stand on or hold. Nothing is
+ * sent when no route is tracked or no way is found: the taxi keeps waiting
+ * and asks again after another RESERVATION_MAX_WAITS ticks.
+ * 
+ * @param visualizer Visualizer owning the route states
+ * @param map Current map
+ * @param taxi_id Blocked taxi
+ * @param col X coordinate of the taxi
+ * @param row Y coordinate of the taxi
+ */
+
+static void visualizerReplanBlocked(Visualizer* visualizer, Map* map, int taxi_id, int col, int row) {
+    ReservationTable* reservations = visualizer->center->reservations;
+    if (taxi_id < 1 || taxi_id > MAX_TAXIS || !reservations) return;
+
+    InflightRoute* route = &visualizer->inflight[taxi_id];
+    int num_legs = route->num_legs - route->leg;
+    int passenger_id = route->passenger_id;
+    int ticks_per_step = route->ticks_per_step;
+    if (route->num_legs == 0 || num_legs <= 0) return;
+
+    // Moved on since it asked: the wait is over
+    const DStarLite* current = route->legs[route->leg];
+    if (current->start_col != col || current->start_row != row) return;
+
+    // The old route keeps its claims unless the replan succeeds
+    PathData* legs[2] = {NULL, NULL};
+    int events[2];
+    int saved_count;
+    long saved_until;
+    Reservation* saved = reservationTake(reservations, taxi_id, &saved_count, &saved_until);
+    long start_tick = reservationNow(reservations);
+    for (int l = 0; l < num_legs; l++) {
+        const DStarLite* d = route->legs[route->leg + l];
+        events[l] = route->leg_event[route->leg + l];
+        legs[l] = pathCreate();
+        if (!legs[l] ||
+            findPathCooperative(visualizer->route_cache, reservations, map, routingCongestion(visualizer, map),
+                                taxi_id, ticks_per_step, start_tick, col, row, d->goal_col, d->goal_row, legs[l]) != 0) {
+            for (int i = 0; i <= l; i++) pathFree(legs[i]);
+            reservationRestore(reservations, taxi_id, saved, saved_count, saved_until);
+            free(saved);
+            return;
+        }
+        start_tick += (long)pathSteps(legs[l]) * ticks_per_step;
+        col = d->goal_col;
+        row = d->goal_row;
+    }
+    inflightTrack(visualizer, map, taxi_id, passenger_id, ticks_per_step, legs, events, num_legs);
+
+    // One route with the waypoint events between the legs, as in PATHFIND_REQUEST
+    PathData* path = legs[0];
+    bool stored = true;
+    for (int l = 0; l < num_legs; l++) {
+        if (l > 0) {
+            stored = stored && pathAppendPath(path, legs[l]);
+            pathFree(legs[l]);
+        }
+        if (events[l] >= 0) {
+            stored = stored && pathAppendEvent(path, events[l]);
+        }
+    }
+    if (!stored) {
+        inflightForget(visualizer, taxi_id);
+        reservationRestore(reservations, taxi_id, saved, saved_count, saved_until);
+        free(saved);
+        pathFree(path);
+        return;
+    }
+    free(saved);
+
+    visualizer->route_repairs++;
+    enqueue_message(visualizer->control_queue, ROUTE_PLAN, path->start_x, path->start_y, taxi_id, passenger_id, path);
+}
+
 /**
  * Map visualization and rendering thread
  * 
@@ -1874,26 +11100,27 @@ void* control_center_thread(void* arg) {
  * @return NULL on program exit
  * 
  * @note Uses ANSI escape codes for display control
- * @warning Map matrix access requires proper locking
+ * @warning Map grid access requires proper locking
  */
 
 void* visualizer_thread(void* arg) {
     Visualizer* visualizer = (Visualizer*)arg;
+    traceThreadName("visualizer");
 
-    // Create the map
-    Map* map = createMap();
-    if (!map) return NULL;
-
-    // Generate the map
-    generateMap(map, visualizer->numSquares, visualizer->roadWidth, visualizer->borderWidth,
-              visualizer->minSize, visualizer->maxSize, visualizer->minDistance);
+    // Create the map (its start-up clock is part of the recorded run)
+    schedEnter(SCHED_ACTOR_VISUALIZER);
+    Map* map = visualizerCreateCity(visualizer, city_load_on_start);
+    if (!map) {
+        schedRelease();
+        return NULL;
+    }
 
     // Print the map after generation
     printLogicalMap(map);
     renderMap(map, visualizer->center, visualizer); // TODO: DEIXAR APENAS O RENDER DEPOIS
     while (1) {
         // Dequeue a message
-        Message* msg = dequeue_message(&visualizer->queue);
+        Message* msg = schedDequeue(&visualizer->queue);
 
         switch (msg->type) {
             
@@ -1905,50 +11132,37 @@ void* visualizer_thread(void* arg) {
 
                 // Find a random free point on the map
                 int random_x, random_y;
-                if (!find_random_free_point(map, &random_x, &random_y)) {
+                if (!find_random_free_point(map, &visualizer->spawn_rng, &random_x, &random_y)) {
                     break;
                 }
 
-                // Create vectors to store the solution path
-                int* solutionX = malloc(10000 * sizeof(int));
-                int* solutionY = malloc(10000 * sizeof(int));
-                int solution_size = 0;
-
                 // Find the path using findPathCoordinates
-                if (findPathCoordinates(taxi_x, taxi_y, random_x, random_y, map->matrix, map->cols, map->rows,
-                                               solutionX, solutionY, &solution_size) == 0) {
-                    // Pathfinding succeeded
-                    PathData* path_data = malloc(sizeof(PathData));
-                    path_data->solucaoX = solutionX;
-                    path_data->solucaoY = solutionY;
-                    path_data->tamanho_solucao = solution_size;
-
-                    // Send the ROUTE_PLAN message to the control center
-                    enqueue_message(visualizer->control_queue, ROUTE_PLAN, taxi_x, taxi_y, taxi_id, 0, path_data);
+                PathData* path_data = pathCreate();
+                ReservationTable* reservations = visualizer->center->reservations;
+                if (reservations) {
+                    reservationRelease(reservations, taxi_id);
+                }
+                if (findPathCooperative(visualizer->route_cache, reservations, map, routingCongestion(visualizer, map),
+                                        taxi_id, 1 + TAXI_SPEED_FACTOR, reservations ? reservationNow(reservations) : 0,
+                                        taxi_x, taxi_y, random_x, random_y, path_data) != 0) {
+                    // Pathfinding failed: send a path of length 0
+                    pathClear(path_data);
+                    inflightForget(visualizer, taxi_id);
                 } else {
-                    // Pathfinding failed
-
-                    // Create a PathData structure with path length 0
-                    PathData* path_data = malloc(sizeof(PathData));
-                    path_data->solucaoX = NULL;
-                    path_data->solucaoY = NULL;
-                    path_data->tamanho_solucao = 0;
-
-                    // Send the ROUTE_PLAN message to the control center
-                    enqueue_message(visualizer->control_queue, ROUTE_PLAN, taxi_x, taxi_y, taxi_id, 0, path_data);
-
-                    // Free the allocated memory for the solution arrays
-                    free(solutionX);
-                    free(solutionY);
+                    int events[] = {-1};
+                    inflightTrack(visualizer, map, taxi_id, 0, 1 + TAXI_SPEED_FACTOR, &path_data, events, 1);
                 }
 
+                // Send the ROUTE_PLAN message to the control center
+                enqueue_message(visualizer->control_queue, ROUTE_PLAN, taxi_x, taxi_y, taxi_id, 0, path_data);
+
                 break;
             }
 
             case CREATE_PASSENGER: {
             
-                // Ensure the map matrix is valid
-                if (!map || !map->matrix) {
+                // Ensure the map grid is valid
+                if (!map || !map->grid.tiles) {
                     break;
                 }
             
@@ -1967,10 +11181,29 @@ void* visualizer_thread(void* arg) {
                     passenger->y_sidewalk_dest = passenger->y_sidewalk_dest;
                     passenger->x_road_dest = passenger->x_road_dest;
                     passenger->y_road_dest = passenger->y_road_dest;
+                } else if (passenger->x_road >= 0) {
+                    // A trace request: the nearest free curbs to its cells, on one road component
+                    int free_x = passenger->x_road, free_y = passenger->y_road, sidewalk_x, sidewalk_y;
+                    int dest_x = passenger->x_road_dest, dest_y = passenger->y_road_dest, dest_sidewalk_x, dest_sidewalk_y;
+                    if (!snap_to_curb(map, &free_x, &free_y, &sidewalk_x, &sidewalk_y) ||
+                        !snap_to_curb(map, &dest_x, &dest_y, &dest_sidewalk_x, &dest_sidewalk_y) ||
+                        (dest_x == free_x && dest_y == free_y) || !mapSameComponent(map, free_x, free_y, dest_x, dest_y)) {
+                        enqueue_message(visualizer->control_queue, DELETE_PASSENGER, 0, 0, 0, 0, passenger);
+                        break;
+                    }
+                    passenger->x_sidewalk = sidewalk_x;
+                    passenger->y_sidewalk = sidewalk_y;
+                    passenger->x_road = free_x;
+                    passenger->y_road = free_y;
+                    passenger->x_sidewalk_dest = dest_sidewalk_x;
+                    passenger->y_sidewalk_dest = dest_sidewalk_y;
+                    passenger->x_road_dest = dest_x;
+                    passenger->y_road_dest = dest_y;
                 } else {
                     // Find a random free position adjacent to a SIDEWALK
                     int free_x, free_y, sidewalk_x, sidewalk_y;
-                    if (!find_random_free_point_adjacent_to_sidewalk(map, &free_x, &free_y, &sidewalk_x, &sidewalk_y)) {
+                    if (!find_demand_point(visualizer, map, &free_x, &free_y, &sidewalk_x, &sidewalk_y)) {
+                        enqueue_message(visualizer->control_queue, DELETE_PASSENGER, 0, 0, 0, 0, passenger);
                         break;
                     }
                     passenger->x_sidewalk = sidewalk_x;
@@ -1978,9 +11211,17 @@ void* visualizer_thread(void* arg) {
                     passenger->x_road = free_x;
                     passenger->y_road = free_y;
             
-                    // Find a random free position for the destination
+                    // Find a random free position for the destination, reachable from the pickup
                     int dest_x, dest_y, dest_sidewalk_x, dest_sidewalk_y;
-                    if (!find_random_free_point_adjacent_to_sidewalk(map, &dest_x, &dest_y, &dest_sidewalk_x, &dest_sidewalk_y)) {
+                    bool found = false;
+                    for (int attempt = 0; attempt < MAX_ATTEMPTS && !found; attempt++) {
+                        if (!find_demand_point(visualizer, map, &dest_x, &dest_y, &dest_sidewalk_x, &dest_sidewalk_y)) {
+                            break;
+                        }
+                        found = mapSameComponent(map, free_x, free_y, dest_x, dest_y);
+                    }
+                    if (!found) {
+                        enqueue_message(visualizer->control_queue, DELETE_PASSENGER, 0, 0, 0, 0, passenger);
                         break;
                     }
                     passenger->x_sidewalk_dest = dest_sidewalk_x;
@@ -1991,27 +11232,32 @@ void* visualizer_thread(void* arg) {
                 }
             
                 // Add the passenger to the SIDEWALK
-                map->matrix[passenger->y_sidewalk][passenger->x_sidewalk] = passenger->id + R_PASSENGER;
-                map->matrix[passenger->y_road][passenger->x_road] = passenger->id + R_PASSENGER_POINT;
+                mapSetCell(map, passenger->x_sidewalk, passenger->y_sidewalk, passenger->id + R_PASSENGER);
+                visualizerSetCell(visualizer, map, passenger->x_road, passenger->y_road, passenger->id + R_PASSENGER_POINT);
             
                 // Add the destination to the SIDEWALK if it's a new passenger
                 if (msg->data_x == 0 && msg->data_y == 0 && msg->extra_x == 0 && msg->extra_y == 0) {
-                    map->matrix[passenger->y_sidewalk_dest][passenger->x_sidewalk_dest] = passenger->id + R_PASSENGER_DEST;
+                    mapSetCell(map, passenger->x_sidewalk_dest, passenger->y_sidewalk_dest, passenger->id + R_PASSENGER_DEST);
                 }
             
                 // Render the updated map
                 renderMap(map, visualizer->center, visualizer);
             
                 // Find a free taxi for the passenger
-                int* solutionX = malloc(10000 * sizeof(int));
-                int* solutionY = malloc(10000 * sizeof(int));
-                int solution_size = 0;
+                PathData* taxi_path = pathCreate();
             
-                if (findPath(passenger->x_road, passenger->y_road, map->matrix, map->cols, map->rows,
-                                    solutionX, solutionY, &solution_size, R_TAXI_FREE) == 0) {
+                // Walk the free taxi field when available; otherwise large maps use the
+                // bit-parallel search and small ones stay on the node BFS
+                int search_result = map->free_taxi_field ?
+                    taxiFieldNearest(map->free_taxi_field, passenger->x_road, passenger->y_road, taxi_path) :
+                    (map->rows * map->cols >= BITBFS_MIN_CELLS) ?
+                    findPathBitboard(map, passenger->x_road, passenger->y_road, taxi_path, R_TAXI_FREE) :
+                    findPath(passenger->x_road, passenger->y_road, &map->grid, map->cols, map->rows,
+                             taxi_path, R_TAXI_FREE);
+                if (search_result == 0) {
                     // Found a free taxi
-                    int taxi_x = solutionX[solution_size - 1];
-                    int taxi_y = solutionY[solution_size - 1];
+                    int taxi_x = taxi_path->end_x;
+                    int taxi_y = taxi_path->end_y;
             
                     // Create a small vector for destination coordinates
                     int* destinations = malloc(4 * sizeof(int));
@@ -2024,48 +11270,71 @@ void* visualizer_thread(void* arg) {
                     enqueue_message(&visualizer->queue, PATHFIND_REQUEST, taxi_x, taxi_y, passenger->x_road, passenger->y_road, destinations);
                 }
             
-                free(solutionX);
-                free(solutionY);
+                pathFree(taxi_path);
                 break;
             }
 
-            case RESET_MAP: {
+            case RESET_MAP:
+            case LOAD_MAP: {
 
                 // Ensure the map is valid
-                if (!map || !map->matrix) {
+                if (!map || !map->grid.tiles) {
                     break;
                 }
 
-                // Deallocate the old map
-                freeMap(map);
+                // Forget every route computed on the old map (the taxis keep their D* states)
+                long long started_ns = monotonic_ns();
+                inflightForgetAll(visualizer, false);
+                if (visualizer->route_cache) {
+                    routeCacheClear(visualizer->route_cache);
+                }
+
+                // Regenerate in place, or load the city file / build a new map
+                bool in_place = msg->type == RESET_MAP && visualizerResetCity(visualizer, map);
+                if (!in_place) {
+                    freeMap(map);
+                    map = visualizerCreateCity(visualizer, msg->type == LOAD_MAP);
+                }
+                visualizer->last_reset_us = (monotonic_ns() - started_ns) / 1000;
+                visualizer->last_reset_in_place = in_place;
+                hdrRecord(&visualizer->resets, (uint64_t)visualizer->last_reset_us);
 
-                // Create a new map
-                map = createMap();
+                // The fleet respawns on the new map
+                enqueue_message(visualizer->control_queue, MAP_READY, 0, 0, 0, 0, msg->pointer);
                 if (!map) {
                     break;
                 }
 
-                // Regenerate the map
-                generateMap(map, visualizer->numSquares, visualizer->roadWidth, visualizer->borderWidth,
-                          visualizer->minSize, visualizer->maxSize, visualizer->minDistance);
-
                 // Print the new map
                 printLogicalMap(map);
                 renderMap(map, visualizer->center, visualizer);
                 break;
             }
             
+            case SAVE_MAP: {
+
+                // Ensure the map is valid
+                if (!map || !map->grid.tiles) {
+                    break;
+                }
+
+                snprintf(visualizer->city_status, sizeof(visualizer->city_status),
+                         mapSave(map, city_file_path) ? "Saved %s" : "Could not save %s", city_file_path);
+                renderMap(map, visualizer->center, visualizer);
+                break;
+            }
+
             case SPAWN_TAXI: {
 
                 // Garantir que o mapa está válido
-                if (!map || !map->matrix) {
+                if (!map || !map->grid.tiles) {
                     break;
                 }
 
                 // Calcular um ponto aleatório no mapa
                 int random_x, random_y;
 
-                if (!find_random_free_point(map, &random_x, &random_y)) {
+                if (!find_random_free_point(map, &visualizer->spawn_rng, &random_x, &random_y)) {
                     break;
                 }
 
@@ -2073,43 +11342,72 @@ void* visualizer_thread(void* arg) {
                 MessageQueue* taxi_queue = (MessageQueue*)msg->pointer;
 
                 // Enviar SPAWN_TAXI para a fila do táxi com as coordenadas calculadas
-                enqueue_message(taxi_queue, SPAWN_TAXI, random_x, random_y, 0, 0, NULL);
-                // Send FINISH to the taxi after it spawns
-                enqueue_message(taxi_queue, FINISH, 0, 0, 0, 0, NULL);
+                enqueue_message(taxi_queue, SPAWN_TAXI, random_x, random_y, msg->extra_x, 0, NULL);
+                // Send FINISH to the taxi after it spawns (in the route epoch the control center gave)
+                enqueue_message(taxi_queue, FINISH, 0, 0, msg->extra_x, 0, NULL);
+                break;
+            }
+
+            case RETIRE_TAXI: {
+                Taxi* taxi = (Taxi*)msg->pointer;
+                ControlCenter* center = visualizer->center;
+
+                // Remove the taxi from the map, unless the cell was repainted since
+                if (map && map->grid.tiles && msg->data_x >= 0 && msg->data_y >= 0) {
+                    lockAcquire(&map->lock, LOCK_MAP);
+                    int value = tileGet(&map->grid, msg->data_x, msg->data_y);
+                    if (value == R_TAXI_FREE + taxi->id || value == R_TAXI_OCCUPIED + taxi->id) {
+                        mapSetCell(map, msg->data_x, msg->data_y, ROAD);
+                    }
+                    lockRelease(&map->lock, LOCK_MAP);
+                }
+                inflightForget(visualizer, taxi->id);
+
+                // No message names the taxi any more: its ID is free and the reaper may join it
+                lockAcquire(&center->lock, LOCK_CENTER);
+                for (int i = 0; i < center->numRetiring; i++) {
+                    if (center->retiring[i] == taxi) {
+                        center->retiring[i] = center->retiring[--center->numRetiring];
+                        break;
+                    }
+                }
+                lockRelease(&center->lock, LOCK_CENTER);
+                enqueue_message(&center->reaper_queue, RETIRE_TAXI, 0, 0, 0, 0, taxi);
+
+                if (map && map->grid.tiles) {
+                    renderMap(map, center, visualizer);
+                }
                 break;
             }
 
             case MOVE_TO: {
             
                 // Ensure the map is valid
-                if (!map || !map->matrix) {
+                if (!map || !map->grid.tiles) {
                     break;
                 }
                  // Lock the map for writing
 
-                // Handle the special case where the taxi is exiting
-                if (msg->extra_x == -1 && msg->extra_y == -1) {
-                    // Remove the taxi from the map
-                    if (msg->data_x >= 0 && msg->data_y >= 0) {
-                        pthread_mutex_lock(&map->lock);
-                        map->matrix[msg->data_y][msg->data_x] = ROAD; // Clear the old position
-                        pthread_mutex_unlock(&map->lock);
-                    }
-                    renderMap(map, visualizer->center, visualizer);
+                // A move onto the same cell is a wait; it only adds to the congestion
+                if (map->congestion) {
+                    congestionRecord(map->congestion, msg->extra_x, msg->extra_y);
+                }
+                if (msg->data_x == msg->extra_x && msg->data_y == msg->extra_y) {
                     break;
                 }
-                
+
                 Taxi* taxi = (Taxi*)msg->pointer;
                 int taxi_id = taxi->id;
                 bool taxi_isFree = taxi->isFree;
                 // Update the map: move the taxi
-                pthread_mutex_lock(&map->lock);
+                lockAcquire(&map->lock, LOCK_MAP);
 
-                map->matrix[msg->extra_y][msg->extra_x] = taxi_id+(taxi_isFree? R_TAXI_FREE : R_TAXI_OCCUPIED); // Place the taxi in the new position
+                visualizerSetCell(visualizer, map, msg->extra_x, msg->extra_y, taxi_id+(taxi_isFree? R_TAXI_FREE : R_TAXI_OCCUPIED)); // Place the taxi in the new position
                 if (msg->data_x >= 0 && msg->data_y >= 0) { // Check if the old position is valid
-                    map->matrix[msg->data_y][msg->data_x] = ROAD; // Clear the old position
+                    mapSetCell(map, msg->data_x, msg->data_y, ROAD); // Clear the old position
                 }
-                pthread_mutex_unlock(&map->lock);
+                lockRelease(&map->lock, LOCK_MAP);
+                inflightMoved(visualizer, taxi_id, msg->extra_x, msg->extra_y);
 
 
                 // Render the updated map
@@ -2120,7 +11418,7 @@ void* visualizer_thread(void* arg) {
             case PATHFIND_REQUEST: {
             
                 // Ensure the map is valid
-                if (!map || !map->matrix) {
+                if (!map || !map->grid.tiles) {
                     break;
                 }
             
@@ -2129,22 +11427,38 @@ void* visualizer_thread(void* arg) {
                 int passenger_x = msg->extra_x;
                 int passenger_y = msg->extra_y;
             
-                int taxi_id = map->matrix[taxi_y][taxi_x];
+                int taxi_id = tileGet(&map->grid, taxi_x, taxi_y);
                 taxi_id = taxi_id % R_TAXI_FREE; // Remove the last digit to get the taxi ID
             
-                int passenger_id = map->matrix[passenger_y][passenger_x];
-                passenger_id = passenger_id % R_PASSENGER_POINT; // Remove the last digit to get the passenger ID                                      
-            
-                // Allocate memory for the first solution path (taxi to passenger)
-                int* solutionX1 = malloc(10000 * sizeof(int));
-                int* solutionY1 = malloc(10000 * sizeof(int));
-                int solution_size1 = 0;
+                int passenger_cell = tileGet(&map->grid, passenger_x, passenger_y);
+                int passenger_id = passenger_cell % R_PASSENGER_POINT; // Remove the last digit to get the passenger ID                                      
+
+                // Stale under heavy demand: the taxi left its cell (or the passenger was taken) since the request
+                int taxi_cell = tileGet(&map->grid, taxi_x, taxi_y);
+                if (taxi_cell < R_TAXI_FREE || taxi_cell >= R_PASSENGER || taxi_id < 1 || taxi_id > MAX_TAXIS ||
+                    passenger_cell < R_PASSENGER_POINT || passenger_cell >= R_PASSENGER_POINT + 100) {
+                    free(msg->pointer);
+                    break;
+                }
             
-                // Find the path from taxi to passenger
-                if (findPathCoordinates(taxi_x, taxi_y, passenger_x, passenger_y, map->matrix, map->cols, map->rows,
-                                               solutionX1, solutionY1, &solution_size1) != 0) {
-                    free(solutionX1);
-                    free(solutionY1);
+                // Find the path from taxi to passenger (occupied taxis drive one cell per tick);
+                // the taxi's current claims come back if no route is sent
+                ReservationTable* reservations = visualizer->center->reservations;
+                long start_tick = 0;
+                Reservation* saved = NULL;
+                int saved_count = 0;
+                long saved_until = -1;
+                if (reservations) {
+                    saved = reservationTake(reservations, taxi_id, &saved_count, &saved_until);
+                    start_tick = reservationNow(reservations);
+                }
+                PathData* path_data = pathCreate();
+                if (findPathCooperative(visualizer->route_cache, reservations, map, routingCongestion(visualizer, map),
+                                        taxi_id, 1, start_tick, taxi_x, taxi_y, passenger_x, passenger_y, path_data) != 0) {
+                    if (reservations) reservationRestore(reservations, taxi_id, saved, saved_count, saved_until);
+                    free(saved);
+                    pathFree(path_data);
+                    free(msg->pointer);
                     break;
                 }
             
@@ -2153,75 +11467,63 @@ void* visualizer_thread(void* arg) {
                     int* destination_coords = (int*)msg->pointer;
                     int dest_x = destination_coords[0];
                     int dest_y = destination_coords[1];
-            
-                    // Allocate memory for the second solution path (passenger to destination)
-                    int* solutionX2 = malloc(10000 * sizeof(int));
-                    int* solutionY2 = malloc(10000 * sizeof(int));
-                    int solution_size2 = 0;
+                    free(destination_coords);
             
                     // Find the path from passenger to destination
-                    if (findPathCoordinates(passenger_x, passenger_y, dest_x, dest_y, map->matrix, map->cols, map->rows,
-                                                   solutionX2, solutionY2, &solution_size2) != 0) {
-                        free(solutionX1);
-                        free(solutionY1);
-                        free(solutionX2);
-                        free(solutionY2);
-                        free(destination_coords);
+                    PathData* trip_path = pathCreate();
+                    if (findPathCooperative(visualizer->route_cache, reservations, map, routingCongestion(visualizer, map),
+                                            taxi_id, 1, start_tick + pathSteps(path_data),
+                                            passenger_x, passenger_y, dest_x, dest_y, trip_path) != 0) {
+                        if (reservations) reservationRestore(reservations, taxi_id, saved, saved_count, saved_until);
+                        free(saved);
+                        pathFree(path_data);
+                        pathFree(trip_path);
                         break;
                     }
             
-                    // Combine the two paths into a single path with dummy coordinates
-                    int total_size = solution_size1 + solution_size2 + 2; // +2 for the dummy coordinates
-                    int* combinedX = malloc(total_size * sizeof(int));
-                    int* combinedY = malloc(total_size * sizeof(int));
-            
-                    memcpy(combinedX, solutionX1, solution_size1 * sizeof(int));
-                    memcpy(combinedY, solutionY1, solution_size1 * sizeof(int));
-            
-                    // Add the dummy coordinate (-2, -2) to indicate arrival at the passenger
-                    combinedX[solution_size1] = -2;
-                    combinedY[solution_size1] = -2;
-            
-                    memcpy(combinedX + solution_size1 + 1, solutionX2, solution_size2 * sizeof(int));
-                    memcpy(combinedY + solution_size1 + 1, solutionY2, solution_size2 * sizeof(int));
-            
-                    // Add the dummy coordinate (-3, -3) to indicate arrival at the destination
-                    combinedX[total_size - 1] = -3;
-                    combinedY[total_size - 1] = -3;
-            
-                    // Free the individual paths
-                    free(solutionX1);
-                    free(solutionY1);
-                    free(solutionX2);
-                    free(solutionY2);
-                    free(destination_coords);
-            
-                    // Create a single PathData structure for the combined path
-                    PathData* path_data = malloc(sizeof(PathData));
-                    path_data->solucaoX = combinedX;
-                    path_data->solucaoY = combinedY;
-                    path_data->tamanho_solucao = total_size;
+                    // Keep both legs repairable while the taxi drives them
+                    PathData* legs[] = {path_data, trip_path};
+                    int events[] = {ROUTE_PICKUP, ROUTE_DROPOFF};
+                    inflightTrack(visualizer, map, taxi_id, passenger_id, 1, legs, events, 2);
+
+                    // Combine both legs into one route with pickup and drop-off waypoints
+                    bool stored = pathAppendEvent(path_data, ROUTE_PICKUP) && pathAppendPath(path_data, trip_path) &&
+                                  pathAppendEvent(path_data, ROUTE_DROPOFF);
+                    pathFree(trip_path);
+                    if (!stored) {
+                        inflightForget(visualizer, taxi_id);
+                        if (reservations) reservationRestore(reservations, taxi_id, saved, saved_count, saved_until);
+                        free(saved);
+                        pathFree(path_data);
+                        break;
+                    }
             
                     // Send the combined ROUTE_PLAN message to the control center
                     enqueue_message(visualizer->control_queue, ROUTE_PLAN, taxi_x, taxi_y, taxi_id, passenger_id, path_data);
             
                 } else {
                     // If no destination exists, send only the taxi-to-passenger path
-                    PathData* path_data = malloc(sizeof(PathData));
-                    path_data->solucaoX = solutionX1;
-                    path_data->solucaoY = solutionY1;
-                    path_data->tamanho_solucao = solution_size1;
-            
+                    int events[] = {-1};
+                    inflightTrack(visualizer, map, taxi_id, 0, 1, &path_data, events, 1);
                     enqueue_message(visualizer->control_queue, ROUTE_PLAN, taxi_x, taxi_y, passenger_id, 0, path_data);
                 }
+                free(saved);
             
                 break;
             }
             
+            case ROUTE_BLOCKED: {
+                // A taxi waited too long for a cell another taxi stands on
+                if (map && map->grid.tiles) {
+                    visualizerReplanBlocked(visualizer, map, ((Taxi*)msg->pointer)->id, msg->data_x, msg->data_y);
+                }
+                break;
+            }
+
             case DELETE_PASSENGER: {
             
                 // Ensure the map is valid
-                if (!map || !map->matrix) {
+                if (!map || !map->grid.tiles) {
                     break;
                 }
                 
@@ -2230,11 +11532,13 @@ void* visualizer_thread(void* arg) {
                 int sidewalk_y = msg->data_y;
                 int road_x = msg->extra_x;
                 int road_y = msg->extra_y;
-                pthread_mutex_lock(&map->lock);
-                // Remove the passenger from the map
-                map->matrix[sidewalk_y][sidewalk_x] = SIDEWALK; // Clear the SIDEWALK position
-                //map->matrix[road_y][road_x] = ROAD;        // Clear the ROAD position
-                pthread_mutex_unlock(&map->lock); 
+                lockAcquire(&map->lock, LOCK_MAP);
+                // Remove the passenger from the map (not placed yet: nothing to clear)
+                if (sidewalk_x >= 0 && sidewalk_y >= 0) {
+                    mapSetCell(map, sidewalk_x, sidewalk_y, SIDEWALK); // Clear the SIDEWALK position
+                }
+                //tileSet(&map->grid, road_x, road_y, ROAD);       // Clear the ROAD position
+                lockRelease(&map->lock, LOCK_MAP); 
                 // Render the updated map
                 renderMap(map, visualizer->center, visualizer);
                 break;
@@ -2243,9 +11547,22 @@ void* visualizer_thread(void* arg) {
                 printLogicalMap(map); // Print the logical map
                 break;
 
+            case CHECKPOINT:
+
+                // Ensure the map is valid
+                if (!map || !map->grid.tiles) {
+                    break;
+                }
+
+                checkpointTake(visualizer, map);
+                renderMap(map, visualizer->center, visualizer);
+                break;
+
             case EXIT:
                 freeMap(map);
+                passengersFree(msg->pointer);
                 free(msg);
+                schedRelease();
                 return NULL;
 
             default:
@@ -2271,96 +11588,153 @@ void* visualizer_thread(void* arg) {
  * @param arg Taxi pointer passed as void*
  * @return NULL on taxi destruction
  * 
- * @note Uses usleep for movement timing
+ * @note Uses schedSleep for movement timing
  * @warning Queue cleanup required on exit
  */
 
 void* taxi_thread(void* arg) {
     Taxi* taxi = (Taxi*)arg;
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "taxi %d", taxi->id);
+    traceThreadName(thread_name);
 
-    enqueue_message(taxi->visualizerQueue, SPAWN_TAXI, taxi->x, taxi->y, 0, 0, &taxi->queue);
+    // The control center already asked the visualizer for a spawn point
     while (1) {
-        pthread_mutex_lock(&pause_mutex);
+        schedRelease(); // The previous step ends before pausing
+        lockAcquire(&pause_mutex, LOCK_PAUSE);
         while (isPaused) {
-            pthread_cond_wait(&pause_cond, &pause_mutex);
+            lockWait(&pause_cond, &pause_mutex, LOCK_PAUSE);
         }
-        pthread_mutex_unlock(&pause_mutex);
+        lockRelease(&pause_mutex, LOCK_PAUSE);
         // Dequeue a message
-        Message* msg = dequeue_message(&taxi->queue);
+        Message* msg = schedDequeue(&taxi->queue);
+
+        // Route messages of a replaced route are skipped
+        int passenger = taxi->currentPassenger;
+        if ((msg->type == MOVE_TO || msg->type == FINISH || msg->type == GOT_PASSENGER) &&
+            !taxiRouteCurrent(taxi, msg, &passenger)) {
+            free(msg);
+            continue;
+        }
 
         // Process the message
         switch (msg->type) {
-            case DROP:
-
-                // Clear all messages in the taxi's queue
-                cleanup_queue(&taxi->queue);
-            
-                // Signal the Control Center that DROP has been processed
-                pthread_mutex_lock(&taxi->lock);
-                taxi->drop_processed = true;
-                pthread_cond_signal(&taxi->drop_cond);
-                pthread_mutex_unlock(&taxi->lock);
-
-                break;
             case SPAWN_TAXI: 
             
-                // Enviar a mensagem MOVE_TO para o visualizador
-                enqueue_message(taxi->visualizerQueue, MOVE_TO, 
-                                taxi->x, taxi->y, msg->data_x, msg->data_y, taxi);
-            
-                // Atualizar a posição do táxi para o destino
-                pthread_mutex_lock(&taxi->lock);
-                taxi->x = msg->data_x;
-                taxi->y = msg->data_y;
-                pthread_mutex_unlock(&taxi->lock);
+                // Atualizar a posição do táxi para o destino (waiting while a taxi still stands there)
+                while (1) {
+                    pthread_mutex_lock(&taxi->lock);
+                    // A retired taxi never appears, and a spawn point on a map that was replaced since is stale
+                    bool spawned = !taxi->retiring && msg->extra_x == taxi->route_epoch;
+                    if (spawned && taxi->reservations &&
+                        !reservationOccupy(taxi->reservations, taxi->id, msg->data_x, msg->data_y)) {
+                        pthread_mutex_unlock(&taxi->lock);
+                        schedSleep(TAXI_REFRESH_RATE);
+                        continue;
+                    }
+                    if (spawned) {
+                        // Enviar a mensagem MOVE_TO para o visualizador
+                        enqueue_message(taxi->visualizerQueue, MOVE_TO, 
+                                        taxi->x, taxi->y, msg->data_x, msg->data_y, taxi);
+                        taxi->x = msg->data_x;
+                        taxi->y = msg->data_y;
+                    }
+                    pthread_mutex_unlock(&taxi->lock);
+                    break;
+                }
             
                 break;
             
             case MOVE_TO: 
             
-                if (msg->data_x == -2 && msg->data_y == -2) {
+                if (msg->data_x == WAYPOINT_PICKUP && msg->data_y == WAYPOINT_PICKUP) {
                     // Dummy coordinate indicating arrival at the passenger
-                    enqueue_message(taxi->control_queue, GOT_PASSENGER, taxi->currentPassenger, 0, 0, 0, NULL);
+                    enqueue_message(taxi->control_queue, GOT_PASSENGER, passenger, 0, 0, 0, NULL);
                     break;
                 }
             
-                if (msg->data_x == -3 && msg->data_y == -3) {
+                if (msg->data_x == WAYPOINT_DROPOFF && msg->data_y == WAYPOINT_DROPOFF) {
                     // Dummy coordinate indicating arrival at the destination
-                    enqueue_message(taxi->control_queue, ARRIVED_AT_DESTINATION, taxi->currentPassenger, 1, 0, 0, NULL);
+                    enqueue_message(taxi->control_queue, ARRIVED_AT_DESTINATION, passenger, 1, 0, 0, NULL);
                     break;
                 }
             
-                usleep(TAXI_REFRESH_RATE * (1 + (taxi->isFree * TAXI_SPEED_FACTOR))); 
-            
-                pthread_mutex_lock(&taxi->lock);
-                int old_x = taxi->x;
-                int old_y = taxi->y;
-                taxi->x = msg->data_x;
-                taxi->y = msg->data_y;
-                pthread_mutex_unlock(&taxi->lock);
-            
-                enqueue_message(taxi->visualizerQueue, MOVE_TO, old_x, old_y, msg->data_x, msg->data_y, taxi);
+                schedSleep(TAXI_REFRESH_RATE * (1 + (taxi->isFree * TAXI_SPEED_FACTOR))); 
+
+                // Same cell: a planned wait step (reported so it counts as congestion, unless the route was dropped)
+                if (msg->data_x == taxi->x && msg->data_y == taxi->y) {
+                    pthread_mutex_lock(&taxi->lock);
+                    if (msg->extra_x == taxi->route_epoch) {
+                        enqueue_message(taxi->visualizerQueue, MOVE_TO, taxi->x, taxi->y, taxi->x, taxi->y, NULL);
+                    }
+                    pthread_mutex_unlock(&taxi->lock);
+                    break;
+                }
+
+                // Re-routed or retired while sleeping or waiting: the move is dropped. Checked
+                // under the lock the control center bumps the epoch with, so a move either
+                // reaches the visualizer before the bump or not at all
+                for (int waits = 1; ; waits++) {
+                    pthread_mutex_lock(&taxi->lock);
+                    if (msg->extra_x != taxi->route_epoch) {
+                        pthread_mutex_unlock(&taxi->lock);
+                        __atomic_add_fetch(&taxi->queue.dropped, 1, __ATOMIC_RELAXED);
+                        break;
+                    }
+
+                    // Do not drive onto a cell another taxi is standing on: wait for it to leave,
+                    // asking the visualizer for a way around every RESERVATION_MAX_WAITS ticks
+                    if (taxi->reservations && !reservationOccupy(taxi->reservations, taxi->id, msg->data_x, msg->data_y)) {
+                        int at_x = taxi->x, at_y = taxi->y;
+                        pthread_mutex_unlock(&taxi->lock);
+                        if (waits % RESERVATION_MAX_WAITS == 0) {
+                            enqueue_message(taxi->visualizerQueue, ROUTE_BLOCKED, at_x, at_y, msg->data_x, msg->data_y, taxi);
+                        }
+                        schedSleep(TAXI_REFRESH_RATE);
+                        continue;
+                    }
+
+                    int old_x = taxi->x;
+                    int old_y = taxi->y;
+                    taxi->x = msg->data_x;
+                    taxi->y = msg->data_y;
+                    enqueue_message(taxi->visualizerQueue, MOVE_TO, old_x, old_y, msg->data_x, msg->data_y, taxi);
+                    pthread_mutex_unlock(&taxi->lock);
+                    break;
+                }
                 break;
                               
             case GOT_PASSENGER:
-                usleep(TAXI_REFRESH_RATE);
-                enqueue_message(taxi->control_queue, GOT_PASSENGER, taxi->currentPassenger, 0, 0, 0, NULL);
+                schedSleep(TAXI_REFRESH_RATE);
+                if (taxiRouteCurrent(taxi, msg, &passenger)) {
+                    enqueue_message(taxi->control_queue, GOT_PASSENGER, passenger, 0, 0, 0, NULL);
+                }
                 break;
 
             case FINISH:
-                usleep(1000000);
+                schedSleep(1000000);
+                // A route sent while sleeping keeps the taxi busy
+                if (!taxiFinishRoute(taxi, msg->extra_x)) {
+                    break;
+                }
                 // Send RANDOM_REQUEST to the control center
-                taxi->isFree = true;
                 enqueue_message(taxi->control_queue, RANDOM_REQUEST, taxi->x, taxi->y, taxi->id, 0, NULL);
 
                 break;   
 
             case EXIT:
+                if (taxi->reservations) {
+                    reservationOccupy(taxi->reservations, taxi->id, -1, -1);
+                    reservationRelease(taxi->reservations, taxi->id);
+                }
+                // Acknowledge behind every move sent; data_x 1: the map is replaced, no cell to clear
                 if (msg->data_x == 1) {
+                    enqueue_message(taxi->visualizerQueue, RETIRE_TAXI, -1, -1, 0, 0, taxi);
                 } else {
-                    enqueue_message(taxi->visualizerQueue, MOVE_TO, taxi->x, taxi->y, -1, -1, NULL);
+                    enqueue_message(taxi->visualizerQueue, RETIRE_TAXI, taxi->x, taxi->y, 0, 0, taxi);
                 }
                 free(msg);
+                schedRelease();
                 return NULL;
 
             case STATUS_REQUEST:
@@ -2390,21 +11764,48 @@ void* taxi_thread(void* arg) {
 
 void* timer_thread(void* arg) {
     ControlCenter* center = (ControlCenter*)arg;
+    traceThreadName("timer");
 
     while (1) {
-        pthread_mutex_lock(&pause_mutex);
+        lockAcquire(&pause_mutex, LOCK_PAUSE);
         while (isPaused) {
-            pthread_cond_wait(&pause_cond, &pause_mutex);
+            lockWait(&pause_cond, &pause_mutex, LOCK_PAUSE);
         }
-        pthread_mutex_unlock(&pause_mutex);
+        lockRelease(&pause_mutex, LOCK_PAUSE);
         sleep(REFRESH_PASSENGERS_SEC); // Wait for 10 seconds (adjust as needed)
 
-        enqueue_message(&center->queue, REFRESH_PASSENGERS, 0, 0, 0, 0, NULL);
+        externalEvent(&center->queue, REFRESH_PASSENGERS);
     }
 
     return NULL;
 }
 
+/**
+ * Reaper thread for retired taxis
+ * 
+ * Joins and frees each taxi the visualizer hands over (RETIRE_TAXI), so
+ * neither the control center nor the visualizer ever waits on a taxi
+ * thread. Not a replay actor: it only touches taxis nothing refers to.
+ * 
+ * @param arg ControlCenter pointer passed as void*
+ * @return NULL after EXIT
+ */
+
+void* reaper_thread(void* arg) {
+    ControlCenter* center = (ControlCenter*)arg;
+    traceThreadName("reaper");
+
+    while (1) {
+        Message* msg = dequeue_message(&center->reaper_queue);
+        if (msg->type == EXIT) {
+            free(msg);
+            return NULL;
+        }
+        taxiReap((Taxi*)msg->pointer);
+        free(msg);
+    }
+}
+
 /**
  * Creates and starts a new taxi thread
  * 
@@ -2459,17 +11860,41 @@ pthread_t create_taxi_thread(Taxi* taxi) {
  */
 
 void init_operations() {
-    log_file = fopen("operation_log.txt", "w");
-    if (!log_file) {
-        perror("Failed to open log file");
-        exit(EXIT_FAILURE);
+    // A headless run skips the per-message log, which would dominate what it measures
+    if (!headless) {
+        log_file = fopen("operation_log.txt", "w");
+        if (!log_file) {
+            perror("Failed to open log file");
+            exit(EXIT_FAILURE);
+        }
     }
+    metrics_file = fopen(METRICS_FILE_PATH, "w"); // Optional: snapshots are skipped without it
     // Initialize the control center
     ControlCenter center;
     center.numPassengers = 0;
     center.numTaxis = 0;
     pthread_mutex_init(&center.lock, NULL);
     init_queue(&center.queue);
+    center.queue.actor = SCHED_ACTOR_CENTER;
+    center.taxis_created = 0;
+    center.resetting = false;
+    center.numRetiring = 0;
+    init_queue(&center.reaper_queue);
+    center.passengers_created = 0;
+    center.dispatches = 0;
+    center.routes = 0;
+    center.passengers_shed = 0;
+    center.passengers_unplaced = 0;
+    if (trip_log.path && !tripLogOpen(&trip_log)) {
+        fprintf(stderr, "Failed to create trip log %s\n", trip_log.path);
+        exit(EXIT_FAILURE);
+    }
+    center.reservations = reservationCreate();
+    center.congestion_routing = true;
+    for (int i = 0; i < 2; i++) {
+        center.trips[i] = 0;
+        center.trip_ns[i] = 0;
+    }
 
     for (int i = 0; i < MAX_TAXIS; i++) {
         center.taxis[i] = NULL; // Initialize taxi array
@@ -2485,7 +11910,12 @@ void init_operations() {
 
     Visualizer visualizer = {numSquares, roadWidth, borderWidth, minSize, maxSize, minDistance};
     visualizer.center = &center;
+    visualizer.route_cache = routeCacheCreate();
     init_queue(&visualizer.queue);
+    visualizer.queue.actor = SCHED_ACTOR_VISUALIZER;
+    rngSeed(&visualizer.map_rng, sim_seed, RNG_STREAM_MAP);
+    rngSeed(&visualizer.spawn_rng, sim_seed, RNG_STREAM_SPAWN);
+    rngSeed(&visualizer.hotspot_rng, sim_seed, RNG_STREAM_HOTSPOTS);
 
     // Link the visualizer queue to the control center
     center.visualizerQueue = &visualizer.queue;
@@ -2493,36 +11923,256 @@ void init_operations() {
     // Link the control queue to the visualizer
     visualizer.control_queue = &center.queue;
 
+    // Resume a checkpointed run (starts its taxi threads)
+    if (checkpoint_restore_path && !checkpointRestore(checkpoint_restore_path, &center, &visualizer)) {
+        fprintf(stderr, "Failed to restore checkpoint %s\n", checkpoint_restore_path);
+        exit(EXIT_FAILURE);
+    }
+
     // Create threads
-    pthread_t inputThread, controlCenterThread, visualizerThread, timerThread;
-    pthread_create(&inputThread, NULL, input_thread, &center);
+    pthread_t inputThread, controlCenterThread, visualizerThread, timerThread, replayThread, reaperThread, demandThread,
+        tripsThread;
+    bool replaying = __atomic_load_n(&schedule.mode, __ATOMIC_ACQUIRE) == SCHED_REPLAY;
+    pthread_create(&inputThread, NULL, bench_config.enabled ? bench_thread : input_thread, &center);
     pthread_create(&controlCenterThread, NULL, control_center_thread, &center);
     pthread_create(&visualizerThread, NULL, visualizer_thread, &visualizer);
     pthread_create(&timerThread, NULL, timer_thread, &center); // Start the timer thread
+    pthread_create(&reaperThread, NULL, reaper_thread, &center);
+    bool demand = demand_config.rate > 0 && !replaying; // A replay brings the recorded arrivals
+    if (demand) {
+        pthread_create(&demandThread, NULL, demand_thread, &center);
+    }
+    bool trips = trip_trace.path && !replaying;
+    if (trips) {
+        pthread_create(&tripsThread, NULL, trips_thread, &center);
+    }
+    if (replaying) {
+        pthread_create(&replayThread, NULL, replay_thread, &center);
+    }
 
-    // Wait for threads to finish
-    pthread_join(inputThread, NULL);
+    // Wait for threads to finish (a replayed quit leaves the input thread waiting for a key;
+    // the benchmark driver has returned by then)
     pthread_join(controlCenterThread, NULL);
     pthread_join(visualizerThread, NULL);
+    schedStop(NULL);
+    if (replaying) {
+        pthread_join(replayThread, NULL);
+    }
+    pthread_cancel(inputThread);
+    pthread_join(inputThread, NULL);
     pthread_cancel(timerThread);
     pthread_join(timerThread, NULL); // Wait for the timer thread to finish
+    if (demand || trips) {
+        lockAcquire(&pause_mutex, LOCK_PAUSE);
+        __atomic_store_n(&demand_stop, true, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&pause_cond); // Quitting while paused
+        lockRelease(&pause_mutex, LOCK_PAUSE);
+        if (demand) pthread_join(demandThread, NULL);
+        if (trips) pthread_join(tripsThread, NULL);
+    }
+
+    // Taxis retired at exit that the visualizer did not see leave, then the reaper's own
+    for (int i = 0; i < center.numRetiring; i++) {
+        taxiReap(center.retiring[i]);
+    }
+    center.numRetiring = 0;
+    enqueue_message(&center.reaper_queue, EXIT, 0, 0, 0, 0, NULL);
+    pthread_join(reaperThread, NULL);
+    checkpointJoinWriter(); // Let the last checkpoint reach the disk
+    if (trip_log.path) {
+        tripLogClose(&trip_log);
+    }
+    if (trace_file_path && !traceExport(trace_file_path)) {
+        perror("Failed to write trace");
+    }
+    if (!lockProfileWrite(LOCK_PROFILE_FILE_PATH)) {
+        perror("Failed to write lock contention report");
+    }
+    if (perf_enabled && !perfReportWrite(PERF_FILE_PATH)) {
+        perror("Failed to write counter report");
+    }
 
     // Clean up
     pthread_mutex_destroy(&center.lock);
+    for (Message* m = center.queue.head; m != NULL; m = m->next) {
+        if (m->type == MAP_READY) {
+            passengersFree(m->pointer); // A reset's passengers, back after the center quit
+        }
+    }
+    cleanup_queue(&center.queue); // Takes the queue lock: drain before destroying it
+    cleanup_queue(&visualizer.queue);
+    cleanup_queue(&center.reaper_queue);
     pthread_mutex_destroy(&center.queue.lock);
     pthread_cond_destroy(&center.queue.cond);
     pthread_mutex_destroy(&visualizer.queue.lock);
     pthread_cond_destroy(&visualizer.queue.cond);
-    cleanup_queue(&center.queue);
-    cleanup_queue(&visualizer.queue);
+    pthread_mutex_destroy(&center.reaper_queue.lock);
+    pthread_cond_destroy(&center.reaper_queue.cond);
+    routeCacheFree(visualizer.route_cache);
+    inflightForgetAll(&visualizer, true);
+    free(visualizer.curb_weights.cumulative);
+    reservationFree(center.reservations);
     
-    // Close the log file
+    // Close the log files
     if (log_file) {
         fclose(log_file);
     }
+    if (metrics_file) {
+        metricsSnapshot(); // Final figures of the run
+        fclose(metrics_file);
+        metrics_file = NULL;
+    }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    const char* record_path = NULL;
+    const char* replay_path = NULL;
+    bool seeded = false;
+
+    // Options, then an optional city file loaded at start and used by the save/load keys
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            sim_seed = strtoull(argv[++i], NULL, 0);
+            seeded = true;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            checkpoint_restore_path = argv[++i];
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &sim_rows, &sim_cols) != 2 || sim_rows <= 0 || sim_cols <= 0) {
+                fprintf(stderr, "--size expects ROWSxCOLS, e.g. 40x80\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--time-scale") == 0 && i + 1 < argc) {
+            double scale = strtod(argv[++i], NULL);
+            sim_time_scale = MAX(SIM_MIN_TIME_SCALE, scale);
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench_config.enabled = true;
+            headless = true;
+        } else if (strcmp(argv[i], "--taxis") == 0 && i + 1 < argc) {
+            int taxis = atoi(argv[++i]);
+            bench_config.taxis = MIN(MAX(taxis, 0), MAX_TAXIS);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            double rate = strtod(argv[++i], NULL);
+            bench_config.rate = MAX(0.0, rate);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            double duration = strtod(argv[++i], NULL);
+            bench_config.duration_s = MAX(0.0, duration);
+        } else if (strcmp(argv[i], "--bench-out") == 0 && i + 1 < argc) {
+            bench_config.output = argv[++i];
+        } else if (strcmp(argv[i], "--demand") == 0 && i + 1 < argc) {
+            double rate = strtod(argv[++i], NULL);
+            demand_config.rate = MAX(0.0, rate);
+        } else if (strcmp(argv[i], "--demand-profile") == 0 && i + 1 < argc) {
+            if (!demandSetProfile(argv[++i])) {
+                fprintf(stderr, "--demand-profile expects flat, commute or up to %d comma-separated multipliers\n",
+                        DEMAND_PROFILE_HOURS);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--demand-day") == 0 && i + 1 < argc) {
+            double day_s = strtod(argv[++i], NULL);
+            demand_config.day_s = MAX(1.0, day_s);
+        } else if (strcmp(argv[i], "--hotspots") == 0 && i + 1 < argc) {
+            int hotspots = atoi(argv[++i]);
+            demand_hotspots = MIN(MAX(hotspots, 0), DEMAND_MAX_HOTSPOTS);
+        } else if (strcmp(argv[i], "--trips") == 0 && i + 1 < argc) {
+            trip_trace.path = argv[++i];
+        } else if (strcmp(argv[i], "--trip-log") == 0 && i + 1 < argc) {
+            trip_log.path = argv[++i];
+        } else if (strcmp(argv[i], "--trip-dump") == 0 && i + 1 < argc) {
+            // Prints a trip log as CSV and exits
+            const char* path = argv[++i];
+            if (!tripLogDump(path, stdout)) {
+                fprintf(stderr, "Failed to read trip log %s\n", path);
+                exit(EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(argv[i], "--trips-speed") == 0 && i + 1 < argc) {
+            double speed = strtod(argv[++i], NULL);
+            if (speed <= 0) {
+                fprintf(stderr, "--trips-speed expects a positive factor\n");
+                exit(EXIT_FAILURE);
+            }
+            trip_trace.speed = speed;
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            perf_enabled = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_file_path = argv[++i];
+        } else if (strcmp(argv[i], "--pathbench") == 0) {
+            pathbench_config.enabled = true;
+            headless = true;
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            pathbench_config.sizes = argv[++i];
+        } else if (strcmp(argv[i], "--densities") == 0 && i + 1 < argc) {
+            pathbench_config.densities = argv[++i];
+        } else if (strcmp(argv[i], "--engines") == 0 && i + 1 < argc) {
+            pathbench_config.engines = argv[++i];
+        } else if (strcmp(argv[i], "--seeds") == 0 && i + 1 < argc) {
+            int seeds = atoi(argv[++i]);
+            pathbench_config.seeds = MAX(seeds, 1);
+        } else if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc) {
+            int queries = atoi(argv[++i]);
+            pathbench_config.queries = MAX(queries, 1);
+        } else {
+            city_file_path = argv[i];
+            city_load_on_start = true;
+        }
+    }
+    if (!seeded) {
+        sim_seed = (uint64_t)time(NULL);
+    }
+
+    if (checkpoint_restore_path && (record_path || replay_path)) {
+        fprintf(stderr, "--restore cannot be combined with --record or --replay\n");
+        exit(EXIT_FAILURE);
+    }
+    if (bench_config.enabled && replay_path) {
+        fprintf(stderr, "--bench cannot be combined with --replay\n");
+        exit(EXIT_FAILURE);
+    }
+    lock_profile_origin_ns = monotonic_ns();
+    if (trace_file_path) {
+        trace_origin_ns = monotonic_ns();
+        traceThreadName("main");
+    }
+    if (pathbench_config.enabled) {
+        // Routing only: no threads, no terminal, no logs
+        if (bench_config.enabled || record_path || replay_path || checkpoint_restore_path) {
+            fprintf(stderr, "--pathbench cannot be combined with --bench, --record, --replay or --restore\n");
+            exit(EXIT_FAILURE);
+        }
+        bool ok = pathBenchRun();
+        if (perf_enabled && !perfReportWrite(PERF_FILE_PATH)) {
+            perror("Failed to write counter report");
+        }
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (headless && (sim_rows <= 0 || sim_cols <= 0)) {
+        sim_rows = BENCH_DEFAULT_ROWS; // No terminal to fit
+        sim_cols = BENCH_DEFAULT_COLS;
+    }
+
+    if (replay_path) {
+        // The log brings its own seed, map size and city file
+        if (!schedReplay(replay_path)) {
+            fprintf(stderr, "Failed to read replay log %s\n", replay_path);
+            exit(EXIT_FAILURE);
+        }
+    } else if (record_path) {
+        // Resets keep the size the log is recorded with
+        if (sim_rows <= 0 || sim_cols <= 0) {
+            terminalMapSize(&sim_rows, &sim_cols);
+        }
+        if (!schedRecord(record_path)) {
+            perror("Failed to create replay log");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        schedule.origin_ns = monotonic_ns(); // The simulation clock starts at 0, as when recording
+    }
+
     init_operations();
     return 0;
 }
\ No newline at end of file